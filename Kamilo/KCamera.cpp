@@ -75,6 +75,9 @@ void KCamera::uninstall() {
 		g_CameraMgr = nullptr;
 	}
 }
+bool KCamera::isInstalled() {
+	return g_CameraMgr != nullptr;
+}
 void KCamera::attach(KNode *node) {
 	K__ASSERT(g_CameraMgr);
 	if (node && !isAttached(node)) {
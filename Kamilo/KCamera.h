@@ -26,6 +26,7 @@ class KCamera: public KComp {
 public:
 	static void install();
 	static void uninstall();
+	static bool isInstalled();
 
 	static void attach(KNode *node);
 	static KCamera * of(KNode *node);
@@ -2,6 +2,8 @@
 #include "KImGui.h"
 #include "KInternal.h"
 #include "keng_game.h" // KNode
+#include "KClock.h"
+#include "KImage.h"
 
 namespace Kamilo {
 
@@ -32,6 +34,18 @@ static bool _raycast_quad(const KRay &ray, const KVec3 &p0, const KVec3 &p1, con
 	}
 	return false;
 }
+// 直線 o + d*t が区間 [lo, hi] にある範囲で [t0, t1] を狭める。範囲が無くなったら false を返す
+static bool _clip_slab(float o, float d, float lo, float hi, float *t0, float *t1) {
+	if (d == 0) {
+		return lo <= o && o <= hi;
+	}
+	float ta = (lo - o) / d;
+	float tb = (hi - o) / d;
+	if (ta > tb) std::swap(ta, tb);
+	if (ta > *t0) *t0 = ta;
+	if (tb < *t1) *t1 = tb;
+	return *t0 <= *t1;
+}
 
 #pragma endregion // Utils
 
@@ -39,10 +53,23 @@ static bool _raycast_quad(const KRay &ray, const KVec3 &p0, const KVec3 &p1, con
 
 
 #pragma region KCollider
+static uint32_t g_ColliderShapeRevision = 0;
+static uint32_t g_ColliderEnableRevision = 0;
+
+uint32_t KCollider::get_shape_revision() {
+	return g_ColliderShapeRevision;
+}
+uint32_t KCollider::get_enable_revision() {
+	return g_ColliderEnableRevision;
+}
+void KCollider::notify_shape_changed() {
+	g_ColliderShapeRevision++;
+}
 KCollider::KCollider() {
 	m_bitflag = (uint32_t)(-1);
 	m_enable = true;
 	m_node = nullptr;
+	m_type = KColliderType_OTHER;
 }
 void KCollider::_setNode(KNode *node) {
 	m_node = node;
@@ -57,13 +84,18 @@ uint32_t KCollider::get_bitflag() const {
 	return m_bitflag;
 }
 void KCollider::setEnable(bool value) {
-	m_enable = value;
+	if (m_enable != value) {
+		m_enable = value;
+		g_ColliderEnableRevision++;
+		notify_shape_changed();
+	}
 }
 bool KCollider::getEnable() const {
 	return m_enable;
 }
 void KCollider::set_offset(const KVec3 &value) {
 	m_offset = value;
+	notify_shape_changed();
 }
 const KVec3 & KCollider::get_offset() const {
 	return m_offset;
@@ -91,13 +123,14 @@ void KCollider::get_aabb_local(uint32_t bitmask, KVec3 *out_minpoint, KVec3 *out
 	if (out_minpoint) *out_minpoint += m_offset;
 	if (out_maxpoint) *out_maxpoint += m_offset;
 }
-bool KCollider::get_collision_result(KCollisionTest &args) const {
+// コライダーの型 T が確定している場合は、仮想関数を経由せずに呼び出せる（T が final の場合）
+template <class T> static bool _GetCollisionResult(const T *coll, KCollisionTest &args) {
 	// まず静止状態で判定
 	bool collide = false;
 	float depth = -1;
 	float dist = -1;
 	KVec3 norm;
-	if (get_sphere_collision(args.ball_pos, args.ball_radius+args.ball_skin, args.bitmask, &dist, &norm)) {
+	if (coll->get_sphere_collision(args.ball_pos, args.ball_radius+args.ball_skin, args.bitmask, &dist, &norm)) {
 		// 距離が球半径よりも近い。接触またはめり込み状態にある。
 		// めり込みの深さ（正の値）
 		// これが負の値の場合、隙間があるということ
@@ -137,7 +170,7 @@ bool KCollider::get_collision_result(KCollisionTest &args) const {
 
 		// AABBを調べる
 		KVec3 aabbMax;
-		get_aabb(args.bitmask, nullptr, &aabbMax);
+		coll->get_aabb(args.bitmask, nullptr, &aabbMax);
 
 		if (aabbMax.y <= args.ball_pos.y - args.ball_radius + args.ball_climb) {
 			// 段差が climb よりも低いので接触判定を無視する（→上に登ることができる）
@@ -150,7 +183,7 @@ bool KCollider::get_collision_result(KCollisionTest &args) const {
 		args.result_newpos = args.ball_pos + norm * depth;
 		args.result_hitpos = args.ball_pos - norm * dist;
 		args.result_normal = norm;
-		args.result_collider = const_cast<KCollider*>(this);
+		args.result_collider = const_cast<T*>(coll);
 		return true;
 	}
 
@@ -177,7 +210,7 @@ bool KCollider::get_collision_result(KCollisionTest &args) const {
 		} else {
 			ray_pos.y += (args.ball_climb - args.ball_radius);
 		}
-		if (get_ray_collision_point(ray_pos, ray_dir, args.bitmask, &hit_pos, &hit_nor, nullptr)) {
+		if (coll->get_ray_collision_point(ray_pos, ray_dir, args.bitmask, &hit_pos, &hit_nor, nullptr)) {
 			// レイがコライダーと衝突している。
 			// まだ距離を考慮していない（もしかしたら遥か先で衝突しているかもしれない）ので、さらに調べる
 			float speed_len = args.ball_speed.getLength(); // 球の進行距離
@@ -196,7 +229,7 @@ bool KCollider::get_collision_result(KCollisionTest &args) const {
 				// これで球の移動中にコライダーと衝突したことが確定した。球を衝突点まで押し戻す
 				args.result_newpos = hit_pos + hit_nor * args.ball_radius; // 衝突点から radius だけ離れた位置に戻す
 				args.result_normal = hit_nor;
-				args.result_collider = const_cast<KCollider*>(this);
+				args.result_collider = const_cast<T*>(coll);
 				return true;
 			}
 		}
@@ -205,15 +238,19 @@ bool KCollider::get_collision_result(KCollisionTest &args) const {
 	// 衝突なし
 	return false;
 }
+bool KCollider::get_collision_result(KCollisionTest &args) const {
+	return _GetCollisionResult(this, args);
+}
 #pragma endregion // KCollider
 
 
 
 
-class CSphereCollider: public KSphereCollider {
+class CSphereCollider final: public KSphereCollider {
 	float m_radius;
 public:
 	CSphereCollider(const KVec3 &pos, float radius) {
+		m_type = KColliderType_SPHERE;
 		m_offset = pos;
 		m_radius = radius;
 	}
@@ -223,6 +260,7 @@ public:
 		ImGui::DragFloat("Radius", &m_radius, 1.0f, 0.0f, 1000.0f);
 	}
 	virtual void set_radius(float value) {
+		notify_shape_changed();
 		K__ASSERT(value >= 0);
 		m_radius = value;
 	}
@@ -270,10 +308,11 @@ KSphereCollider * KSphereCollider::create(const KVec3 &pos, float radius) {
 
 
 
-class CAabbCollider: public KAabbCollider {
+class CAabbCollider final: public KAabbCollider {
 	KVec3 m_halfsize;
 public:
 	CAabbCollider(const KVec3 &pos, const KVec3 &halfsize) {
+		m_type = KColliderType_AABB;
 		m_offset = pos;
 		m_halfsize = halfsize;
 	}
@@ -283,6 +322,7 @@ public:
 		ImGui::DragFloat3("HalfSize", m_halfsize.floats());
 	}
 	virtual void set_halfsize(const KVec3 &value) {
+		notify_shape_changed();
 		K__ASSERT(value.x >= 0);
 		K__ASSERT(value.y >= 0);
 		K__ASSERT(value.z >= 0);
@@ -379,12 +419,13 @@ KAabbCollider * KAabbCollider::create(const KVec3 &pos, const KVec3 &halfsize) {
 
 
 
-class CCapsuleCollider: public KCapsuleCollider {
+class CCapsuleCollider final: public KCapsuleCollider {
 	float m_radius;
 	float m_halfheight;
 	bool m_cylinder;
 public:
 	CCapsuleCollider(const KVec3 &pos, float radius, float halfheight, bool is_cylinder) {
+		m_type = KColliderType_CAPSULE;
 		m_offset = pos;
 		m_radius = radius;
 		m_halfheight = halfheight;
@@ -406,11 +447,13 @@ public:
 		}
 	}
 	virtual void set_halfheight(float value) {
+		notify_shape_changed();
 		K__ASSERT(value >= 0);
 		m_halfheight = value;
 		adj();
 	}
 	virtual void set_radius(float value) {
+		notify_shape_changed();
 		K__ASSERT(value >= 0);
 		m_radius = value;
 		adj();
@@ -509,11 +552,12 @@ KCapsuleCollider * KCapsuleCollider::create(const KVec3 &pos, float radius, floa
 }
 
 
-class CCharacterCollider: public KCharacterCollider {
+class CCharacterCollider final: public KCharacterCollider {
 	float m_radius;
 	float m_halfheight;
 public:
 	CCharacterCollider(const KVec3 &pos, float radius, float halfheight) {
+		m_type = KColliderType_CHARACTER;
 		m_offset = pos;
 		m_radius = radius;
 		m_halfheight = halfheight;
@@ -533,11 +577,13 @@ public:
 		}
 	}
 	virtual void set_halfheight(float value) {
+		notify_shape_changed();
 		K__ASSERT(value >= 0);
 		m_halfheight = value;
 		adj();
 	}
 	virtual void set_radius(float value) {
+		notify_shape_changed();
 		K__ASSERT(value >= 0);
 		m_radius = value;
 		adj();
@@ -628,7 +674,7 @@ KCharacterCollider * KCharacterCollider::create(const KVec3 &pos, float radius,
 
 
 
-class CPlaneCollider: public KPlaneCollider {
+class CPlaneCollider final: public KPlaneCollider {
 	KVec3 m_normal;
 
 	// 平面のトリミング範囲。このAxisAlignedボックス内にある平面だけが処理対象になる
@@ -639,6 +685,7 @@ class CPlaneCollider: public KPlaneCollider {
 	KVec3 m_aabb_max;
 public:
 	CPlaneCollider(const KVec3 &pos, const KVec3 &normal, const KVec3 &trim_min, const KVec3 &trim_max) {
+		m_type = KColliderType_PLANE;
 		m_offset = pos;
 		m_trim_min = trim_min;
 		m_trim_max = trim_max;
@@ -715,6 +762,7 @@ public:
 		);
 	}
 	virtual void set_trim_box(const KVec3 &trim_min, const KVec3 &trim_max) {
+		notify_shape_changed();
 		m_trim_min = trim_min;
 		m_trim_max = trim_max;
 		update_aabb();
@@ -724,6 +772,7 @@ public:
 		if (trim_max) *trim_max = m_trim_max;
 	}
 	virtual void set_normal(const KVec3 &value) {
+		notify_shape_changed();
 		if (value.getNormalizedSafe(&m_normal)) {
 			update_aabb();
 		} else {
@@ -789,13 +838,14 @@ KPlaneCollider * KPlaneCollider::create(const KVec3 &pos, const KVec3 &normal, c
 
 
 
-class CQuadCollider: public KQuadCollider {
+class CQuadCollider final: public KQuadCollider {
 	KVec3 m_points[4];
 	KVec3 m_aabb_min;
 	KVec3 m_aabb_max;
 	KVec3 m_normal;
 public:
 	CQuadCollider(const KVec3 &pos, const KVec3 *points_cw4) {
+		m_type = KColliderType_QUAD;
 		m_offset = pos;
 		set_points(points_cw4);
 	}
@@ -835,6 +885,7 @@ public:
 		return false;
 	}
 	virtual void set_points(const KVec3 *points_cw4) {
+		notify_shape_changed();
 		for (int i=0; i<4; i++) {
 			m_points[i] = points_cw4[i];
 		}
@@ -912,7 +963,7 @@ KQuadCollider * KQuadCollider::create(const KVec3 &pos, const KVec3 *points_cw4)
 }
 
 
-class CShearedBoxCollider: public KShearedBoxCollider {
+class CShearedBoxCollider final: public KShearedBoxCollider {
 	KVec3 m_halfsize;
 	float m_shearx;
 	KVec3 m_aabb_min;
@@ -920,6 +971,7 @@ class CShearedBoxCollider: public KShearedBoxCollider {
 	FLAGS m_flags; // KShearedBoxCollider::FLAGS
 public:
 	CShearedBoxCollider(const KVec3 &pos, const KVec3 &halfsize, float shearx, FLAGS flags) {
+		m_type = KColliderType_SHEARED_BOX;
 		m_offset = pos;
 		m_halfsize = halfsize;
 		m_shearx = shearx;
@@ -986,6 +1038,7 @@ public:
 		if (out_maxpoint) *out_maxpoint = m_aabb_max;
 	}
 	virtual void set_halfsize(const KVec3 &value) {
+		notify_shape_changed();
 		m_halfsize = value;
 		update_aabb();
 	}
@@ -993,6 +1046,7 @@ public:
 		return m_halfsize;
 	}
 	virtual void set_shearx(float value) {
+		notify_shape_changed();
 		m_shearx = value;
 		update_aabb();
 	}
@@ -1219,7 +1273,7 @@ KShearedBoxCollider * KShearedBoxCollider::create(const KVec3 &pos, const KVec3
 
 
 
-class CFloorCollider: public KFloorCollider {
+class CFloorCollider final: public KFloorCollider {
 	KVec3 m_halfsize;
 	float m_shearx;
 	float m_heights[4];
@@ -1227,6 +1281,7 @@ class CFloorCollider: public KFloorCollider {
 	KVec3 m_aabb_max;
 public:
 	CFloorCollider(const KVec3 &pos, const KVec3 &halfsize, float shearx, const float *heights) {
+		m_type = KColliderType_FLOOR;
 		m_offset = pos;
 		m_halfsize = halfsize;
 		m_shearx = shearx;
@@ -1270,6 +1325,7 @@ public:
 		if (out_maxpoint) *out_maxpoint = m_aabb_max;
 	}
 	virtual void set_halfsize(const KVec3 &value) {
+		notify_shape_changed();
 		m_halfsize = value;
 		update_aabb();
 	}
@@ -1277,6 +1333,7 @@ public:
 		return m_halfsize;
 	}
 	virtual void set_shearx(float value) {
+		notify_shape_changed();
 		m_shearx = value;
 		update_aabb();
 	}
@@ -1284,6 +1341,7 @@ public:
 		return m_shearx;
 	}
 	virtual void set_heights(const float *heights) {
+		notify_shape_changed();
 		if (heights) {
 			for (int i=0; i<4; i++) {
 				m_heights[i] = heights[i];
@@ -1352,6 +1410,395 @@ KFloorCollider * KFloorCollider::create(const KVec3 &pos, const KVec3 &halfsize,
 }
 
 
+
+
+class CHeightfieldCollider final: public KHeightfieldCollider {
+	std::vector<float> m_heights; // m_heights[iz * m_cols + ix]
+	int m_cols;
+	int m_rows;
+	float m_cell;
+	float m_inv_cell;
+	KVec3 m_aabb_min;
+	KVec3 m_aabb_max;
+public:
+	CHeightfieldCollider(const KVec3 &pos, int cols, int rows, float cell_size, const float *heights) {
+		K__ASSERT(cols >= 2 && rows >= 2);
+		K__ASSERT(cell_size > 0);
+		m_type = KColliderType_HEIGHTFIELD;
+		m_offset = pos;
+		m_cols = KMath::max(cols, 2);
+		m_rows = KMath::max(rows, 2);
+		m_cell = cell_size;
+		m_inv_cell = 1.0f / cell_size;
+		m_heights.resize(m_cols * m_rows, 0.0f);
+		if (heights) {
+			memcpy(m_heights.data(), heights, sizeof(float) * m_heights.size());
+		}
+		update_aabb();
+	}
+	virtual void update_inspector() {
+		ImGui::Text("HeightfieldCollider");
+		ImGui::DragFloat3("Center", m_offset.floats());
+		ImGui::Text("Grid: %d x %d (Cell %.1f)", m_cols, m_rows, m_cell);
+		ImGui::InputFloat3("AABB min", m_aabb_min.floats(), "%.1f", ImGuiInputTextFlags_ReadOnly);
+		ImGui::InputFloat3("AABB max", m_aabb_max.floats(), "%.1f", ImGuiInputTextFlags_ReadOnly);
+	}
+	void update_aabb() {
+		float hmin = m_heights[0];
+		float hmax = m_heights[0];
+		for (size_t i=1; i<m_heights.size(); i++) {
+			hmin = KMath::min(hmin, m_heights[i]);
+			hmax = KMath::max(hmax, m_heights[i]);
+		}
+		m_aabb_min.x = -(m_cols - 1) * m_cell * 0.5f;
+		m_aabb_min.y = hmin;
+		m_aabb_min.z = -(m_rows - 1) * m_cell * 0.5f;
+		m_aabb_max.x = -m_aabb_min.x;
+		m_aabb_max.y = hmax;
+		m_aabb_max.z = -m_aabb_min.z;
+	}
+	virtual void get_aabb_raw(uint32_t bitmask, KVec3 *out_minpoint, KVec3 *out_maxpoint) const {
+		if (out_minpoint) *out_minpoint = m_aabb_min;
+		if (out_maxpoint) *out_maxpoint = m_aabb_max;
+	}
+	virtual int get_cols() const {
+		return m_cols;
+	}
+	virtual int get_rows() const {
+		return m_rows;
+	}
+	virtual float get_cell_size() const {
+		return m_cell;
+	}
+	virtual void set_heights(const float *heights) {
+		notify_shape_changed();
+		if (heights) {
+			memcpy(m_heights.data(), heights, sizeof(float) * m_heights.size());
+			update_aabb();
+		}
+	}
+	virtual void get_heights(float *heights) const {
+		if (heights) {
+			memcpy(heights, m_heights.data(), sizeof(float) * m_heights.size());
+		}
+	}
+	virtual float get_height(int ix, int iz) const {
+		K__ASSERT(0 <= ix && ix < m_cols);
+		K__ASSERT(0 <= iz && iz < m_rows);
+		return m_heights[iz * m_cols + ix];
+	}
+	virtual bool get_height_at(float x, float z, float *out_y, KVec3 *out_normal) const {
+		KVec3 wpos = get_offset_world();
+		int cx, cz;
+		float u, v;
+		if (!find_cell(x - wpos.x, z - wpos.z, &cx, &cz, &u, &v)) {
+			return false;
+		}
+		float h00, a, b;
+		get_triangle(cx, cz, (u >= v) ? 0 : 1, &h00, &a, &b);
+		if (out_y) *out_y = wpos.y + h00 + a * u + b * v;
+		if (out_normal) *out_normal = get_triangle_normal(a, b);
+		return true;
+	}
+	virtual bool get_ray_collision_point(const KVec3 &ray_pos, const KVec3 &ray_dir, uint32_t bitmask, KVec3 *out_point, KVec3 *out_normal, KCollider **out_collider) const {
+		KVec3 wpos = get_offset_world();
+		KVec3 lpos = ray_pos - wpos;
+		if (ray_dir.x == 0 && ray_dir.z == 0 && ray_dir.y < 0) {
+			// 真下に向けたレイ（地面の問い合わせ）。レイ始点を含むセルだけを調べればよい
+			int cx, cz;
+			float u, v;
+			if (!find_cell(lpos.x, lpos.z, &cx, &cz, &u, &v)) {
+				return false;
+			}
+			float h00, a, b;
+			get_triangle(cx, cz, (u >= v) ? 0 : 1, &h00, &a, &b);
+			float y = h00 + a * u + b * v;
+			if (lpos.y < y) {
+				return false; // レイ始点が地形よりも下にある
+			}
+			if (out_point) *out_point = KVec3(ray_pos.x, wpos.y + y, ray_pos.z);
+			if (out_normal) *out_normal = get_triangle_normal(a, b);
+			if (out_collider) *out_collider = const_cast<CHeightfieldCollider*>(this);
+			return true;
+		}
+		float t;
+		int cx, cz, tri;
+		if (!raycast_local(lpos, ray_dir, &t, &cx, &cz, &tri)) {
+			return false;
+		}
+		float h00, a, b;
+		get_triangle(cx, cz, tri, &h00, &a, &b);
+		if (out_point) *out_point = ray_pos + ray_dir * t;
+		if (out_normal) *out_normal = get_triangle_normal(a, b);
+		if (out_collider) *out_collider = const_cast<CHeightfieldCollider*>(this);
+		return true;
+	}
+	virtual bool get_sphere_collision(const KVec3 &ball_wpos, float ball_radius, uint32_t bitmask, float *out_dist, KVec3 *out_normal) const {
+		KVec3 wpos = get_offset_world();
+		KVec3 lpos = ball_wpos - wpos;
+		if (lpos.y - ball_radius > m_aabb_max.y) return false;
+		if (lpos.y + ball_radius < m_aabb_min.y) return false;
+
+		// 球が XZ 平面上で重なっているセルの範囲
+		int cx0 = (int)floorf((lpos.x - ball_radius - m_aabb_min.x) * m_inv_cell);
+		int cx1 = (int)floorf((lpos.x + ball_radius - m_aabb_min.x) * m_inv_cell);
+		int cz0 = (int)floorf((lpos.z - ball_radius - m_aabb_min.z) * m_inv_cell);
+		int cz1 = (int)floorf((lpos.z + ball_radius - m_aabb_min.z) * m_inv_cell);
+		if (cx1 < 0 || cx0 > m_cols-2) return false;
+		if (cz1 < 0 || cz0 > m_rows-2) return false;
+		cx0 = KMath::max(cx0, 0);
+		cz0 = KMath::max(cz0, 0);
+		cx1 = KMath::min(cx1, m_cols-2);
+		cz1 = KMath::min(cz1, m_rows-2);
+
+		// 球の中心の真下にある三角形。
+		// 稜線の真上では垂線の足がどちらの三角形からも外れてしまうので、
+		// この三角形だけは垂線の足の位置に関係なく平面との距離で判定する
+		int center_cx = -1;
+		int center_cz = -1;
+		int center_tri = -1;
+		{
+			float u, v;
+			if (find_cell(lpos.x, lpos.z, &center_cx, &center_cz, &u, &v)) {
+				center_tri = (u >= v) ? 0 : 1;
+			}
+		}
+
+		// 最も深くめり込んでいる三角形を選ぶ
+		bool found = false;
+		float best_dist = 0;
+		KVec3 best_normal;
+		for (int cz=cz0; cz<=cz1; cz++) {
+			for (int cx=cx0; cx<=cx1; cx++) {
+				float ou = (lpos.x - m_aabb_min.x) * m_inv_cell - cx; // セル内での球の位置
+				float ov = (lpos.z - m_aabb_min.z) * m_inv_cell - cz;
+				for (int tri=0; tri<2; tri++) {
+					float h00, a, b;
+					get_triangle(cx, cz, tri, &h00, &a, &b);
+					KVec3 nor = get_triangle_normal(a, b);
+					float dist = (lpos.y - (h00 + a * ou + b * ov)) * nor.y; // 三角形を含む平面と球中心の符号付き距離
+					if (fabsf(dist) > ball_radius) {
+						continue;
+					}
+					if (cx != center_cx || cz != center_cz || tri != center_tri) {
+						float fu = ou - nor.x * dist * m_inv_cell; // 垂線の足
+						float fv = ov - nor.z * dist * m_inv_cell;
+						if (!is_in_triangle(fu, fv, tri)) {
+							continue; // エッジ部分との衝突は考慮しない
+						}
+					}
+					if (!found || dist < best_dist) {
+						found = true;
+						best_dist = dist;
+						best_normal = nor;
+					}
+				}
+			}
+		}
+		if (found) {
+			if (out_dist) *out_dist = best_dist;
+			if (out_normal) *out_normal = best_normal;
+			return true;
+		}
+		return false;
+	}
+private:
+	// ローカル座標 (lx, lz) を含むセルと、セル内での位置 (0..1) を得る。範囲外なら false を返す
+	bool find_cell(float lx, float lz, int *out_cx, int *out_cz, float *out_u, float *out_v) const {
+		float fx = (lx - m_aabb_min.x) * m_inv_cell;
+		float fz = (lz - m_aabb_min.z) * m_inv_cell;
+		if (fx < 0 || fz < 0 || fx > m_cols-1 || fz > m_rows-1) {
+			return false;
+		}
+		int cx = KMath::min((int)fx, m_cols-2); // 右端と奥端の格子点上は一つ手前のセルに含める
+		int cz = KMath::min((int)fz, m_rows-2);
+		*out_cx = cx;
+		*out_cz = cz;
+		*out_u = fx - cx;
+		*out_v = fz - cz;
+		return true;
+	}
+	// セル (cx, cz) の三角形 tri の高さを y = h00 + a*u + b*v の形で得る。
+	// tri=0 は u >= v 側の三角形 (-X-Z, +X-Z, +X+Z)、tri=1 は u < v 側の三角形 (-X-Z, +X+Z, -X+Z)
+	void get_triangle(int cx, int cz, int tri, float *h00, float *a, float *b) const {
+		const float *row0 = &m_heights[cz * m_cols + cx];
+		const float *row1 = row0 + m_cols;
+		*h00 = row0[0];
+		if (tri == 0) {
+			*a = row0[1] - row0[0];
+			*b = row1[1] - row0[1];
+		} else {
+			*a = row1[1] - row1[0];
+			*b = row1[0] - row0[0];
+		}
+	}
+	KVec3 get_triangle_normal(float a, float b) const {
+		return KVec3(-a * m_inv_cell, 1.0f, -b * m_inv_cell).getNormalized();
+	}
+	bool is_in_triangle(float u, float v, int tri) const {
+		const float E = 1.0e-5f;
+		if (tri == 0) {
+			return v >= -E && u <= 1+E && v <= u+E;
+		} else {
+			return u >= -E && v <= 1+E && u <= v+E;
+		}
+	}
+	// ローカル座標のレイ o + d*t とセル (cx, cz) の三角形 tri の表面との交点を調べる
+	bool raycast_triangle(const KVec3 &o, const KVec3 &d, int cx, int cz, int tri, float *out_t) const {
+		float h00, a, b;
+		get_triangle(cx, cz, tri, &h00, &a, &b);
+		float ou = (o.x - m_aabb_min.x) * m_inv_cell - cx; // セル内でのレイ始点の位置
+		float ov = (o.z - m_aabb_min.z) * m_inv_cell - cz;
+		float du = d.x * m_inv_cell;
+		float dv = d.z * m_inv_cell;
+		float denom = d.y - a * du - b * dv; // 面法線（正規化前）とレイ方向の内積
+		if (denom >= 0) {
+			return false; // レイと面法線が同じ向き（平行の場合も含む）の場合は裏側から当たっていることになるので判定しない
+		}
+		float t = (h00 + a * ou + b * ov - o.y) / denom;
+		if (t < 0) {
+			return false;
+		}
+		if (!is_in_triangle(ou + du * t, ov + dv * t, tri)) {
+			return false;
+		}
+		*out_t = t;
+		return true;
+	}
+	// ローカル座標のレイが通過するセルを近い順にたどり、最初に衝突した三角形を得る
+	bool raycast_local(const KVec3 &o, const KVec3 &d, float *out_t, int *out_cx, int *out_cz, int *out_tri) const {
+		// AABB の中にある区間 [t0, t1] だけを調べる
+		float t0 = 0;
+		float t1 = FLT_MAX;
+		if (!_clip_slab(o.x, d.x, m_aabb_min.x, m_aabb_max.x, &t0, &t1)) return false;
+		if (!_clip_slab(o.y, d.y, m_aabb_min.y, m_aabb_max.y, &t0, &t1)) return false;
+		if (!_clip_slab(o.z, d.z, m_aabb_min.z, m_aabb_max.z, &t0, &t1)) return false;
+
+		// 区間の始点を含むセル
+		float fx = (o.x + d.x * t0 - m_aabb_min.x) * m_inv_cell;
+		float fz = (o.z + d.z * t0 - m_aabb_min.z) * m_inv_cell;
+		int cx = KMath::clampi((int)floorf(fx), 0, m_cols-2);
+		int cz = KMath::clampi((int)floorf(fz), 0, m_rows-2);
+
+		// 隣のセルとの境界に達する t とその間隔
+		int step_x = (d.x > 0) ? 1 : (d.x < 0) ? -1 : 0;
+		int step_z = (d.z > 0) ? 1 : (d.z < 0) ? -1 : 0;
+		float next_tx = FLT_MAX;
+		float next_tz = FLT_MAX;
+		float delta_tx = 0;
+		float delta_tz = 0;
+		if (step_x != 0) {
+			next_tx = (m_aabb_min.x + (cx + (step_x > 0 ? 1 : 0)) * m_cell - o.x) / d.x;
+			delta_tx = m_cell / fabsf(d.x);
+		}
+		if (step_z != 0) {
+			next_tz = (m_aabb_min.z + (cz + (step_z > 0 ? 1 : 0)) * m_cell - o.z) / d.z;
+			delta_tz = m_cell / fabsf(d.z);
+		}
+		while (1) {
+			// セル内の２枚の三角形のうち近い方
+			int hit_tri = -1;
+			float hit_t = FLT_MAX;
+			for (int tri=0; tri<2; tri++) {
+				float t;
+				if (raycast_triangle(o, d, cx, cz, tri, &t) && t < hit_t) {
+					hit_t = t;
+					hit_tri = tri;
+				}
+			}
+			if (hit_tri >= 0) {
+				*out_t = hit_t;
+				*out_cx = cx;
+				*out_cz = cz;
+				*out_tri = hit_tri;
+				return true;
+			}
+			// 次のセルへ
+			if (next_tx <= next_tz) {
+				if (step_x == 0 || next_tx > t1) break;
+				cx += step_x;
+				if (cx < 0 || cx > m_cols-2) break;
+				next_tx += delta_tx;
+			} else {
+				if (step_z == 0 || next_tz > t1) break;
+				cz += step_z;
+				if (cz < 0 || cz > m_rows-2) break;
+				next_tz += delta_tz;
+			}
+		}
+		return false;
+	}
+};
+KHeightfieldCollider * KHeightfieldCollider::create(const KVec3 &pos, int cols, int rows, float cell_size, const float *heights) {
+	return new CHeightfieldCollider(pos, cols, rows, cell_size, heights);
+}
+KHeightfieldCollider * KHeightfieldCollider::createFromImage(const KVec3 &pos, const KImage &image, float cell_size, float height_scale) {
+	int w = image.getWidth();
+	int h = image.getHeight();
+	if (w < 2 || h < 2) {
+		return nullptr;
+	}
+	std::vector<float> heights(w * h);
+	for (int y=0; y<h; y++) {
+		for (int x=0; x<w; x++) {
+			heights[y * w + x] = image.getPixel(x, y).grayscale() * height_scale / 255.0f;
+		}
+	}
+	return new CHeightfieldCollider(pos, w, h, cell_size, heights.data());
+}
+
+
+
+#pragma region CCollisionDispatchTable
+typedef bool (*COLLISION_FUNC)(const KCollider *static_collider, KCollisionTest &args);
+
+template <class T> static bool _GetCollisionResultAs(const KCollider *static_collider, KCollisionTest &args) {
+	return _GetCollisionResult(static_cast<const T*>(static_collider), args);
+}
+
+/// 動的コライダーの種類と静的コライダーの種類の組み合わせごとの判定関数
+class CCollisionDispatchTable {
+	COLLISION_FUNC m_Funcs[KColliderType_COUNT][KColliderType_COUNT];
+public:
+	CCollisionDispatchTable() {
+		memset(m_Funcs, 0, sizeof(m_Funcs));
+
+		// 静的形状との判定に対応している動的コライダーは KCharacterCollider のみ。
+		// キャラクターの下側半球を KCollisionTest の球として判定する
+		set_row(KColliderType_CHARACTER);
+	}
+	COLLISION_FUNC get(KColliderType dynamic_type, KColliderType static_type) const {
+		return m_Funcs[dynamic_type][static_type];
+	}
+private:
+	void set_row(KColliderType dynamic_type) {
+		COLLISION_FUNC *row = m_Funcs[dynamic_type];
+		row[KColliderType_SPHERE]      = _GetCollisionResultAs<CSphereCollider>;
+		row[KColliderType_AABB]        = _GetCollisionResultAs<CAabbCollider>;
+		row[KColliderType_CAPSULE]     = _GetCollisionResultAs<CCapsuleCollider>;
+		row[KColliderType_PLANE]       = _GetCollisionResultAs<CPlaneCollider>;
+		row[KColliderType_QUAD]        = _GetCollisionResultAs<CQuadCollider>;
+		row[KColliderType_CHARACTER]   = _GetCollisionResultAs<CCharacterCollider>;
+		row[KColliderType_SHEARED_BOX] = _GetCollisionResultAs<CShearedBoxCollider>;
+		row[KColliderType_FLOOR]       = _GetCollisionResultAs<CFloorCollider>;
+		row[KColliderType_HEIGHTFIELD] = _GetCollisionResultAs<CHeightfieldCollider>;
+	}
+};
+static const CCollisionDispatchTable g_CollisionDispatchTable;
+
+bool KCollider::dispatch_collision_result(const KCollider *dynamic_collider, const KCollider *static_collider, KCollisionTest &args) {
+	K__ASSERT(dynamic_collider);
+	K__ASSERT(static_collider);
+	COLLISION_FUNC func = g_CollisionDispatchTable.get(dynamic_collider->m_type, static_collider->m_type);
+	if (func) {
+		return func(static_collider, args);
+	}
+	return static_collider->get_collision_result(args); // 専用の関数が無い組み合わせ
+}
+#pragma endregion // CCollisionDispatchTable
+
+
+
 namespace Test {
 void Test_collisionshape() {
 	{
@@ -1409,6 +1856,128 @@ void Test_collisionshape() {
 
 		co->drop();
 	}
+
+	{
+		// 原点から離れた、傾いた四角形。頂点はコライダーの中心を通る判定面よりも下にある。
+		// AABB は頂点の範囲そのもので、乗り上げ判定 (ball_climb) にもその上端を使う
+		KVec3 p[] = {KVec3(-40, -6, -40), KVec3(-40, -2, 40), KVec3(40, -2, 40), KVec3(40, -6, -40)};
+		KVec3 wpos(500, 100, 0);
+		KCollider *co = KQuadCollider::create(wpos, p);
+		KVec3 minp, maxp;
+		co->get_aabb(0, &minp, &maxp);
+		K__ASSERT(minp == wpos + KVec3(-40, -6, -40));
+		K__ASSERT(maxp == wpos + KVec3( 40, -2,  40));
+
+		// 判定面に少しめり込んだ球
+		KCollisionTest args;
+		args.ball_pos = wpos + KVec3(-20, 10, 10);
+		args.ball_radius = 10;
+		bool b = co->get_collision_result(args);
+		K__ASSERT(b);
+
+		// 頂点の上端は球の底面より低いので、乗り上げられる。
+		// 判定面に投影した頂点の上端は球の底面より climb 以上高いので、それを AABB に含めると乗り上げられなくなる
+		args.ball_climb = 1;
+		b = co->get_collision_result(args);
+		K__ASSERT(!b);
+
+		co->drop();
+	}
+}
+
+void Test_collision_dispatch() {
+	uint32_t seed = 13579;
+	auto rnd = [&seed](float lo, float hi) {
+		seed = seed * 1664525 + 1013904223;
+		return lo + (hi - lo) * ((seed >> 8) / (float)(1 << 24));
+	};
+
+	// 全種類の静的コライダーを混ぜて並べる
+	const int NUM_COLLIDERS = 64;
+	const int NUM_TESTS = 4000;
+	std::vector<KCollider *> colliders;
+	for (int i=0; i<NUM_COLLIDERS; i++) {
+		KVec3 pos(rnd(-100, 100), rnd(-20, 20), rnd(-100, 100));
+		KCollider *co = nullptr;
+		switch (i % 8) {
+		case 0: co = KSphereCollider::create(pos, rnd(8, 32)); break;
+		case 1: co = KAabbCollider::create(pos, KVec3(rnd(8, 32), rnd(8, 32), rnd(8, 32))); break;
+		case 2: co = KCapsuleCollider::create(pos, rnd(8, 16), rnd(16, 48), (i/8) % 2 == 0); break;
+		case 3: co = KPlaneCollider::create(pos, KVec3(rnd(-0.5f, 0.5f), 1.0f, rnd(-0.5f, 0.5f)).getNormalized(), KVec3(-40, -40, -40), KVec3(40, 40, 40)); break;
+		case 4:
+			{
+				float h = rnd(-20, 20);
+				KVec3 p[] = {KVec3(-40.0f, -h, -40.0f), KVec3(-40.0f, h, 40.0f), KVec3(40.0f, h, 40.0f), KVec3(40.0f, -h, -40.0f)};
+				co = KQuadCollider::create(pos, p);
+			}
+			break;
+		case 5: co = KCharacterCollider::create(pos, rnd(8, 16), rnd(16, 32)); break;
+		case 6: co = KShearedBoxCollider::create(pos, KVec3(rnd(16, 48), rnd(8, 32), rnd(16, 48)), rnd(-16, 16), KShearedBoxCollider::ALL); break;
+		case 7:
+			{
+				float heights[] = {rnd(0, 30), rnd(0, 30), rnd(0, 30), rnd(0, 30)};
+				co = KFloorCollider::create(pos, KVec3(rnd(16, 48), 0.0f, rnd(16, 48)), rnd(0, 8), heights);
+			}
+			break;
+		}
+		colliders.push_back(co);
+	}
+	KCollider *chara = KCharacterCollider::create(KVec3(), 12, 24);
+
+	std::vector<KCollisionTest> tests;
+	for (int i=0; i<NUM_TESTS; i++) {
+		KCollisionTest test;
+		test.ball_pos = KVec3(rnd(-120, 120), rnd(-40, 40), rnd(-120, 120));
+		test.ball_radius = 12;
+		test.ball_speed = KVec3(rnd(-8, 8), rnd(-8, 8), rnd(-8, 8));
+		test.ball_climb = (i % 2) ? 16.0f : 0.0f;
+		tests.push_back(test);
+	}
+
+	// 仮想関数経由の判定と、判定表による判定の結果が完全に一致する
+	int num_hits[2] = {0, 0};
+	int num_errors = 0;
+	int usec[2];
+	for (int t=0; t<2; t++) {
+		KClock clock;
+		for (int i=0; i<NUM_TESTS; i++) {
+			for (int c=0; c<NUM_COLLIDERS; c++) {
+				KCollisionTest test = tests[i];
+				bool hit;
+				if (t == 0) {
+					hit = colliders[c]->get_collision_result(test);
+				} else {
+					hit = KCollider::dispatch_collision_result(chara, colliders[c], test);
+				}
+				if (hit) num_hits[t]++;
+			}
+		}
+		usec[t] = (int)(clock.getTimeNano64() / 1000);
+	}
+	for (int i=0; i<NUM_TESTS; i++) {
+		for (int c=0; c<NUM_COLLIDERS; c++) {
+			KCollisionTest a = tests[i];
+			KCollisionTest b = tests[i];
+			bool ha = colliders[c]->get_collision_result(a);
+			bool hb = KCollider::dispatch_collision_result(chara, colliders[c], b);
+			if (ha != hb) num_errors++;
+			if (ha && hb) {
+				if (a.result_newpos != b.result_newpos) num_errors++;
+				if (a.result_hitpos != b.result_hitpos) num_errors++;
+				if (a.result_normal != b.result_normal) num_errors++;
+				if (a.result_collider != b.result_collider) num_errors++;
+			}
+		}
+	}
+	K__PRINT("Test_collision_dispatch: %d tests x %d colliders: virtual %d usec, dispatch %d usec (hits %d)",
+		NUM_TESTS, NUM_COLLIDERS, usec[0], usec[1], num_hits[1]);
+	K__ASSERT(num_hits[0] == num_hits[1]);
+	K__ASSERT(num_errors == 0);
+
+	chara->drop();
+	for (size_t i=0; i<colliders.size(); i++) {
+		colliders[i]->drop();
+	}
 }
 } // Test
 
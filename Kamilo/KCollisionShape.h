@@ -11,7 +11,22 @@ namespace Kamilo {
 
 class KNode;
 class KCollider;
-
+class KImage;
+
+/// コライダーの種類。dynamic_cast の代わりにこれを使って分岐する
+enum KColliderType {
+	KColliderType_OTHER,       ///< 以下のどれでもない（ユーザー定義のコライダーなど）
+	KColliderType_SPHERE,      ///< KSphereCollider
+	KColliderType_AABB,        ///< KAabbCollider
+	KColliderType_CAPSULE,     ///< KCapsuleCollider
+	KColliderType_PLANE,       ///< KPlaneCollider
+	KColliderType_QUAD,        ///< KQuadCollider
+	KColliderType_CHARACTER,   ///< KCharacterCollider
+	KColliderType_SHEARED_BOX, ///< KShearedBoxCollider
+	KColliderType_FLOOR,       ///< KFloorCollider（KAabbCollider の派生だが、種類としては区別する）
+	KColliderType_HEIGHTFIELD, ///< KHeightfieldCollider
+	KColliderType_COUNT
+};
 
 
 struct KCollisionTest {
@@ -39,6 +54,7 @@ public:
 	KCollider();
 	void _setNode(KNode *node);
 	KNode * getNode() const;
+	KColliderType get_type() const { return m_type; }
 	void set_bitflag(uint32_t value);
 	uint32_t get_bitflag() const;
 	void setEnable(bool value);
@@ -55,6 +71,10 @@ public:
 	/// ball_wspeed 球速度（ワールド座標系）
 	virtual bool get_collision_result(KCollisionTest &args) const;
 
+	/// dynamic_collider と static_collider の種類の組み合わせに応じて、専用の判定関数を使って get_collision_result を行う。
+	/// 結果は static_collider->get_collision_result(args) と完全に同じになる
+	static bool dispatch_collision_result(const KCollider *dynamic_collider, const KCollider *static_collider, KCollisionTest &args);
+
 	/// aabb 範囲を得る（ワールド座標）
 	virtual void get_aabb(uint32_t bitmask, KVec3 *out_minpoint, KVec3 *out_maxpoint) const;
 
@@ -74,11 +94,22 @@ public:
 
 	virtual void update_inspector() = 0;
 
+	/// いずれかのコライダーの有効状態、オフセット、形状が変化するたびに増加するカウンタ。
+	/// AABB をキャッシュしている側が、再計算の必要があるかどうかを調べるために使う
+	static uint32_t get_shape_revision();
+
+	/// いずれかのコライダーの有効状態が変化するたびに増加するカウンタ。
+	/// 有効なコライダーのリストをキャッシュしている側が、作り直す必要があるかどうかを調べるために使う
+	static uint32_t get_enable_revision();
+
 protected:
+	static void notify_shape_changed();
+
 	KNode *m_node;
 	KVec3 m_offset;
 	uint32_t m_bitflag;
 	bool m_enable;
+	KColliderType m_type;
 };
 
 class KSphereCollider: public KCollider {
@@ -165,8 +196,35 @@ public:
 	virtual void get_heights(float *heights) const = 0;
 };
 
+/// 等間隔の格子点の高さで表した地形。
+/// 大きな地形を多数の KFloorCollider や KQuadCollider で作る代わりに使う。
+/// 格子点は XZ 平面上で cols x rows 個並び、格子全体の中心がオフセット位置になる。
+/// 各セルは KFloorCollider と同じく、(-X,-Z) と (+X,+Z) の角を結ぶ対角線で２枚の三角形に分割される。
+/// 真下へのレイ（地面の問い合わせ）はセルを直接引いて O(1) で判定し、
+/// それ以外のレイはレイが通過するセルだけを順番にたどって判定する
+class KHeightfieldCollider: public KCollider {
+public:
+	/// heights には cols * rows 個の高さを heights[iz * cols + ix] の順番で入れておく（nullptr なら高さ 0）
+	static KHeightfieldCollider * create(const KVec3 &pos, int cols, int rows, float cell_size, const float *heights);
+
+	/// 画像の明るさを高さとして使う（明るさ 0..255 が高さ 0..height_scale になる）。
+	/// 画像の１ピクセルが格子点１個に対応する（画像の x, y が格子点の ix, iz になる）
+	static KHeightfieldCollider * createFromImage(const KVec3 &pos, const KImage &image, float cell_size, float height_scale);
+
+	virtual int get_cols() const = 0;
+	virtual int get_rows() const = 0;
+	virtual float get_cell_size() const = 0;
+	virtual void set_heights(const float *heights) = 0;
+	virtual void get_heights(float *heights) const = 0;
+	virtual float get_height(int ix, int iz) const = 0;
+
+	/// ワールド座標 (x, z) の真下（真上）にある地形の高さと法線を得る。範囲外なら false を返す
+	virtual bool get_height_at(float x, float z, float *out_y, KVec3 *out_normal) const = 0;
+};
+
 namespace Test {
 void Test_collisionshape();
+void Test_collision_dispatch();
 }
 
 } // namespace
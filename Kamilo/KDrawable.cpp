@@ -1,6 +1,7 @@
 ﻿#include "KDrawable.h"
 //
 #include <algorithm> // std::stable_sort
+#include <string.h> // memcpy
 #include "KAction.h"
 #include "KCamera.h"
 #include "KImGui.h"
@@ -8,6 +9,8 @@
 #include "KInspector.h"
 #include "KInternal.h"
 #include "KScreen.h"
+#include "KClock.h"
+#include "KThread.h"
 
 namespace Kamilo {
 
@@ -19,6 +22,7 @@ namespace Kamilo {
 
 #pragma region Sort
 // 描画の優先度順で並び替える（優先度低いほうから高いほうへ）
+// ※描画時のソートには CRenderSorter を使う。この比較関数はその並び順の定義
 class CSortByPriority {
 public:
 	bool operator()(const KNode *node1, const KNode *node2) const {
@@ -58,26 +62,598 @@ public:
 		return false;
 	}
 };
+
+/// 描画順のソート。
+/// CSortByPriority または CSortByPriorityAndDepth を使った std::stable_sort と同じ順番に並べるが、
+/// 比較のたびにノードを参照するのではなく、ノードごとに一度だけ 64 ビットのキーを作って基数ソートする
+class CRenderSorter {
+	struct SKey {
+		uint64_t key;   // 昇順に並べると描画順になる値
+		uint32_t index; // ソート前のリスト内での位置
+	};
+	struct SValue {
+		int priority;
+		float y;
+		float z;
+	};
+	std::vector<SKey> m_Keys;
+	std::vector<SKey> m_Tmp;
+	std::vector<SValue> m_Values;
+	KNodeArray m_Nodes;
+
+	// 大小関係を保ったまま int を符号なし整数にする
+	static uint32_t sortable_int(int value) {
+		return (uint32_t)value ^ 0x80000000;
+	}
+	// 大小関係を保ったまま float を符号なし整数にする
+	static uint32_t sortable_float(float value) {
+		if (value == 0) value = 0; // -0.0 と 0.0 は同じ値として扱う（比較関数と同じ）
+		uint32_t u;
+		memcpy(&u, &value, sizeof(u));
+		return (u & 0x80000000) ? ~u : (u | 0x80000000);
+	}
+	// m_Keys をキーの昇順に安定ソートする（LSD 基数ソート）。
+	// 全要素で同じ値になっている桁は飛ばす
+	void radix_sort() {
+		const size_t n = m_Keys.size();
+		if (n < 2) return;
+		size_t hist[8][256];
+		memset(hist, 0, sizeof(hist));
+		for (size_t i=0; i<n; i++) {
+			uint64_t k = m_Keys[i].key;
+			for (int b=0; b<8; b++) {
+				hist[b][(k >> (b * 8)) & 0xFF]++;
+			}
+		}
+		m_Tmp.resize(n);
+		SKey *src = m_Keys.data();
+		SKey *dst = m_Tmp.data();
+		for (int b=0; b<8; b++) {
+			const int shift = b * 8;
+			if (hist[b][(src[0].key >> shift) & 0xFF] == n) {
+				continue; // この桁は全て同じ
+			}
+			size_t offset[256];
+			size_t sum = 0;
+			for (int i=0; i<256; i++) {
+				offset[i] = sum;
+				sum += hist[b][i];
+			}
+			for (size_t i=0; i<n; i++) {
+				dst[offset[(src[i].key >> shift) & 0xFF]++] = src[i];
+			}
+			std::swap(src, dst);
+		}
+		if (src != m_Keys.data()) {
+			m_Keys.swap(m_Tmp);
+		}
+	}
+public:
+	/// list を描画順に並び替える。
+	/// with_depth が false なら CSortByPriority と、true なら CSortByPriorityAndDepth と同じ順番になる
+	void sort(KNodeArray &list, bool with_depth) {
+		const size_t n = list.size();
+		if (n < 2) return;
+		m_Keys.resize(n);
+		m_Values.resize(n);
+		for (size_t i=0; i<n; i++) {
+			const KNode *node = list[i];
+			SValue &val = m_Values[i];
+			val.priority = node->getPriorityInTree();
+			if (with_depth) {
+				KVec3 pos = node->getWorldPosition();
+				val.y = pos.y;
+				val.z = pos.z;
+			}
+		}
+		if (with_depth) {
+			// 最も優先度の低い比較（Y座標の小さいほうから）で先に並べておく。
+			// 安定ソートなので、この順番は次のソートで同値になった要素同士の間で保たれる
+			for (size_t i=0; i<n; i++) {
+				m_Keys[i].key = sortable_float(m_Values[i].y);
+				m_Keys[i].index = (uint32_t)i;
+			}
+			radix_sort();
+			// 優先度番号の大きいほうから、Z座標の大きいほうから
+			for (size_t i=0; i<n; i++) {
+				const SValue &val = m_Values[m_Keys[i].index];
+				uint64_t pri = ~sortable_int(val.priority);
+				uint64_t z = ~sortable_float(val.z);
+				m_Keys[i].key = (pri << 32) | z;
+			}
+			radix_sort();
+		} else {
+			// 優先度番号の大きいほうから
+			for (size_t i=0; i<n; i++) {
+				m_Keys[i].key = ~sortable_int(m_Values[i].priority);
+				m_Keys[i].index = (uint32_t)i;
+			}
+			radix_sort();
+		}
+		m_Nodes.resize(n);
+		for (size_t i=0; i<n; i++) {
+			m_Nodes[i] = list[m_Keys[i].index];
+		}
+		list.swap(m_Nodes);
+	}
+};
 #pragma endregion // Sort
 
 
+#pragma region Culling
+/// setCullingStatic(true) が指定されたノードの描画範囲 AABB をキャッシュし、BVH でカメラ範囲内にあるものを探す。
+/// AABB は、ウォッチしているノードのどれかが移動したとき (STransformData::getWatchedWorldMatrixRevision) か、
+/// invalidate されたときにだけ計算し直す。移動したときは、実際に動いたノード (STransformData::m_WatchedRevision) の
+/// AABB と、それを含む BVH ノードだけを更新する。
+/// 最終的な判定には KCamera::isWorldAabbInFrustum を使うので、ノードごとに判定した場合と同じ結果になる
+class CCullingIndex {
+	struct NODE {
+		KVec3 minp, maxp;
+		int parent; // 親ノードのインデックス。ルートなら -1
+		int left;  // 子ノードのインデックス（右の子は left+1）。葉なら -1
+		int first; // 葉の場合、m_Items 内の開始位置
+		int count; // 葉の場合、要素数
+	};
+	static const int LEAF_SIZE = 4;
+
+	std::vector<KDrawable *> m_Drawables;
+	std::vector<const STransformData *> m_Transforms; // m_Drawables のノードの変形データ
+	std::vector<uint32_t> m_SeenRevision; // AABB を求めた時点での各ノードの STransformData::m_WatchedRevision
+	std::vector<KVec3> m_Min;
+	std::vector<KVec3> m_Max;
+	std::vector<int> m_LeafOf; // 要素が入っている BVH の葉ノード。BVH に入っていなければ -1
+	std::vector<int> m_TmpMoved;
+	std::vector<int> m_Items;  // BVH に登録されている要素
+	std::vector<int> m_Always; // AABB の大きさがゼロの要素。常に描画する
+	std::vector<int> m_Huge;   // BVH に入れると検索範囲が広がりすぎる巨大な要素。常に個別に判定する
+	std::vector<NODE> m_Nodes;
+	std::vector<uint32_t> m_VisibleStamp;
+	std::vector<int> m_Stack;
+	KVec3 m_MaxHalfSize; // m_Items の要素の広がり（AABBの各辺の半分）の最大値
+	uint32_t m_Stamp;
+	uint32_t m_TransformRevision;
+	bool m_Dirty;
+	bool m_NeedRefit;
+	int m_NumRebuilds;
+	int m_NumRefits;
+	int m_NumAabbUpdates;
+	int m_NumTests;
+
+	static float huge_half_size() {
+		return 1024.0f;
+	}
+public:
+	CCullingIndex() {
+		m_Stamp = 0;
+		m_TransformRevision = 0;
+		m_Dirty = true;
+		m_NeedRefit = false;
+		m_NumRebuilds = 0;
+		m_NumRefits = 0;
+		m_NumAabbUpdates = 0;
+		m_NumTests = 0;
+	}
+	/// 登録するノードの構成が変わった
+	void markDirty() {
+		m_Dirty = true;
+	}
+	/// どれかの描画範囲が変わった
+	void markRefit() {
+		m_NeedRefit = true;
+	}
+	int getNumRebuilds() const {
+		return m_NumRebuilds;
+	}
+	int getNumRefits() const {
+		return m_NumRefits;
+	}
+	/// これまでに on_node_render_aabb で AABB を求め直した回数
+	int getNumAabbUpdates() const {
+		return m_NumAabbUpdates;
+	}
+	/// 直前の query で isWorldAabbInFrustum を呼んだ回数
+	int getNumTests() const {
+		return m_NumTests;
+	}
+
+	/// 必要ならば再構築、または AABB を更新する
+	void validate(const std::unordered_map<KNode*, KDrawable*> &nodes) {
+		if (m_Dirty) {
+			rebuild(nodes);
+			return;
+		}
+		if (m_NeedRefit) {
+			refit();
+		} else if (m_TransformRevision != STransformData::getWatchedWorldMatrixRevision()) {
+			// 監視しているノードのどれかが動いた。
+			// 静的剛体など、ドローアブル以外の理由で監視されているノードの場合もあるので、
+			// 実際に動いた要素だけを更新する
+			refit_moved();
+		}
+	}
+
+	/// カメラ範囲内にある要素を調べ、isVisible で得られるようにする。
+	/// 透視射影などでインデックスが使えない場合は false を返す（その場合は個別に判定すること）
+	bool query(KCamera *cam) {
+		m_Stamp++;
+		m_NumTests = 0;
+		m_VisibleStamp.resize(m_Drawables.size(), 0);
+
+		KMatrix4 m;
+		if (!cam->getWorld2ViewMatrix(&m)) {
+			return false;
+		}
+		if (m._14 != 0 || m._24 != 0 || m._34 != 0 || m._44 != 1) {
+			return false; // 射影成分がある
+		}
+		KMatrix4 inv;
+		if (!m.computeInverse(&inv)) {
+			return false;
+		}
+		for (size_t i=0; i<m_Always.size(); i++) {
+			m_VisibleStamp[m_Always[i]] = m_Stamp;
+		}
+		for (size_t i=0; i<m_Huge.size(); i++) {
+			test(cam, m_Huge[i]);
+		}
+		if (m_Nodes.empty()) {
+			return true;
+		}
+
+		// isWorldAabbInFrustum は AABB の８頂点をビュー空間に変換してできる AABB とカメラ範囲を比べる。
+		// この AABB の広がりは要素の広がり h に対して |M|h 以下なので、
+		// カメラ範囲をビュー空間で |M|h_max だけ広げておけば、判定が成立しうる要素の中心はすべてその中に入る
+		const KVec3 &h = m_MaxHalfSize;
+		const float pad = 0.001f; // 丸め誤差の分
+		KVec3 ext(
+			fabsf(m._11) * h.x + fabsf(m._21) * h.y + fabsf(m._31) * h.z + pad,
+			fabsf(m._12) * h.x + fabsf(m._22) * h.y + fabsf(m._32) * h.z + pad,
+			fabsf(m._13) * h.x + fabsf(m._23) * h.y + fabsf(m._33) * h.z + pad
+		);
+		KVec3 fmin(-1.0f - ext.x, -1.0f - ext.y, cam->getZNear() - ext.z);
+		KVec3 fmax( 1.0f + ext.x,  1.0f + ext.y, cam->getZFar()  + ext.z);
+		KVec3 qmin, qmax;
+		for (int i=0; i<8; i++) {
+			KVec3 p(
+				(i & 1) ? fmax.x : fmin.x,
+				(i & 2) ? fmax.y : fmin.y,
+				(i & 4) ? fmax.z : fmin.z
+			);
+			p = inv.transform(p);
+			qmin = (i == 0) ? p : qmin.getmin(p);
+			qmax = (i == 0) ? p : qmax.getmax(p);
+		}
+		const KVec3 world_pad(1.0f, 1.0f, 1.0f);
+		qmin -= world_pad;
+		qmax += world_pad;
+
+		m_Stack.clear();
+		m_Stack.push_back(0);
+		while (!m_Stack.empty()) {
+			const NODE &node = m_Nodes[m_Stack.back()];
+			m_Stack.pop_back();
+			if (!overlaps(node.minp, node.maxp, qmin, qmax)) {
+				continue;
+			}
+			if (node.left < 0) {
+				for (int i=0; i<node.count; i++) {
+					int idx = m_Items[node.first + i];
+					if (overlaps(m_Min[idx], m_Max[idx], qmin, qmax)) {
+						test(cam, idx);
+					}
+				}
+			} else {
+				m_Stack.push_back(node.left + 1);
+				m_Stack.push_back(node.left);
+			}
+		}
+		return true;
+	}
+
+	/// 直前の query でカメラ範囲内にあったかどうか
+	bool isVisible(const KDrawable *dw) const {
+		int idx = dw->_getCullingIndex();
+		return 0 <= idx && idx < (int)m_VisibleStamp.size() && m_VisibleStamp[idx] == m_Stamp;
+	}
+
+private:
+	void test(KCamera *cam, int idx) {
+		m_NumTests++;
+		if (cam->isWorldAabbInFrustum(m_Min[idx], m_Max[idx])) {
+			m_VisibleStamp[idx] = m_Stamp;
+		}
+	}
+	static bool overlaps(const KVec3 &amin, const KVec3 &amax, const KVec3 &bmin, const KVec3 &bmax) {
+		if (amax.x < bmin.x || bmax.x < amin.x) return false;
+		if (amax.y < bmin.y || bmax.y < amin.y) return false;
+		if (amax.z < bmin.z || bmax.z < amin.z) return false;
+		return true;
+	}
+	bool is_huge(int idx) const {
+		KVec3 size = m_Max[idx] - m_Min[idx];
+		float lim = huge_half_size() * 2;
+		return size.x > lim || size.y > lim || size.z > lim;
+	}
+	// m_Always, m_Huge, m_Items のどれに入るべきか
+	int get_kind(int idx) const {
+		if ((m_Max[idx] - m_Min[idx]).isZero()) return 1;
+		if (is_huge(idx)) return 2;
+		return 0;
+	}
+	void rebuild(const std::unordered_map<KNode*, KDrawable*> &nodes) {
+		m_Drawables.clear();
+		m_Transforms.clear();
+		for (auto it=nodes.begin(); it!=nodes.end(); ++it) {
+			KDrawable *dw = it->second;
+			if (dw->isCullingStatic()) {
+				dw->_setCullingIndex((int)m_Drawables.size());
+				m_Drawables.push_back(dw);
+				m_Transforms.push_back(&it->first->_getTransformData());
+			} else {
+				dw->_setCullingIndex(-1);
+			}
+		}
+		m_SeenRevision.resize(m_Drawables.size());
+		m_Min.resize(m_Drawables.size());
+		m_Max.resize(m_Drawables.size());
+		m_VisibleStamp.assign(m_Drawables.size(), 0);
+		update_aabbs();
+		build_structure();
+		m_Dirty = false;
+		m_NumRebuilds++;
+	}
+	void refit() {
+		// 大きさの分類が変わらなければ BVH の形はそのままで範囲だけを更新する
+		std::vector<int> old_huge;
+		old_huge.swap(m_Huge);
+		size_t old_always = m_Always.size();
+		update_aabbs();
+		m_Always.clear();
+		for (int i=0; i<(int)m_Drawables.size(); i++) {
+			if ((m_Max[i] - m_Min[i]).isZero()) {
+				m_Always.push_back(i);
+			} else if (is_huge(i)) {
+				m_Huge.push_back(i);
+			}
+		}
+		if (m_Huge != old_huge || m_Always.size() != old_always) {
+			build_structure();
+		} else {
+			// 子ノードは必ず親ノードよりも後ろにあるので、逆順にたどれば葉から順に更新できる
+			for (int n=(int)m_Nodes.size()-1; n>=0; n--) {
+				NODE &node = m_Nodes[n];
+				if (node.left < 0) {
+					node.minp = m_Min[m_Items[node.first]];
+					node.maxp = m_Max[m_Items[node.first]];
+					for (int i=1; i<node.count; i++) {
+						int idx = m_Items[node.first + i];
+						node.minp = node.minp.getmin(m_Min[idx]);
+						node.maxp = node.maxp.getmax(m_Max[idx]);
+					}
+				} else {
+					const NODE &a = m_Nodes[node.left];
+					const NODE &b = m_Nodes[node.left + 1];
+					node.minp = a.minp.getmin(b.minp);
+					node.maxp = a.maxp.getmax(b.maxp);
+				}
+			}
+			update_max_half_size();
+		}
+		m_NumRefits++;
+	}
+	void refit_moved() {
+		// 前回から変形が変わった要素を探す
+		m_TmpMoved.clear();
+		for (int i=0; i<(int)m_Drawables.size(); i++) {
+			if (m_Transforms[i]->m_WatchedRevision != m_SeenRevision[i]) {
+				m_TmpMoved.push_back(i);
+			}
+		}
+		bool reclassified = false;
+		for (size_t k=0; k<m_TmpMoved.size(); k++) {
+			int idx = m_TmpMoved[k];
+			int old_kind = get_kind(idx);
+			update_aabb(idx);
+			if (get_kind(idx) != old_kind) {
+				reclassified = true;
+			}
+		}
+		m_TransformRevision = STransformData::getWatchedWorldMatrixRevision();
+		if (m_TmpMoved.empty()) {
+			return;
+		}
+		if (reclassified) {
+			build_structure();
+		} else {
+			// 動いた要素を含む葉から根に向かって範囲を更新する
+			for (size_t k=0; k<m_TmpMoved.size(); k++) {
+				int idx = m_TmpMoved[k];
+				if (m_LeafOf[idx] < 0) {
+					continue; // BVH に入っていない
+				}
+				m_MaxHalfSize = m_MaxHalfSize.getmax((m_Max[idx] - m_Min[idx]) * 0.5f);
+				for (int n=m_LeafOf[idx]; n>=0; n=m_Nodes[n].parent) {
+					NODE &node = m_Nodes[n];
+					if (node.left < 0) {
+						node.minp = m_Min[m_Items[node.first]];
+						node.maxp = m_Max[m_Items[node.first]];
+						for (int i=1; i<node.count; i++) {
+							int item = m_Items[node.first + i];
+							node.minp = node.minp.getmin(m_Min[item]);
+							node.maxp = node.maxp.getmax(m_Max[item]);
+						}
+					} else {
+						const NODE &a = m_Nodes[node.left];
+						const NODE &b = m_Nodes[node.left + 1];
+						node.minp = a.minp.getmin(b.minp);
+						node.maxp = a.maxp.getmax(b.maxp);
+					}
+				}
+			}
+		}
+		m_NumRefits++;
+	}
+	void update_aabb(int idx) {
+		m_Drawables[idx]->on_node_render_aabb(&m_Min[idx], &m_Max[idx]);
+		m_SeenRevision[idx] = m_Transforms[idx]->m_WatchedRevision; // AABB を求める途中でワールド行列が更新されることがあるので、その後で記録する
+		m_NumAabbUpdates++;
+	}
+	void update_aabbs() {
+		for (int i=0; i<(int)m_Drawables.size(); i++) {
+			update_aabb(i);
+		}
+		m_TransformRevision = STransformData::getWatchedWorldMatrixRevision();
+		m_NeedRefit = false;
+	}
+	void update_max_half_size() {
+		m_MaxHalfSize = KVec3();
+		for (size_t i=0; i<m_Items.size(); i++) {
+			int idx = m_Items[i];
+			m_MaxHalfSize = m_MaxHalfSize.getmax((m_Max[idx] - m_Min[idx]) * 0.5f);
+		}
+	}
+	void build_structure() {
+		m_Items.clear();
+		m_Always.clear();
+		m_Huge.clear();
+		m_Nodes.clear();
+		for (int i=0; i<(int)m_Drawables.size(); i++) {
+			if ((m_Max[i] - m_Min[i]).isZero()) {
+				m_Always.push_back(i);
+			} else if (is_huge(i)) {
+				m_Huge.push_back(i);
+			} else {
+				m_Items.push_back(i);
+			}
+		}
+		update_max_half_size();
+		m_LeafOf.assign(m_Drawables.size(), -1);
+		if (m_Items.empty()) {
+			return;
+		}
+		m_Nodes.reserve(m_Items.size() * 2 / LEAF_SIZE + 1);
+		m_Nodes.push_back(NODE());
+		m_Nodes[0].parent = -1;
+		build_bvh(0, 0, (int)m_Items.size());
+	}
+	// 中心座標の広がりが最も大きい軸で、要素数が半分になるように分割する
+	void build_bvh(int nodeindex, int first, int count) {
+		KVec3 minp = m_Min[m_Items[first]];
+		KVec3 maxp = m_Max[m_Items[first]];
+		KVec3 cmin = (minp + maxp) * 0.5f;
+		KVec3 cmax = cmin;
+		for (int i=first+1; i<first+count; i++) {
+			int idx = m_Items[i];
+			KVec3 c = (m_Min[idx] + m_Max[idx]) * 0.5f;
+			minp = minp.getmin(m_Min[idx]);
+			maxp = maxp.getmax(m_Max[idx]);
+			cmin = cmin.getmin(c);
+			cmax = cmax.getmax(c);
+		}
+		m_Nodes[nodeindex].minp = minp;
+		m_Nodes[nodeindex].maxp = maxp;
+		m_Nodes[nodeindex].left = -1;
+		m_Nodes[nodeindex].first = first;
+		m_Nodes[nodeindex].count = count;
+		if (count <= LEAF_SIZE) {
+			for (int i=first; i<first+count; i++) {
+				m_LeafOf[m_Items[i]] = nodeindex;
+			}
+			return;
+		}
+		KVec3 ext = cmax - cmin;
+		int axis = 0;
+		if (ext.y > ext.x && ext.y >= ext.z) axis = 1;
+		if (ext.z > ext.x && ext.z > ext.y) axis = 2;
+		const std::vector<KVec3> &mins = m_Min;
+		const std::vector<KVec3> &maxs = m_Max;
+		int half = count / 2;
+		std::nth_element(m_Items.begin() + first, m_Items.begin() + first + half, m_Items.begin() + first + count, [&](int a, int b) {
+			return mins[a][axis] + maxs[a][axis] < mins[b][axis] + maxs[b][axis];
+		});
+		int left = (int)m_Nodes.size();
+		m_Nodes.push_back(NODE());
+		m_Nodes.push_back(NODE());
+		m_Nodes[nodeindex].left = left;
+		m_Nodes[left].parent = nodeindex;
+		m_Nodes[left + 1].parent = nodeindex;
+		build_bvh(left, first, half);
+		build_bvh(left + 1, first + half, count - half);
+	}
+};
+#pragma endregion // Culling
+
+
 
 class CRenderMgr: public KManager, public KInspectorCallback {
+	// registerDrawables の結果を開始ノードとレイヤーごとに保持したもの。
+	// 開始ノード以下で、そのレイヤーに関わる構成が変わったときだけ作り直し、優先度が変わったときだけ並べ直す
+	struct SRenderList {
+		KNode *start;
+		int layer;
+		int start_layer;
+		uint32_t tree_revision;  // start の SRenderData::getRenderListRevisionInTree の値
+		uint32_t layer_revision; // SRenderData::getRenderListRevision(layer) の値（start がツリー外なら getRenderListRevision() の値）
+		bool in_tree; // start がノードツリーに入っていたかどうか
+		uint32_t order_revision; // SRenderData::getRenderOrderRevision の値
+		uint32_t drawable_revision; // m_DrawableRevision の値
+		uint32_t last_used;
+		bool sorted_valid;
+		KNodeArray nodes;  // ツリー巡回順
+		KNodeArray sorted; // nodes を優先度順に並べたもの (KCamera::ORDER_HIERARCHY 用)
+	};
+	static const int MAX_RENDER_LISTS = 16;
+	std::vector<SRenderList> m_RenderLists;
+	uint32_t m_DrawableRevision; // invalidateRenderLists のたびに増える
+	uint32_t m_RenderListClock;
+	int m_NumRenderListRebuilds;
+	int m_NumRenderListSorts;
+	// 描画リストの並列記録。
+	// ノード列を連続する区間 (SRecordSegment) に分け、区間ごとに別の描画リストに記録してから順番に連結する
+	struct SRecordNode {
+		KNode *node;
+		KDrawable *drawable;
+		KDrawable::RenderArgs args;
+	};
+	struct SRecordSegment {
+		int begin; // m_RecordNodes の範囲。parallel が false なら使わない
+		int end;
+		bool parallel; // ワーカースレッドで記録する区間
+		KDrawList *drawlist;
+	};
+	static const int RECORD_SEGMENT_SIZE = 64;  // 並列に記録する区間のノード数
+	static const int RECORD_MIN_NODES = 256; // これより少なければ並列化しない
+	std::vector<SRecordNode> m_RecordNodes;
+	std::vector<SRecordSegment> m_RecordSegments;
+	std::vector<int> m_RecordJobs; // 並列に記録する区間の番号
+	std::vector<KDrawList *> m_RecordDrawLists;
+	KParallelFor m_Parallel;
+
 	KNodeArray m_Tmp0;
 	KNodeArray m_Tmp1;
 	KNodeArray m_Tmp1a;
 	KNodeArray m_Tmp2;
 	KDrawList m_DrawList;
+	CRenderSorter m_Sorter;
+	CCullingIndex m_CullingIndex;
 	KRenderCallback *m_CB;
 	std::unordered_map<KNode*, KDrawable*> m_Nodes;
 	int m_NumDrawNodes;
 	int m_NumDrawList;
 	bool m_AdjSnap;
 	bool m_AdjHalf;
+	bool m_UseCullingIndex;
+	bool m_UseRenderListCache;
 public:
 	CRenderMgr() {
 		m_AdjSnap = MO_VIDEO_ENABLE_HALF_PIXEL;
 		m_AdjHalf = MO_VIDEO_ENABLE_HALF_PIXEL;
+		m_UseCullingIndex = true;
+		m_UseRenderListCache = true;
+		m_DrawableRevision = 0;
+		m_RenderListClock = 0;
+		m_NumRenderListRebuilds = 0;
+		m_NumRenderListSorts = 0;
 		m_NumDrawNodes = 0;
 		m_NumDrawList = 0;
 		m_CB = nullptr;
@@ -99,6 +675,7 @@ public:
 		m_Nodes[node] = drawable;
 		drawable->_setNode(node);
 		drawable->grab();
+		node->_getRenderData()._markRenderListChanged(false);
 	}
 	void delDrawable(KNode *node) {
 		auto it = m_Nodes.find(node);
@@ -107,6 +684,7 @@ public:
 			drawable->_setNode(nullptr);
 			drawable->drop();
 			m_Nodes.erase(it);
+			node->_getRenderData()._markRenderListChanged(false);
 		}
 	}
 	KDrawable * getDrawable(KNode *node) {
@@ -116,6 +694,30 @@ public:
 		}
 		return nullptr;
 	}
+	void markCullingDirty() {
+		m_CullingIndex.markDirty();
+	}
+	void markCullingRefit() {
+		m_CullingIndex.markRefit();
+	}
+	int getNumCullingAabbUpdates() const {
+		return m_CullingIndex.getNumAabbUpdates();
+	}
+	void invalidateRenderLists() {
+		m_DrawableRevision++;
+	}
+	int getNumRenderListRebuilds() const {
+		return m_NumRenderListRebuilds;
+	}
+	int getNumRenderListSorts() const {
+		return m_NumRenderListSorts;
+	}
+	void setNumThreads(int num) {
+		m_Parallel.setNumThreads(num);
+	}
+	int getNumThreads() const {
+		return m_Parallel.getNumThreads();
+	}
 
 	#pragma region KManager
 	virtual void on_manager_nodeinspector(KNode *node) override {
@@ -128,7 +730,12 @@ public:
 	}
 	virtual void on_manager_end() override {
 		K__ASSERT(m_Nodes.empty()); // 正しく on_manager_detach が呼ばれていればノードは存在しないはず
+		m_RenderLists.clear();
 		m_DrawList.destroy();
+		for (size_t i=0; i<m_RecordDrawLists.size(); i++) {
+			delete m_RecordDrawLists[i];
+		}
+		m_RecordDrawLists.clear();
 	}
 	virtual void on_manager_detach(KNode *node) override {
 		delDrawable(node);
@@ -202,6 +809,12 @@ public:
 		case KDrawable::C_MASTER_ADJ_HALF:
 			m_AdjHalf = value;
 			break;
+		case KDrawable::C_CULLING_INDEX:
+			m_UseCullingIndex = value;
+			break;
+		case KDrawable::C_RENDER_LIST_CACHE:
+			m_UseRenderListCache = value;
+			break;
 		}
 	}
 	bool getConfig(KDrawable::EConfig conf) const {
@@ -210,6 +823,10 @@ public:
 			return m_AdjSnap;
 		case KDrawable::C_MASTER_ADJ_HALF:
 			return m_AdjHalf;
+		case KDrawable::C_CULLING_INDEX:
+			return m_UseCullingIndex;
+		case KDrawable::C_RENDER_LIST_CACHE:
+			return m_UseRenderListCache;
 		}
 		return false;
 	}
@@ -281,6 +898,12 @@ public:
 	}
 private:
 	void nodes_filter_by_frustum(KNodeArray &output, const KNodeArray &input, KNode *camera) {
+		// 描画範囲が静的なノードは、空間インデックスにまとめて問い合わせておく
+		bool indexed = false;
+		if (m_UseCullingIndex) {
+			m_CullingIndex.validate(m_Nodes);
+			indexed = m_CullingIndex.query(KCamera::of(camera));
+		}
 		for (auto it=input.begin(); it!=input.end(); ++it) {
 			KNode *node = *it;
 			K__ASSERT(node);
@@ -291,8 +914,14 @@ private:
 			
 			} else {
 				// カリング有効。カメラの撮影範囲内にある場合のみ描画する
-				KVec3 aabb_min, aabb_max;
 				KDrawable *dw = getDrawable(node);
+				if (indexed && dw && dw->_getCullingIndex() >= 0) {
+					if (m_CullingIndex.isVisible(dw)) {
+						output.push_back(node);
+					}
+					continue;
+				}
+				KVec3 aabb_min, aabb_max;
 				if (dw) dw->on_node_render_aabb(&aabb_min, &aabb_max);
 				KVec3 size = aabb_max - aabb_min;
 				// aabb サイズがゼロの場合は無条件で描画とする
@@ -329,13 +958,13 @@ private:
 			// ヒエラルキー上で親→子の順番になるようにソートする
 			// KNode::_RegisterForRender でノードを登録した時点でヒエラルキー順になってるので、
 			// 基本的にはこのままでよいのでだが、さらに描画優先度の値でソートしておく。
-			// ソートキーが同値だった場合に順番を変えないよう std::sort ではなく stable_sort を使う
-			std::stable_sort(list.begin(), list.end(), CSortByPriority());
+			// ソートキーが同値だった場合に順番を変えないよう安定ソートを使う
+			m_Sorter.sort(list, false);
 			break;
 		case KCamera::ORDER_ZDEPTH:
 			// エンティティのワールド座標が奥(Z大)→手前(Z小)の順番になるようにソートする。
-			// ソートキーが同値だった場合に順番を変えないよう std::sort ではなく stable_sort を使う
-			std::stable_sort(list.begin(), list.end(), CSortByPriorityAndDepth());
+			// ソートキーが同値だった場合に順番を変えないよう安定ソートを使う
+			m_Sorter.sort(list, true);
 			break;
 		case KCamera::ORDER_CUSTOM:
 			// ユーザー定義のソートを行う
@@ -345,23 +974,101 @@ private:
 			break;
 		}
 	}
+	// start 以下の描画対象ノードのリストを得る。
+	// 前回から描画リストの構成が変わっていなければ、ツリーを巡回せずに保持しているリストを返す。
+	// start の外側での変更や、ほかのレイヤーだけに関わる変更では作り直さない
+	SRenderList * get_render_list(KNode *start, int layer, int start_layer) {
+		m_RenderListClock++;
+		SRenderList *rl = nullptr;
+		for (size_t i=0; i<m_RenderLists.size(); i++) {
+			SRenderList &item = m_RenderLists[i];
+			if (item.start == start && item.layer == layer && item.start_layer == start_layer) {
+				rl = &item;
+				break;
+			}
+		}
+		if (rl == nullptr) {
+			if ((int)m_RenderLists.size() < MAX_RENDER_LISTS) {
+				m_RenderLists.push_back(SRenderList());
+				rl = &m_RenderLists.back();
+			} else {
+				// 一番長い間使われていないものを再利用する
+				rl = &m_RenderLists[0];
+				for (size_t i=1; i<m_RenderLists.size(); i++) {
+					if (m_RenderLists[i].last_used < rl->last_used) {
+						rl = &m_RenderLists[i];
+					}
+				}
+			}
+			rl->start = start;
+			rl->layer = layer;
+			rl->start_layer = start_layer;
+			rl->drawable_revision = m_DrawableRevision - 1; // 必ず作り直させる
+		}
+		rl->last_used = m_RenderListClock;
+
+		// start 以下での変更と、layer に関わる変更の両方があったときだけ作り直す。
+		// 別々の変更によるものかもしれないが、その場合は作り直しても結果が変わらないだけ
+		bool in_tree = start->get_tree() != nullptr;
+		uint32_t tree_rev = start->_getRenderData().getRenderListRevisionInTree();
+		uint32_t layer_rev = in_tree ? SRenderData::getRenderListRevision(layer) : SRenderData::getRenderListRevision();
+		bool changed = rl->tree_revision != tree_rev && rl->layer_revision != layer_rev;
+		if (changed || rl->in_tree != in_tree || rl->drawable_revision != m_DrawableRevision) {
+			rl->nodes.clear();
+			registerDrawables(start, layer, rl->nodes, false, start_layer);
+			rl->tree_revision = tree_rev;
+			rl->layer_revision = layer_rev;
+			rl->in_tree = in_tree;
+			rl->drawable_revision = m_DrawableRevision;
+			rl->sorted_valid = false;
+			m_NumRenderListRebuilds++;
+		}
+		return rl;
+	}
+	// get_render_list で得たリストを優先度順に並べたものを得る (KCamera::ORDER_HIERARCHY)。
+	// 優先度が変わっていなければ並べ直さない
+	const KNodeArray & get_sorted_render_list(SRenderList *rl) {
+		uint32_t order_rev = SRenderData::getRenderOrderRevision();
+		if (!rl->sorted_valid || rl->order_revision != order_rev) {
+			rl->sorted.assign(rl->nodes.begin(), rl->nodes.end());
+			sortByRenderingOrder(KCamera::ORDER_HIERARCHY, rl->sorted);
+			rl->order_revision = order_rev;
+			rl->sorted_valid = true;
+			m_NumRenderListSorts++;
+		}
+		return rl->sorted;
+	}
 	void renderqueue_add_nodes(KNodeArray &output, KNode *start, KNode *camera, KEntityFilterCallback *filter) {
 		if (start == nullptr) return;
 		if (camera == nullptr) return;
 
 		int camera_layer = camera->getLayerInTree();
 		int start_layer = start->getLayerInTree();
+		KCamera::Order order = KCamera::of(camera)->getRenderingOrder();
 
-		m_Tmp0.clear();
-
-		registerDrawables(start, camera_layer, m_Tmp0, false, start_layer);
+		const KNodeArray *list = &m_Tmp0;
+		bool sorted = false;
+		if (m_UseRenderListCache) {
+			SRenderList *rl = get_render_list(start, camera_layer, start_layer);
+			if (order == KCamera::ORDER_HIERARCHY) {
+				// 安定ソートしてから選別しても、選別してから安定ソートしても同じ結果になる。
+				// 並べ替え済みのリストを選別すれば、毎回ソートしなくて済む
+				list = &get_sorted_render_list(rl);
+				sorted = true;
+			} else {
+				list = &rl->nodes;
+			}
+		} else {
+			m_Tmp0.clear();
+			registerDrawables(start, camera_layer, m_Tmp0, false, start_layer);
+		}
 
 		// カメラ範囲による選別
 		if (1) {
 			m_Tmp1.clear();
-			nodes_filter_by_frustum(m_Tmp1, m_Tmp0, camera);
+			nodes_filter_by_frustum(m_Tmp1, *list, camera);
 		} else {
-			m_Tmp1.assign(m_Tmp0.begin(), m_Tmp0.end());
+			m_Tmp1.assign(list->begin(), list->end());
 		}
 
 		// コールバックによる選別
@@ -370,8 +1077,21 @@ private:
 
 		// ソートする
 		output.assign(m_Tmp1a.begin(), m_Tmp1a.end());
-		KCamera::Order order = KCamera::of(camera)->getRenderingOrder();
-		sortByRenderingOrder(order, output);
+		if (!sorted) {
+			sortByRenderingOrder(order, output);
+		}
+	}
+
+	void make_render_args(KNode *node, const KMatrix4 &projection, const KMatrix4 &transform, KNode *camera, KDrawable::RenderArgs *opt) {
+		KMatrix4 world_matrix;
+		node->getLocal2WorldMatrix(&world_matrix);
+
+		opt->projection = projection;
+		opt->transform = world_matrix * transform; // エンティティ座標を適用
+		opt->cb = m_CB;
+		opt->adj_snap = m_AdjSnap && KCamera::of(camera)->isSnapIntEnabled();
+		opt->adj_half = m_AdjHalf && KCamera::of(camera)->isOffsetHalfPixelEnabled();
+		opt->camera = camera;
 	}
 
 	// 与えられたノードだけを描画する
@@ -380,16 +1100,9 @@ private:
 		KDrawable *renderer = KDrawable::of(node);
 		if (renderer == nullptr) return; // 必ずチェックする。例えば ATOMIC が設定されているノードはレンダラーを持っていない場合もある
 
-		KMatrix4 world_matrix;
-		node->getLocal2WorldMatrix(&world_matrix);
-
 		KDrawable::RenderArgs opt;
-		opt.projection = projection;
-		opt.transform = world_matrix * transform; // エンティティ座標を適用
-		opt.cb = m_CB;
-		opt.adj_snap = m_AdjSnap && KCamera::of(camera)->isSnapIntEnabled();
-		opt.adj_half = m_AdjHalf && KCamera::of(camera)->isOffsetHalfPixelEnabled();
-		opt.camera = camera;
+		make_render_args(node, projection, transform, camera, &opt);
+		renderer->onDrawable_prepare(node, &opt);
 		renderer->onDrawable_draw(node, &opt, drawlist);
 	}
 
@@ -439,27 +1152,115 @@ private:
 		m_Tmp2.clear();
 	}
 
-	void nodes_render(const KNodeArray &input, const KMatrix4 &projection, const KMatrix4 &transform, KNode *camera) {
-		bool depth_test = KCamera::of(camera)->isZEnabled();
-		if (depth_test) {
-			KVideo::setDepthTestEnabled(true);
+	KDrawList * get_record_drawlist(int index) {
+		while ((int)m_RecordDrawLists.size() <= index) {
+			m_RecordDrawLists.push_back(new KDrawList());
 		}
-		if (USING_DRAWLIST) {
-			// 描画リスト使う
-			m_DrawList.clear();
-			int i = 0;
+		KDrawList *drawlist = m_RecordDrawLists[index];
+		drawlist->clear();
+		return drawlist;
+	}
+	SRecordSegment * begin_segment(bool parallel) {
+		SRecordSegment *last = m_RecordSegments.empty() ? nullptr : &m_RecordSegments.back();
+		if (last) {
+			if (!parallel && !last->parallel) {
+				return last; // 呼び出し元スレッドで記録する区間は、続けて同じ描画リストに記録する
+			}
+			if (parallel && last->parallel && last->end - last->begin < RECORD_SEGMENT_SIZE) {
+				return last;
+			}
+		}
+		SRecordSegment seg;
+		seg.begin = (int)m_RecordNodes.size();
+		seg.end = seg.begin;
+		seg.parallel = parallel;
+		seg.drawlist = get_record_drawlist((int)m_RecordSegments.size());
+		m_RecordSegments.push_back(seg);
+		return &m_RecordSegments.back();
+	}
+	static void record_segment_cb(void *data, int begin, int end, int worker) {
+		CRenderMgr *mgr = reinterpret_cast<CRenderMgr *>(data);
+		for (int j=begin; j<end; j++) {
+			const SRecordSegment &seg = mgr->m_RecordSegments[mgr->m_RecordJobs[j]];
+			for (int i=seg.begin; i<seg.end; i++) {
+				SRecordNode &rn = mgr->m_RecordNodes[i];
+				rn.drawable->onDrawable_draw(rn.node, &rn.args, seg.drawlist);
+			}
+		}
+	}
+
+public:
+	// ノード列を描画リストに記録する
+	void recordNodes(const KNodeArray &input, const KMatrix4 &projection, const KMatrix4 &transform, KNode *camera, KDrawList *drawlist) {
+		if (m_Parallel.getNumThreads() <= 1 || (int)input.size() < RECORD_MIN_NODES) {
 			for (auto it=input.begin(); it!=input.end(); ++it) {
 				KNode *node = *it;
 				if (node->getRenderAtomic()) {
 					// 不可分描画
 					// 子ツリーが node 登録されていないので、いまここで子ツリーを描画させる
-					renderNodeTree(node, projection, transform, camera, &m_DrawList);
+					renderNodeTree(node, projection, transform, camera, drawlist);
 
 				} else {
-					renderSingleNode(node, projection, transform, camera, &m_DrawList);
+					renderSingleNode(node, projection, transform, camera, drawlist);
 				}
-				i++;
 			}
+			return;
+		}
+
+		// 準備フェーズ。
+		// 描画設定の計算と onDrawable_prepare はノードの順番通りに呼び出し元スレッドで行う。
+		// 並列に記録できないノードは、ここでそのまま記録してしまう
+		m_RecordNodes.clear();
+		m_RecordSegments.clear();
+		m_RecordJobs.clear();
+		for (auto it=input.begin(); it!=input.end(); ++it) {
+			KNode *node = *it;
+			if (node->getRenderAtomic()) {
+				SRecordSegment *seg = begin_segment(false);
+				renderNodeTree(node, projection, transform, camera, seg->drawlist);
+				continue;
+			}
+			KDrawable *renderer = KDrawable::of(node);
+			if (renderer == nullptr) continue;
+
+			SRecordNode rn;
+			rn.node = node;
+			rn.drawable = renderer;
+			make_render_args(node, projection, transform, camera, &rn.args);
+			if (renderer->onDrawable_prepare(node, &rn.args)) {
+				SRecordSegment *seg = begin_segment(true);
+				m_RecordNodes.push_back(rn);
+				seg->end = (int)m_RecordNodes.size();
+			} else {
+				SRecordSegment *seg = begin_segment(false);
+				renderer->onDrawable_draw(node, &rn.args, seg->drawlist);
+			}
+		}
+
+		// 記録フェーズ。区間ごとに別々の描画リストに記録する
+		for (size_t i=0; i<m_RecordSegments.size(); i++) {
+			if (m_RecordSegments[i].parallel) {
+				m_RecordJobs.push_back((int)i);
+			}
+		}
+		m_Parallel.run((int)m_RecordJobs.size(), 1, record_segment_cb, this);
+
+		// 連結フェーズ。ノードの順番通りに連結する
+		for (size_t i=0; i<m_RecordSegments.size(); i++) {
+			drawlist->append(*m_RecordSegments[i].drawlist);
+		}
+	}
+private:
+
+	void nodes_render(const KNodeArray &input, const KMatrix4 &projection, const KMatrix4 &transform, KNode *camera) {
+		bool depth_test = KCamera::of(camera)->isZEnabled();
+		if (depth_test) {
+			KVideo::setDepthTestEnabled(true);
+		}
+		if (USING_DRAWLIST) {
+			// 描画リスト使う
+			m_DrawList.clear();
+			recordNodes(input, projection, transform, camera, &m_DrawList);
 			m_DrawList.endList();
 			m_DrawList.draw();
 			m_NumDrawList += m_DrawList.size(); // on_manager_renderworld はカメラごとに呼ばれるので、代入ではなく加算する
@@ -504,6 +1305,18 @@ void KDrawable::setCallback(KRenderCallback *cb) {
 	K__ASSERT(g_RenderMgr);
 	g_RenderMgr->setCallback(cb);
 }
+void KDrawable::invalidateRenderLists() {
+	K__ASSERT(g_RenderMgr);
+	g_RenderMgr->invalidateRenderLists();
+}
+void KDrawable::setNumThreads(int num) {
+	K__ASSERT(g_RenderMgr);
+	g_RenderMgr->setNumThreads(num);
+}
+int KDrawable::getNumThreads() {
+	K__ASSERT(g_RenderMgr);
+	return g_RenderMgr->getNumThreads();
+}
 KDrawable * KDrawable::of(KNode *node) {
 	K__ASSERT(g_RenderMgr);
 	return g_RenderMgr->getDrawable(node);
@@ -528,6 +1341,8 @@ KDrawable::KDrawable() {
 	m_adj_snap = MO_VIDEO_ENABLE_HALF_PIXEL;
 	m_adj_half = MO_VIDEO_ENABLE_HALF_PIXEL;
 	m_node = nullptr;
+	m_culling_static = false;
+	m_culling_index = -1;
 }
 KDrawable::~KDrawable() {
 	if (KBank::getTextureBank()) {
@@ -540,8 +1355,36 @@ KNode * KDrawable::getNode() {
 void KDrawable::_setNode(KNode *node) {
 	// KDrawable は KNode によって保持される。
 	// 循環ロック防止のために KNode の参照カウンタは変更しない
+	if (m_culling_static && m_node != node) {
+		// 描画範囲をキャッシュするので、ノードの移動を検出できるようにしておく
+		if (m_node) m_node->_getTransformData().m_WatchWorldMatrix--;
+		if (node) node->_getTransformData().m_WatchWorldMatrix++;
+		if (g_RenderMgr) g_RenderMgr->markCullingDirty();
+	}
 	m_node = node;
 }
+void KDrawable::setCullingStatic(bool value) {
+	if (m_culling_static == value) return;
+	m_culling_static = value;
+	if (m_node) {
+		m_node->_getTransformData().m_WatchWorldMatrix += value ? 1 : -1;
+	}
+	if (g_RenderMgr) g_RenderMgr->markCullingDirty();
+}
+bool KDrawable::isCullingStatic() const {
+	return m_culling_static;
+}
+void KDrawable::invalidateCullingAabb() {
+	if (m_culling_static && g_RenderMgr) {
+		g_RenderMgr->markCullingRefit();
+	}
+}
+int KDrawable::_getCullingIndex() const {
+	return m_culling_index;
+}
+void KDrawable::_setCullingIndex(int index) {
+	m_culling_index = index;
+}
 void KDrawable::on_node_render_aabb(KVec3 *aabb_min, KVec3 *aabb_max) {
 	KNode *self = getNode();
 	K__ASSERT(self);
@@ -588,6 +1431,9 @@ void KDrawable::onDrawable_inspector() {
 	KDebugGui::K_DebugGui_Aabb("AABB (Raw)", lmin, lmax);
 	KDebugGui::K_DebugGui_Aabb("AABB (World)", wmin, wmax);
 }
+bool KDrawable::onDrawable_prepare(KNode *node, const RenderArgs *args) {
+	return false;
+}
 void KDrawable::onDrawable_register(int layer, std::vector<KNode*> &list) {
 	K__ASSERT_RETURN(m_node);
 	int this_layer = m_node->getLayerInTree();
@@ -835,4 +1681,593 @@ void KDrawable::updateInspector() {
 #pragma endregion // KDrawable
 
 
+namespace Test {
+
+void Test_render_sort() {
+	bool install = !KNodeTree::isInstalled();
+	if (install) KNodeTree::install();
+
+	// 50000 ノードを作る。優先度や座標は同値が多くなるようにして、安定ソートかどうかを確かめる
+	const int NUM_NODES = 50000;
+	uint32_t seed = 16180;
+	auto rnd = [&seed](int n) {
+		seed = seed * 1664525 + 1013904223;
+		return (int)((seed >> 8) % n);
+	};
+	KNode *group = KNode::create();
+	group->setParent(KNodeTree::getRoot());
+	KNodeArray nodes;
+	for (int i=0; i<NUM_NODES; i++) {
+		KNode *node = KNode::create();
+		node->setPriority(rnd(8) - 4);
+		float z = rnd(20) * 0.25f - 2;
+		if (i % 97 == 0) z = -0.0f; // 0.0 と -0.0 は同値
+		node->setPosition(KVec3((float)rnd(640), (float)rnd(480) * 0.5f, z));
+		node->setParent(group);
+		nodes.push_back(node);
+		node->drop();
+	}
+
+	int num_errors = 0;
+	CRenderSorter sorter;
+	for (int with_depth=0; with_depth<2; with_depth++) {
+		KNodeArray expected = nodes;
+		KClock clock;
+		if (with_depth) {
+			std::stable_sort(expected.begin(), expected.end(), CSortByPriorityAndDepth());
+		} else {
+			std::stable_sort(expected.begin(), expected.end(), CSortByPriority());
+		}
+		int t_stable = clock.getTimeNano() / 1000;
+
+		// 毎フレーム同じソーターを使うので、作業領域を確保した後の時間を計る
+		KNodeArray actual = nodes;
+		sorter.sort(actual, with_depth != 0);
+		actual = nodes;
+		clock.reset();
+		sorter.sort(actual, with_depth != 0);
+		int t_radix = clock.getTimeNano() / 1000;
+
+		if (actual != expected) {
+			num_errors++;
+		}
+		K__PRINT("Test_render_sort: %d nodes, %s: stable_sort %d usec, radix %d usec",
+			NUM_NODES, with_depth ? "priority and depth" : "priority", t_stable, t_radix);
+	}
+	K__ASSERT(num_errors == 0);
+
+	// 後始末
+	group->remove();
+	group->drop();
+	KNodeTree::destroyMarkedNodes(nullptr);
+
+	if (install) KNodeTree::uninstall();
+}
+
+// 描画範囲が固定の四角形
+class CTestRectDrawable: public KDrawable {
+public:
+	KVec3 m_Min;
+	KVec3 m_Max;
+	virtual bool copyFrom(const KDrawable *co) override { return false; }
+	virtual void onDrawable_getGroupImageSize(int *w, int *h, KVec3 *pivot) override {}
+	virtual void onDrawable_draw(KNode *node, const RenderArgs *args, KDrawList *drawlist) override {}
+	virtual bool onDrawable_getBoundingAabb(KVec3 *minpoint, KVec3 *maxpoint) override {
+		if (minpoint) *minpoint = m_Min;
+		if (maxpoint) *maxpoint = m_Max;
+		return true;
+	}
+};
+
+void Test_render_culling() {
+	bool install_tree = !KNodeTree::isInstalled();
+	bool install_render = g_RenderMgr == nullptr;
+	bool install_camera = !KCamera::isInstalled();
+	if (install_tree) KNodeTree::install();
+	if (install_render) KDrawable::install();
+	if (install_camera) KCamera::install();
+	const bool old_config = KDrawable::getConfig(KDrawable::C_CULLING_INDEX);
+
+	// 400x250 個のタイル (32x32) を並べた 12800x8000 のマップと、その上を動き回る 200 個のスプライト
+	const int COLS = 400;
+	const int ROWS = 250;
+	const int NUM_MOVERS = 200;
+	const int NUM_FRAMES = 60;
+	const float TILE = 32;
+	uint32_t seed = 27182;
+	auto rnd = [&seed](float lo, float hi) {
+		seed = seed * 1664525 + 1013904223;
+		return lo + (hi - lo) * ((seed >> 8) / (float)(1 << 24));
+	};
+	KNode *root = KNode::create();
+	root->setParent(KNodeTree::getRoot());
+	std::vector<KNode *> tiles;
+	for (int y=0; y<ROWS; y++) {
+		for (int x=0; x<COLS; x++) {
+			KNode *node = KNode::create();
+			node->setPosition(KVec3(x * TILE, y * TILE, 0.0f));
+			node->setParent(root);
+			CTestRectDrawable *dw = new CTestRectDrawable();
+			dw->m_Max = KVec3(TILE, TILE, 0.0f);
+			dw->setCullingStatic(true);
+			KDrawable::_attach(node, dw);
+			dw->drop();
+			tiles.push_back(node);
+			node->drop();
+		}
+	}
+	std::vector<KNode *> movers;
+	for (int i=0; i<NUM_MOVERS; i++) {
+		KNode *node = KNode::create();
+		node->setPosition(KVec3(rnd(0, COLS * TILE), rnd(0, ROWS * TILE), 0.0f));
+		node->setParent(root);
+		CTestRectDrawable *dw = new CTestRectDrawable();
+		dw->m_Min = KVec3(-24.0f, -24.0f, 0.0f);
+		dw->m_Max = KVec3(24.0f, 24.0f, 0.0f);
+		KDrawable::_attach(node, dw);
+		dw->drop();
+		movers.push_back(node);
+		node->drop();
+	}
+	// 静的剛体のように、描画とは関係なくワールド行列を監視されている移動床
+	KNode *platform = KNode::create();
+	platform->setParent(root);
+	platform->_getTransformData().m_WatchWorldMatrix++;
+	KNode *camera = KNode::create();
+	camera->setParent(KNodeTree::getRoot());
+	KCamera::attach(camera);
+	KCamera::of(camera)->setProjectionW(640);
+	KCamera::of(camera)->setProjectionH(480);
+
+	int num_errors = 0;
+	int64_t nano[2] = {0, 0};
+	int num_visible = 0;
+	int num_tile_moves = 0;
+	int aabb_updates = 0;
+	KNodeArray result[2];
+	for (int f=0; f<NUM_FRAMES; f++) {
+		// カメラをスクロールし、動くスプライトを移動させる。
+		// 移動床も動かすので、毎フレーム getWatchedWorldMatrixRevision が変化する。
+		// ときどきタイルも１枚だけ動かす（インデックスの AABB が更新される）
+		camera->setPosition(KVec3(320 + f * 173.0f, 240 + f * 97.0f, 0.0f));
+		for (int i=0; i<NUM_MOVERS; i++) {
+			movers[i]->setPositionDelta(KVec3(rnd(-8, 8), rnd(-8, 8), 0.0f));
+		}
+		platform->setPositionDelta(KVec3(4.0f, 0.0f, 0.0f));
+		if (f % 20 == 10) {
+			KNode *tile = tiles[(int)rnd(0, (float)tiles.size())];
+			tile->setPosition(camera->getPosition());
+			num_tile_moves++;
+		}
+		if (f == 1) {
+			aabb_updates = g_RenderMgr->getNumCullingAabbUpdates(); // 最初のフレームでの構築分は除く
+		}
+		for (int mode=0; mode<2; mode++) {
+			KDrawable::setConfig(KDrawable::C_CULLING_INDEX, mode == 1);
+			result[mode].clear();
+			KClock clock;
+			g_RenderMgr->getRenderNodes(camera, KNodeTree::getRoot(), nullptr, result[mode]);
+			nano[mode] += clock.getTimeNano64();
+		}
+		if (result[0] != result[1]) {
+			num_errors++;
+		}
+		num_visible += (int)result[0].size();
+	}
+	if (num_visible == 0) {
+		num_errors++; // 何も見えていないのでは確認にならない
+	}
+	// インデックスの AABB を求め直すのは、実際に動いたタイルだけ
+	aabb_updates = g_RenderMgr->getNumCullingAabbUpdates() - aabb_updates;
+	K__PRINT("Test_render_culling: %d tiles + %d sprites, %d visible/frame: per-node %d usec/frame, indexed %d usec/frame, %d aabb updates",
+		COLS * ROWS, NUM_MOVERS, num_visible / NUM_FRAMES,
+		(int)(nano[0] / 1000 / NUM_FRAMES), (int)(nano[1] / 1000 / NUM_FRAMES), aabb_updates);
+	K__ASSERT(num_errors == 0);
+	K__ASSERT(0 < aabb_updates && aabb_updates <= num_tile_moves);
+
+	// 後始末
+	KDrawable::setConfig(KDrawable::C_CULLING_INDEX, old_config);
+	platform->_getTransformData().m_WatchWorldMatrix--;
+	platform->drop();
+	camera->remove();
+	camera->drop();
+	root->remove();
+	root->drop();
+	KNodeTree::destroyMarkedNodes(nullptr);
+	if (install_camera) KCamera::uninstall();
+	if (install_render) KDrawable::uninstall();
+	if (install_tree) KNodeTree::uninstall();
+}
+
+void Test_render_list() {
+	bool install_tree = !KNodeTree::isInstalled();
+	bool install_render = g_RenderMgr == nullptr;
+	bool install_camera = !KCamera::isInstalled();
+	if (install_tree) KNodeTree::install();
+	if (install_render) KDrawable::install();
+	if (install_camera) KCamera::install();
+	const bool old_config = KDrawable::getConfig(KDrawable::C_RENDER_LIST_CACHE);
+
+	// 100 グループ x 500 ノードの静的なシーン。
+	// 一部のグループはレイヤー 1 にして、不可分描画や子→親描画のグループも混ぜておく
+	const int NUM_GROUPS = 100;
+	const int NUM_CHILDREN = 500;
+	const int NUM_MOVERS = 20;
+	const int NUM_FRAMES = 120;
+	uint32_t seed = 14142;
+	auto rnd = [&seed](int n) {
+		seed = seed * 1664525 + 1013904223;
+		return (int)((seed >> 8) % n);
+	};
+	KNode *root = KNode::create();
+	root->setParent(KNodeTree::getRoot());
+	std::vector<KNode *> groups;
+	std::vector<KNode *> nodes;
+	for (int g=0; g<NUM_GROUPS; g++) {
+		KNode *group = KNode::create();
+		group->setParent(root);
+		if (g % 4 == 3) group->setLayer(1);
+		if (g % 10 == 7) group->setRenderAtomic(true);
+		if (g % 10 == 8) group->setRenderAfterChildren(true);
+		groups.push_back(group);
+		group->drop();
+		for (int i=0; i<NUM_CHILDREN; i++) {
+			KNode *node = KNode::create();
+			node->setPosition(KVec3((float)rnd(8000), (float)rnd(8000), (float)rnd(4)));
+			node->setPriority(rnd(4) - 2);
+			node->setParent(group);
+			if (rnd(50) == 0) node->setVisible(false);
+			CTestRectDrawable *dw = new CTestRectDrawable();
+			dw->m_Max = KVec3(16.0f, 16.0f, 0.0f);
+			dw->setCullingStatic(true);
+			KDrawable::_attach(node, dw);
+			dw->drop();
+			nodes.push_back(node);
+			node->drop();
+		}
+	}
+	std::vector<KNode *> movers;
+	for (int i=0; i<NUM_MOVERS; i++) {
+		movers.push_back(nodes[rnd((int)nodes.size())]);
+	}
+
+	// レイヤー 0 を優先度順で、レイヤー 1 を深度順で撮影するカメラ
+	KNode *cameras[2];
+	for (int c=0; c<2; c++) {
+		cameras[c] = KNode::create();
+		cameras[c]->setParent(KNodeTree::getRoot());
+		cameras[c]->setLayer(c);
+		KCamera::attach(cameras[c]);
+		KCamera::of(cameras[c])->setProjectionW(1280);
+		KCamera::of(cameras[c])->setProjectionH(960);
+		KCamera::of(cameras[c])->setRenderingOrder(c == 0 ? KCamera::ORDER_HIERARCHY : KCamera::ORDER_ZDEPTH);
+	}
+
+	int num_errors = 0;
+	int num_changes = 0;
+	int64_t nano[2] = {0, 0};
+	int num_visible = 0;
+	std::vector<KNode *> detached;
+	std::vector<KNode *> shots;
+	KNodeArray result[2];
+	int rebuilds[2] = {0, 0};
+	int sorts = g_RenderMgr->getNumRenderListSorts();
+	for (int f=0; f<NUM_FRAMES; f++) {
+		for (int c=0; c<2; c++) {
+			cameras[c]->setPosition(KVec3(640 + f * 50.0f, 480 + f * 45.0f + c * 1000, 0.0f));
+		}
+		// 毎フレーム、レイヤー 1 に弾を生成し、古いものから消していく。
+		// レイヤー 0 の描画リストは作り直さなくてよい
+		{
+			KNode *shot = KNode::create();
+			shot->setLayer(1);
+			shot->setPosition(cameras[1]->getPosition());
+			CTestRectDrawable *dw = new CTestRectDrawable();
+			dw->m_Max = KVec3(8.0f, 8.0f, 0.0f);
+			KDrawable::_attach(shot, dw);
+			dw->drop();
+			shot->setParent(root);
+			shots.push_back(shot);
+			shot->drop();
+			if (shots.size() > 8) {
+				shots.front()->remove();
+				shots.erase(shots.begin());
+			}
+			KNodeTree::destroyMarkedNodes(nullptr);
+		}
+		for (int i=0; i<NUM_MOVERS; i++) {
+			movers[i]->setPositionDelta(KVec3((float)rnd(9) - 4, (float)rnd(9) - 4, 0.0f));
+		}
+		// ときどきツリー構造を変える
+		if (f % 6 == 3) {
+			KNode *node = nodes[rnd((int)nodes.size())];
+			KNode *group = groups[rnd((int)groups.size())];
+			switch (num_changes % 9) {
+			case 0: node->setVisible(!node->getVisible()); break;
+			case 1: node->setEnable(!node->getEnable()); break;
+			case 2: node->setLayer(node->getLayer() ? 0 : 1); break;
+			case 3: node->setPriority(rnd(4) - 2); break;
+			case 4: group->setRenderAtomic(!group->getRenderAtomic()); break;
+			case 5: if (node->getParent()) node->getParent()->setChildIndex(node, 0); break;
+			case 6: if (node->getParent()) node->setParent(group); break;
+			case 7:
+				if (node->getParent()) {
+					node->grab(); // 親から外すと参照カウンタが減るので保持しておく
+					node->setParent(nullptr);
+					detached.push_back(node);
+				}
+				break;
+			case 8:
+				if (!detached.empty()) {
+					detached.back()->setParent(group);
+					detached.back()->drop();
+					detached.pop_back();
+				}
+				break;
+			}
+			num_changes++;
+		}
+		for (int c=0; c<2; c++) {
+			int num_rebuilds = g_RenderMgr->getNumRenderListRebuilds();
+			for (int mode=0; mode<2; mode++) {
+				KDrawable::setConfig(KDrawable::C_RENDER_LIST_CACHE, mode == 1);
+				result[mode].clear();
+				KClock clock;
+				g_RenderMgr->getRenderNodes(cameras[c], KNodeTree::getRoot(), nullptr, result[mode]);
+				nano[mode] += clock.getTimeNano64();
+			}
+			rebuilds[c] += g_RenderMgr->getNumRenderListRebuilds() - num_rebuilds;
+			if (result[0] != result[1]) {
+				num_errors++;
+			}
+			num_visible += (int)result[0].size();
+		}
+	}
+	if (num_visible == 0) {
+		num_errors++; // 何も見えていないのでは確認にならない
+	}
+	// 見えているノードを親から外すと、キャッシュされたリストからも消える。
+	// カメラ範囲による選別で消えたのでは確認にならないので、カリングを切っておく
+	KDrawable::setConfig(KDrawable::C_RENDER_LIST_CACHE, true);
+	result[0].clear();
+	g_RenderMgr->getRenderNodes(cameras[0], KNodeTree::getRoot(), nullptr, result[0]);
+	if (!result[0].empty()) {
+		KNode *node = result[0].front();
+		KNode *parent = node->getParent();
+		node->setViewCulling(false);
+		node->grab();
+		node->setParent(nullptr);
+		result[1].clear();
+		g_RenderMgr->getRenderNodes(cameras[0], KNodeTree::getRoot(), nullptr, result[1]);
+		if (std::find(result[1].begin(), result[1].end(), node) != result[1].end()) {
+			num_errors++;
+		}
+		node->setParent(parent);
+		node->drop();
+		result[1].clear();
+		g_RenderMgr->getRenderNodes(cameras[0], KNodeTree::getRoot(), nullptr, result[1]);
+		if (std::find(result[1].begin(), result[1].end(), node) == result[1].end()) {
+			num_errors++;
+		}
+		node->setViewCulling(true);
+	}
+	// レイヤー 0 の作り直しや並べ直しは、ツリー構造を変えたフレームでだけ行われる（最初のフレームの分を含む）。
+	// 弾のあるレイヤー 1 は毎フレーム作り直す
+	sorts = g_RenderMgr->getNumRenderListSorts() - sorts;
+	if (rebuilds[0] > num_changes + 1) {
+		num_errors++;
+	}
+	if (rebuilds[1] > NUM_FRAMES) {
+		num_errors++;
+	}
+	if (sorts > num_changes + 1) {
+		num_errors++; // 並べ替え済みのリストを使うのは ORDER_HIERARCHY のカメラだけ
+	}
+	K__PRINT("Test_render_list: %d nodes, %d changes, %d spawns, %d+%d rebuilds, %d visible/frame: rebuild %d usec/frame, cached %d usec/frame",
+		NUM_GROUPS * NUM_CHILDREN, num_changes, NUM_FRAMES, rebuilds[0], rebuilds[1], num_visible / NUM_FRAMES / 2,
+		(int)(nano[0] / 1000 / NUM_FRAMES), (int)(nano[1] / 1000 / NUM_FRAMES));
+	K__ASSERT(num_errors == 0);
+
+	// 後始末
+	KDrawable::setConfig(KDrawable::C_RENDER_LIST_CACHE, old_config);
+	for (size_t i=0; i<detached.size(); i++) {
+		detached[i]->setParent(root);
+		detached[i]->drop();
+	}
+	for (int c=0; c<2; c++) {
+		cameras[c]->remove();
+		cameras[c]->drop();
+	}
+	root->remove();
+	root->drop();
+	KNodeTree::destroyMarkedNodes(nullptr);
+	if (install_camera) KCamera::uninstall();
+	if (install_render) KDrawable::uninstall();
+	if (install_tree) KNodeTree::uninstall();
+}
+
+// 四角形を１枚描画する
+class CTestQuadDrawable: public KDrawable {
+public:
+	KColor m_Color;
+	KBlend m_Blend;
+	bool m_WithIndex;
+	bool m_Parallel;
+
+	virtual bool copyFrom(const KDrawable *co) override { return false; }
+	virtual void onDrawable_getGroupImageSize(int *w, int *h, KVec3 *pivot) override {}
+	virtual bool onDrawable_getBoundingAabb(KVec3 *minpoint, KVec3 *maxpoint) override { return false; }
+	virtual bool onDrawable_prepare(KNode *node, const RenderArgs *args) override {
+		return m_Parallel;
+	}
+	virtual void onDrawable_draw(KNode *node, const RenderArgs *args, KDrawList *drawlist) override {
+		KVertex v[4];
+		v[0].pos = KVec3( 0.0f,  0.0f, 0.0f);
+		v[1].pos = KVec3(16.0f,  0.0f, 0.0f);
+		v[2].pos = KVec3( 0.0f, 16.0f, 0.0f);
+		v[3].pos = KVec3(16.0f, 16.0f, 0.0f);
+		for (int i=0; i<4; i++) {
+			v[i].tex = KVec2(v[i].pos.x / 16, v[i].pos.y / 16);
+			v[i].dif32 = KColor32(m_Color);
+		}
+		const int idx[] = {0, 1, 2, 2, 1, 3};
+		KMaterial mat;
+		mat.color = m_Color;
+		mat.blend = m_Blend;
+		drawlist->setProjection(args->projection);
+		drawlist->setTransform(args->transform);
+		drawlist->setMaterial(mat);
+		drawlist->setPrimitive(KPrimitive_TRIANGLES);
+		if (m_WithIndex) {
+			drawlist->addVerticesWithIndex(v, 4, idx, 6);
+		} else {
+			KVertex tri[6];
+			for (int i=0; i<6; i++) {
+				tri[i] = v[idx[i]];
+			}
+			drawlist->addVertices(tri, 6);
+		}
+	}
+};
+
+static bool _IsSameDrawList(KDrawList &a, KDrawList &b) {
+	if (a.size() != b.size()) return false;
+	for (size_t i=0; i<a.size(); i++) {
+		const KDrawListItem &x = a[i];
+		const KDrawListItem &y = b[i];
+		if (x.prim != y.prim) return false;
+		if (x.start != y.start || x.count != y.count) return false;
+		if (x.index_number_offset != y.index_number_offset) return false;
+		if (x.with_index != y.with_index) return false;
+		if (x.with_stencil != y.with_stencil || x.color_write != y.color_write) return false;
+		if (x.cb_mesh != y.cb_mesh || x.cb_submesh != y.cb_submesh) return false;
+		if (x.projection != y.projection || x.transform != y.transform) return false;
+		if (x.material.color != y.material.color) return false;
+		if (x.material.blend != y.material.blend) return false;
+		if (x.material.texture != y.material.texture) return false;
+	}
+	const KMesh *ma = a.getMesh();
+	const KMesh *mb = b.getMesh();
+	if (ma->getVertexCount() != mb->getVertexCount()) return false;
+	if (ma->getIndexCount() != mb->getIndexCount()) return false;
+	if (memcmp(ma->getVertices(), mb->getVertices(), sizeof(KVertex) * ma->getVertexCount()) != 0) return false;
+	if (memcmp(ma->getIndices(), mb->getIndices(), sizeof(int) * ma->getIndexCount()) != 0) return false;
+	return true;
+}
+
+void Test_render_record() {
+	bool install_tree = !KNodeTree::isInstalled();
+	bool install_render = g_RenderMgr == nullptr;
+	bool install_camera = !KCamera::isInstalled();
+	if (install_tree) KNodeTree::install();
+	if (install_render) KDrawable::install();
+	if (install_camera) KCamera::install();
+	const int old_threads = KDrawable::getNumThreads();
+
+	// 20000 枚の四角形。
+	// 同じマテリアルのものが数枚ずつ続くようにして、区間の境目での結合を確かめる。
+	// インデックスの有無、並列に記録できないノード、不可分描画のグループも混ぜておく
+	const int NUM_NODES = 20000;
+	const int NUM_CAMERAS = 4;
+	const int NUM_FRAMES = 10;
+	uint32_t seed = 17320;
+	auto rnd = [&seed](int n) {
+		seed = seed * 1664525 + 1013904223;
+		return (int)((seed >> 8) % n);
+	};
+	const KColor colors[] = {KColor::WHITE, KColor(1.0f, 0.5f, 0.5f, 1.0f), KColor(0.5f, 1.0f, 0.5f, 1.0f)};
+	KNode *root = KNode::create();
+	root->setParent(KNodeTree::getRoot());
+	KNode *parent = root;
+	int run = 0;
+	int run_type = 0;
+	for (int i=0; i<NUM_NODES; i++) {
+		if (run == 0) {
+			run = 1 + rnd(12);
+			run_type = rnd(12);
+		}
+		run--;
+		if (i % 1000 == 500) {
+			// 不可分描画のグループ
+			parent = KNode::create();
+			parent->setParent(root);
+			parent->setRenderAtomic(true);
+			parent->drop();
+		} else if (i % 1000 == 520) {
+			parent = root;
+		}
+		KNode *node = KNode::create();
+		node->setPosition(KVec3((float)rnd(1200) - 600, (float)rnd(900) - 450, 0.0f));
+		node->setParent(parent);
+		CTestQuadDrawable *dw = new CTestQuadDrawable();
+		dw->m_Color = colors[run_type % 3];
+		dw->m_Blend = (run_type / 3 % 2) ? KBlend_ADD : KBlend_ALPHA;
+		dw->m_WithIndex = (run_type / 6 % 2) != 0;
+		dw->m_Parallel = rnd(50) != 0;
+		KDrawable::_attach(node, dw);
+		dw->drop();
+		node->drop();
+	}
+	KNode *cameras[NUM_CAMERAS];
+	for (int c=0; c<NUM_CAMERAS; c++) {
+		cameras[c] = KNode::create();
+		cameras[c]->setParent(KNodeTree::getRoot());
+		cameras[c]->setPosition(KVec3((float)(c % 2) * 200 - 100, (float)(c / 2) * 200 - 100, 0.0f));
+		KCamera::attach(cameras[c]);
+		KCamera::of(cameras[c])->setProjectionW(1024);
+		KCamera::of(cameras[c])->setProjectionH(768);
+	}
+
+	int num_errors = 0;
+	int num_items = 0;
+	int64_t nano[2] = {0, 0};
+	KNodeArray nodes[NUM_CAMERAS];
+	KDrawList drawlist[2];
+	for (int c=0; c<NUM_CAMERAS; c++) {
+		g_RenderMgr->getRenderNodes(cameras[c], KNodeTree::getRoot(), nullptr, nodes[c]);
+	}
+	for (int f=0; f<NUM_FRAMES; f++) {
+		for (int c=0; c<NUM_CAMERAS; c++) {
+			KMatrix4 tr;
+			cameras[c]->getWorld2LocalMatrix(&tr);
+			const KMatrix4 &projection = KCamera::of(cameras[c])->getProjectionMatrix();
+			for (int mode=0; mode<2; mode++) {
+				KDrawable::setNumThreads(mode == 0 ? 1 : 4);
+				drawlist[mode].clear();
+				KClock clock;
+				g_RenderMgr->recordNodes(nodes[c], projection, tr, cameras[c], &drawlist[mode]);
+				drawlist[mode].endList();
+				nano[mode] += clock.getTimeNano64();
+			}
+			if (!_IsSameDrawList(drawlist[0], drawlist[1])) {
+				num_errors++;
+			}
+			num_items += (int)drawlist[0].size();
+		}
+	}
+	if (num_items == 0) {
+		num_errors++; // 何も記録されていないのでは確認にならない
+	}
+	K__PRINT("Test_render_record: %d nodes x %d cameras, %d items/camera: serial %d usec/frame, parallel(4) %d usec/frame",
+		NUM_NODES, NUM_CAMERAS, num_items / NUM_FRAMES / NUM_CAMERAS,
+		(int)(nano[0] / 1000 / NUM_FRAMES), (int)(nano[1] / 1000 / NUM_FRAMES));
+	K__ASSERT(num_errors == 0);
+
+	// 後始末
+	KDrawable::setNumThreads(old_threads);
+	for (int c=0; c<NUM_CAMERAS; c++) {
+		cameras[c]->remove();
+		cameras[c]->drop();
+	}
+	root->remove();
+	root->drop();
+	KNodeTree::destroyMarkedNodes(nullptr);
+	if (install_camera) KCamera::uninstall();
+	if (install_render) KDrawable::uninstall();
+	if (install_tree) KNodeTree::uninstall();
+}
+
+} // Test
+
+
 } // namespace
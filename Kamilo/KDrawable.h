@@ -29,6 +29,8 @@ public:
 	enum EConfig {
 		C_MASTER_ADJ_SNAP,
 		C_MASTER_ADJ_HALF,
+		C_CULLING_INDEX, ///< setCullingStatic(true) のノードを空間インデックスでカリングする（既定は true）
+		C_RENDER_LIST_CACHE, ///< 描画対象ノードのリストを保持し、ツリー構造が変わったときだけ作り直す（既定は true）
 	};
 	static void install();
 	static void uninstall();
@@ -39,6 +41,17 @@ public:
 	static bool getConfig(EConfig c);
 	static void setCallback(KRenderCallback *cb);
 
+	/// 保持している描画リストを捨てて、次の描画時に作り直させる。
+	/// ツリー構造以外の理由で onDrawable_register の結果が変わる場合に呼ぶ
+	static void invalidateRenderLists();
+
+	/// 描画リストの記録に使うスレッド数（呼び出し元スレッドを含む）を設定する。
+	/// 0 ならハードウェアのスレッド数を使う（既定）。1 なら並列化しない。
+	/// onDrawable_prepare が true を返したノードの onDrawable_draw だけを並列に呼び、
+	/// ノードごとの記録を順番通りに連結するので、記録内容はスレッド数によらず同じになる
+	static void setNumThreads(int num);
+	static int getNumThreads();
+
 public:
 	struct RenderArgs {
 		RenderArgs() {
@@ -71,13 +84,24 @@ public:
 	/// pivot 一時レンダーテクスチャ「を」描画する時に使う原点座標
 	virtual void onDrawable_getGroupImageSize(int *w, int *h, KVec3 *pivot) = 0;
 
-	/// 描画を実行する
+	/// onDrawable_draw の準備をする。必ず呼び出し元（描画）スレッドから、onDrawable_draw よりも前に呼ばれる。
+	/// リソースバンクやビデオ関数を使う処理、描画コールバック (RenderArgs::cb) の呼び出しはここで済ませておく。
+	/// true を返した場合、続く onDrawable_draw はワーカースレッドから、他のノードの onDrawable_draw と同時に呼ばれることがある。
+	/// その場合の onDrawable_draw は、自分自身と drawlist 以外の状態を変更してはいけない。
+	/// false を返した場合（既定）は、続けて呼び出し元スレッドで onDrawable_draw が呼ばれる
+	virtual bool onDrawable_prepare(KNode *node, const RenderArgs *args);
+
+	/// 描画を実行する。
+	/// drawlist の描画設定（マテリアル、変形行列、ステンシルなど）は、直前のノードから引き継がれるとは限らない。
+	/// 必要な設定は毎回行い、既定値から変更したものは元に戻しておくこと
 	virtual void onDrawable_draw(KNode *node, const RenderArgs *args, KDrawList *drawlist) = 0;
 
 	/// 描画オブジェクトのAABB
 	/// 描画するべきものが存在しない場合は false を返す
 	virtual bool onDrawable_getBoundingAabb(KVec3 *minpoint, KVec3 *maxpoint) = 0;
 
+	/// 描画リストに自分のノードを登録する。
+	/// 結果は C_RENDER_LIST_CACHE によって保持されるので、ツリー構造以外の理由で登録内容が変わる場合は invalidateRenderLists() を呼ぶこと
 	virtual void onDrawable_register(int layer, std::vector<KNode*> &list);
 	virtual void onDrawable_willDraw(const KNode *camera);
 	virtual void onDrawable_inspector();
@@ -97,6 +121,19 @@ public:
 	void setGrouping(bool value);
 	bool isGrouping() const;
 
+	/// 描画範囲 (onDrawable_getBoundingAabb) がノードの移動以外では変化しないことを宣言する（既定は false）。
+	/// true にすると描画範囲を空間インデックスに登録し、カメラ範囲によるカリングを
+	/// ノードごとの判定ではなくインデックスへの問い合わせで行う。
+	/// 描画範囲はノードが移動したときだけ計算し直すので、それ以外の理由で変わった場合は invalidateCullingAabb() を呼ぶこと
+	void setCullingStatic(bool value);
+	bool isCullingStatic() const;
+
+	/// setCullingStatic(true) の場合に、描画範囲が変わったことを知らせる
+	void invalidateCullingAabb();
+
+	int _getCullingIndex() const;
+	void _setCullingIndex(int index);
+
 	/// グループ化されている場合、一時レンダーテクスチャへの描画結果を
 	/// 改めて出力するときに使うマテリアルを得る
 	KMaterial * getGroupingMaterial();
@@ -176,6 +213,8 @@ protected:
 	KMesh m_group_mesh;
 	KNode *m_node;
 	bool m_group_enabled;
+	bool m_culling_static;
+	int m_culling_index; // 空間インデックス内での番号。登録されていなければ -1
 };
 
 
@@ -194,6 +233,14 @@ public:
 };
 
 
+namespace Test {
+void Test_render_sort();
+void Test_render_culling();
+void Test_render_list();
+void Test_render_record();
+}
+
+
 
 
 } // namespace
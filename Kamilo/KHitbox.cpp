@@ -1,6 +1,8 @@
 ﻿#include "KHitbox.h"
 //
+#include <algorithm>
 #include "KCamera.h"
+#include "KClock.h"
 #include "KImGui.h"
 #include "KInspector.h"
 #include "KInternal.h"
@@ -8,6 +10,16 @@
 #include "KScreen.h"
 #include "keng_game.h"
 
+
+// Use SIMD
+#define K_USE_SIMD
+
+
+#ifdef K_USE_SIMD
+#	include <xmmintrin.h> // 128bit simd
+#endif
+
+
 namespace Kamilo {
 
 
@@ -36,12 +48,139 @@ static bool _IsDebugInfoVisible(KNode *target, KNode *camera) {
 
 
 #pragma region CHitboxManagerImpl
+// KHitbox::setHalfSize が呼ばれるたびに増える。判定中に大きさが変わったことを検出するために使う
+static uint32_t g_HitboxHalfSizeRevision = 0;
+
+/// 判定に使うヒットボックスの範囲（ワールド座標）
+struct SHitboxBounds {
+	KVec3 center;
+	KVec3 halfsize;
+	uint32_t revision; // 範囲を求めた時点でのノードの STransformData::m_WatchedRevision
+};
+
+/// SHitboxBounds を成分ごとの配列に並べ替えたもの。
+/// １つの範囲と複数の範囲との判定をまとめて行うときに使う
+struct SHitboxBoundsSoA {
+	std::vector<float> cx, cy, cz; // center
+	std::vector<float> hx, hy, hz; // halfsize
+
+	size_t size() const {
+		return cx.size();
+	}
+	void resize(size_t n) {
+		cx.resize(n); cy.resize(n); cz.resize(n);
+		hx.resize(n); hy.resize(n); hz.resize(n);
+	}
+	void set(size_t i, const SHitboxBounds &b) {
+		cx[i] = b.center.x;   cy[i] = b.center.y;   cz[i] = b.center.z;
+		hx[i] = b.halfsize.x; hy[i] = b.halfsize.y; hz[i] = b.halfsize.z;
+	}
+};
+
+/// b1 と b2 が重なっているかどうか（接しているだけの場合は重なっていないとみなす）
+static bool _IsHitboxOverlapped(const SHitboxBounds &b1, const SHitboxBounds &b2) {
+	const KVec3 delta = b1.center - b2.center;
+	const KVec3 r = b1.halfsize + b2.halfsize;
+	return fabsf(delta.x) < r.x && fabsf(delta.y) < r.y && fabsf(delta.z) < r.z;
+}
+
+/// b と soa[begin, end) を判定し、重なっているものの soa 内でのインデックスを昇順で out_indices に追加する。
+/// 結果は _IsHitboxOverlapped で１つずつ判定した場合と完全に一致する
+static void _GetHitboxOverlaps_generic(const SHitboxBounds &b, const SHitboxBoundsSoA &soa, int begin, int end, std::vector<int> &out_indices) {
+	for (int i=begin; i<end; i++) {
+		// _IsHitboxOverlapped と同じ順番で計算する（差の符号と和の順番は結果に影響しない）
+		float dx = fabsf(soa.cx[i] - b.center.x);
+		float dy = fabsf(soa.cy[i] - b.center.y);
+		float dz = fabsf(soa.cz[i] - b.center.z);
+		if (dx < soa.hx[i] + b.halfsize.x && dy < soa.hy[i] + b.halfsize.y && dz < soa.hz[i] + b.halfsize.z) {
+			out_indices.push_back(i);
+		}
+	}
+}
+#ifdef K_USE_SIMD
+static void _GetHitboxOverlaps_simd(const SHitboxBounds &b, const SHitboxBoundsSoA &soa, int begin, int end, std::vector<int> &out_indices) {
+	// ４個ずつまとめて判定し、端数は１個ずつ判定する
+	const __m128 signbit = _mm_set1_ps(-0.0f);
+	const __m128 bcx = _mm_set1_ps(b.center.x);
+	const __m128 bcy = _mm_set1_ps(b.center.y);
+	const __m128 bcz = _mm_set1_ps(b.center.z);
+	const __m128 bhx = _mm_set1_ps(b.halfsize.x);
+	const __m128 bhy = _mm_set1_ps(b.halfsize.y);
+	const __m128 bhz = _mm_set1_ps(b.halfsize.z);
+	int i = begin;
+	for (; i+4<=end; i+=4) {
+		__m128 dx = _mm_andnot_ps(signbit, _mm_sub_ps(_mm_loadu_ps(&soa.cx[i]), bcx));
+		__m128 dy = _mm_andnot_ps(signbit, _mm_sub_ps(_mm_loadu_ps(&soa.cy[i]), bcy));
+		__m128 dz = _mm_andnot_ps(signbit, _mm_sub_ps(_mm_loadu_ps(&soa.cz[i]), bcz));
+		__m128 hit = _mm_cmplt_ps(dx, _mm_add_ps(_mm_loadu_ps(&soa.hx[i]), bhx));
+		hit = _mm_and_ps(hit, _mm_cmplt_ps(dy, _mm_add_ps(_mm_loadu_ps(&soa.hy[i]), bhy)));
+		hit = _mm_and_ps(hit, _mm_cmplt_ps(dz, _mm_add_ps(_mm_loadu_ps(&soa.hz[i]), bhz)));
+		int mask = _mm_movemask_ps(hit);
+		if (mask) {
+			if (mask & 1) out_indices.push_back(i);
+			if (mask & 2) out_indices.push_back(i+1);
+			if (mask & 4) out_indices.push_back(i+2);
+			if (mask & 8) out_indices.push_back(i+3);
+		}
+	}
+	_GetHitboxOverlaps_generic(b, soa, i, end, out_indices);
+}
+#endif
+static void _GetHitboxOverlaps(const SHitboxBounds &b, const SHitboxBoundsSoA &soa, int begin, int end, std::vector<int> &out_indices) {
+#ifdef K_USE_SIMD
+	_GetHitboxOverlaps_simd(b, soa, begin, end, out_indices);
+#else
+	_GetHitboxOverlaps_generic(b, soa, begin, end, out_indices);
+#endif
+}
+
+/// 衝突ペアを探すためのキー。ヒットボックスの順番によらず同じキーになるように、アドレスの小さい方を hitbox1 にする
+struct SHitPairKey {
+	SHitPairKey(const KHitbox *a, const KHitbox *b) {
+		hitbox1 = (a < b) ? a : b;
+		hitbox2 = (a < b) ? b : a;
+	}
+	bool operator == (const SHitPairKey &k) const {
+		return hitbox1 == k.hitbox1 && hitbox2 == k.hitbox2;
+	}
+	const KHitbox *hitbox1;
+	const KHitbox *hitbox2;
+};
+struct SHitPairKeyHash {
+	size_t operator()(const SHitPairKey &k) const {
+		size_t h1 = std::hash<const KHitbox *>()(k.hitbox1);
+		size_t h2 = std::hash<const KHitbox *>()(k.hitbox2);
+		return h1 ^ (h2 + 0x9e3779b9 + (h1 << 6) + (h1 >> 2));
+	}
+};
+
+/// ソート＆スイープ用の X 軸上の範囲
+struct SHitboxSweepEntry {
+	float minx;
+	float maxx;
+	int index; // グループ内でのインデックス
+};
+
 class CHitboxManagerImpl: public KManager, public KInspectorCallback {
 	std::vector<KHitPair> m_HitPairs;
+	std::unordered_map<SHitPairKey, int, SHitPairKeyHash> m_HitPairIndices; // ヒットボックスの組み合わせから m_HitPairs 内のインデックスへの対応
 	std::unordered_map<KNode*, KHitbox*> m_Nodes;
 	std::vector<std::vector<KHitbox*>> m_GroupedEntries;
+	std::vector<std::vector<SHitboxBounds>> m_GroupedBounds; // m_GroupedEntries と同じ並び
+	std::vector<std::vector<SHitboxSweepEntry>> m_GroupedSweep; // minx の昇順
+	std::vector<SHitboxBoundsSoA> m_GroupedSweepBounds; // m_GroupedSweep と同じ並び
+	std::vector<char> m_GroupedSweepReady;
+	uint32_t m_BoundsTransformRevision; // m_GroupedBounds を最後に確認した時点の STransformData::getWatchedWorldMatrixRevision()
+	uint32_t m_BoundsHalfSizeRevision;  // m_GroupedBounds を最後に確認した時点の g_HitboxHalfSizeRevision
+	std::vector<uint64_t> m_TmpCandidates;
+	std::vector<int> m_TmpOverlaps;
 	std::vector<KHitboxGroup> m_Groups;
+	std::vector<KHitboxContact> m_Contacts; // このフレームで送った衝突イベント
+	std::vector<KNodeArray> m_TmpSubscriberBufs; // シグナルの購読ノードのリスト（受信側がさらにヒットボックスのシグナルを発生させる場合に備えて深さごとに用意する）
+	int m_SignalDepth;
 	KHitboxCallback *m_Callback;
+	KHitboxBroadphase m_Broadphase;
+	bool m_BroadcastSignals;
 	int m_Clock;
 	bool m_Highlight;
 	bool m_AlwaysShowHitboxes;
@@ -49,6 +188,11 @@ public:
 	CHitboxManagerImpl() {
 		m_Highlight = true;
 		m_Callback = nullptr;
+		m_Broadphase = KHitboxBroadphase_SWEEP;
+		m_BroadcastSignals = false;
+		m_SignalDepth = 0;
+		m_BoundsTransformRevision = 0;
+		m_BoundsHalfSizeRevision = 0;
 		m_Clock = 0;
 		m_AlwaysShowHitboxes  = false;
 
@@ -75,6 +219,8 @@ public:
 		tickHitboxClock();
 	}
 	virtual void on_manager_frame() override {
+		m_Contacts.clear();
+
 		// 前フレームで衝突が解消されたペアを削除する
 		removeEndedPairs();
 
@@ -135,6 +281,22 @@ public:
 	void setHitboxCallback(KHitboxCallback *cb) {
 		m_Callback = cb;
 	}
+	void setBroadphase(KHitboxBroadphase type) {
+		m_Broadphase = type;
+	}
+	KHitboxBroadphase getBroadphase() const {
+		return m_Broadphase;
+	}
+	void setBroadcastSignals(bool value) {
+		m_BroadcastSignals = value;
+	}
+	bool getBroadcastSignals() const {
+		return m_BroadcastSignals;
+	}
+	const KHitboxContact * getContacts(int *out_count) const {
+		if (out_count) *out_count = (int)m_Contacts.size();
+		return m_Contacts.empty() ? nullptr : m_Contacts.data();
+	}
 	KHitbox * getTrulyThisHitbox(KNode *node) {
 		auto it = m_Nodes.find(node);
 		if (it != m_Nodes.end()) {
@@ -193,14 +355,14 @@ public:
 		KHitbox *hb = getThisHitbox(node);
 		if (hb == nullptr) return;
 
-		for (auto it=m_HitPairs.begin(); it!=m_HitPairs.end(); /*no expr*/) {
-			if (it->m_Object1.node == hb->getNode() || it->m_Object2.node == hb->getNode()) {
-				onHitboxExit(*it);
-				it = m_HitPairs.erase(it); // 衝突エンティティが消えた場合、EXIT イベントが発生しないことに注意
-			} else {
-				++it;
+		KNode *hbnode = hb->getNode();
+		remove_hit_pairs_if([this, hbnode](KHitPair &pair) {
+			if (pair.m_Object1.node == hbnode || pair.m_Object2.node == hbnode) {
+				onHitboxExit(pair);
+				return true;
 			}
-		}
+			return false;
+		});
 		{
 			auto it = m_Nodes.find(node);
 			if (it != m_Nodes.end()) {
@@ -213,6 +375,7 @@ public:
 	}
 	void clearHitboxNodes() {
 		m_HitPairs.clear();
+		m_HitPairIndices.clear();
 
 		for (auto it=m_Nodes.begin(); it!=m_Nodes.end(); ++it) {
 			KHitbox *hb = it->second;
@@ -333,13 +496,9 @@ public:
 	}
 	void removeEndedPairs() {
 		// 前フレームで衝突が解消されたペアを削除する
-		for (auto it=m_HitPairs.begin(); it!=m_HitPairs.end(); /*++it*/) {
-			if (it->m_TimestampExit >= 0) {
-				it = m_HitPairs.erase(it);
-			} else {
-				++it;
-			}
-		}
+		remove_hit_pairs_if([](KHitPair &pair) {
+			return pair.m_TimestampExit >= 0;
+		});
 	}
 	void detectHitboxExit() {
 		// 衝突解消の検出
@@ -437,21 +596,42 @@ private:
 		}
 	}
 	int get_index_of_hit_pair(const KHitbox *hitbox1, const KHitbox *hitbox2) const {
+		auto it = m_HitPairIndices.find(SHitPairKey(hitbox1, hitbox2));
+		if (it != m_HitPairIndices.end()) {
+			return it->second;
+		}
+		return -1;
+	}
+	/// pred が true を返したペアを m_HitPairs から取り除く。
+	/// 残ったペアは前に詰めるだけで順番は変えない（Exit の発生順やインデックスでの列挙順を変えないため）
+	template <class PRED> void remove_hit_pairs_if(PRED pred) {
+		size_t num = 0;
 		for (size_t i=0; i<m_HitPairs.size(); i++) {
-			const KHitPair &pair = m_HitPairs[i];
-			if (pair.m_Object1.hitbox == hitbox1 && pair.m_Object2.hitbox == hitbox2) {
-				return (int)i;
+			KHitPair &pair = m_HitPairs[i];
+			SHitPairKey key(pair.m_Object1.hitbox, pair.m_Object2.hitbox);
+			if (pred(pair)) {
+				m_HitPairIndices.erase(key);
+				continue;
 			}
-			if (pair.m_Object1.hitbox == hitbox2 && pair.m_Object2.hitbox == hitbox1) {
-				return (int)i;
+			if (num != i) {
+				m_HitPairs[num] = pair;
+				m_HitPairIndices[key] = (int)num;
 			}
+			num++;
 		}
-		return -1;
+		m_HitPairs.resize(num);
 	}
 
 	void updateSensorNodeList() {
 		m_GroupedEntries.clear();
 		m_GroupedEntries.resize(m_Groups.size());
+		m_GroupedBounds.resize(m_Groups.size());
+		m_GroupedSweep.resize(m_Groups.size());
+		m_GroupedSweepBounds.resize(m_Groups.size());
+		m_GroupedSweepReady.assign(m_Groups.size(), 0);
+		for (size_t i=0; i<m_GroupedBounds.size(); i++) {
+			m_GroupedBounds[i].clear();
+		}
 		for (auto it=m_Nodes.begin(); it!=m_Nodes.end(); ++it) {
 			KNode *node = it->first;
 			KHitbox *hitbox = it->second;
@@ -468,9 +648,114 @@ private:
 		
 			int gindex = hitbox->getGroupIndex();
 			if (0 <= gindex && gindex < (int)m_GroupedEntries.size()) {
+				// ワールド座標での範囲はここで計算しておく。判定中に動いたものは refresh_bounds で計算しなおす
+				SHitboxBounds bounds;
+				bounds.center = hitbox->getCenterInWorld();
+				bounds.halfsize = hitbox->getHalfSize();
+				bounds.revision = node->_getTransformData().m_WatchedRevision; // ワールド座標を求めるときに更新されることがあるので、その後で記録する
 				m_GroupedEntries[gindex].push_back(hitbox);
+				m_GroupedBounds[gindex].push_back(bounds);
+			}
+		}
+		m_BoundsTransformRevision = STransformData::getWatchedWorldMatrixRevision();
+		m_BoundsHalfSizeRevision = g_HitboxHalfSizeRevision;
+	}
+	/// 判定中（コールバックやシグナルの処理中）に移動したり大きさが変わったりしたヒットボックスの範囲を計算しなおす。
+	/// 範囲が変わったグループは、ソート＆スイープ用のリストも作り直すようにする。
+	/// ヒットボックスのノードのワールド行列は監視しているので、どれも変化していなければすぐに戻る
+	void refresh_bounds() {
+		if (m_BoundsTransformRevision == STransformData::getWatchedWorldMatrixRevision() && m_BoundsHalfSizeRevision == g_HitboxHalfSizeRevision) {
+			return;
+		}
+		for (size_t g=0; g<m_GroupedEntries.size(); g++) {
+			const std::vector<KHitbox*> &entries = m_GroupedEntries[g];
+			std::vector<SHitboxBounds> &bounds = m_GroupedBounds[g];
+			for (size_t i=0; i<entries.size(); i++) {
+				KHitbox *hitbox = entries[i];
+				SHitboxBounds &b = bounds[i];
+				const STransformData &tr = hitbox->getNode()->_getTransformData();
+				if (b.revision == tr.m_WatchedRevision && b.halfsize == hitbox->getHalfSize()) continue;
+				KVec3 center = hitbox->getCenterInWorld();
+				b.revision = tr.m_WatchedRevision;
+				if (b.center == center && b.halfsize == hitbox->getHalfSize()) continue; // 行列が計算しなおされただけ
+				b.center = center;
+				b.halfsize = hitbox->getHalfSize();
+				m_GroupedSweepReady[g] = 0;
 			}
 		}
+		m_BoundsTransformRevision = STransformData::getWatchedWorldMatrixRevision();
+		m_BoundsHalfSizeRevision = g_HitboxHalfSizeRevision;
+	}
+	/// グループ groupIndex のヒットボックスを X 軸上の範囲の最小値の順に並べたものを得る（フレームごとに一度だけ作る）
+	const std::vector<SHitboxSweepEntry> & get_sweep_list(int groupIndex) {
+		std::vector<SHitboxSweepEntry> &list = m_GroupedSweep[groupIndex];
+		if (m_GroupedSweepReady[groupIndex]) {
+			return list;
+		}
+		const std::vector<SHitboxBounds> &bounds = m_GroupedBounds[groupIndex];
+		list.resize(bounds.size());
+		for (size_t i=0; i<bounds.size(); i++) {
+			const SHitboxBounds &b = bounds[i];
+			// 判定は中心間の距離で行うので、端の座標の丸め誤差で候補から漏れないように少しだけ広げておく
+			float margin = (fabsf(b.center.x) + b.halfsize.x) * 1.0e-5f + 1.0e-5f;
+			list[i].minx = b.center.x - b.halfsize.x - margin;
+			list[i].maxx = b.center.x + b.halfsize.x + margin;
+			list[i].index = (int)i;
+		}
+		std::sort(list.begin(), list.end(), [](const SHitboxSweepEntry &a, const SHitboxSweepEntry &b) {
+			return a.minx < b.minx;
+		});
+		// スイープ中に連続したメモリをまとめて判定できるように、範囲も同じ順番で並べておく
+		SHitboxBoundsSoA &soa = m_GroupedSweepBounds[groupIndex];
+		soa.resize(list.size());
+		for (size_t i=0; i<list.size(); i++) {
+			soa.set(i, bounds[list[i].index]);
+		}
+		m_GroupedSweepReady[groupIndex] = 1;
+		return list;
+	}
+	/// グループ groupIndex1, groupIndex2 の間で範囲が重なっている組み合わせを
+	/// (groupIndex1 内のインデックス << 32) | (groupIndex2 内のインデックス) の形で out_pairs に入れる
+	void collect_sweep_pairs(int groupIndex1, int groupIndex2, std::vector<uint64_t> &out_pairs) {
+		out_pairs.clear();
+		const std::vector<SHitboxSweepEntry> &list1 = get_sweep_list(groupIndex1);
+		const std::vector<SHitboxSweepEntry> &list2 = get_sweep_list(groupIndex2);
+		const SHitboxBoundsSoA &soa1 = m_GroupedSweepBounds[groupIndex1];
+		const SHitboxBoundsSoA &soa2 = m_GroupedSweepBounds[groupIndex2];
+		const std::vector<SHitboxBounds> &bounds1 = m_GroupedBounds[groupIndex1];
+		const std::vector<SHitboxBounds> &bounds2 = m_GroupedBounds[groupIndex2];
+		int n1 = (int)list1.size();
+		int n2 = (int)list2.size();
+		int k1 = 0;
+		int k2 = 0;
+		// 両方のリストを minx の小さい順に取り出し、取り出したものの X 範囲に入っている相手側の要素を調べる。
+		// X 範囲が重なっている組み合わせは、ちょうど一度だけ調べられる。
+		// 相手側の候補はソート済みリスト上で連続しているので、まとめて判定する
+		while (k1 < n1 && k2 < n2) {
+			if (list1[k1].minx <= list2[k2].minx) {
+				const SHitboxSweepEntry &e1 = list1[k1];
+				int end = k2;
+				while (end < n2 && list2[end].minx <= e1.maxx) end++;
+				m_TmpOverlaps.clear();
+				_GetHitboxOverlaps(bounds1[e1.index], soa2, k2, end, m_TmpOverlaps);
+				for (size_t t=0; t<m_TmpOverlaps.size(); t++) {
+					out_pairs.push_back(((uint64_t)e1.index << 32) | (uint32_t)list2[m_TmpOverlaps[t]].index);
+				}
+				k1++;
+			} else {
+				const SHitboxSweepEntry &e2 = list2[k2];
+				int end = k1;
+				while (end < n1 && list1[end].minx <= e2.maxx) end++;
+				m_TmpOverlaps.clear();
+				_GetHitboxOverlaps(bounds2[e2.index], soa1, k1, end, m_TmpOverlaps);
+				for (size_t t=0; t<m_TmpOverlaps.size(); t++) {
+					out_pairs.push_back(((uint64_t)list1[m_TmpOverlaps[t]].index << 32) | (uint32_t)e2.index);
+				}
+				k2++;
+			}
+		}
+		// 総当たりの場合と同じ順番で処理するために並べ替える
+		std::sort(out_pairs.begin(), out_pairs.end());
 	}
 	void updateSensorCollision() {
 		for (int i=0; i<(int)m_Groups.size(); i++) {
@@ -489,26 +774,50 @@ private:
 		K__ASSERT(groupIndex1 != groupIndex2); // 同一グルーブ同士の比較はダメ
 		std::vector<KHitbox*> &groupHitboxes1 = m_GroupedEntries[groupIndex1];
 		std::vector<KHitbox*> &groupHitboxes2 = m_GroupedEntries[groupIndex2];
+		const std::vector<SHitboxBounds> &groupBounds1 = m_GroupedBounds[groupIndex1];
+		const std::vector<SHitboxBounds> &groupBounds2 = m_GroupedBounds[groupIndex2];
+		if (m_Broadphase == KHitboxBroadphase_SWEEP) {
+			// 範囲が重なっている組み合わせだけを、総当たりと同じ順番で処理する
+			refresh_bounds();
+			collect_sweep_pairs(groupIndex1, groupIndex2, m_TmpCandidates);
+			size_t k = 0;
+			while (k < m_TmpCandidates.size()) {
+				uint64_t key = m_TmpCandidates[k++];
+				size_t i = (size_t)(key >> 32);
+				size_t j = (size_t)(key & 0xFFFFFFFF);
+				KHitbox *hitbox1 = groupHitboxes1[i];
+				KHitbox *hitbox2 = groupHitboxes2[j];
+				if (hitbox1->getNode() == hitbox2->getNode()) continue; // 同キャラ判定を排除
+				if (hitbox1->getOwner() == hitbox2->getOwner()) continue; // 同一オーナー判定を排除
+				update_node_pair(hitbox1, hitbox2, groupBounds1[i], groupBounds2[j]);
+				refresh_bounds();
+				if (!m_GroupedSweepReady[groupIndex1] || !m_GroupedSweepReady[groupIndex2]) {
+					// 処理中にヒットボックスが動いた。まだ処理していない組み合わせを、今の範囲で選びなおす
+					collect_sweep_pairs(groupIndex1, groupIndex2, m_TmpCandidates);
+					k = std::upper_bound(m_TmpCandidates.begin(), m_TmpCandidates.end(), key) - m_TmpCandidates.begin();
+				}
+			}
+			return;
+		}
 		for (size_t i=0; i<groupHitboxes1.size(); i++) {
 			for (size_t j=0; j<groupHitboxes2.size(); j++) {
 				KHitbox *hitbox1 = groupHitboxes1[i];
 				KHitbox *hitbox2 = groupHitboxes2[j];
 				if (hitbox1->getNode() == hitbox2->getNode()) continue; // 同キャラ判定を排除
 				if (hitbox1->getOwner() == hitbox2->getOwner()) continue; // 同一オーナー判定を排除
-				update_node_pair(hitbox1, hitbox2);
+				update_node_pair(hitbox1, hitbox2, groupBounds1[i], groupBounds2[j]);
 			}
 		}
 	}
 	/// 衝突ノード node1 と node2 の衝突判定と処理を行う
-	void update_node_pair(KHitbox *hitbox1, KHitbox *hitbox2) {
+	void update_node_pair(KHitbox *hitbox1, KHitbox *hitbox2, const SHitboxBounds &bounds1, const SHitboxBounds &bounds2) {
 		bool deny = false;
 		if (m_Callback) m_Callback->on_hitbox_update(hitbox1, hitbox2, &deny);
 		if (deny) return;
-		const KVec3 hitboxPos1 = hitbox1->getCenterInWorld();
-		const KVec3 hitboxPos2 = hitbox2->getCenterInWorld();
-		const KVec3 delta = hitboxPos1 - hitboxPos2;
-		const KVec3 r = hitbox1->getHalfSize() + hitbox2->getHalfSize();
-		if (fabsf(delta.x) < r.x && fabsf(delta.y) < r.y && fabsf(delta.z) < r.z) {
+		refresh_bounds(); // 直前の組み合わせの処理やコールバックで動いたヒットボックスの範囲を更新する。bounds1, bounds2 にも反映される
+		const KVec3 &hitboxPos1 = bounds1.center;
+		const KVec3 &hitboxPos2 = bounds2.center;
+		if (_IsHitboxOverlapped(bounds1, bounds2)) {
 			int pair_index = get_index_of_hit_pair(hitbox1, hitbox2);
 			if (pair_index >= 0) {
 				// 同じ衝突ペアが見つかった。衝突状態が持続している
@@ -530,28 +839,88 @@ private:
 				pair.m_TimestampEnter    = m_Clock;
 				pair.m_TimestampExit     = -1;
 				pair.m_TimestampLastUpdate = m_Clock;
+				m_HitPairIndices[SHitPairKey(hitbox1, hitbox2)] = (int)m_HitPairs.size();
 				m_HitPairs.push_back(pair);
 				onHitboxEnter(pair);
 			}
 		}
 	}
 	void onHitboxEnter(KHitPair &pair) {
-		KSig sig(K_SIG_HITBOX_ENTER);
-		sig.setNode("hitbox1", pair.m_Object1.node);
-		sig.setNode("hitbox2", pair.m_Object2.node);
-		KNodeTree::broadcastSignal(sig);
+		send_hitbox_signal(K_SIG_HITBOX_ENTER, KHitboxPhase_ENTER, pair);
 	}
 	void onHitboxStay(KHitPair &pair) {
-		KSig sig(K_SIG_HITBOX_STAY);
-		sig.setNode("hitbox1", pair.m_Object1.node);
-		sig.setNode("hitbox2", pair.m_Object2.node);
-		KNodeTree::broadcastSignal(sig);
+		send_hitbox_signal(K_SIG_HITBOX_STAY, KHitboxPhase_STAY, pair);
 	}
 	void onHitboxExit(KHitPair &pair) {
-		KSig sig(K_SIG_HITBOX_EXIT);
+		send_hitbox_signal(K_SIG_HITBOX_EXIT, KHitboxPhase_EXIT, pair);
+	}
+	void send_hitbox_signal(const char *signame, KHitboxPhase phase, const KHitPair &pair) {
+		add_contact(phase, pair);
+
+		KSig sig(signame);
 		sig.setNode("hitbox1", pair.m_Object1.node);
 		sig.setNode("hitbox2", pair.m_Object2.node);
-		KNodeTree::broadcastSignal(sig);
+		if (m_BroadcastSignals) {
+			KNodeTree::broadcastSignal(sig);
+			return;
+		}
+
+		// 衝突した２つのヒットボックスの持ち主 (KHitbox::getOwner) とヒットボックスのノードに送る
+		KNode *targets[4];
+		int num_targets = 0;
+		KNode *candidates[] = {
+			pair.m_Object1.hitbox ? pair.m_Object1.hitbox->getOwner() : nullptr,
+			pair.m_Object1.node,
+			pair.m_Object2.hitbox ? pair.m_Object2.hitbox->getOwner() : nullptr,
+			pair.m_Object2.node,
+		};
+		for (int i=0; i<4; i++) {
+			if (candidates[i] && std::find(targets, targets+num_targets, candidates[i]) == targets+num_targets) {
+				targets[num_targets++] = candidates[i];
+			}
+		}
+		for (int i=0; i<num_targets; i++) {
+			KNodeTree::sendSignal(targets[i], sig);
+		}
+
+		// このシグナルを購読しているノードに送る（すでに送ったノードには送らない）。
+		// 受信側がさらにヒットボックスを削除して入れ子で呼ばれる場合があるので、作業用リストは入れ子の深さごとに使い分ける。
+		// ※入れ子の呼び出しで m_TmpSubscriberBufs が resize される可能性があるため、参照を保持せずに毎回添え字でアクセスする
+		const int depth = m_SignalDepth;
+		if ((int)m_TmpSubscriberBufs.size() <= depth) {
+			m_TmpSubscriberBufs.resize(depth + 1);
+		}
+		KNodeTree::getSignalSubscribers(&m_TmpSubscriberBufs[depth], signame, true);
+		m_SignalDepth++;
+		for (size_t i=0; i<m_TmpSubscriberBufs[depth].size(); i++) {
+			KNode *node = m_TmpSubscriberBufs[depth][i];
+			if (std::find(targets, targets+num_targets, node) == targets+num_targets) {
+				KNodeTree::sendSignal(node, sig);
+			}
+		}
+		m_SignalDepth--;
+		m_TmpSubscriberBufs[depth].clear();
+	}
+	void add_contact(KHitboxPhase phase, const KHitPair &pair) {
+		const KHitPair::Obj &obj1 = pair.m_Object1;
+		const KHitPair::Obj &obj2 = pair.m_Object2;
+		KHitboxContact contact;
+		KNode *owner1 = obj1.hitbox ? obj1.hitbox->getOwner() : nullptr;
+		KNode *owner2 = obj2.hitbox ? obj2.hitbox->getOwner() : nullptr;
+		contact.owner1  = owner1 ? owner1->getId() : nullptr;
+		contact.owner2  = owner2 ? owner2->getId() : nullptr;
+		contact.hitbox1 = obj1.node ? obj1.node->getId() : nullptr;
+		contact.hitbox2 = obj2.node ? obj2.node->getId() : nullptr;
+		contact.group1  = obj1.hitbox ? obj1.hitbox->getGroupIndex() : -1;
+		contact.group2  = obj2.hitbox ? obj2.hitbox->getGroupIndex() : -1;
+		contact.phase   = phase;
+		// 衝突検出時の AABB 同士の重なり部分の中心
+		KVec3 half1 = obj1.hitbox ? obj1.hitbox->getHalfSize() : KVec3();
+		KVec3 half2 = obj2.hitbox ? obj2.hitbox->getHalfSize() : KVec3();
+		KVec3 lo = (obj1.hitbox_pos - half1).getmax(obj2.hitbox_pos - half2);
+		KVec3 hi = (obj1.hitbox_pos + half1).getmin(obj2.hitbox_pos + half2);
+		contact.point = (lo + hi) * 0.5f;
+		m_Contacts.push_back(contact);
 	}
 }; // CHitboxManagerImpl
 
@@ -711,14 +1080,30 @@ KHitbox::KHitbox() {
 	memset(m_UserData, 0, sizeof(m_UserData));
 	m_Mute = 0;
 	m_Node = nullptr;
+	m_OwnerId = nullptr;
 }
 KNode * KHitbox::getOwner() {
-	return m_Node ? m_Node->getParent() : nullptr;
+	if (m_OwnerId) {
+		return KNodeTree::findNodeById(m_OwnerId);
+	}
+	KNode *parent = m_Node ? m_Node->getParent() : nullptr;
+	if (parent && parent == KNodeTree::getRoot()) {
+		return nullptr; // ルートノードは持ち主ではない
+	}
+	return parent;
+}
+void KHitbox::setOwner(KNode *owner) {
+	m_OwnerId = owner ? owner->getId() : nullptr;
 }
 KNode * KHitbox::getNode() {
 	return m_Node;
 }
 void KHitbox::_setNode(KNode *node) {
+	if (m_Node != node) {
+		// 判定中の移動を検出できるようにしておく (CHitboxManagerImpl::refresh_bounds)
+		if (m_Node) m_Node->_getTransformData().m_WatchWorldMatrix--;
+		if (node) node->_getTransformData().m_WatchWorldMatrix++;
+	}
 	m_Node = node;
 }
 void KHitbox::on_node_inspector() {
@@ -768,6 +1153,7 @@ const KVec3 & KHitbox::getHalfSize() const {
 }
 void KHitbox::setHalfSize(const KVec3 &s) {
 	m_HalfSize = s;
+	g_HitboxHalfSizeRevision++;
 }
 bool KHitbox::getEnabled() const {
 	return m_Node && m_Node->getEnable();
@@ -861,11 +1247,664 @@ KHitboxGroup * KHitbox::getGroup(int index) {
 	K__ASSERT(g_HitboxMgr);
 	return g_HitboxMgr->getGroup(index);
 }
+void KHitbox::setBroadphase(KHitboxBroadphase type) {
+	K__ASSERT(g_HitboxMgr);
+	g_HitboxMgr->setBroadphase(type);
+}
+KHitboxBroadphase KHitbox::getBroadphase() {
+	K__ASSERT(g_HitboxMgr);
+	return g_HitboxMgr->getBroadphase();
+}
+void KHitbox::setBroadcastSignals(bool value) {
+	K__ASSERT(g_HitboxMgr);
+	g_HitboxMgr->setBroadcastSignals(value);
+}
+bool KHitbox::getBroadcastSignals() {
+	K__ASSERT(g_HitboxMgr);
+	return g_HitboxMgr->getBroadcastSignals();
+}
+const KHitboxContact * KHitbox::getContacts(int *out_count) {
+	K__ASSERT(g_HitboxMgr);
+	return g_HitboxMgr->getContacts(out_count);
+}
 
 #pragma endregion // KHitbox
 
 
 
+namespace Test {
+void Test_hitbox_broadphase() {
+	bool install_tree = !KNodeTree::isInstalled();
+	if (install_tree) KNodeTree::install();
+	bool install = g_HitboxMgr == nullptr;
+	if (install) KHitbox::install();
+	KHitboxBroadphase old_type = KHitbox::getBroadphase();
+
+	uint32_t seed = 16180;
+	auto rnd = [&seed](float lo, float hi) {
+		seed = seed * 1664525 + 1013904223;
+		return lo + (hi - lo) * ((seed >> 8) / (float)(1 << 24));
+	};
+
+	// 5000 個の弾（グループ0）と 500 個の喰らい判定（グループ1）
+	const int NUM_BULLETS = 5000;
+	const int NUM_TARGETS = 500;
+	const int NUM_FRAMES = 20;
+	const float WORLD = 8000;
+	KHitbox::setGroupCount(2);
+	KHitbox::getGroup(0)->clearMask();
+	KHitbox::getGroup(0)->setCollideWith(1);
+	KHitbox::getGroup(1)->clearMask();
+	KHitbox::getGroup(1)->setCollideWith(0);
+	KNode *root = KNode::create();
+	root->setParent(KNodeTree::getRoot());
+	std::vector<KNode *> owners;
+	std::vector<KNode *> hbnodes;
+	std::vector<KVec3> start_pos;
+	std::vector<KVec3> velocity;
+	for (int i=0; i<NUM_BULLETS+NUM_TARGETS; i++) {
+		bool is_bullet = i < NUM_BULLETS;
+		KNode *owner = KNode::create();
+		owner->setParent(root);
+		KHitbox *hb = KHitbox::attach2(owner);
+		hb->setGroupIndex(is_bullet ? 0 : 1);
+		hb->setHalfSize(is_bullet ? KVec3(4, 4, 4) : KVec3(24, 32, 24));
+		KVec3 pos(rnd(0, WORLD), rnd(0, 64), rnd(0, WORLD));
+		KVec3 vel = is_bullet ? KVec3(rnd(-8, 8), 0.0f, rnd(-8, 8)) : KVec3(rnd(-1, 1), 0.0f, rnd(-1, 1));
+		owners.push_back(owner);
+		hbnodes.push_back(hb->getNode());
+		start_pos.push_back(pos);
+		velocity.push_back(vel);
+		owner->drop();
+	}
+
+	// フレームごとの Enter/Stay/Exit を記録する
+	struct EVENT {
+		KNode *node1;
+		KNode *node2;
+		int type; // 0=Enter, 1=Stay, 2=Exit
+		bool operator == (const EVENT &e) const { return node1 == e.node1 && node2 == e.node2 && type == e.type; }
+	};
+	std::vector<EVENT> events[2];
+	int usec[2];
+	int num_events[3] = {0, 0, 0};
+	const KHitboxBroadphase types[] = {KHitboxBroadphase_NONE, KHitboxBroadphase_SWEEP};
+	for (int t=0; t<2; t++) {
+		KHitbox::setBroadphase(types[t]);
+		for (size_t i=0; i<owners.size(); i++) {
+			owners[i]->setPosition(start_pos[i]);
+		}
+		int64_t nano = 0;
+		for (int f=0; f<NUM_FRAMES; f++) {
+			for (size_t i=0; i<owners.size(); i++) {
+				owners[i]->setPosition(owners[i]->getPosition() + velocity[i]);
+			}
+			KClock clock;
+			g_HitboxMgr->on_manager_beginframe();
+			g_HitboxMgr->on_manager_frame();
+			nano += clock.getTimeNano64();
+			for (int i=0; i<KHitbox::getHitboxHitPairCount(); i++) {
+				const KHitPair *pair = KHitbox::getHitboxHitPairByIndex(i);
+				EVENT e;
+				e.node1 = pair->m_Object1.node;
+				e.node2 = pair->m_Object2.node;
+				e.type = pair->isExit() ? 2 : pair->isEnter() ? 0 : 1;
+				events[t].push_back(e);
+				if (t == 1) num_events[e.type]++;
+			}
+			EVENT sep = {nullptr, nullptr, f};
+			events[t].push_back(sep);
+		}
+		usec[t] = (int)(nano / 1000 / NUM_FRAMES);
+
+		// すべて遠ざけて衝突を解消させ、記録を空にしておく
+		for (size_t i=0; i<owners.size(); i++) {
+			owners[i]->setPosition(KVec3(-100000.0f * (i + 1), 0.0f, 0.0f));
+		}
+		g_HitboxMgr->on_manager_beginframe();
+		g_HitboxMgr->on_manager_frame();
+		g_HitboxMgr->on_manager_beginframe();
+		g_HitboxMgr->on_manager_frame();
+		K__ASSERT(KHitbox::getHitboxHitPairCount() == 0);
+	}
+	K__PRINT("Test_hitbox_broadphase: %d vs %d hitboxes: brute force %d usec/frame, sweep %d usec/frame (enter %d, stay %d, exit %d)",
+		NUM_BULLETS, NUM_TARGETS, usec[0], usec[1], num_events[0], num_events[1], num_events[2]);
+	K__ASSERT(num_events[0] > 0 && num_events[1] > 0 && num_events[2] > 0);
+	K__ASSERT(events[0] == events[1]);
+
+	KHitbox::setBroadphase(old_type);
+	for (size_t i=0; i<hbnodes.size(); i++) {
+		g_HitboxMgr->on_manager_detach(hbnodes[i]);
+	}
+	root->remove();
+	root->drop();
+	KNodeTree::destroyMarkedNodes(nullptr);
+	if (install) KHitbox::uninstall();
+	if (install_tree) KNodeTree::uninstall();
+}
+void Test_hitbox_pairs() {
+	bool install_tree = !KNodeTree::isInstalled();
+	if (install_tree) KNodeTree::install();
+	bool install = g_HitboxMgr == nullptr;
+	if (install) KHitbox::install();
+
+	// 100 x 100 個のヒットボックスを重ねて、10000 組の衝突を持続させる。
+	// 毎フレーム 1 割の弾を遠ざけて Enter と Exit も発生させる
+	const int NUM_BULLETS = 100;
+	const int NUM_TARGETS = 100;
+	const int NUM_FRAMES = 10;
+	KHitbox::setGroupCount(2);
+	KHitbox::getGroup(0)->clearMask();
+	KHitbox::getGroup(0)->setCollideWith(1);
+	KHitbox::getGroup(1)->clearMask();
+	KHitbox::getGroup(1)->setCollideWith(0);
+	KNode *root = KNode::create();
+	root->setParent(KNodeTree::getRoot());
+	std::vector<KNode *> owners;
+	std::vector<KNode *> hbnodes;
+	std::unordered_map<KNode *, int> indices;
+	for (int i=0; i<NUM_BULLETS+NUM_TARGETS; i++) {
+		KNode *owner = KNode::create();
+		owner->setParent(root);
+		owner->setPosition(KVec3((float)(i % 7), (float)(i % 5), (float)(i % 3)));
+		KHitbox *hb = KHitbox::attach2(owner);
+		hb->setGroupIndex(i < NUM_BULLETS ? 0 : 1);
+		hb->setHalfSize(KVec3(16, 16, 16));
+		owners.push_back(owner);
+		hbnodes.push_back(hb->getNode());
+		indices[hb->getNode()] = i;
+		owner->drop();
+	}
+
+	int num_errors = 0;
+	int num_events[3] = {0, 0, 0};
+	std::vector<char> prev_hit(NUM_BULLETS * NUM_TARGETS, 0);
+	std::vector<int> prev_order; // 前フレームでの m_HitPairs の並び（弾 * NUM_TARGETS + 的）
+	KClock clock;
+	for (int f=0; f<NUM_FRAMES; f++) {
+		for (int i=0; i<NUM_BULLETS; i++) {
+			KVec3 pos = owners[i]->getPosition();
+			pos.x = (float)(i % 7) + (((i + f) % 10 == 0) ? 10000.0f : 0.0f);
+			owners[i]->setPosition(pos);
+		}
+		g_HitboxMgr->on_manager_beginframe();
+		g_HitboxMgr->on_manager_frame();
+
+		// 位置から求めた衝突状態と一致する
+		std::vector<char> hit(NUM_BULLETS * NUM_TARGETS, 0);
+		for (int b=0; b<NUM_BULLETS; b++) {
+			if ((b + f) % 10 == 0) continue;
+			for (int t=0; t<NUM_TARGETS; t++) {
+				hit[b * NUM_TARGETS + t] = 1; // 遠ざけたもの以外はすべて重なっている
+			}
+		}
+		std::vector<int> order;
+		std::vector<char> listed(NUM_BULLETS * NUM_TARGETS, 0);
+		for (int i=0; i<KHitbox::getHitboxHitPairCount(); i++) {
+			const KHitPair *pair = KHitbox::getHitboxHitPairByIndex(i);
+			int b = indices[pair->m_Object1.node];
+			int t = indices[pair->m_Object2.node] - NUM_BULLETS;
+			int k = b * NUM_TARGETS + t;
+			int type = pair->isExit() ? 2 : pair->isEnter() ? 0 : 1;
+			int expected = hit[k] ? (prev_hit[k] ? 1 : 0) : 2;
+			if (type != expected || listed[k]) num_errors++;
+			if (type == 2 && !prev_hit[k]) num_errors++;
+			listed[k] = 1;
+			order.push_back(k);
+			num_events[type]++;
+		}
+		for (int k=0; k<NUM_BULLETS * NUM_TARGETS; k++) {
+			if ((hit[k] || prev_hit[k]) && !listed[k]) num_errors++;
+		}
+		// 前フレームから続いているペアは前フレームと同じ順番のまま、新しいペアはその後ろに並ぶ
+		{
+			size_t n = 0;
+			for (size_t i=0; i<prev_order.size(); i++) {
+				if (!prev_hit[prev_order[i]]) continue; // 前フレームで Exit したもの
+				if (n >= order.size() || order[n] != prev_order[i]) { num_errors++; break; }
+				n++;
+			}
+			for (; n<order.size(); n++) {
+				if (prev_hit[order[n]]) num_errors++;
+			}
+		}
+		prev_hit.swap(hit);
+		prev_order.swap(order);
+	}
+	int usec = (int)(clock.getTimeNano64() / 1000 / NUM_FRAMES);
+	K__PRINT("Test_hitbox_pairs: %d persistent pairs: %d usec/frame (enter %d, stay %d, exit %d)",
+		NUM_BULLETS * NUM_TARGETS, usec, num_events[0], num_events[1], num_events[2]);
+	K__ASSERT(num_errors == 0);
+
+	for (size_t i=0; i<hbnodes.size(); i++) {
+		g_HitboxMgr->on_manager_detach(hbnodes[i]);
+	}
+	K__ASSERT(KHitbox::getHitboxHitPairCount() == 0);
+	root->remove();
+	root->drop();
+	KNodeTree::destroyMarkedNodes(nullptr);
+	if (install) KHitbox::uninstall();
+	if (install_tree) KNodeTree::uninstall();
+}
+struct SHitboxSigLog {
+	KNode *receiver;
+	KNode *hitbox1;
+	KNode *hitbox2;
+	int phase;
+	bool operator == (const SHitboxSigLog &e) const { return receiver == e.receiver && hitbox1 == e.hitbox1 && hitbox2 == e.hitbox2 && phase == e.phase; }
+};
+class CTestHitboxSigNode: public KNode {
+public:
+	std::vector<SHitboxSigLog> *m_Log;
+	bool m_LogAll;   // 自分が関係しないイベントも記録する（リスナー）
+	int m_Unrelated; // 自分が関係しないイベントを受け取った回数
+	CTestHitboxSigNode() {
+		m_Log = nullptr;
+		m_LogAll = false;
+		m_Unrelated = 0;
+	}
+	virtual void on_node_signal(KSig &sig) override {
+		int phase;
+		if (sig.check(K_SIG_HITBOX_ENTER)) {
+			phase = KHitboxPhase_ENTER;
+		} else if (sig.check(K_SIG_HITBOX_STAY)) {
+			phase = KHitboxPhase_STAY;
+		} else if (sig.check(K_SIG_HITBOX_EXIT)) {
+			phase = KHitboxPhase_EXIT;
+		} else {
+			return;
+		}
+		SHitboxSigLog e;
+		e.receiver = this;
+		e.hitbox1 = sig.getNode("hitbox1");
+		e.hitbox2 = sig.getNode("hitbox2");
+		e.phase = phase;
+		bool related = e.hitbox1->getParent() == this || e.hitbox2->getParent() == this;
+		if (m_Log && (related || m_LogAll)) {
+			m_Log->push_back(e);
+		} else {
+			m_Unrelated++;
+		}
+	}
+};
+
+void Test_hitbox_signal() {
+	bool install_tree = !KNodeTree::isInstalled();
+	if (install_tree) KNodeTree::install();
+	bool install = g_HitboxMgr == nullptr;
+	if (install) KHitbox::install();
+	bool old_broadcast = KHitbox::getBroadcastSignals();
+
+	// 20000 ノードのツリーで、1000 組の弾と的を重ねる。
+	// 弾と的の持ち主、および衝突シグナルを購読するリスナーだけがイベントを記録する
+	const int NUM_PAIRS = 1000;
+	const int NUM_NODES = 20000;
+	const int NUM_FRAMES = 6;
+	KHitbox::setGroupCount(2);
+	KHitbox::getGroup(0)->clearMask();
+	KHitbox::getGroup(0)->setCollideWith(1);
+	KHitbox::getGroup(1)->clearMask();
+	KHitbox::getGroup(1)->setCollideWith(0);
+	KNode *root = KNode::create();
+	root->setParent(KNodeTree::getRoot());
+	std::vector<SHitboxSigLog> log;
+	std::vector<CTestHitboxSigNode *> owners; // [0, NUM_PAIRS) が弾、[NUM_PAIRS, NUM_PAIRS*2) が的
+	std::vector<KNode *> hbnodes;
+	for (int i=0; i<NUM_PAIRS*2; i++) {
+		bool is_bullet = i < NUM_PAIRS;
+		CTestHitboxSigNode *owner = new CTestHitboxSigNode();
+		owner->m_Log = &log;
+		owner->setParent(root);
+		owner->setPosition(KVec3(100.0f * (i % NUM_PAIRS), 0.0f, 0.0f));
+		KHitbox *hb = KHitbox::attach2(owner);
+		hb->setGroupIndex(is_bullet ? 0 : 1);
+		hb->setHalfSize(is_bullet ? KVec3(4, 4, 4) : KVec3(16, 16, 16));
+		owners.push_back(owner);
+		hbnodes.push_back(hb->getNode());
+		owner->drop();
+	}
+	CTestHitboxSigNode *listener = new CTestHitboxSigNode();
+	listener->m_Log = &log;
+	listener->m_LogAll = true;
+	listener->setParent(root);
+	listener->subscribeSignal(K_SIG_HITBOX_ENTER);
+	listener->subscribeSignal(K_SIG_HITBOX_STAY);
+	listener->subscribeSignal(K_SIG_HITBOX_EXIT);
+	listener->drop();
+	std::vector<CTestHitboxSigNode *> bystanders;
+	for (int i=NUM_PAIRS*4+2; i<NUM_NODES; i++) {
+		CTestHitboxSigNode *node = new CTestHitboxSigNode();
+		node->setParent(owners[i % owners.size()]);
+		bystanders.push_back(node);
+		node->drop();
+	}
+
+	int num_errors = 0;
+	std::vector<SHitboxSigLog> logs[2];
+	int unrelated[2] = {0, 0};
+	int num_contacts = 0;
+	int usec[2];
+	for (int mode=0; mode<2; mode++) {
+		KHitbox::setBroadcastSignals(mode == 0);
+		log.clear();
+		int64_t nano = 0;
+		for (int f=0; f<NUM_FRAMES; f++) {
+			// 偶数番目の弾は途中で的から離れ、また戻ってくる
+			for (int i=0; i<NUM_PAIRS; i++) {
+				bool away = i % 2 == 0 && f >= 2 && f < 4;
+				owners[i]->setPosition(KVec3(100.0f * i, away ? 50.0f : 1.0f, 2.0f));
+			}
+			size_t log_start = log.size();
+			KClock clock;
+			g_HitboxMgr->on_manager_beginframe();
+			g_HitboxMgr->on_manager_frame();
+			nano += clock.getTimeNano64();
+
+			// リスナーが受け取ったイベントと getContacts の内容が一致する
+			int count = 0;
+			const KHitboxContact *contacts = KHitbox::getContacts(&count);
+			int n = 0;
+			for (size_t i=log_start; i<log.size(); i++) {
+				const SHitboxSigLog &e = log[i];
+				if (e.receiver != listener) continue;
+				if (n >= count) { num_errors++; break; }
+				const KHitboxContact &c = contacts[n++];
+				if (c.hitbox1 != e.hitbox1->getId() || c.hitbox2 != e.hitbox2->getId()) num_errors++;
+				if (c.owner1 != e.hitbox1->getParent()->getId() || c.owner2 != e.hitbox2->getParent()->getId()) num_errors++;
+				if (c.phase != e.phase || c.group1 != 0 || c.group2 != 1) num_errors++;
+				KVec3 expected_point = e.hitbox1->getParent()->getPosition(); // 弾は的の内側にある
+				if (c.phase != KHitboxPhase_EXIT && (c.point - expected_point).getLength() > 0.001f) num_errors++;
+			}
+			if (n != count) num_errors++;
+			num_contacts += count;
+		}
+		usec[mode] = (int)(nano / 1000 / NUM_FRAMES);
+
+		for (size_t i=0; i<owners.size(); i++) {
+			unrelated[mode] += owners[i]->m_Unrelated;
+		}
+		for (size_t i=0; i<bystanders.size(); i++) {
+			unrelated[mode] += bystanders[i]->m_Unrelated;
+		}
+		logs[mode].swap(log);
+
+		// すべて遠ざけて衝突を解消させる
+		for (int i=0; i<NUM_PAIRS; i++) {
+			owners[i]->setPosition(KVec3(-100000.0f * (i + 1), 0.0f, 0.0f));
+		}
+		g_HitboxMgr->on_manager_beginframe();
+		g_HitboxMgr->on_manager_frame();
+		g_HitboxMgr->on_manager_beginframe();
+		g_HitboxMgr->on_manager_frame();
+		K__ASSERT(KHitbox::getHitboxHitPairCount() == 0);
+		for (size_t i=0; i<owners.size(); i++) {
+			owners[i]->m_Unrelated = 0;
+		}
+		for (size_t i=0; i<bystanders.size(); i++) {
+			bystanders[i]->m_Unrelated = 0;
+		}
+	}
+
+	// 受信ノードごとに見たとき、受け取ったイベントとその順番は配信方法によらず同じ
+	auto by_receiver = [](const SHitboxSigLog &a, const SHitboxSigLog &b) { return a.receiver < b.receiver; };
+	std::stable_sort(logs[0].begin(), logs[0].end(), by_receiver);
+	std::stable_sort(logs[1].begin(), logs[1].end(), by_receiver);
+	if (logs[0].empty() || !(logs[0] == logs[1])) num_errors++;
+
+	// 全体配信では関係のないノードにも届くが、そうでなければ届かない
+	if (unrelated[0] == 0 || unrelated[1] != 0) num_errors++;
+
+	K__PRINT("Test_hitbox_signal: %d nodes, %d pairs: broadcast %d usec/frame, targeted %d usec/frame (%d contacts)",
+		NUM_NODES, NUM_PAIRS, usec[0], usec[1], num_contacts / 2);
+	K__ASSERT(num_errors == 0);
+
+	KHitbox::setBroadcastSignals(old_broadcast);
+	for (size_t i=0; i<hbnodes.size(); i++) {
+		g_HitboxMgr->on_manager_detach(hbnodes[i]);
+	}
+	root->remove();
+	root->drop();
+	KNodeTree::destroyMarkedNodes(nullptr);
+	if (install) KHitbox::uninstall();
+	if (install_tree) KNodeTree::uninstall();
+}
+void Test_hitbox_owner() {
+	bool install_tree = !KNodeTree::isInstalled();
+	if (install_tree) KNodeTree::install();
+	bool install = g_HitboxMgr == nullptr;
+	if (install) KHitbox::install();
+	bool old_broadcast = KHitbox::getBroadcastSignals();
+	KHitbox::setBroadcastSignals(false);
+	KHitbox::setGroupCount(2);
+	KHitbox::getGroup(0)->clearMask();
+	KHitbox::getGroup(0)->setCollideWith(1);
+	KHitbox::getGroup(1)->clearMask();
+	KHitbox::getGroup(1)->setCollideWith(0);
+
+	// entity/body/$hitbox : エンティティより一段深いヒットボックス。持ち主として entity を指定する
+	// other/$hitbox       : 通常のヒットボックス。持ち主は other
+	// loose               : ルート直下のノードに直接つけたヒットボックス。持ち主はいない
+	std::vector<SHitboxSigLog> log;
+	KNode *root = KNode::create();
+	root->setParent(KNodeTree::getRoot());
+	CTestHitboxSigNode *entity = new CTestHitboxSigNode();
+	CTestHitboxSigNode *body = new CTestHitboxSigNode();
+	CTestHitboxSigNode *other = new CTestHitboxSigNode();
+	CTestHitboxSigNode *loose = new CTestHitboxSigNode();
+	CTestHitboxSigNode *nodes[] = {entity, body, other, loose};
+	for (int i=0; i<4; i++) {
+		nodes[i]->m_Log = &log;
+		nodes[i]->m_LogAll = true;
+	}
+	entity->setParent(root);
+	body->setParent(entity);
+	other->setParent(root);
+	loose->setParent(KNodeTree::getRoot());
+	KHitbox *hb1 = KHitbox::attach2(body);
+	hb1->setOwner(entity);
+	hb1->setGroupIndex(0);
+	KHitbox *hb2 = KHitbox::attach2(other);
+	hb2->setGroupIndex(1);
+	KHitbox::attach(loose);
+	KHitbox *hb3 = KHitbox::of(loose);
+	hb3->setGroupIndex(1);
+	K__ASSERT(hb1->getOwner() == entity);
+	K__ASSERT(hb2->getOwner() == other);
+	K__ASSERT(hb3->getOwner() == nullptr);
+
+	g_HitboxMgr->on_manager_beginframe();
+	g_HitboxMgr->on_manager_frame();
+	int count[4] = {0, 0, 0, 0};
+	for (size_t i=0; i<log.size(); i++) {
+		for (int n=0; n<4; n++) {
+			if (log[i].receiver == nodes[n]) count[n]++;
+		}
+	}
+	K__ASSERT(count[0] == 2); // entity は両方の Enter を受け取る
+	K__ASSERT(count[1] == 0); // 持ち主ではない body には送らない
+	K__ASSERT(count[2] == 1);
+	K__ASSERT(count[3] == 1); // loose はヒットボックスのノードとして受け取る
+	int num_contacts = 0;
+	const KHitboxContact *contacts = KHitbox::getContacts(&num_contacts);
+	K__ASSERT(num_contacts == 2);
+	for (int i=0; i<num_contacts; i++) {
+		K__ASSERT(contacts[i].owner1 == entity->getId());
+		K__ASSERT(contacts[i].owner2 == (contacts[i].hitbox2 == loose->getId() ? nullptr : other->getId()));
+	}
+
+	g_HitboxMgr->on_manager_detach(hb1->getNode());
+	g_HitboxMgr->on_manager_detach(hb2->getNode());
+	g_HitboxMgr->on_manager_detach(loose);
+	for (int i=0; i<4; i++) {
+		nodes[i]->drop();
+	}
+	loose->remove();
+	root->remove();
+	root->drop();
+	KNodeTree::destroyMarkedNodes(nullptr);
+	KHitbox::setBroadcastSignals(old_broadcast);
+	if (install) KHitbox::uninstall();
+	if (install_tree) KNodeTree::uninstall();
+}
+void Test_hitbox_overlaps() {
+	uint32_t seed = 27182;
+	auto rnd = [&seed](float lo, float hi) {
+		seed = seed * 1664525 + 1013904223;
+		return lo + (hi - lo) * ((seed >> 8) / (float)(1 << 24));
+	};
+
+	// 2000 x 2000 組の範囲を判定する。
+	// 半分は整数座標に置いて、ちょうど接している（重なっていない）組み合わせも含める
+	const int NUM1 = 2000;
+	const int NUM2 = 2000;
+	const float WORLD = 1000;
+	std::vector<SHitboxBounds> bounds1(NUM1);
+	std::vector<SHitboxBounds> bounds2(NUM2);
+	for (int i=0; i<NUM1+NUM2; i++) {
+		SHitboxBounds &b = (i < NUM1) ? bounds1[i] : bounds2[i - NUM1];
+		if (i % 2 == 0) {
+			b.center = KVec3(rnd(0, WORLD), rnd(0, WORLD), rnd(0, 64));
+			b.halfsize = KVec3(rnd(1, 32), rnd(1, 32), rnd(1, 32));
+		} else {
+			b.center = KVec3(floorf(rnd(0, WORLD / 8)) * 8, floorf(rnd(0, WORLD / 8)) * 8, 0.0f);
+			b.halfsize = KVec3(4, 4, 4) * floorf(rnd(1, 4));
+		}
+	}
+
+	// 現在の方法：構造体の配列のまま１組ずつ判定する
+	std::vector<uint64_t> expected;
+	int usec_aos;
+	{
+		KClock clock;
+		for (int i=0; i<NUM1; i++) {
+			for (int j=0; j<NUM2; j++) {
+				if (_IsHitboxOverlapped(bounds1[i], bounds2[j])) {
+					expected.push_back(((uint64_t)i << 32) | (uint32_t)j);
+				}
+			}
+		}
+		usec_aos = (int)(clock.getTimeNano64() / 1000);
+	}
+
+	// 成分ごとの配列に集めてから判定する（集める時間も含める）
+	int usec_soa[2] = {-1, -1};
+	int num_errors = 0;
+	for (int m=0; m<2; m++) {
+#ifndef K_USE_SIMD
+		if (m == 1) break;
+#endif
+		std::vector<uint64_t> result;
+		std::vector<int> indices;
+		KClock clock;
+		SHitboxBoundsSoA soa;
+		soa.resize(NUM2);
+		for (int j=0; j<NUM2; j++) {
+			soa.set(j, bounds2[j]);
+		}
+		for (int i=0; i<NUM1; i++) {
+			indices.clear();
+#ifdef K_USE_SIMD
+			if (m == 1) {
+				_GetHitboxOverlaps_simd(bounds1[i], soa, 0, NUM2, indices);
+			} else
+#endif
+			{
+				_GetHitboxOverlaps_generic(bounds1[i], soa, 0, NUM2, indices);
+			}
+			for (size_t k=0; k<indices.size(); k++) {
+				result.push_back(((uint64_t)i << 32) | (uint32_t)indices[k]);
+			}
+		}
+		usec_soa[m] = (int)(clock.getTimeNano64() / 1000);
+		if (result != expected) num_errors++;
+
+		// 範囲の途中から途中までを判定しても同じ
+		indices.clear();
+		_GetHitboxOverlaps(bounds1[0], soa, 3, NUM2 - 2, indices);
+		for (size_t k=0; k<indices.size(); k++) {
+			if (!_IsHitboxOverlapped(bounds1[0], bounds2[indices[k]])) num_errors++;
+		}
+		for (int j=3; j<NUM2 - 2; j++) {
+			bool listed = std::find(indices.begin(), indices.end(), j) != indices.end();
+			if (listed != _IsHitboxOverlapped(bounds1[0], bounds2[j])) num_errors++;
+		}
+	}
+	K__PRINT("Test_hitbox_overlaps: %d x %d boxes (%d overlaps): per pair %d usec, gather + generic %d usec, gather + simd %d usec",
+		NUM1, NUM2, (int)expected.size(), usec_aos, usec_soa[0], usec_soa[1]);
+	K__ASSERT(!expected.empty());
+	K__ASSERT(num_errors == 0);
+}
+void Test_hitbox_moved_in_callback() {
+	bool install_tree = !KNodeTree::isInstalled();
+	if (install_tree) KNodeTree::install();
+	bool install = g_HitboxMgr == nullptr;
+	if (install) KHitbox::install();
+	KHitboxBroadphase old_type = KHitbox::getBroadphase();
+
+	// グループ 0 と 1 の判定中に、グループ 2 のヒットボックスを動かしたり大きくしたりする。
+	// 後から判定するグループ 0 と 2 の組み合わせでは、変更後の範囲を使わないといけない
+	struct CB: public KHitboxCallback {
+		KHitbox *trigger1, *trigger2, *moved, *resized;
+		virtual void on_hitbox_update(const KHitbox *hitbox1, const KHitbox *hitbox2, bool *deny) override {
+			if (hitbox1 == trigger1 && hitbox2 == trigger2) {
+				moved->setCenter(KVec3(10000, 0, 0)); // 遠ざける
+				resized->setHalfSize(KVec3(100, 16, 16)); // 届くようにする
+			}
+		}
+	};
+	KHitbox::setGroupCount(3);
+	KHitbox::getGroup(0)->clearMask();
+	KHitbox::getGroup(0)->setCollideWith(1);
+	KHitbox::getGroup(0)->setCollideWith(2);
+	KHitbox::getGroup(1)->clearMask();
+	KHitbox::getGroup(1)->setCollideWith(0);
+	KHitbox::getGroup(2)->clearMask();
+	KHitbox::getGroup(2)->setCollideWith(0);
+	const KHitboxBroadphase types[] = {KHitboxBroadphase_NONE, KHitboxBroadphase_SWEEP};
+	for (int t=0; t<2; t++) {
+		KHitbox::setBroadphase(types[t]);
+		KNode *root = KNode::create();
+		root->setParent(KNodeTree::getRoot());
+		const KVec3 pos[] = {KVec3(0, 0, 0), KVec3(8, 0, 0), KVec3(-8, 0, 0), KVec3(100, 0, 0)};
+		const int groups[] = {0, 1, 2, 2};
+		KHitbox *hb[4];
+		for (int i=0; i<4; i++) {
+			KNode *owner = KNode::create();
+			owner->setParent(root);
+			owner->setPosition(pos[i]);
+			hb[i] = KHitbox::attach2(owner);
+			hb[i]->setGroupIndex(groups[i]);
+			hb[i]->setHalfSize(KVec3(16, 16, 16));
+			owner->drop();
+		}
+		CB cb;
+		cb.trigger1 = hb[0];
+		cb.trigger2 = hb[1];
+		cb.moved = hb[2];
+		cb.resized = hb[3];
+		g_HitboxMgr->setHitboxCallback(&cb);
+		g_HitboxMgr->on_manager_beginframe();
+		g_HitboxMgr->on_manager_frame();
+		g_HitboxMgr->setHitboxCallback(nullptr);
+		K__ASSERT(KHitbox::getHitboxHitPairCount() == 2);
+		K__ASSERT(KHitbox::getHitboxHitPairOf(hb[0]->getNode(), hb[1]->getNode()) != nullptr);
+		K__ASSERT(KHitbox::getHitboxHitPairOf(hb[0]->getNode(), hb[2]->getNode()) == nullptr); // 動かした後の範囲で判定する
+		K__ASSERT(KHitbox::getHitboxHitPairOf(hb[0]->getNode(), hb[3]->getNode()) != nullptr); // 大きくした後の範囲で判定する
+		for (int i=0; i<4; i++) {
+			g_HitboxMgr->on_manager_detach(hb[i]->getNode());
+		}
+		root->remove();
+		root->drop();
+		KNodeTree::destroyMarkedNodes(nullptr);
+	}
+	KHitbox::setBroadphase(old_type);
+	if (install) KHitbox::uninstall();
+	if (install_tree) KNodeTree::uninstall();
+}
+} // Test
+
+
+
 
 
 } // namespace
@@ -1,4 +1,5 @@
 ﻿#pragma once
+#include "KNode.h"
 #include "KRef.h"
 #include "KVec.h"
 #include "KColor.h"
@@ -12,6 +13,32 @@ class KHitPair;
 class KHitboxGroup;
 class KNode;
 
+/// グループ同士のヒットボックスの判定候補を絞り込む方法
+enum KHitboxBroadphase {
+	KHitboxBroadphase_NONE,  ///< 絞り込まない（総当たり）
+	KHitboxBroadphase_SWEEP, ///< X軸上でのソート＆スイープ（既定）
+};
+
+/// 衝突イベントの種類
+enum KHitboxPhase {
+	KHitboxPhase_ENTER, ///< K_SIG_HITBOX_ENTER
+	KHitboxPhase_STAY,  ///< K_SIG_HITBOX_STAY
+	KHitboxPhase_EXIT,  ///< K_SIG_HITBOX_EXIT
+};
+
+/// KHitbox::getContacts で得られる衝突イベントの記録。
+/// ポインタを持たない単純な構造体なので、そのままコピーしたり別スレッドに渡したりできる
+struct KHitboxContact {
+	EID owner1;         ///< KHitPair::m_Object1 側のヒットボックスの持ち主
+	EID owner2;         ///< KHitPair::m_Object2 側のヒットボックスの持ち主
+	EID hitbox1;        ///< KHitPair::m_Object1 側のヒットボックスのノード（シグナルの "hitbox1"）
+	EID hitbox2;        ///< KHitPair::m_Object2 側のヒットボックスのノード（シグナルの "hitbox2"）
+	int group1;         ///< hitbox1 のグループ番号
+	int group2;         ///< hitbox2 のグループ番号
+	KHitboxPhase phase;
+	KVec3 point;        ///< ２つのヒットボックスの重なり部分の中心（ワールド座標）
+};
+
 class KHitbox: public KRef {
 public:
 	static void install();
@@ -26,6 +53,23 @@ public:
 	static void setGroupCount(int count);
 	static KHitboxGroup * getGroup(int index);
 
+	/// 判定候補の絞り込み方法。どちらを使っても Enter/Stay/Exit の発生順は変わらない。
+	/// ただし KHitboxCallback::on_hitbox_update が呼ばれる組み合わせは異なる（KHitboxCallback を参照）
+	static void setBroadphase(KHitboxBroadphase type);
+	static KHitboxBroadphase getBroadphase();
+
+	/// 衝突シグナル K_SIG_HITBOX_ENTER/STAY/EXIT の送り先。
+	/// false（既定）なら、衝突した２つのヒットボックスのノードとその持ち主、
+	/// およびそのシグナルを KNode::subscribeSignal で購読しているノードにだけ送る。
+	/// true ならば、以前と同じようにツリー全体に broadcastSignal する
+	static void setBroadcastSignals(bool value);
+	static bool getBroadcastSignals();
+
+	/// 直近のヒットボックス更新で発生した衝突イベントを、シグナルを送った順番で得る。
+	/// 戻り値の配列は次のヒットボックス更新まで有効。
+	/// ヒットボックスが削除されたときの Exit も、次の更新までの間はここに追加される
+	static const KHitboxContact * getContacts(int *out_count);
+
 	static int getHitboxCount(KNode *node);
 	static KHitbox * getHitboxByGroup(KNode *node, int groupindex);
 	static KHitbox * getHitboxByIndex(KNode *node, int index);
@@ -45,8 +89,15 @@ public:
 
 	void on_node_inspector();
 
-	/// このヒットボックスの持ち主（親ノードとは限らない）
+	/// このヒットボックスの持ち主（親ノードとは限らない）。
+	/// 衝突シグナルの送り先、KHitboxContact::owner1/owner2、同じ持ち主のヒットボックス同士を判定しないための比較に使う。
+	/// setOwner で指定されていればそのノード、指定されていなければヒットボックスのノードの親を返す。
+	/// ただし、ルートノードは持ち主として扱わない（ルート直下のヒットボックスには持ち主がいない）
 	KNode * getOwner();
+
+	/// 持ち主を指定する。nullptr を指定すると既定の持ち主（親ノード）に戻す。
+	/// ヒットボックスをグループ用のノードなどを挟んでエンティティの孫以下に置く場合は、ここでエンティティを指定する
+	void setOwner(KNode *owner);
 	void _setNode(KNode *node);
 	KNode * getNode();
 
@@ -89,6 +140,7 @@ private:
 	intptr_t m_UserData[USERDATA_COUNT];
 	KVec3 m_HalfSize; // aabb half size
 	KNode *m_Node;
+	EID m_OwnerId; // setOwner で指定された持ち主。ヒットボックスより先に削除されてもよいように EID で持つ
 	KName m_UserTag;
 	int m_GroupIndex;
 	int m_Mute; // 一時的に利用不可能にする (enabled が true だったとしても）
@@ -131,6 +183,10 @@ public:
 	/// e1 の判定 box1 と、e2 の判定 box2 が衝突可能な組み合わせであれば true を返す。
 	/// 判定を無視するなら deny に true をセットする
 	/// deny の値を true にすると衝突判定を無視する
+	/// ※KHitboxBroadphase_NONE の場合は、衝突可能なグループのすべての組み合わせについて呼ばれる。
+	/// KHitboxBroadphase_SWEEP の場合は、その時点で範囲が重なっている組み合わせについてだけ呼ばれる。
+	/// 範囲が重なっていない組み合わせも調べる必要があるなら KHitboxBroadphase_NONE を使うこと。
+	/// コールバックやシグナルの処理中にヒットボックスを移動したりサイズを変えたりした場合、まだ判定していない組み合わせには変更後の範囲が使われる
 	virtual void on_hitbox_update(const KHitbox *hitbox1, const KHitbox *hitbox2, bool *deny) {}
 };
 
@@ -179,6 +235,14 @@ public:
 };
 
 
+namespace Test {
+void Test_hitbox_broadphase();
+void Test_hitbox_pairs();
+void Test_hitbox_signal();
+void Test_hitbox_owner();
+void Test_hitbox_overlaps();
+void Test_hitbox_moved_in_callback();
+}
 
 
 } // namespace
@@ -149,6 +149,11 @@ void KMeshDrawable::drawMesh(const KMatrix4 &projection_matrix, const KMatrix4 &
 		}
 	}
 }
+bool KMeshDrawable::onDrawable_prepare(KNode *node, const RenderArgs *opt) {
+	// 描画コールバックの呼び出しと、グループ化（レンダーテクスチャへの描画）は
+	// 呼び出し元スレッドで行う必要がある。それ以外はメッシュを読むだけ
+	return opt && opt->cb == nullptr && !isGrouping();
+}
 void KMeshDrawable::onDrawable_draw(KNode *node, const RenderArgs *opt, KDrawList *drawlist) {
 	if (node == nullptr) return;
 	if (opt == nullptr) return;
@@ -27,6 +27,7 @@ public:
 	int getSubMeshCount() const;
 
 	virtual void onDrawable_inspector() override;
+	virtual bool onDrawable_prepare(KNode *node, const RenderArgs *opt) override;
 	virtual void onDrawable_draw(KNode *node, const RenderArgs *opt, KDrawList *drawlist) override;
 	virtual void onDrawable_getGroupImageSize(int *w, int *h, KVec3 *pivot) override;
 	virtual bool onDrawable_getBoundingAabb(KVec3 *min_point, KVec3 *max_point) override;
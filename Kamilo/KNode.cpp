@@ -5,6 +5,7 @@
 #include "KAction.h"
 #include "KSig.h"
 #include "KAny.h"
+#include "KClock.h"
 #include <algorithm> // std::sort
 
 
@@ -21,6 +22,21 @@ static void KNodeTree_on_node_removing(CNodeTreeImpl *tree, KNode *node);
 static void KNodeTree_add_tag(CNodeTreeImpl *tree, KNode *node, const KName &tag);
 static void KNodeTree_del_tag(CNodeTreeImpl *tree, KNode *node, const KName &tag);
 static void KNodeTree_on_node_marked_as_remove(CNodeTreeImpl *tree, KNode *node);
+static void KNodeTree_on_node_reorder(CNodeTreeImpl *tree, KNode *node);
+static void KNodeTree_add_signal_subscriber(CNodeTreeImpl *tree, KNode *node, const KName &signame);
+static void KNodeTree_del_signal_subscriber(CNodeTreeImpl *tree, KNode *node, const KName &signame);
+static void KNodeTree_set_name(CNodeTreeImpl *tree, KNode *node, const std::string &name);
+static KNode * KNodeTree_find_name(CNodeTreeImpl *tree, const KNode *start, const std::string &name);
+
+// 描画リストの構成と描画順が変わるたびに増加するカウンタ。
+// SRenderData::getRenderListRevision, SRenderData::getRenderOrderRevision を参照
+static uint32_t g_RenderListRevision = 0;
+static uint32_t g_RenderOrderRevision = 0;
+
+// ノードツリーに入っているノードの変更だけを記録した、レイヤーごとの g_RenderListRevision。
+// レイヤー番号の下位５ビットで共有する
+static const int RENDER_LIST_LAYER_SLOTS = 32;
+static uint32_t g_RenderListLayerRevision[RENDER_LIST_LAYER_SLOTS] = {0};
 
 
 // スケーリング * 並行移動
@@ -59,6 +75,11 @@ static KMatrix4 _MakeMatrix_Inv_Tr_Sc(const KVec3 &tr, const KVec3 &sc) {
 
 
 #pragma region STransformData
+static uint32_t g_WatchedWorldMatrixRevision = 0;
+
+uint32_t STransformData::getWatchedWorldMatrixRevision() {
+	return g_WatchedWorldMatrixRevision;
+}
 STransformData::STransformData() {
 	m_Scale = KVec3(1.0f, 1.0f, 1.0f);
 	m_DirtyLocalMatrix = true;
@@ -66,6 +87,8 @@ STransformData::STransformData() {
 	m_UsingEuler = true;
 	m_UsingCustom = false;
 	m_InheritTransform = true;
+	m_WatchWorldMatrix = 0;
+	m_WatchedRevision = 0;
 	m_Node = nullptr;
 }
 const KVec3 & STransformData::getPosition() const {
@@ -296,6 +319,9 @@ void STransformData::_updateLocalMatrix() const {
 	}
 }
 void STransformData::_updateWorldMatrix(const KMatrix4 &parent) const {
+	if (m_WatchWorldMatrix) {
+		m_WatchedRevision = ++g_WatchedWorldMatrixRevision;
+	}
 	if (m_InheritTransform) {
 		m_WorldMatrix = m_LocalMatrix * parent;
 	} else {
@@ -308,6 +334,9 @@ void STransformData::_updateWorldMatrix(const KMatrix4 &parent) const {
 	}
 }
 void STransformData::_setDirtyWorldMatrix() {
+	if (m_WatchWorldMatrix) {
+		m_WatchedRevision = ++g_WatchedWorldMatrixRevision;
+	}
 	m_DirtyWorldMatrix = true;
 	for (size_t i=0; i<m_Node->getChildCount(); i++) {
 		KNode *child = m_Node->getChildFast(i);
@@ -337,157 +366,237 @@ void STransformData::_updateTree() {
 
 
 
+#pragma region KTagBits
+static std::unordered_map<KName, int> g_TagBitIndex; // タグ --> ビット番号
+static std::vector<KName> g_TagBitNames; // ビット番号 --> タグ
+
+KTagBits::KTagBits() {
+	clear();
+}
+void KTagBits::clear() {
+	for (int i=0; i<WORDS; i++) {
+		m_Words[i] = 0;
+	}
+}
+bool KTagBits::empty() const {
+	for (int i=0; i<WORDS; i++) {
+		if (m_Words[i]) return false;
+	}
+	return true;
+}
+bool KTagBits::test(int bit) const {
+	if (bit < 0) return false;
+	K__ASSERT(bit < K_NODE_TAG_BITS);
+	return (m_Words[bit >> 6] >> (bit & 63)) & 1;
+}
+void KTagBits::set(int bit, bool value) {
+	if (bit < 0) return;
+	K__ASSERT(bit < K_NODE_TAG_BITS);
+	uint64_t mask = (uint64_t)1 << (bit & 63);
+	if (value) {
+		m_Words[bit >> 6] |= mask;
+	} else {
+		m_Words[bit >> 6] &= ~mask;
+	}
+}
+KTagBits KTagBits::operator | (const KTagBits &other) const {
+	KTagBits ret;
+	for (int i=0; i<WORDS; i++) {
+		ret.m_Words[i] = m_Words[i] | other.m_Words[i];
+	}
+	return ret;
+}
+bool KTagBits::operator == (const KTagBits &other) const {
+	for (int i=0; i<WORDS; i++) {
+		if (m_Words[i] != other.m_Words[i]) return false;
+	}
+	return true;
+}
+bool KTagBits::operator != (const KTagBits &other) const {
+	return !(*this == other);
+}
+int KTagBits::getBit(const KTag &tag) {
+	auto it = g_TagBitIndex.find(tag);
+	return (it != g_TagBitIndex.end()) ? it->second : -1;
+}
+int KTagBits::getOrAssignBit(const KTag &tag) {
+	K__ASSERT(!tag.empty());
+	auto it = g_TagBitIndex.find(tag);
+	if (it != g_TagBitIndex.end()) {
+		return it->second;
+	}
+	int bit = -1;
+	if ((int)g_TagBitNames.size() < K_NODE_TAG_BITS) {
+		bit = (int)g_TagBitNames.size();
+		g_TagBitNames.push_back(tag);
+	} else {
+		K__WARNING("Too many tags (K_NODE_TAG_BITS=%d). Tag '%s' will be inherited by name (slow)", K_NODE_TAG_BITS, tag.c_str());
+	}
+	g_TagBitIndex[tag] = bit; // 上限を超えた場合も -1 として登録し、警告は一度だけにする
+	return bit;
+}
+KTag KTagBits::getTag(int bit) {
+	if (0 <= bit && bit < (int)g_TagBitNames.size()) {
+		return g_TagBitNames[bit];
+	}
+	return KTag();
+}
+#pragma endregion // KTagBits
+
+
+
+
 #pragma region STagData
 STagData::STagData() {
+	m_ListsDirty = false;
 	m_Node = nullptr;
 }
 bool STagData::hasTag(const KTag &tag) const {
-	return KNameList_contains(m_SelfTags, tag);
+	int bit = KTagBits::getBit(tag);
+	if (bit >= 0) {
+		return m_SelfBits.test(bit);
+	}
+	return KNameList_contains(m_SelfTags, tag); // ビットが割り当てられていないタグ
 }
 bool STagData::hasTagInTree(const KTag &tag) const {
-	return KNameList_contains(getTagListInTree(), tag);
+	int bit = KTagBits::getBit(tag);
+	if (bit >= 0) {
+		return m_BitsInTree.test(bit);
+	}
+	return KNameList_contains(m_ExtraTagsInTree, tag); // ビットが割り当てられていないタグ
 }
 const KNameList & STagData::getTagList() const {
 	return m_SelfTags;
 }
 const KNameList & STagData::getTagListInherited() const {
+	_updateLists();
 	return m_ParentTags;
 }
 const KNameList & STagData::getTagListInTree() const {
+	_updateLists();
 	return m_TagsInTree;
 }
 void STagData::setTag(const KTag &tag) {
-	_setTagEx(tag, false);
-}
-void STagData::_setTagEx(const KTag &tag, bool is_inherited) {
 	K__ASSERT(!tag.empty());
-	if (is_inherited) {
-		// 継承タグリストに追加
-		if (KNameList_pushback_unique(m_ParentTags, tag)) {
-			//	if (get_tree()) {
-			//		KNodeTree_add_tag(get_tree(), this, tag);
-			//	}
-		}
+	if (KNameList_contains(m_SelfTags, tag)) {
+		return; // 既に持っている
+	}
+	m_SelfTags.push_back(tag);
+	m_SelfTagSlots.push_back(-1);
+	int bit = KTagBits::getOrAssignBit(tag);
+	if (bit >= 0) {
+		m_SelfBits.set(bit, true);
 	} else {
-		// 自身のタグリストに追加
-		if (KNameList_pushback_unique(m_SelfTags, tag)) {
-			if (m_Node->get_tree()) {
-				KNodeTree_add_tag(m_Node->get_tree(), m_Node, tag);
-			}
-		}
-	}
-
-	// ツリー内タグリストを更新
-	{
-		m_TagsInTree = m_SelfTags;
-		KNameList_merge_unique(m_TagsInTree, m_ParentTags);
+		m_SelfExtraTags.push_back(tag);
 	}
-
-	// 子に伝番
-	if (is_inherited && KNameList_contains(m_SelfTags, tag)) {
-		// 親から継承したタグを追加しているが、自分自身も同じタグを持っている。
-		// 子ツリーは自分のタグを継承していることになるので、
-		// これ以上子をたどって追加する必要はない
-	} else {
-		for (int i=0; i<m_Node->getChildCount(); i++) {
-			KNode *child = m_Node->getChildFast(i);
-			STagData &data = child->_getTagData();
-			data._setTagEx(tag, true);
-		}
+	m_ListsDirty = true;
+	if (m_Node->get_tree()) {
+		KNodeTree_add_tag(m_Node->get_tree(), m_Node, tag);
 	}
+	_updateBitsInTree();
 }
-
 void STagData::removeTag(const KTag &tag) {
-	_removeTagEx(tag, false);
-}
-void STagData::_removeTagEx(const KTag &tag, bool is_inherited) {
 	K__ASSERT(!tag.empty());
-	if (is_inherited) {
-		// 継承タグリストから削除
-		if (KNameList_erase(m_ParentTags, tag)) {
-		//	if (get_tree()) {
-		//		KNodeTree_del_tag(get_tree(), this, tag);
-		//	}
-		}
-	} else {
-		// 自身のタグリストから削除
-		if (KNameList_erase(m_SelfTags, tag)) {
-			if (m_Node->get_tree()) {
-				KNodeTree_del_tag(m_Node->get_tree(), m_Node, tag);
-			}
+	int index = -1;
+	for (int i=0; i<(int)m_SelfTags.size(); i++) {
+		if (m_SelfTags[i] == tag) {
+			index = i;
+			break;
 		}
 	}
-
-	// ツリー内タグリストを更新
-	{
-		m_TagsInTree = m_SelfTags;
-		KNameList_merge_unique(m_TagsInTree, m_ParentTags);
+	if (index < 0) {
+		return; // 持っていない
 	}
-
-	// 子に伝番
-	if (is_inherited && KNameList_contains(m_SelfTags, tag)) {
-		// 親から継承したタグを削除しているが、自分自身も同じタグを持っている。
-		// 子ツリーは自分のタグを継承していることになるので、
-		// これ以上子をたどって削除する必要はない
-	} else {
-		for (int i=0; i<m_Node->getChildCount(); i++) {
-			KNode *child = m_Node->getChildFast(i);
-			STagData &data = child->_getTagData();
-			data._removeTagEx(tag, true);
-		}
+	if (m_Node->get_tree()) {
+		KNodeTree_del_tag(m_Node->get_tree(), m_Node, tag);
 	}
-}
-void STagData::_updateNodeTreeTags(bool add) {
-	K__ASSERT(m_Node->get_tree());
-	if (add) {
-		// ノードツリー側に自分のタグを追加する
-		for (auto it=m_SelfTags.begin(); it!=m_SelfTags.end(); ++it) {
-			KNodeTree_add_tag(m_Node->get_tree(), m_Node, *it);
-		}
-
+	m_SelfTags.erase(m_SelfTags.begin() + index);
+	m_SelfTagSlots.erase(m_SelfTagSlots.begin() + index);
+	int bit = KTagBits::getBit(tag);
+	if (bit >= 0) {
+		m_SelfBits.set(bit, false);
 	} else {
-		// ノードツリー側から自分のタグを削除する
-		for (auto it=m_SelfTags.begin(); it!=m_SelfTags.end(); ++it) {
-			KNodeTree_del_tag(m_Node->get_tree(), m_Node, *it);
-		}
+		KNameList_erase(m_SelfExtraTags, tag);
+	}
+	m_ListsDirty = true;
+	_updateBitsInTree();
+}
+void STagData::_updateBitsInTree() {
+	// ツリー内タグを更新し、変化があれば子に伝番する。
+	// 子の m_ParentBits は常に親の m_BitsInTree と一致しているので、
+	// 自分の m_BitsInTree が変化しなければ子ツリーも変化しない
+	m_ListsDirty = true; // m_ParentBits が変わっている可能性がある
+	KTagBits bits = m_SelfBits | m_ParentBits;
+	bool extra_changed = _updateExtraTagsInTree();
+	if (bits == m_BitsInTree && !extra_changed) {
+		return;
 	}
-
-	// 子に伝番
+	m_BitsInTree = bits;
 	for (int i=0; i<m_Node->getChildCount(); i++) {
 		KNode *child = m_Node->getChildFast(i);
 		STagData &data = child->_getTagData();
-		data._updateNodeTreeTags(add);
-	}
-}
-
-void STagData::_beginParentChange() {
-	if (m_Node->get_tree()) {
-		// 自分の（および子の）タグをノードツリーから外す
-		_updateNodeTreeTags(false);
-
-		// 古い親から継承したタグを外す
-		if (m_Node->getParent()) {
-			const STagData &parent_data = m_Node->getParent()->_getTagData();
-			for (auto it=parent_data.m_TagsInTree.begin(); it!=parent_data.m_TagsInTree.end(); ++it) {
-				_removeTagEx(*it, true);
+		data.m_ParentBits = bits;
+		if (extra_changed) {
+			data.m_ParentExtraTags = m_ExtraTagsInTree;
+		}
+		data._updateBitsInTree();
+	}
+}
+bool STagData::_updateExtraTagsInTree() {
+	// ビットが割り当てられなかったタグ（K_NODE_TAG_BITS を超えた分）を名前のリストで合成する。
+	// 変化があれば true を返す
+	if (m_SelfExtraTags.empty() && m_ParentExtraTags.empty() && m_ExtraTagsInTree.empty()) {
+		return false; // ほとんどの場合はここで終わる
+	}
+	KNameList tags = m_SelfExtraTags;
+	KNameList_merge_unique(tags, m_ParentExtraTags);
+	if (tags == m_ExtraTagsInTree) {
+		return false;
+	}
+	m_ExtraTagsInTree.swap(tags);
+	return true;
+}
+void STagData::_updateLists() const {
+	if (!m_ListsDirty) return;
+	m_ParentTags.clear();
+	m_TagsInTree = m_SelfTags;
+	for (int bit=0; bit<K_NODE_TAG_BITS; bit++) {
+		if (m_ParentBits.m_Words[bit >> 6] == 0) {
+			bit |= 63; // このワードにはビットが無い
+			continue;
+		}
+		if (m_ParentBits.test(bit)) {
+			KTag tag = KTagBits::getTag(bit);
+			m_ParentTags.push_back(tag);
+			if (!m_SelfBits.test(bit)) {
+				m_TagsInTree.push_back(tag);
 			}
 		}
 	}
+	for (auto it=m_ParentExtraTags.begin(); it!=m_ParentExtraTags.end(); ++it) {
+		m_ParentTags.push_back(*it);
+		if (!KNameList_contains(m_SelfExtraTags, *it)) {
+			m_TagsInTree.push_back(*it);
+		}
+	}
+	m_ListsDirty = false;
+}
+void STagData::_beginParentChange() {
+	// ノードツリーのタグ別リストは、ツリーから出入りするときに
+	// CNodeTreeImpl::_on_node_exit, _on_node_enter で更新される
 }
 
 void STagData::_endParentChange() {
-	if (m_Node->get_tree()) {
-		// 自分の（および子の）タグをノードツリーに追加する
-		_updateNodeTreeTags(true);
-
-		// 新しい親から継承したタグを追加する
-		if (m_Node->getParent()) {
-			const STagData &parent_data = m_Node->getParent()->_getTagData();
-			for (auto it=parent_data.m_TagsInTree.begin(); it!=parent_data.m_TagsInTree.end(); ++it) {
-				_setTagEx(*it, true);
-			}
-		}
+	// 新しい親から継承したタグで、子ツリーのタグを更新する
+	if (m_Node->getParent()) {
+		const STagData &parent_data = m_Node->getParent()->_getTagData();
+		m_ParentBits = parent_data.m_BitsInTree;
+		m_ParentExtraTags = parent_data.m_ExtraTagsInTree;
+	} else {
+		m_ParentBits.clear();
+		m_ParentExtraTags.clear();
 	}
+	_updateBitsInTree();
 }
 #pragma endregion // STagData
 
@@ -495,10 +604,16 @@ void STagData::_endParentChange() {
 
 
 #pragma region SFlagData
+static uint32_t g_WatchedBitsInTreeRevision = 0;
+
+uint32_t SFlagData::getWatchedBitsInTreeRevision() {
+	return g_WatchedBitsInTreeRevision;
+}
 SFlagData::SFlagData() {
 	m_Bits = 0;
 	m_BitsInTreeAll = 0;
 	m_BitsInTreeAny = 0;
+	m_WatchBitsInTree = false;
 	m_Node = nullptr;
 }
 bool SFlagData::hasFlag(uint32_t flag) const {
@@ -527,6 +642,9 @@ void SFlagData::setFlag(uint32_t flag, bool value) {
 		} else {
 			m_Bits &= ~flag;
 		}
+		if (flag & (KNode::FLAG_NO_ENABLE | KNode::FLAG_NO_RENDER)) {
+			m_Node->_getRenderData()._markRenderListChanged(true); // 描画対象が変わる
+		}
 		_updateTree();
 	}
 }
@@ -540,6 +658,7 @@ void SFlagData::_updateTree() {
 	}
 }
 void SFlagData::_updateTree(const SFlagData *parent) {
+	uint32_t old_any = m_BitsInTreeAny;
 	if (parent) {
 		m_BitsInTreeAll = m_Bits & parent->m_BitsInTreeAll;
 		m_BitsInTreeAny = m_Bits | parent->m_BitsInTreeAny;
@@ -547,6 +666,9 @@ void SFlagData::_updateTree(const SFlagData *parent) {
 		m_BitsInTreeAll = m_Bits;
 		m_BitsInTreeAny = m_Bits;
 	}
+	if (m_WatchBitsInTree && m_BitsInTreeAny != old_any) {
+		g_WatchedBitsInTreeRevision++;
+	}
 
 	// 子に伝搬
 	for (int i=0; i<m_Node->getChildCount(); i++) {
@@ -576,6 +698,7 @@ SRenderData::SRenderData() {
 	m_LayerInTree = 0;
 	m_Priority = 0;
 	m_PriorityInTree = 0;
+	m_RenderListRevisionInTree = ++g_RenderListRevision; // 同じアドレスに作られた以前のノードの描画リストと区別する
 	m_Node = nullptr;
 }
 const KColor & SRenderData::getColor() const {
@@ -665,13 +788,19 @@ void SRenderData::_updateTree(const SRenderData *parent) {
 	}
 }
 void SRenderData::setRenderAtomic(bool value) {
-	m_RenderAtomic = value;
+	if (m_RenderAtomic != value) {
+		m_RenderAtomic = value;
+		_markRenderListChanged(true);
+	}
 }
 bool SRenderData::getRenderAtomic() const {
 	return m_RenderAtomic;
 }
 void SRenderData::setRenderAfterChildren(bool value) {
-	m_RenderAfterChildren = value;
+	if (m_RenderAfterChildren != value) {
+		m_RenderAfterChildren = value;
+		_markRenderListChanged(true);
+	}
 }
 bool SRenderData::getRenderAfterChildren() const {
 	return m_RenderAfterChildren;
@@ -699,8 +828,12 @@ void SRenderData::setLocalRenderOrder(KLocalRenderOrder lro) {
 	m_LocalRenderOrder = lro;
 }
 void SRenderData::setLayer(int value) {
-	m_Layer = value;
-	_updateTree();
+	if (m_Layer != value) {
+		_markRenderListChanged(true); // 変更前のレイヤー
+		m_Layer = value;
+		_updateTree();
+		_markRenderListChanged(true); // 変更後のレイヤー
+	}
 }
 int SRenderData::getLayer() const {
 	return m_Layer;
@@ -709,6 +842,9 @@ int SRenderData::getLayerInTree() const {
 	return m_LayerInTree;
 }
 void SRenderData::setPriority(int value) {
+	if (m_Priority != value) {
+		g_RenderOrderRevision++;
+	}
 	m_Priority = value;
 	_updateTree();
 }
@@ -718,6 +854,46 @@ int SRenderData::getPriority() const {
 int SRenderData::getPriorityInTree() const {
 	return m_PriorityInTree;
 }
+static void _MarkRenderListLayersInTree(const KNode *node, uint32_t rev) {
+	g_RenderListLayerRevision[node->getLayerInTree() & (RENDER_LIST_LAYER_SLOTS-1)] = rev;
+	for (int i=0; i<node->getChildCount(); i++) {
+		_MarkRenderListLayersInTree(node->getChildFast(i), rev);
+	}
+}
+void SRenderData::_markRenderListChanged(bool subtree) {
+	uint32_t rev = ++g_RenderListRevision;
+
+	// 自分と先祖
+	KNode *top = m_Node;
+	for (KNode *node=m_Node; node; node=node->getParent()) {
+		node->_getRenderData().m_RenderListRevisionInTree = rev;
+		top = node;
+	}
+	// ツリー外での変更は、ツリー内の描画リストには関係ない
+	if (top->get_tree() == nullptr) {
+		return;
+	}
+	if (subtree) {
+		_MarkRenderListLayersInTree(m_Node, rev); // 自分以下に含まれるレイヤーすべて
+	} else {
+		g_RenderListLayerRevision[m_LayerInTree & (RENDER_LIST_LAYER_SLOTS-1)] = rev;
+	}
+}
+uint32_t SRenderData::getRenderListRevisionInTree() const {
+	return m_RenderListRevisionInTree;
+}
+uint32_t SRenderData::getRenderListRevision() {
+	return g_RenderListRevision;
+}
+uint32_t SRenderData::getRenderListRevision(int layer) {
+	if (layer < 0) {
+		return g_RenderListRevision;
+	}
+	return g_RenderListLayerRevision[layer & (RENDER_LIST_LAYER_SLOTS-1)];
+}
+uint32_t SRenderData::getRenderOrderRevision() {
+	return g_RenderOrderRevision;
+}
 #pragma endregion // SRenderData
 
 
@@ -727,6 +903,56 @@ int SRenderData::getPriorityInTree() const {
 
 
 
+#pragma region CChildNameIndex
+// 子ノードの名前インデックス。
+// 子の数が多いノードに対して findChild を呼んだときに作成され、以降は子の追加削除に合わせて更新する。
+// 子の並び替えや子の名前変更があった場合は、次の検索時に作り直す
+class CChildNameIndex {
+public:
+	static const int MIN_CHILDREN = 16; // 子の数がこれ未満なら、インデックスを作らずに線形探索する
+
+	std::unordered_map<std::string, std::vector<KNode*>> m_Map; // 名前ごとの子ノード（子リストでの順番と同じ並び）
+	bool m_Dirty;
+
+	CChildNameIndex() {
+		m_Dirty = true;
+	}
+	void rebuild(const std::vector<KNode*> &children) {
+		m_Map.clear();
+		m_Dirty = false;
+		for (auto it=children.begin(); it!=children.end(); ++it) {
+			add(*it);
+		}
+	}
+	void add(KNode *child) {
+		// 子リストの末尾に追加されたものとする
+		if (!m_Dirty && !child->getName().empty()) {
+			m_Map[child->getName()].push_back(child);
+		}
+	}
+	void remove(KNode *child) {
+		if (m_Dirty || child->getName().empty()) return;
+		auto it = m_Map.find(child->getName());
+		if (it == m_Map.end()) return;
+		std::vector<KNode*> &list = it->second;
+		auto pos = std::find(list.begin(), list.end(), child);
+		if (pos != list.end()) {
+			list.erase(pos); // 順番を保つ
+		}
+		if (list.empty()) {
+			m_Map.erase(it);
+		}
+	}
+	const std::vector<KNode*> * get(const std::string &name) const {
+		auto it = m_Map.find(name);
+		return (it != m_Map.end()) ? &it->second : nullptr;
+	}
+};
+#pragma endregion // CChildNameIndex
+
+
+
+
 #pragma region KNode
 static int g_KNode_unique_id = 0;
 
@@ -763,6 +989,8 @@ KNode::~KNode() {
 		_DeleteAction();
 	}
 	_invalidate_child_tree();
+	delete m_NodeData.childNames;
+	m_NodeData.childNames = nullptr;
 }
 void KNode::lock() const {
 #if K_THREAD_SAFE
@@ -911,6 +1139,9 @@ void KNode::setParent(KNode *new_parent) {
 	m_FlagData._updateTree();
 	m_RenderData._updateTree();
 	m_TagData._endParentChange();
+	if (new_parent) {
+		m_RenderData._markRenderListChanged(true);
+	}
 
 	K__ASSERT(m_NodeData.parent == new_parent);
 }
@@ -960,6 +1191,18 @@ void KNode::setChildIndex(KNode *child, int new_index) {
 		}
 	}
 	unlock();
+
+	// 名前インデックスは子リストと同じ順番で並んでいるので、作り直す必要がある
+	if (m_NodeData.childNames) {
+		m_NodeData.childNames->m_Dirty = true;
+	}
+	m_NodeData.childIndexDirty = true;
+	m_RenderData._markRenderListChanged(true);
+
+	// 兄弟の順番が変わった
+	if (m_NodeData.tree) {
+		KNodeTree_on_node_reorder(m_NodeData.tree, this);
+	}
 }
 int KNode::getChildIndex(const KNode *child) const {
 	int ret = -1;
@@ -1001,8 +1244,13 @@ void KNode::_add_child_nocheck(KNode *child) {
 	// node を子リストに追加する
 	m_NodeData.children.push_back(child);
 	child->grab();
+	child->m_NodeData.indexInParent = (int)m_NodeData.children.size() - 1;
+	if (m_NodeData.childNames) {
+		m_NodeData.childNames->add(child);
+	}
 
-	// node の親を自分にする
+	// node の親を自分にする。
+	// child のレイヤーはまだ更新されていないので、描画リストの変更は setParent で記録する
 	child->m_NodeData.parent = this;
 
 	// 自分がすでにツリーに入っているなら、新しい子も同じツリーに入れる
@@ -1026,12 +1274,22 @@ void KNode::_remove_child_nocheck(KNode *child) {
 		return; // child は自分の子ではない
 	}
 
+	// 親子関係を切る前に、先祖の描画リストの変更を記録する
+	child->m_RenderData._markRenderListChanged(true);
+
 	// child がノードツリーから出る
 	child->_set_tree(nullptr);
 
 	// 親子関係を解消する
 	child->m_NodeData.parent = nullptr;
 	m_NodeData.children.erase(m_NodeData.children.begin() + index);
+	if (m_NodeData.childNames) {
+		m_NodeData.childNames->remove(child);
+	}
+	if (index < (int)m_NodeData.children.size()) {
+		m_NodeData.childIndexDirty = true; // 後ろの子の位置がずれた
+	}
+	child->m_NodeData.indexInParent = -1;
 
 	// 参照カウンタを減らす
 	child->drop();
@@ -1101,6 +1359,11 @@ void KNode::_invalidate_child_tree() {
 	// もしほかの場所で参照カウンタを保持していても、
 	// 無効化フラグの有無を見れば破棄すべきかどうかが分かる
 
+	// 子ツリーを外す前に、描画リストの変更を記録しておく
+	if (!m_NodeData.children.empty()) {
+		m_RenderData._markRenderListChanged(true);
+	}
+
 	// 子ツリーを再帰的に無効化
 	for (auto it=m_NodeData.children.begin(); it!=m_NodeData.children.end(); ++it) {
 		KNode *node = *it;
@@ -1110,6 +1373,9 @@ void KNode::_invalidate_child_tree() {
 		node->drop();
 	}
 	m_NodeData.children.clear();
+	if (m_NodeData.childNames) {
+		m_NodeData.childNames->m_Dirty = true;
+	}
 }
 #pragma endregion // Removing
 
@@ -1128,6 +1394,32 @@ void KNode::_invalidate_child_tree() {
 KNode * KNode::findChild(const std::string &name, const KTag &tag) const {
 	KNode *ret = nullptr;
 	lock();
+	if (!name.empty() && (int)m_NodeData.children.size() >= CChildNameIndex::MIN_CHILDREN) {
+		// 子の数が多い場合は名前インデックスを使う
+		if (m_NodeData.childNames == nullptr) {
+			m_NodeData.childNames = new CChildNameIndex();
+		}
+		if (m_NodeData.childNames->m_Dirty) {
+			m_NodeData.childNames->rebuild(m_NodeData.children);
+		}
+		const std::vector<KNode*> *list = m_NodeData.childNames->get(name);
+		if (list) {
+			for (auto it=list->begin(); it!=list->end(); ++it) {
+				KNode *sub = *it;
+				#if IGNORE_REMOVING_NODES
+				if (sub->hasFlag(KNode::FLAG__MARK_REMOVE)) {
+					continue; // 削除マークがついている場合は、もう削除済みとして扱う
+				}
+				#endif
+				if (tag.empty() || sub->hasTag(tag)) {
+					ret = sub;
+					break;
+				}
+			}
+		}
+		unlock();
+		return ret;
+	}
 	for (auto it=m_NodeData.children.begin(); it!=m_NodeData.children.end(); ++it) {
 		KNode *sub = *it;
 		#if IGNORE_REMOVING_NODES
@@ -1161,6 +1453,10 @@ KNode * KNode::findChildInTree(const std::string &name, const KTag &tag) const {
 	return ret;
 }
 KNode * KNode::findChildInTree_unsafe(const std::string &name, const KTag &tag) const {
+	if (m_NodeData.tree && !name.empty() && tag.empty()) {
+		// ツリーに入っているなら、ツリーの名前インデックスで探す
+		return KNodeTree_find_name(m_NodeData.tree, this, name);
+	}
 	for (auto it=m_NodeData.children.begin(); it!=m_NodeData.children.end(); ++it) {
 		KNode *sub = *it;
 		#if IGNORE_REMOVING_NODES
@@ -1205,14 +1501,23 @@ const std::string & KNode::getName() const {
 	return m_NodeData.name;
 }
 void KNode::setName(const std::string &name) {
+	std::string newname;
 	if (name.empty()) {
 		// 空文字列が指定された場合は自動的に名前をつける
 		char s[256] = {0};
 		sprintf_s(s, sizeof(s), "__%p", m_NodeData.uuid);
-		m_NodeData.name = s;
+		newname = s;
+	} else {
+		newname = name;
+	}
+	if (m_NodeData.tree) {
+		// 名前インデックスも更新するので、ツリーをロックした状態で名前を変える
+		KNodeTree_set_name(m_NodeData.tree, this, newname);
 	} else {
-		// 名前を適用
-		m_NodeData.name = name;
+		m_NodeData.name = newname;
+	}
+	if (m_NodeData.parent && m_NodeData.parent->m_NodeData.childNames) {
+		m_NodeData.parent->m_NodeData.childNames->m_Dirty = true;
 	}
 	_updateNames();
 }
@@ -1462,9 +1767,6 @@ void KNode::setTag(const KTag &tag) {
 void KNode::removeTag(const KTag &tag) {
 	m_TagData.removeTag(tag);
 }
-void KNode::_updateNodeTreeTags(bool add) {
-	m_TagData._updateNodeTreeTags(add);
-}
 void KNode::copyTags(KNode *src) {
 	const KNameList &tags = src->getTagList();
 	for (auto it=tags.begin(); it!=tags.end(); ++it) {
@@ -1683,6 +1985,31 @@ void KNode::processSignal(KSig &sig) {
 		m_ActionCurr->onSignal(sig);
 	}
 }
+/// シグナル signame を購読する。
+/// 購読したノードには KNodeTree::sendSignalToSubscribers でシグナルが届くようになる。
+/// ただし KNodeTree::broadcastSignal と同じく、ルートノードには購読しても届かない。
+/// 購読情報はノード自身が保持するため、ツリーに入る前に購読してもよいし、親を付け替えても解除されない
+void KNode::subscribeSignal(const KName &signame) {
+	if (signame.empty()) return;
+	if (KNameList_pushback_unique(m_NodeData.signals, signame)) {
+		if (m_NodeData.tree) {
+			KNodeTree_add_signal_subscriber(m_NodeData.tree, this, signame);
+		}
+	}
+}
+void KNode::unsubscribeSignal(const KName &signame) {
+	if (KNameList_erase(m_NodeData.signals, signame)) {
+		if (m_NodeData.tree) {
+			KNodeTree_del_signal_subscriber(m_NodeData.tree, this, signame);
+		}
+	}
+}
+bool KNode::isSubscribedSignal(const KName &signame) const {
+	return KNameList_contains(m_NodeData.signals, signame);
+}
+const KNameList & KNode::getSubscribedSignals() const {
+	return m_NodeData.signals;
+}
 #pragma endregion // Signal
 
 
@@ -1855,7 +2182,7 @@ class CNodeTreeImpl {
 	KNode *m_root; // ルートノード
 	bool m_node_will_be_removed; // 削除すべきノードが少なくともひとつ存在する？
 	mutable std::recursive_mutex m_mutex;
-	std::unordered_map<KName, std::unordered_set<KNode*>> m_tag_nodes;
+	std::unordered_map<KName, std::vector<KNode*>> m_tag_nodes; // タグ別のノードリスト。各ノードの位置は STagData::m_SelfTagSlots に記録する
 	std::vector<KNode*> m_tmp_node_starts;  // on_node_start を呼ぶべきノード
 	std::vector<KNode*> m_tmp_node_steps;   // on_node_step を呼ぶべきノード
 	std::vector<KNode*> m_tmp_node_actions; // アクションを更新するべきノード
@@ -1872,6 +2199,33 @@ class CNodeTreeImpl {
 	};
 	std::vector<SigItem> m_signal_queue;
 
+	// シグナル名ごとの購読ノード
+	struct SigSubscribers {
+		std::vector<KNode *> nodes;
+		int sorted_rev; // nodes がツリー順に並んでいるときの m_structure_rev の値。並べ替えが必要なら -1
+
+		SigSubscribers() {
+			sorted_rev = -1;
+		}
+	};
+	std::unordered_map<KName, SigSubscribers> m_sig_subscribers;
+	std::vector<std::vector<KNode *>> m_sig_dispatch_bufs; // 配信作業用のノードリスト（配信中に再び配信される場合に備えて深さごとに用意する）
+	int m_sig_dispatch_depth;
+	int m_structure_rev; // ツリー構造が変化するたびに増える
+
+	// 名前からノードへのインデックス。
+	// 同名ノードは KNode::NodeData の namePrev, nameNext による双方向リストでつながっている
+	struct SNameList {
+		KNode *head;
+		int count; // 同名ノードの数
+	};
+	std::unordered_map<std::string, SNameList> m_name_lists;
+
+	// 同名ノードがこれより多ければインデックスを使わずに子孫を直接たどる。
+	// インデックスによる検索は（同名ノード数）×（深さ）のコストがかかるので、
+	// "body" のようなよくある名前を探す場合は、最初に見つかった時点で終わる再帰の方が速い（ルートから探す場合も同じ）
+	static const int NAME_INDEX_MAX_DUPLICATES = 16;
+
 	void lock() const {
 	#if K_THREAD_SAFE
 		m_mutex.lock();
@@ -1887,6 +2241,8 @@ public:
 	CNodeTreeImpl() {
 		m_cb = nullptr;
 		m_node_will_be_removed = false;
+		m_sig_dispatch_depth = 0;
+		m_structure_rev = 0;
 		m_root = new KNode();
 		m_root->_set_tree(this);
 	}
@@ -1912,6 +2268,97 @@ public:
 			m_root->broadcastSignalToChildren(sig);
 		}
 	}
+	void sendSignalToSubscribers(KSig &sig, bool tree_order) {
+		// 配信中に購読リストが変化しても影響を受けないよう、作業用リストにコピーしてから配信する。
+		// 配信先がさらにシグナルを送る場合に備えて、作業用リストは入れ子の深さごとに使い分ける
+		// ※入れ子の配信で m_sig_dispatch_bufs が resize される可能性があるため、参照を保持せずに毎回添え字でアクセスする
+		const int depth = m_sig_dispatch_depth;
+		if ((int)m_sig_dispatch_bufs.size() <= depth) {
+			m_sig_dispatch_bufs.resize(depth + 1);
+		}
+		get_signal_subscribers(m_sig_dispatch_bufs[depth], sig.mName, tree_order);
+		m_sig_dispatch_depth++;
+		for (size_t i=0; i<m_sig_dispatch_bufs[depth].size(); i++) {
+			m_sig_dispatch_bufs[depth][i]->processSignal(sig);
+		}
+		m_sig_dispatch_depth--;
+		m_sig_dispatch_bufs[depth].clear();
+	}
+	int getSignalSubscribers(KNodeArray *out_nodes, const KName &signame, bool tree_order) {
+		std::vector<KNode *> tmp;
+		std::vector<KNode *> &nodes = out_nodes ? *out_nodes : tmp;
+		get_signal_subscribers(nodes, signame, tree_order);
+		return (int)nodes.size();
+	}
+	void get_signal_subscribers(std::vector<KNode *> &out_nodes, const KName &signame, bool tree_order) {
+		out_nodes.clear();
+		lock();
+		{
+			auto it = m_sig_subscribers.find(signame);
+			if (it != m_sig_subscribers.end()) {
+				SigSubscribers &subs = it->second;
+				if (tree_order && subs.sorted_rev != m_structure_rev) {
+					sort_by_tree_order(subs.nodes);
+					subs.sorted_rev = m_structure_rev;
+				}
+				out_nodes.assign(subs.nodes.begin(), subs.nodes.end());
+			}
+		}
+		unlock();
+	}
+
+	// ノードを broadcastSignal と同じ順番（深さ優先、親が先）に並べる
+	static void sort_by_tree_order(std::vector<KNode *> &nodes) {
+		if (nodes.size() < 2) return;
+
+		// ルートからの子インデックス列を辞書順で比較すれば深さ優先の巡回順になる
+		typedef std::pair<std::vector<int>, KNode *> PATH_NODE;
+		std::vector<PATH_NODE> tmp(nodes.size());
+		for (size_t i=0; i<nodes.size(); i++) {
+			std::vector<int> &path = tmp[i].first;
+			for (const KNode *nd=nodes[i]; nd->getParent(); nd=nd->getParent()) {
+				path.push_back(nd->getParent()->getChildIndex(nd));
+			}
+			std::reverse(path.begin(), path.end());
+			tmp[i].second = nodes[i];
+		}
+		std::sort(tmp.begin(), tmp.end(), [](const PATH_NODE &a, const PATH_NODE &b) {
+			return a.first < b.first;
+		});
+		for (size_t i=0; i<nodes.size(); i++) {
+			nodes[i] = tmp[i].second;
+		}
+	}
+	void _add_signal_subscriber(KNode *node, const KName &signame) {
+		if (node == m_root) return; // broadcastSignal と同じく、ルートノードには配信しない
+		lock();
+		{
+			SigSubscribers &subs = m_sig_subscribers[signame];
+			subs.nodes.push_back(node);
+			subs.sorted_rev = -1;
+		}
+		unlock();
+	}
+	void _del_signal_subscriber(KNode *node, const KName &signame) {
+		lock();
+		{
+			auto it = m_sig_subscribers.find(signame);
+			if (it != m_sig_subscribers.end()) {
+				// 順番はあとでツリー順に並べ直すので、末尾と入れ替えて削除する
+				SigSubscribers &subs = it->second;
+				auto nit = std::find(subs.nodes.begin(), subs.nodes.end(), node);
+				if (nit != subs.nodes.end()) {
+					*nit = subs.nodes.back();
+					subs.nodes.pop_back();
+					subs.sorted_rev = -1;
+				}
+			}
+		}
+		unlock();
+	}
+	void _on_node_reorder(KNode *node) {
+		m_structure_rev++;
+	}
 	void sendSignal(KNode *target, KSig &sig) {
 		if (target) target->processSignal(sig);
 	}
@@ -1949,27 +2396,73 @@ public:
 		}
 	}
 
+	static int _find_self_tag(const STagData &data, const KName &tag) {
+		for (int i=0; i<(int)data.m_SelfTags.size(); i++) {
+			if (data.m_SelfTags[i] == tag) return i;
+		}
+		return -1;
+	}
 	void _add_tag(KNode *node, const KName &tag) {
-		m_tag_nodes[tag].insert(node);
+		STagData &data = node->_getTagData();
+		int index = _find_self_tag(data, tag);
+		if (index < 0 || data.m_SelfTagSlots[index] >= 0) {
+			return; // タグを持っていないか、既に登録済み
+		}
+		std::vector<KNode*> &nodes = m_tag_nodes[tag];
+		data.m_SelfTagSlots[index] = (int)nodes.size();
+		nodes.push_back(node); // grab 省略
 	}
 	void _del_tag(KNode *node, const KName &tag) {
-		m_tag_nodes[tag].erase(node);
+		STagData &data = node->_getTagData();
+		int index = _find_self_tag(data, tag);
+		if (index < 0 || data.m_SelfTagSlots[index] < 0) {
+			return; // タグを持っていないか、登録されていない
+		}
+		std::vector<KNode*> &nodes = m_tag_nodes[tag];
+		int slot = data.m_SelfTagSlots[index];
+		K__ASSERT(nodes[slot] == node);
+
+		// 末尾のノードを空いた位置に移動する
+		KNode *last = nodes.back();
+		if (last != node) {
+			STagData &last_data = last->_getTagData();
+			last_data.m_SelfTagSlots[_find_self_tag(last_data, tag)] = slot;
+			nodes[slot] = last;
+		}
+		nodes.pop_back();
+		data.m_SelfTagSlots[index] = -1;
 	}
 	void _on_node_enter(KNode *node) {
 		// node が tree に入った
-		
+
+		// 深さを決める。子は親の後に入るので、親の深さは決まっている
+		{
+			const KNode *parent = node->getParent();
+			node->m_NodeData.depthInTree = parent ? parent->m_NodeData.depthInTree + 1 : 0;
+		}
 		// タググループを更新する
 		{
 			const KNameList &tags = node->getTagList();
 			for (auto it=tags.begin(); it!=tags.end(); ++it) {
-				const KName &T = *it;
-				m_tag_nodes[T].insert(node); // grab 省略
+				_add_tag(node, *it);
 			}
 		}
 		// EID ==> KNode 変換テーブルに登録する
 		{
 			m_id2node_map.insert(node);
 		}
+		// シグナルの購読リストに登録する
+		{
+			const KNameList &signames = node->getSubscribedSignals();
+			for (auto it=signames.begin(); it!=signames.end(); ++it) {
+				_add_signal_subscriber(node, *it);
+			}
+		}
+		// 名前インデックスに登録する
+		{
+			_add_name(node);
+		}
+		m_structure_rev++;
 	}
 	void _on_node_exit(KNode *node) {
 		// node が tree から出た
@@ -1978,14 +2471,183 @@ public:
 		{
 			const KNameList &tags = node->getTagList();
 			for (auto it=tags.begin(); it!=tags.end(); ++it) {
-				const KName &T = *it;
-				m_tag_nodes[T].erase(node);
+				_del_tag(node, *it);
 			}
 		}
 		// EID ==> KNode 変換テーブルから削除する
 		{
 			m_id2node_map.remove(node);
 		}
+		// シグナルの購読リストから削除する
+		{
+			const KNameList &signames = node->getSubscribedSignals();
+			for (auto it=signames.begin(); it!=signames.end(); ++it) {
+				_del_signal_subscriber(node, *it);
+			}
+		}
+		// 名前インデックスから削除する
+		{
+			_del_name(node);
+		}
+		m_structure_rev++;
+	}
+	void _add_name(KNode *node) {
+		const std::string &name = node->getName();
+		if (name.empty()) return; // 名前が無い
+		K__ASSERT(node->m_NodeData.namePrev == nullptr);
+		K__ASSERT(node->m_NodeData.nameNext == nullptr);
+		lock();
+		{
+			auto it = m_name_lists.find(name);
+			if (it == m_name_lists.end()) {
+				SNameList list;
+				list.head = node;
+				list.count = 1;
+				m_name_lists[name] = list;
+			} else {
+				SNameList &list = it->second;
+				list.head->m_NodeData.namePrev = node;
+				node->m_NodeData.nameNext = list.head;
+				list.head = node;
+				list.count++;
+			}
+		}
+		unlock();
+	}
+	void _del_name(KNode *node) {
+		const std::string &name = node->getName();
+		if (name.empty()) return; // 名前が無い
+		lock();
+		{
+			auto it = m_name_lists.find(name);
+			if (it != m_name_lists.end()) {
+				KNode *prev = node->m_NodeData.namePrev;
+				KNode *next = node->m_NodeData.nameNext;
+				if (prev || it->second.head == node) { // 登録されている
+					if (prev) {
+						prev->m_NodeData.nameNext = next;
+					} else {
+						it->second.head = next; // node はリストの先頭
+					}
+					if (next) {
+						next->m_NodeData.namePrev = prev;
+					}
+					if (--it->second.count == 0) {
+						m_name_lists.erase(it);
+					}
+					node->m_NodeData.namePrev = nullptr;
+					node->m_NodeData.nameNext = nullptr;
+				}
+			}
+		}
+		unlock();
+	}
+	// 名前インデックスと一緒に node の名前を変える
+	void _set_name(KNode *node, const std::string &name) {
+		lock();
+		{
+			_del_name(node);
+			node->m_NodeData.name = name;
+			_add_name(node);
+		}
+		unlock();
+	}
+	const SNameList * _get_name_list(const std::string &name) const {
+		auto it = m_name_lists.find(name);
+		return (it != m_name_lists.end()) ? &it->second : nullptr;
+	}
+	// start から name という名前のノードを探すときに、名前インデックスを使うべきなら true
+	bool _use_name_index(const KNode *start, const SNameList *list) const {
+		return list->count <= NAME_INDEX_MAX_DUPLICATES;
+	}
+	// ツリーの深さ優先巡回順で a が b よりも先に来るなら true。a, b はツリーに入っていること
+	static bool is_before_in_tree(const KNode *a, const KNode *b) {
+		if (a == b) return false;
+		int da = a->m_NodeData.depthInTree;
+		int db = b->m_NodeData.depthInTree;
+		while (da > db) { a = a->getParent(); da--; }
+		while (db > da) { b = b->getParent(); db--; }
+		if (a == b) {
+			// 一方がもう一方の先祖になっている。深い方が後
+			return da < db;
+		}
+		while (a->getParent() != b->getParent()) {
+			a = a->getParent();
+			b = b->getParent();
+		}
+		const KNode *parent = a->getParent();
+		if (parent == nullptr) return a < b; // 別々のツリー。順序に意味はない
+		if (parent->m_NodeData.childIndexDirty) {
+			// 子の位置を振りなおす
+			const std::vector<KNode *> &children = parent->m_NodeData.children;
+			for (int i=0; i<(int)children.size(); i++) {
+				children[i]->m_NodeData.indexInParent = i;
+			}
+			parent->m_NodeData.childIndexDirty = false;
+		}
+		return a->m_NodeData.indexInParent < b->m_NodeData.indexInParent;
+	}
+	KNode * find_name_indexed(const KNode *start, const std::string &name) const {
+		KNode *ret = nullptr;
+		lock();
+		{
+			ret = find_name_indexed_unsafe(start, name);
+		}
+		unlock();
+		return ret;
+	}
+	// 名前インデックスを使って start の子孫から name という名前のノードを探す。
+	// KNode::findChildInTree と同じく、削除マークのついたノードの子ツリーは除外し、
+	// 深さ優先巡回順で最初に見つかったものを返す。
+	// 同名ノードが多い場合は、インデックスを使わずに子孫を直接たどる
+	KNode * find_name_indexed_unsafe(const KNode *start, const std::string &name) const {
+		K__ASSERT(start);
+		const SNameList *list = _get_name_list(name);
+		if (list == nullptr) return nullptr; // ツリー内にこの名前のノードは無い
+		if (!_use_name_index(start, list)) {
+			return find_name_recursive_unsafe(start, name);
+		}
+		int start_depth = start->m_NodeData.depthInTree;
+		KNode *ret = nullptr;
+		for (KNode *node=list->head; node; node=node->m_NodeData.nameNext) {
+			// start の子孫なら、深さの差だけ親をたどると start になる
+			int n = node->m_NodeData.depthInTree - start_depth;
+			if (n <= 0) continue; // start 自身か、start より浅い
+			const KNode *p = node;
+			bool ok = true;
+			for (; n > 0; n--) {
+				#if IGNORE_REMOVING_NODES
+				if (p->hasFlag(KNode::FLAG__MARK_REMOVE)) {
+					ok = false; // 削除マークがついている場合は、もう削除済みとして扱う
+					break;
+				}
+				#endif
+				p = p->getParent();
+			}
+			if (!ok || p != start) continue; // start の子孫ではない
+			if (ret == nullptr || is_before_in_tree(node, ret)) {
+				ret = node;
+			}
+		}
+		return ret;
+	}
+	static KNode * find_name_recursive_unsafe(const KNode *start, const std::string &name) {
+		for (int i=0; i<start->getChildCount(); i++) {
+			KNode *sub = start->getChildFast(i);
+			#if IGNORE_REMOVING_NODES
+			if (sub->hasFlag(KNode::FLAG__MARK_REMOVE)) {
+				continue; // 削除マークがついている場合は、もう削除済みとして扱う
+			}
+			#endif
+			if (sub->hasName(name)) {
+				return sub;
+			}
+			KNode *subsub = find_name_recursive_unsafe(sub, name);
+			if (subsub) {
+				return subsub;
+			}
+		}
+		return nullptr;
 	}
 	void _on_node_marked_as_remove(KNode *node) {
 		m_node_will_be_removed = true; // 削除すべきノードが少なくともひとつ存在する
@@ -2097,10 +2759,65 @@ public:
 
 		KNode *ret = nullptr;
 		lock();
-		ret = find_namepath_in_tree_unsafe(start, path);
+		ret = find_namepath_indexed_unsafe(start, path);
 		unlock();
 		return ret;
 	}
+	// 名前インデックスを使って find_namepath_in_tree_unsafe と同じ結果を得る。
+	// パス末尾の名前を持つノードを候補とし、そこからパスを逆にたどって起点となるノードを求める。
+	// 起点が start 以下にある候補のうち、起点が深さ優先巡回順で最も先に来るものを選ぶ。
+	// 末尾の名前を持つノードが多い場合にルート以外から探すときは、find_namepath_in_tree_unsafe を使う
+	KNode * find_namepath_indexed_unsafe(const KNode *start, const std::string &path) const {
+		K__ASSERT(start);
+		K__ASSERT(!path.empty());
+		std::vector<std::string> names;
+		{
+			std::string tmp = path;
+			while (!tmp.empty()) {
+				names.push_back(K::pathPopLeft(tmp));
+				if (names.back().empty()) {
+					// 空の要素を含むパスは findChild("") が任意の子にマッチするので、インデックスを使えない
+					return find_namepath_in_tree_unsafe(start, path);
+				}
+			}
+		}
+		const SNameList *list = _get_name_list(names.back());
+		if (list == nullptr) return nullptr; // ツリー内にこの名前のノードは無い
+		if (start != m_root && !_use_name_index(start, list)) {
+			// パスの再帰検索は各ノードからパスをたどるので、ルートからならインデックスの方が常に速い
+			return find_namepath_in_tree_unsafe(start, path);
+		}
+		KNode *ret = nullptr;
+		const KNode *ret_base = nullptr;
+		for (KNode *node=list->head; node; node=node->m_NodeData.nameNext) {
+			// パスを末尾からたどり、各要素が findChildPath で選ばれるノードと一致するか調べる
+			const KNode *p = node;
+			bool ok = true;
+			for (int i=(int)names.size()-1; i>=0; i--) {
+				const KNode *parent = p->getParent();
+				if (parent == nullptr || !p->hasName(names[i]) || parent->findChild(names[i]) != p) {
+					ok = false;
+					break;
+				}
+				p = parent;
+			}
+			if (!ok) continue;
+
+			// 起点 p は start 自身かその子孫でないといけない
+			const KNode *base = p;
+			int n = base->m_NodeData.depthInTree - start->m_NodeData.depthInTree;
+			if (n < 0) continue;
+			for (; n > 0; n--) {
+				p = p->getParent();
+			}
+			if (p != start) continue;
+			if (ret == nullptr || is_before_in_tree(base, ret_base)) {
+				ret = node;
+				ret_base = base;
+			}
+		}
+		return ret;
+	}
 	KNode * find_namepath_in_tree_unsafe(const KNode *start, const std::string &path) const {
 		K__ASSERT(start);
 		K__ASSERT(!path.empty());
@@ -2194,13 +2911,11 @@ public:
 		if (out_nodes) out_nodes->clear();
 		auto it = m_tag_nodes.find(tag);
 		if (it != m_tag_nodes.end()) {
-			const std::unordered_set<KNode*> &set = it->second;
+			const std::vector<KNode*> &nodes = it->second;
 			if (out_nodes) {
-				for (auto it=set.begin(); it!=set.end(); ++it) {
-					out_nodes->push_back(*it);
-				}
+				out_nodes->assign(nodes.begin(), nodes.end());
 			}
-			ret = set.size();
+			ret = (int)nodes.size();
 		}
 		return ret;
 	}
@@ -2293,6 +3008,26 @@ static void KNodeTree_on_node_marked_as_remove(CNodeTreeImpl *tree, KNode *node)
 	K__ASSERT(tree);
 	tree->_on_node_marked_as_remove(node);
 }
+static void KNodeTree_on_node_reorder(CNodeTreeImpl *tree, KNode *node) {
+	K__ASSERT(tree);
+	tree->_on_node_reorder(node);
+}
+static void KNodeTree_add_signal_subscriber(CNodeTreeImpl *tree, KNode *node, const KName &signame) {
+	K__ASSERT(tree);
+	tree->_add_signal_subscriber(node, signame);
+}
+static void KNodeTree_set_name(CNodeTreeImpl *tree, KNode *node, const std::string &name) {
+	K__ASSERT(tree);
+	tree->_set_name(node, name);
+}
+static KNode * KNodeTree_find_name(CNodeTreeImpl *tree, const KNode *start, const std::string &name) {
+	K__ASSERT(tree);
+	return tree->find_name_indexed(start, name);
+}
+static void KNodeTree_del_signal_subscriber(CNodeTreeImpl *tree, KNode *node, const KName &signame) {
+	K__ASSERT(tree);
+	tree->_del_signal_subscriber(node, signame);
+}
 #pragma endregion // CNodeTreeImpl
 
 
@@ -2366,6 +3101,18 @@ void KNodeTree::broadcastSignal(KSig &sig) {
 	K__ASSERT(g_NodeTree);
 	g_NodeTree->broadcastSignal(sig);
 }
+/// sig を購読しているノードにだけ送信する。
+/// ツリー全体を巡回する broadcastSignal とは異なり、KNode::subscribeSignal で購読登録したノードだけを訪問する。
+/// tree_order が true ならば broadcastSignal と同じ順番（深さ優先、親が先）で配信する。
+/// false の場合の配信順は不定だが、ツリー構造が頻繁に変化する場合でも並べ替えのコストがかからない
+void KNodeTree::sendSignalToSubscribers(KSig &sig, bool tree_order) {
+	K__ASSERT(g_NodeTree);
+	g_NodeTree->sendSignalToSubscribers(sig, tree_order);
+}
+int KNodeTree::getSignalSubscribers(KNodeArray *out_nodes, const KName &signame, bool tree_order) {
+	K__ASSERT(g_NodeTree);
+	return g_NodeTree->getSignalSubscribers(out_nodes, signame, tree_order);
+}
 void KNodeTree::sendSignal(KNode *target, KSig &sig) {
 	K__ASSERT(g_NodeTree);
 	g_NodeTree->sendSignal(target, sig);
@@ -2414,6 +3161,509 @@ void KNodeTree::_on_node_removing(KNode *node) {
 
 
 
+namespace Test {
+
+K_DECL_SIGNAL(K_SIG_TEST_NODESIGNAL);
+
+class CTestSigNode: public KNode {
+public:
+	std::vector<KNode *> *m_Log;
+	CTestSigNode() {
+		m_Log = nullptr;
+	}
+	virtual void on_node_signal(KSig &sig) override {
+		if (m_Log && sig.check(K_SIG_TEST_NODESIGNAL)) {
+			m_Log->push_back(this);
+		}
+	}
+};
+
+void Test_node_signal() {
+	bool install = !KNodeTree::isInstalled();
+	if (install) KNodeTree::install();
+
+	// 20000 ノードのツリーを作り、そのうち少数だけがシグナルを購読する
+	const int NUM_GROUPS = 200;
+	const int NUM_CHILDREN = 99;
+	const int NUM_SIGNALS = 200;
+	std::vector<KNode *> log;
+	std::vector<KNode *> groups;
+	for (int i=0; i<NUM_GROUPS; i++) {
+		CTestSigNode *group = new CTestSigNode();
+		group->m_Log = &log;
+		group->setParent(KNodeTree::getRoot());
+		for (int j=0; j<NUM_CHILDREN; j++) {
+			CTestSigNode *node = new CTestSigNode();
+			node->m_Log = &log;
+			node->setParent(group);
+			if ((i * NUM_CHILDREN + j) % 997 == 0) {
+				node->subscribeSignal(K_SIG_TEST_NODESIGNAL);
+			}
+			node->drop();
+		}
+		groups.push_back(group);
+	}
+	groups[3]->subscribeSignal(K_SIG_TEST_NODESIGNAL);
+	groups[NUM_GROUPS-1]->subscribeSignal(K_SIG_TEST_NODESIGNAL);
+
+	// 親の付け替えや兄弟順の変更があっても購読は維持され、ツリー順も保たれる
+	KNode *moved = groups[0]->getChild(0);
+	moved->setParent(groups[NUM_GROUPS/2]);
+	groups[NUM_GROUPS/2]->setChildIndex(moved, 0);
+	K__ASSERT(moved->isSubscribedSignal(K_SIG_TEST_NODESIGNAL));
+
+	KSig sig(K_SIG_TEST_NODESIGNAL);
+
+	// 全体配信の結果から、購読ノードだけを抜き出したもの
+	std::vector<KNode *> expected;
+	KNodeTree::broadcastSignal(sig);
+	for (size_t i=0; i<log.size(); i++) {
+		if (log[i]->isSubscribedSignal(K_SIG_TEST_NODESIGNAL)) {
+			expected.push_back(log[i]);
+		}
+	}
+	log.clear();
+
+	// 購読者への配信では、受信ノードも順番も一致しなければならない
+	KNodeTree::sendSignalToSubscribers(sig, true);
+	K__ASSERT(!expected.empty());
+	K__ASSERT(log == expected);
+	log.clear();
+
+	// 順不同の配信では、受信ノードの集合だけが一致する
+	KNodeTree::sendSignalToSubscribers(sig, false);
+	std::sort(log.begin(), log.end());
+	std::sort(expected.begin(), expected.end());
+	K__ASSERT(log == expected);
+	log.clear();
+
+	// 購読解除したノードには届かない
+	moved->unsubscribeSignal(K_SIG_TEST_NODESIGNAL);
+	KNodeTree::sendSignalToSubscribers(sig, true);
+	K__ASSERT(std::find(log.begin(), log.end(), moved) == log.end());
+	K__ASSERT(log.size() + 1 == expected.size());
+	log.clear();
+
+	// broadcastSignal と同じく、ルートノードは購読しても配信先に入らない
+	{
+		KNodeArray subs;
+		KNodeTree::getRoot()->subscribeSignal(K_SIG_TEST_NODESIGNAL);
+		KNodeTree::getSignalSubscribers(&subs, K_SIG_TEST_NODESIGNAL);
+		K__ASSERT(std::find(subs.begin(), subs.end(), KNodeTree::getRoot()) == subs.end());
+		K__ASSERT(subs.size() + 1 == expected.size());
+		KNodeTree::getRoot()->unsubscribeSignal(K_SIG_TEST_NODESIGNAL);
+	}
+
+	// ベンチマーク：１フレームあたり NUM_SIGNALS 回の配信
+	{
+		KClock clock;
+		for (int i=0; i<NUM_SIGNALS; i++) {
+			KNodeTree::broadcastSignal(sig);
+		}
+		int t_broadcast = clock.getTimeNano() / 1000;
+		log.clear();
+
+		clock.reset();
+		for (int i=0; i<NUM_SIGNALS; i++) {
+			KNodeTree::sendSignalToSubscribers(sig, true);
+		}
+		int t_subscribers = clock.getTimeNano() / 1000;
+		log.clear();
+		K__PRINT("Test_node_signal: %d nodes, %d signals: broadcast %d usec, subscribers %d usec",
+			NUM_GROUPS * (NUM_CHILDREN + 1), NUM_SIGNALS, t_broadcast, t_subscribers);
+	}
+
+	// 後始末
+	for (size_t i=0; i<groups.size(); i++) {
+		groups[i]->remove();
+		groups[i]->drop();
+	}
+	KNodeTree::destroyMarkedNodes(nullptr);
+	KNodeTree::getSignalSubscribers(&expected, K_SIG_TEST_NODESIGNAL);
+	K__ASSERT(expected.empty());
+
+	if (install) KNodeTree::uninstall();
+}
+
+
+// 名前インデックスを使わない、再帰による検索（KNode::findChildInTree_unsafe の元の実装）
+static KNode * Test_find_name_recursive(const KNode *start, const std::string &name) {
+	for (int i=0; i<start->getChildCount(); i++) {
+		KNode *sub = start->getChildFast(i);
+		if (sub->hasFlag(KNode::FLAG__MARK_REMOVE)) continue;
+		if (sub->hasName(name)) return sub;
+		KNode *subsub = Test_find_name_recursive(sub, name);
+		if (subsub) return subsub;
+	}
+	return nullptr;
+}
+static KNode * Test_find_child_linear(const KNode *node, const std::string &name) {
+	for (int i=0; i<node->getChildCount(); i++) {
+		KNode *sub = node->getChildFast(i);
+		if (sub->hasFlag(KNode::FLAG__MARK_REMOVE)) continue;
+		if (name.empty() || sub->hasName(name)) return sub;
+	}
+	return nullptr;
+}
+// 名前インデックスを使わない、再帰によるパス検索（CNodeTreeImpl::find_namepath_in_tree_unsafe と同じ）
+static KNode * Test_find_path_recursive(const KNode *start, const std::string &path) {
+	std::string tmp = path;
+	KNode *node = const_cast<KNode*>(start);
+	while (node && !tmp.empty()) {
+		node = Test_find_child_linear(node, K::pathPopLeft(tmp));
+	}
+	if (node) return node;
+	for (int i=0; i<start->getChildCount(); i++) {
+		KNode *ret = Test_find_path_recursive(start->getChildFast(i), path);
+		if (ret) return ret;
+	}
+	return nullptr;
+}
+
+void Test_node_find() {
+	bool install = !KNodeTree::isInstalled();
+	if (install) KNodeTree::install();
+
+	// 50000 ノードのツリーを作る。同じ名前のノードが多数存在する
+	const int NUM_GROUPS = 500;
+	const int NUM_CHILDREN = 99;
+	const int NUM_QUERIES = 1000;
+	std::vector<KNode *> groups;
+	std::vector<KNode *> nodes;
+	for (int i=0; i<NUM_GROUPS; i++) {
+		KNode *group = KNode::create();
+		group->setName(K::str_sprintf("g%d", i % 100));
+		group->setParent(KNodeTree::getRoot());
+		for (int j=0; j<NUM_CHILDREN; j++) {
+			KNode *node = KNode::create();
+			node->setName(K::str_sprintf("n%d", j % 40));
+			if (j % 10 == 0) {
+				KNode *leaf = KNode::create();
+				leaf->setName(K::str_sprintf("leaf%d", i % 7));
+				leaf->setParent(node);
+				nodes.push_back(leaf);
+				leaf->drop();
+			}
+			node->setParent(group);
+			nodes.push_back(node);
+			node->drop();
+		}
+		groups.push_back(group);
+	}
+
+	std::vector<std::string> names;
+	std::vector<std::string> paths;
+	for (int i=0; i<40; i+=3) names.push_back(K::str_sprintf("n%d", i));
+	for (int i=0; i<8; i++) names.push_back(K::str_sprintf("leaf%d", i));
+	for (int i=0; i<100; i+=13) names.push_back(K::str_sprintf("g%d", i));
+	names.push_back("renamed");
+	names.push_back("moved");
+	names.push_back("nothing");
+	for (int i=0; i<40; i+=7) paths.push_back(K::str_sprintf("n%d/leaf%d", i, i % 7));
+	for (int i=0; i<100; i+=11) paths.push_back(K::str_sprintf("g%d/n%d", i, i % 40));
+	paths.push_back("g3/n10/leaf3");
+	paths.push_back("n30/leaf2/");
+	paths.push_back("g5//leaf5");
+	paths.push_back("renamed/leaf1");
+
+	std::vector<KNode *> starts;
+	starts.push_back(KNodeTree::getRoot());
+	starts.push_back(groups[0]);
+	starts.push_back(groups[NUM_GROUPS/2]);
+	starts.push_back(groups[NUM_GROUPS/2]->getChild(10));
+
+	// 再帰による検索と結果が一致しなければならない
+	auto check = [&]() {
+		for (size_t s=0; s<starts.size(); s++) {
+			const KNode *start = starts[s];
+			if (start->hasFlagInTreeAny(KNode::FLAG__MARK_REMOVE)) continue;
+			for (size_t i=0; i<names.size(); i++) {
+				K__ASSERT(start->findChildInTree(names[i]) == Test_find_name_recursive(start, names[i]));
+				K__ASSERT(KNodeTree::findNodeByName(start, names[i]) == Test_find_name_recursive(start, names[i]));
+			}
+			for (size_t i=0; i<paths.size(); i++) {
+				K__ASSERT(KNodeTree::findNodeByPath(start, paths[i]) == Test_find_path_recursive(start, paths[i]));
+			}
+		}
+		for (int i=0; i<NUM_GROUPS; i+=37) {
+			for (size_t j=0; j<names.size(); j++) {
+				K__ASSERT(groups[i]->findChild(names[j]) == Test_find_child_linear(groups[i], names[j]));
+			}
+		}
+	};
+	check();
+
+	// 名前の変更、親の付け替え、兄弟順の変更、削除マーク
+	groups[1]->getChild(0)->setName("n5");
+	groups[1]->getChild(20)->setName("renamed");
+	groups[NUM_GROUPS-1]->getChild(30)->setName("renamed");
+	groups[2]->getChild(0)->setParent(groups[1]);
+	groups[3]->getChild(50)->setParent(groups[0]);
+	groups[8]->getChild(10)->getChild(0)->setName("moved");
+	groups[8]->setParent(groups[NUM_GROUPS/2]->getChild(10)); // 子ツリーごと深い位置に移す
+	groups[0]->setChildIndex(groups[0]->getChild(NUM_CHILDREN), 0);
+	groups[1]->setChildIndex(groups[1]->getChild(5), 2);
+	groups[0]->getChild(1)->markAsRemove();
+	groups[1]->getChild(0)->markAsRemove();
+	groups[4]->markAsRemove();
+	groups[0]->findChild("n5")->markAsRemove();
+	check();
+
+	// 既存ノードの名前を変えてからツリーから外すと、インデックスからも消える
+	{
+		KNode *node = groups[6]->getChild(40);
+		node->grab();
+		node->setName("detached");
+		node->setParent(nullptr);
+		K__ASSERT(KNodeTree::findNodeByName(nullptr, "detached") == nullptr);
+		node->setParent(groups[7]);
+		K__ASSERT(KNodeTree::findNodeByName(nullptr, "detached") == node);
+		K__ASSERT(KNodeTree::findNodeByPath(nullptr, "/g7/detached") == node);
+		node->drop();
+	}
+
+	// ベンチマーク：NUM_QUERIES 回の名前検索とパス検索
+	{
+		int dummy = 0;
+		KClock clock;
+		for (int i=0; i<NUM_QUERIES; i++) {
+			dummy += Test_find_name_recursive(KNodeTree::getRoot(), names[i % names.size()]) != nullptr;
+		}
+		int t_name_rec = clock.getTimeNano() / 1000;
+		clock.reset();
+		for (int i=0; i<NUM_QUERIES; i++) {
+			dummy += KNodeTree::findNodeByName(nullptr, names[i % names.size()]) != nullptr;
+		}
+		int t_name_idx = clock.getTimeNano() / 1000;
+		clock.reset();
+		for (int i=0; i<NUM_QUERIES; i++) {
+			dummy += Test_find_path_recursive(KNodeTree::getRoot(), paths[i % paths.size()]) != nullptr;
+		}
+		int t_path_rec = clock.getTimeNano() / 1000;
+		clock.reset();
+		for (int i=0; i<NUM_QUERIES; i++) {
+			dummy += KNodeTree::findNodeByPath(nullptr, paths[i % paths.size()]) != nullptr;
+		}
+		int t_path_idx = clock.getTimeNano() / 1000;
+		K__PRINT("Test_node_find: %d nodes, %d queries: name recursive %d usec, indexed %d usec / path recursive %d usec, indexed %d usec (%d)",
+			(int)nodes.size() + NUM_GROUPS, NUM_QUERIES, t_name_rec, t_name_idx, t_path_rec, t_path_idx, dummy);
+
+		// グループ（アクター相当）の子ツリーからの検索。同名ノードが多いのでインデックスを使わない方が速い
+		dummy = 0;
+		clock.reset();
+		for (int i=0; i<NUM_QUERIES; i++) {
+			dummy += Test_find_name_recursive(groups[i % NUM_GROUPS], names[i % names.size()]) != nullptr;
+		}
+		int t_sub_name_rec = clock.getTimeNano() / 1000;
+		clock.reset();
+		for (int i=0; i<NUM_QUERIES; i++) {
+			dummy += groups[i % NUM_GROUPS]->findChildInTree(names[i % names.size()]) != nullptr;
+		}
+		int t_sub_name_idx = clock.getTimeNano() / 1000;
+		clock.reset();
+		for (int i=0; i<NUM_QUERIES; i++) {
+			dummy += Test_find_path_recursive(groups[i % NUM_GROUPS], paths[i % paths.size()]) != nullptr;
+		}
+		int t_sub_path_rec = clock.getTimeNano() / 1000;
+		clock.reset();
+		for (int i=0; i<NUM_QUERIES; i++) {
+			dummy += KNodeTree::findNodeByPath(groups[i % NUM_GROUPS], paths[i % paths.size()]) != nullptr;
+		}
+		int t_sub_path_idx = clock.getTimeNano() / 1000;
+		K__PRINT("Test_node_find: %d queries from subtrees: name recursive %d usec, tree %d usec / path recursive %d usec, tree %d usec (%d)",
+			NUM_QUERIES, t_sub_name_rec, t_sub_name_idx, t_sub_path_rec, t_sub_path_idx, dummy);
+	}
+
+	// 後始末
+	for (size_t i=0; i<groups.size(); i++) {
+		groups[i]->remove();
+		groups[i]->drop();
+	}
+	KNodeTree::destroyMarkedNodes(nullptr);
+	K__ASSERT(KNodeTree::findNodeByName(nullptr, "n5") == nullptr);
+
+	if (install) KNodeTree::uninstall();
+}
+
+
+// 親をたどってタグを探す（継承タグの定義そのもの）
+static bool Test_has_tag_in_tree(const KNode *node, const KTag &tag) {
+	for (const KNode *n=node; n; n=n->getParent()) {
+		if (KNameList_contains(n->getTagList(), tag)) return true;
+	}
+	return false;
+}
+
+void Test_node_tag() {
+	bool install = !KNodeTree::isInstalled();
+	if (install) KNodeTree::install();
+
+	// 50500 ノードのツリーを作る（グループ 500, 中間ノード 5000, 末端ノード 45000）
+	const int NUM_GROUPS = 500;
+	const int NUM_MIDS = 10;
+	const int NUM_LEAVES = 9;
+	const int NUM_TAGS = 8;
+	std::vector<KTag> tags;
+	for (int i=0; i<NUM_TAGS; i++) {
+		tags.push_back(KTag(K::str_sprintf("Test_node_tag%d", i)));
+	}
+	std::vector<KNode *> groups;
+	std::vector<KNode *> mids;
+	std::vector<KNode *> all;
+	for (int i=0; i<NUM_GROUPS; i++) {
+		KNode *group = KNode::create();
+		group->setParent(KNodeTree::getRoot());
+		if (i % 3 == 0) group->setTag(tags[0]);
+		if (i % 5 == 0) group->setTag(tags[1]);
+		groups.push_back(group);
+		all.push_back(group);
+		for (int j=0; j<NUM_MIDS; j++) {
+			KNode *mid = KNode::create();
+			if (j % 2 == 0) mid->setTag(tags[2]);
+			if (j % 4 == 0) mid->setTag(tags[0]);
+			mid->setParent(group);
+			mids.push_back(mid);
+			all.push_back(mid);
+			for (int k=0; k<NUM_LEAVES; k++) {
+				KNode *leaf = KNode::create();
+				leaf->setParent(mid);
+				leaf->setTag(tags[3 + (i + j + k) % (NUM_TAGS - 3)]);
+				all.push_back(leaf);
+				leaf->drop();
+			}
+			mid->drop();
+		}
+	}
+
+	// 親をたどって求めた結果と一致しなければならない
+	auto check = [&]() {
+		for (size_t i=0; i<all.size(); i++) {
+			const KNode *node = all[i];
+			for (int t=0; t<NUM_TAGS; t++) {
+				K__ASSERT(node->hasTag(tags[t]) == KNameList_contains(node->getTagList(), tags[t]));
+				K__ASSERT(node->hasTagInTree(tags[t]) == Test_has_tag_in_tree(node, tags[t]));
+				K__ASSERT(KNameList_contains(node->getTagListInTree(), tags[t]) == Test_has_tag_in_tree(node, tags[t]));
+				K__ASSERT(KNameList_contains(node->getTagListInherited(), tags[t]) == Test_has_tag_in_tree(node->getParent(), tags[t]));
+			}
+		}
+		for (int t=0; t<NUM_TAGS; t++) {
+			KNodeArray list;
+			KNodeTree::getNodeListByTag(&list, tags[t]);
+			KNodeArray expected;
+			for (size_t i=0; i<all.size(); i++) {
+				if (all[i]->hasTag(tags[t]) && all[i]->getRoot() == KNodeTree::getRoot()) {
+					expected.push_back(all[i]);
+				}
+			}
+			std::sort(list.begin(), list.end());
+			std::sort(expected.begin(), expected.end());
+			K__ASSERT(list == expected);
+		}
+	};
+	check();
+
+	// 親の付け替え、タグの追加と削除、ツリーからの切り離し
+	for (int i=0; i<NUM_GROUPS; i+=7) {
+		mids[i * NUM_MIDS]->setParent(groups[(i * 13 + 1) % NUM_GROUPS]);
+	}
+	groups[0]->removeTag(tags[0]); // 子も同じタグを持っている
+	groups[3]->setTag(tags[2]);
+	groups[5]->removeTag(tags[1]);
+	mids[1]->setTag(tags[1]);
+	mids[2]->removeTag(tags[2]);
+	{
+		// 親と祖父が同じタグを持つ場合、親のタグを外しても祖父から継承し続ける
+		groups[6]->setTag(tags[5]);
+		mids[6 * NUM_MIDS + 1]->setTag(tags[5]);
+		mids[6 * NUM_MIDS + 1]->removeTag(tags[5]);
+		KNode *leaf = mids[6 * NUM_MIDS + 1]->getChild(0);
+		K__ASSERT(leaf->hasTagInTree(tags[5]));
+	}
+	KNode *detached = groups[9];
+	detached->grab();
+	detached->setParent(nullptr);
+	detached->getChild(0)->setTag(tags[6]);
+	check();
+	detached->setParent(groups[10]);
+	detached->drop();
+	check();
+
+	// ベンチマーク
+	{
+		int dummy = 0;
+		KClock clock;
+		for (size_t i=0; i<all.size(); i++) {
+			for (int t=0; t<NUM_TAGS; t++) {
+				dummy += KNameList_contains(all[i]->getTagListInTree(), tags[t]);
+			}
+		}
+		int t_list = clock.getTimeNano() / 1000;
+		clock.reset();
+		for (size_t i=0; i<all.size(); i++) {
+			for (int t=0; t<NUM_TAGS; t++) {
+				dummy += all[i]->hasTagInTree(tags[t]);
+			}
+		}
+		int t_bits = clock.getTimeNano() / 1000;
+		clock.reset();
+		KNodeArray list;
+		for (int n=0; n<100; n++) {
+			dummy += KNodeTree::getNodeListByTag(&list, tags[3 + n % (NUM_TAGS - 3)]);
+		}
+		int t_bytag = clock.getTimeNano() / 1000;
+		clock.reset();
+		for (int n=0; n<1000; n++) {
+			mids[n]->setParent(groups[(n * 31 + 5) % NUM_GROUPS]);
+		}
+		int t_reparent = clock.getTimeNano() / 1000;
+		K__PRINT("Test_node_tag: %d nodes: hasTagInTree x%d: list %d usec, bits %d usec / getNodeListByTag x100: %d usec / reparent x1000: %d usec (%d)",
+			(int)all.size(), (int)all.size() * NUM_TAGS, t_list, t_bits, t_bytag, t_reparent, dummy);
+	}
+	check();
+
+	// K_NODE_TAG_BITS を超えたタグも、名前のリストで継承される。
+	// ※ビット番号はプロセス全体で共有されるので、ここで使い切った後に使われるタグはすべて名前のリストで扱われる
+	{
+		for (int i=0; KTagBits::getOrAssignBit(KTag(K::str_sprintf("Test_node_tag_fill%d", i))) >= 0; i++) {}
+		KTag extra("Test_node_tag_extra");
+		K__ASSERT(KTagBits::getOrAssignBit(extra) < 0);
+		KNode *mid = groups[1]->getChild(0);
+		KNode *leaf = mid->getChild(0);
+		groups[1]->setTag(extra);
+		K__ASSERT(groups[1]->hasTag(extra));
+		K__ASSERT(!mid->hasTag(extra));
+		K__ASSERT(leaf->hasTagInTree(extra));
+		K__ASSERT(KNameList_contains(leaf->getTagListInTree(), extra));
+		K__ASSERT(KNameList_contains(mid->getTagListInherited(), extra));
+		mid->setParent(groups[2]);
+		K__ASSERT(!leaf->hasTagInTree(extra));
+		K__ASSERT(!KNameList_contains(leaf->getTagListInTree(), extra));
+		mid->setParent(groups[1]);
+		K__ASSERT(leaf->hasTagInTree(extra));
+		mid->setTag(extra);
+		groups[1]->removeTag(extra);
+		K__ASSERT(leaf->hasTagInTree(extra)); // mid 自身が持っている
+		mid->removeTag(extra);
+		K__ASSERT(!leaf->hasTagInTree(extra));
+		K__ASSERT(!KNameList_contains(leaf->getTagListInherited(), extra));
+	}
+	check();
+
+	// 後始末
+	for (size_t i=0; i<groups.size(); i++) {
+		groups[i]->remove();
+		groups[i]->drop();
+	}
+	KNodeTree::destroyMarkedNodes(nullptr);
+	K__ASSERT(KNodeTree::getNodeListByTag(nullptr, tags[0]) == 0);
+
+	if (install) KNodeTree::uninstall();
+}
+
+} // Test
+
+
+
 
 
 } // namespace
@@ -16,6 +16,10 @@
 
 #define NODE_NAME 0
 
+// ビット集合で管理できるタグの種類数（64の倍数）
+// これを超えた分のタグは、ビット集合の代わりに名前のリストで継承する（遅い）
+#define K_NODE_TAG_BITS 128
+
 
 namespace Kamilo {
 
@@ -89,6 +93,7 @@ enum KNodeTickFlag {
 typedef int KNodeTickFlags;
 
 class CNodeTreeImpl; // internal
+class CChildNameIndex; // internal
 
 
 struct STransformData {
@@ -106,6 +111,8 @@ struct STransformData {
 	bool m_UsingEuler;
 	bool m_UsingCustom;
 	bool m_InheritTransform;
+	int m_WatchWorldMatrix; // 0 でなければワールド行列が変化するたびに getWatchedWorldMatrixRevision() の値が変わる。監視したい側がそれぞれ増減させる
+	mutable uint32_t m_WatchedRevision; // m_WatchWorldMatrix が 0 でないときに、最後にワールド行列が変化した時点の getWatchedWorldMatrixRevision() の値
 	KNode *m_Node;
 
 	STransformData();
@@ -139,13 +146,48 @@ struct STransformData {
 	void _updateLocalMatrix() const; // mutable 変数を扱うので const 属性にしてある
 	void _updateWorldMatrix(const KMatrix4 &parent) const; // mutable 変数を扱うので const 属性にしてある
 	void _updateTree();
+
+	/// m_WatchWorldMatrix が 0 でないノードのワールド行列が変化するたびに増加するカウンタ。
+	/// 静的剛体など、めったに動かないノードの移動を安価に検出するために使う
+	static uint32_t getWatchedWorldMatrixRevision();
 };
 
 
+/// タグのビット集合
+///
+/// タグには初めて使われたときにビット番号が割り当てられる。
+/// 割り当てはプロセス全体で共通。タグ→ビット番号の対応表はロックで保護していないため、
+/// タグの追加 (KNode::setTag) やタグの問い合わせはメインスレッドからだけ行うこと
+struct KTagBits {
+	static const int WORDS = K_NODE_TAG_BITS / 64;
+	uint64_t m_Words[WORDS];
+
+	KTagBits();
+	void clear();
+	bool empty() const;
+	bool test(int bit) const;
+	void set(int bit, bool value);
+	KTagBits operator | (const KTagBits &other) const;
+	bool operator == (const KTagBits &other) const;
+	bool operator != (const KTagBits &other) const;
+
+	static int getBit(const KTag &tag); ///< タグのビット番号。まだ割り当てられていなければ -1
+	static int getOrAssignBit(const KTag &tag); ///< タグのビット番号。まだ割り当てられていなければ割り当てる。上限を超えた場合は -1
+	static KTag getTag(int bit); ///< ビット番号に割り当てられたタグ
+};
+
 struct STagData {
 	KNameList m_SelfTags; // 自分自身のタグ
-	KNameList m_ParentTags; // 親から継承したタグ
-	KNameList m_TagsInTree; // 自分自身のタグと継承したタグを合成したもの
+	std::vector<int> m_SelfTagSlots; // m_SelfTags の各タグが、ノードツリーのタグ別ノードリストの何番目にあるか。未登録なら -1
+	KTagBits m_SelfBits; // 自分自身のタグ
+	KTagBits m_ParentBits; // 親から継承したタグ（親の m_BitsInTree と同じ）
+	KTagBits m_BitsInTree; // 自分自身のタグと継承したタグを合成したもの
+	KNameList m_SelfExtraTags; // 自分自身のタグのうち、ビットが割り当てられなかったもの
+	KNameList m_ParentExtraTags; // 親から継承した、ビットが割り当てられなかったタグ（親の m_ExtraTagsInTree と同じ）
+	KNameList m_ExtraTagsInTree; // m_SelfExtraTags と m_ParentExtraTags を合成したもの
+	mutable KNameList m_ParentTags; // m_ParentBits, m_ParentExtraTags をリストにしたもの。必要になったときに作る
+	mutable KNameList m_TagsInTree; // m_SelfTags と m_ParentTags を合成したもの。必要になったときに作る
+	mutable bool m_ListsDirty; // m_ParentTags, m_TagsInTree を作り直す必要がある
 	KNode *m_Node;
 
 	STagData();
@@ -156,9 +198,9 @@ struct STagData {
 	const KNameList & getTagListInherited() const;
 	void setTag(const KTag &tag);
 	void removeTag(const KTag &tag);
-	void _setTagEx(const KTag &tag, bool is_inherited); 
-	void _removeTagEx(const KTag &tag, bool is_inherited);
-	void _updateNodeTreeTags(bool add);
+	void _updateBitsInTree();
+	bool _updateExtraTagsInTree();
+	void _updateLists() const;
 	void _beginParentChange();
 	void _endParentChange();
 };
@@ -169,6 +211,7 @@ struct SFlagData {
 	uint32_t m_Bits; // 自分自身のフラグ
 	uint32_t m_BitsInTreeAll; // 自分と親ツリーのフラグビットを AND 結合したもの
 	uint32_t m_BitsInTreeAny; // 自分と親ツリーのフラグビットを OR 結合したもの
+	bool m_WatchBitsInTree; // true なら m_BitsInTreeAny が変化するたびに getWatchedBitsInTreeRevision() の値が変わる
 	KNode *m_Node;
 
 	SFlagData();
@@ -181,6 +224,9 @@ struct SFlagData {
 	void setFlag(uint32_t flag, bool value);
 	void _updateTree();
 	void _updateTree(const SFlagData *parent);
+
+	/// m_WatchBitsInTree が true になっているノードのツリー内フラグ（有効状態など）が変化するたびに増加するカウンタ
+	static uint32_t getWatchedBitsInTreeRevision();
 };
 
 
@@ -204,6 +250,7 @@ struct SRenderData {
 	int m_LayerInTree;
 	int m_Priority; // 描画の優先順位。番号が若いほど手前になる
 	int m_PriorityInTree;
+	uint32_t m_RenderListRevisionInTree; // 自分以下の描画リストの構成が最後に変わった時点の getRenderListRevision() の値
 	KNode *m_Node;
 	KLocalRenderOrder m_LocalRenderOrder;
 
@@ -237,6 +284,27 @@ struct SRenderData {
 	int  getPriorityInTree() const;
 	void _updateTree();
 	void _updateTree(const SRenderData *parent);
+
+	/// 描画リストの構成が変わったことを記録する。
+	/// 自分と先祖の getRenderListRevisionInTree() と、影響するレイヤーの getRenderListRevision(layer) を更新する。
+	/// subtree が true なら自分以下のすべてのノードのレイヤー、false なら自分のレイヤーだけが影響を受ける
+	void _markRenderListChanged(bool subtree);
+
+	/// 自分以下のノードで、描画リストの構成に関わる変更（親子関係、兄弟の順番、有効・表示状態、レイヤー、不可分描画、子→親描画、ドローアブルの追加削除）が
+	/// 最後にあった時点の getRenderListRevision() の値
+	uint32_t getRenderListRevisionInTree() const;
+
+	/// 描画リストの構成に関わる変更があるたびに増加するカウンタ。
+	/// 描画リストを作り直す必要があるかどうかを安価に調べるために使う
+	static uint32_t getRenderListRevision();
+
+	/// ノードツリーに入っているノードのうち、layer のノードが影響を受ける変更があるたびに変化するカウンタ。
+	/// layer が負の場合は getRenderListRevision() と同じ。
+	/// 異なるレイヤーが同じ値を共有することがあるので、変化しても layer が影響を受けたとは限らない
+	static uint32_t getRenderListRevision(int layer);
+
+	/// 描画の優先順位 (setPriority) が変わるたびに増加するカウンタ
+	static uint32_t getRenderOrderRevision();
 };
 
 
@@ -289,6 +357,10 @@ public:
 	void broadcastSignalToChildren(KSig &sig); // 子ツリーに対して送信する
 	void broadcastSignalToParents(KSig &sig); // 親に対して送信する
 	void processSignal(KSig &sig); // このノードにシグナルを処理させる
+	void subscribeSignal(const KName &signame); // シグナルを購読する。KNodeTree::sendSignalToSubscribers で配信されるようになる（broadcastSignal と同じく、ルートノードには届かない）
+	void unsubscribeSignal(const KName &signame); // シグナルの購読を解除する
+	bool isSubscribedSignal(const KName &signame) const;
+	const KNameList & getSubscribedSignals() const;
 	#pragma endregion // Signal
 
 	void sendActionCommand(KSig &cmd);
@@ -441,7 +513,6 @@ public:
 	void setTag(const KTag &tag);
 	void removeTag(const KTag &tag);
 	void copyTags(KNode *src);
-	void _updateNodeTreeTags(bool add);
 	#pragma endregion // Tags
 
 
@@ -483,6 +554,7 @@ public:
 
 
 private:
+	friend class CNodeTreeImpl;
 	void lock() const;
 	void unlock() const;
 #ifdef _DEBUG
@@ -496,7 +568,14 @@ private:
 		std::string name;
 		std::string nameInTree;
 		std::vector<KNode *> children;
+		KNameList signals; // 購読しているシグナル名
 		CNodeTreeImpl *tree;
+		KNode *namePrev; // ツリー内で同じ名前を持つノードの双方向リスト（CNodeTreeImpl の名前インデックス）
+		KNode *nameNext;
+		int depthInTree; // ツリー内での深さ（ルートが 0）。ツリーに入ったときに決まる
+		mutable CChildNameIndex *childNames; // 子ノードの名前インデックス。findChild で必要になったときに作成する
+		mutable int indexInParent; // 親の子リスト内での位置。親の childIndexDirty が false の時だけ有効
+		mutable bool childIndexDirty; // 子の indexInParent を振りなおす必要がある
 		int blocked;
 		bool is_ready;
 		bool should_call_onstart;
@@ -505,6 +584,12 @@ private:
 			uuid = nullptr;
 			parent = nullptr;
 			tree = nullptr;
+			namePrev = nullptr;
+			nameNext = nullptr;
+			depthInTree = 0;
+			childNames = nullptr;
+			indexInParent = -1;
+			childIndexDirty = false;
 			blocked = 0;
 			is_ready = false;
 			should_call_onstart = true;
@@ -665,6 +750,8 @@ public:
 	static void tick_nodes2(KNodeTickFlags flags);
 	static void tick_system_nodes();
 	static void broadcastSignal(KSig &sig);
+	static void sendSignalToSubscribers(KSig &sig, bool tree_order=true); // sig を購読しているノードにだけ送信する
+	static int getSignalSubscribers(KNodeArray *out_nodes, const KName &signame, bool tree_order=true); // sig を購読しているノードを取得する
 	static void sendSignal(KNode *target, KSig &sig);
 	static void sendSignalDelay(KNode *target, KSig &sig, int delay);
 	static int getNodeList(KNodeArray *out_nodes);
@@ -681,6 +768,14 @@ public:
 };
 
 
+namespace Test {
+void Test_node_signal();
+void Test_node_find();
+void Test_node_tag();
+}
+
+
+
 
 } // namespace
 
@@ -6,17 +6,27 @@
 #include "KRes.h"
 #include "KSolidBody.h"
 #include "keng_game.h"
+#include <memory> // std::unique_ptr
 
 namespace Kamilo {
 
 static KShadow::GlobalSettings g_GlobalShadowSettings;
 
+#define SHADOW_BASIC_RADIUS  64
+#define SHADOW_MAX_PENETRATION  16 // 地面を探すとき、地面にどれだけめり込んでいても良いか
+
 
 class CShadowMgr: public KManager, public KInspectorCallback {
 public:
 	KCompNodes<KShadow> m_Nodes;
+	std::vector<KShadow *> m_TmpQueryShadows;
+	std::vector<KVec3> m_TmpQueryPoints;
+	std::vector<float> m_TmpQueryGroundY;
+	std::unique_ptr<bool[]> m_TmpQueryFound;
+	int m_TmpQueryFoundSize;
 
 	CShadowMgr() {
+		m_TmpQueryFoundSize = 0;
 		KEngine::addManager(this);
 		KEngine::addInspectorCallback(this);
 	}
@@ -27,10 +37,39 @@ public:
 		m_Nodes.detach(node);
 	}
 	virtual void on_manager_appframe() override {
+		if (g_GlobalShadowSettings.batchGroundQuery) {
+			query_ground_points();
+		}
 		for (auto it=m_Nodes.begin(); it!=m_Nodes.end(); ++it) {
 			it->second->_StepSystemAction();
 		}
 	}
+	// 地面の高さを問い合わせる必要のある影について、まとめて問い合わせておく
+	void query_ground_points() {
+		m_TmpQueryShadows.clear();
+		m_TmpQueryPoints.clear();
+		for (auto it=m_Nodes.begin(); it!=m_Nodes.end(); ++it) {
+			KShadow *shadow = it->second;
+			KVec3 wpos;
+			if (shadow->_getGroundQueryPoint(&wpos)) {
+				m_TmpQueryShadows.push_back(shadow);
+				m_TmpQueryPoints.push_back(wpos);
+			}
+		}
+		int num = (int)m_TmpQueryPoints.size();
+		if (num == 0) {
+			return;
+		}
+		if (m_TmpQueryFoundSize < num) {
+			m_TmpQueryFound.reset(new bool[num]);
+			m_TmpQueryFoundSize = num;
+		}
+		m_TmpQueryGroundY.resize(num);
+		KSolidBody::getGroundPoints(m_TmpQueryPoints.data(), num, SHADOW_MAX_PENETRATION, m_TmpQueryFound.get(), m_TmpQueryGroundY.data());
+		for (int i=0; i<num; i++) {
+			m_TmpQueryShadows[i]->_setGroundQueryResult(m_TmpQueryFound[i], m_TmpQueryGroundY[i]);
+		}
+	}
 	virtual void on_manager_nodeinspector(KNode *node) override {
 		KShadow *comp = m_Nodes.get(node);
 		comp->_Inspector();
@@ -61,8 +100,6 @@ public:
 
 static CShadowMgr *g_ShadowMgr = nullptr;
 
-#define SHADOW_BASIC_RADIUS  64
-
 static void _MakeCircleMesh(KMesh *mesh, const KVec2 &radius, int numvertices, const KColor &center_color, const KColor &outer_color) {
 	K__ASSERT(mesh);
 	K__ASSERT(numvertices >= 3);
@@ -135,6 +172,9 @@ KShadow::KShadow() {
 	m_Data.use_sprite = false;
 	m_Data.enabled = true;
 	m_Data.delay = 2; // 最初のフレームでは、まだ影の描画に必要な情報が取得できていないので、念のために数フレーム経過してから表示するようにする
+	m_GroundQueryReady = false;
+	m_GroundQueryFound = false;
+	m_GroundQueryY = 0;
 }
 void KShadow::on_comp_attach() {
 	KNode *self = getNode();
@@ -162,6 +202,7 @@ void KShadow::on_comp_detach() {
 }
 void KShadow::_StepSystemAction() {
 	update();
+	m_GroundQueryReady = false; // まとめて問い合わせた結果はこのフレームでのみ有効
 }
 void KShadow::update() {
 	const KVec3 identity_scale(1, 1, 1);
@@ -355,11 +396,15 @@ bool KShadow::getAltitude(float *alt) {
 	}
 
 	// Body が利用できないなら、コリジョンワールドに高度を問い合わせる
-	{
-
+	// （CShadowMgr がまとめて問い合わせた結果があればそれを使う）
+	if (m_GroundQueryReady) {
+		if (m_GroundQueryFound) {
+			if (alt) *alt = wpos.y - m_GroundQueryY;
+			return true;
+		}
+	} else {
 		float ground_y;
-		float max_penetration = 16;
-		if (KSolidBody::getGroundPoint(wpos, max_penetration, &ground_y)) {
+		if (KSolidBody::getGroundPoint(wpos, SHADOW_MAX_PENETRATION, &ground_y)) {
 			if (alt) *alt = wpos.y - ground_y;
 			return true;
 		}
@@ -368,6 +413,23 @@ bool KShadow::getAltitude(float *alt) {
 	// 地面がない。奈落。
 	return false;
 }
+bool KShadow::_getGroundQueryPoint(KVec3 *out_wpos) {
+	// getAltitude で getGroundPoint を呼ぶ条件と同じ
+	if (!m_Data.enabled) return false;
+	if (g_GlobalShadowSettings.useYPositionAsAltitude) return false;
+	KNode *self = getNode();
+	KNode *owner = self ? self->getParent() : nullptr;
+	if (owner == nullptr) return false;
+	KSolidBody *body = KSolidBody::of(owner);
+	if (body && body->getBodyEnabled()) return false;
+	if (out_wpos) *out_wpos = owner->getWorldPosition();
+	return true;
+}
+void KShadow::_setGroundQueryResult(bool found, float ground_y) {
+	m_GroundQueryReady = true;
+	m_GroundQueryFound = found;
+	m_GroundQueryY = ground_y;
+}
 bool KShadow::compute_shadow_transform(const Data &data, KVec3 *out_pos, KVec3 *out_scale, float *out_alt) {
 	K__ASSERT(out_pos);
 	KNode *self = getNode();
@@ -26,6 +26,9 @@ public:
 
 		bool gradient; // 不透明から透明へグラデさせる
 
+		// 剛体を持たないノードの影の高度を、フレームごとに KSolidBody::getGroundPoints でまとめて問い合わせる
+		bool batchGroundQuery;
+
 		GlobalSettings() {
 			defaultRadiusX = 32;
 			defaultRadiusY = 12;
@@ -37,6 +40,7 @@ public:
 			blend = KBlend_ALPHA;
 			scaleByAltitude = true;
 			gradient = true;
+			batchGroundQuery = true;
 		}
 	};
 
@@ -105,6 +109,17 @@ public:
 	void update();
 	bool compute_shadow_transform(const Data &data, KVec3 *out_pos, KVec3 *out_scale, float *out_alt);
 
+	/// 地面の高さを問い合わせる必要があるなら、問い合わせる座標を out_wpos にセットして true を返す
+	bool _getGroundQueryPoint(KVec3 *out_wpos);
+
+	/// まとめて問い合わせた地面の高さをセットする。次の getAltitude で getGroundPoint の代わりに使われる
+	void _setGroundQueryResult(bool found, float ground_y);
+
+private:
+	bool m_GroundQueryReady;
+	bool m_GroundQueryFound;
+	float m_GroundQueryY;
+
 };
 
 
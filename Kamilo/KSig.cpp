@@ -1,5 +1,9 @@
 ﻿#include "KSig.h"
 #include "KInternal.h"
+#include "KClock.h"
+#if defined(_MSC_VER) && defined(_DEBUG)
+#include <crtdbg.h> // _CrtSetAllocHook
+#endif
 
 namespace Kamilo {
 
@@ -15,7 +19,8 @@ bool KSig::empty() const {
 }
 void KSig::clear() {
 	mName = "";
-	mArgs.clear();
+	mNumArgs = 0;
+	mSpillArgs.clear(); // ※確保済みの容量は再利用のために残しておく
 
 	mResult = 0;
 	mBoss1_Node = nullptr;
@@ -40,13 +45,59 @@ bool KSig::check(const KName &name) const {
 	return mName == name;
 }
 void KSig::setAny(const char *key, const KAny &val) {
-	mArgs[key ? key : ""] = val;
+	KName name(key ? key : "");
+
+	// 同名の引数があれば上書きする
+	int index = find_arg(name);
+	if (index >= 0) {
+		arg_at(index).val = val;
+		return;
+	}
+
+	// 新しい引数を追加する。
+	// 固定長配列に空きがあればそこに入れ、なければヒープ上の配列に追加する
+	if (mNumArgs < INLINE_ARGS) {
+		mInlineArgs[mNumArgs].key = name;
+		mInlineArgs[mNumArgs].val = val;
+	} else {
+		Arg arg;
+		arg.key = name;
+		arg.val = val;
+		mSpillArgs.push_back(arg);
+	}
+	mNumArgs++;
+}
+int KSig::find_arg(const KName &key) const {
+	// KName の比較はポインタ比較なので、引数が少ないうちは線形探索で十分速い
+	for (int i=0; i<mNumArgs; i++) {
+		if (arg_at(i).key == key) {
+			return i;
+		}
+	}
+	return -1;
+}
+KSig::Arg & KSig::arg_at(int index) {
+	return (index < INLINE_ARGS) ? mInlineArgs[index] : mSpillArgs[index - INLINE_ARGS];
+}
+const KSig::Arg & KSig::arg_at(int index) const {
+	return (index < INLINE_ARGS) ? mInlineArgs[index] : mSpillArgs[index - INLINE_ARGS];
+}
+int KSig::getArgCount() const {
+	return mNumArgs;
+}
+const KName & KSig::getArgName(int index) const {
+	K__ASSERT(0 <= index && index < mNumArgs);
+	return arg_at(index).key;
+}
+const KAny & KSig::getArgValue(int index) const {
+	K__ASSERT(0 <= index && index < mNumArgs);
+	return arg_at(index).val;
 }
 const KAny & KSig::get(const char *key) {
 	if (key && key[0]) {
-		auto it = mArgs.find(key);
-		if (it != mArgs.end()) {
-			return it->second;
+		int index = find_arg(key);
+		if (index >= 0) {
+			return arg_at(index).val;
 		}
 	}
 	K__WARNING("KSig: \"%s\" not found", key);
@@ -79,4 +130,113 @@ void * KSig::getPointer(const char *key) {
 	return get(key).getPointer();
 }
 
+
+
+namespace Test {
+
+#if defined(_MSC_VER) && defined(_DEBUG)
+// ヒープ確保の回数を数える（MSVC のデバッグビルドでのみ有効）
+static int g_Test_sig_allocs = 0;
+static int Test_sig_alloc_hook(int type, void *, size_t, int, long, const unsigned char *, int) {
+	if (type == _HOOK_ALLOC || type == _HOOK_REALLOC) {
+		g_Test_sig_allocs++;
+	}
+	return 1;
+}
+#	define TEST_SIG_ALLOC_BEGIN()  (g_Test_sig_allocs = 0, _CrtSetAllocHook(Test_sig_alloc_hook))
+#	define TEST_SIG_ALLOC_END()    (_CrtSetAllocHook(nullptr), g_Test_sig_allocs)
+#else
+#	define TEST_SIG_ALLOC_BEGIN()  (void)0
+#	define TEST_SIG_ALLOC_END()    (-1) // 計測不可
+#endif
+
+static int g_Test_sig_sum = 0;
+static void Test_sig_receive(KSig &sig) {
+	g_Test_sig_sum += sig.getInt("x") + (int)sig.getFloat("y") + (sig.getNode("node") ? 1 : 0) + sig.getString("text")[0];
+}
+static void Test_sig_receive_map(std::unordered_map<KName, KAny> &args) {
+	g_Test_sig_sum += args["x"].getInt() + (int)args["y"].getFloat() + (args["node"].getNode() ? 1 : 0) + args["text"].getString()[0];
+}
+
+void Test_sig() {
+	KNode *dummy_node = (KNode *)&g_Test_sig_sum; // 参照はしない。ポインタ値の確認用
+	{
+		KSig sig("TEST");
+		sig.setInt("x", 10);
+		sig.setFloat("y", 2.5f);
+		sig.setNode("node", dummy_node);
+		K__ASSERT(sig.getArgCount() == 3);
+		K__ASSERT(sig.getInt("x") == 10);
+		K__ASSERT(sig.getFloat("y") == 2.5f);
+		K__ASSERT(sig.getNode("node") == dummy_node);
+
+		// 同名の引数は上書きされる
+		sig.setInt("x", 20);
+		K__ASSERT(sig.getArgCount() == 3);
+		K__ASSERT(sig.getInt("x") == 20);
+		K__ASSERT(sig.getArgName(0) == KName("x"));
+
+		// INLINE_ARGS を超えた分も正しく読み書きできる
+		char key[16];
+		for (int i=0; i<KSig::INLINE_ARGS * 2; i++) {
+			sprintf_s(key, sizeof(key), "arg%d", i);
+			sig.setInt(key, i);
+		}
+		K__ASSERT(sig.getArgCount() == 3 + KSig::INLINE_ARGS * 2);
+		for (int i=0; i<KSig::INLINE_ARGS * 2; i++) {
+			sprintf_s(key, sizeof(key), "arg%d", i);
+			K__ASSERT(sig.getInt(key, -1) == i);
+		}
+
+		// コピーしても引数は保たれる
+		KSig copy = sig;
+		K__ASSERT(copy.getArgCount() == sig.getArgCount());
+		K__ASSERT(copy.getInt("arg15") == 15);
+		K__ASSERT(copy.getInt("x") == 20);
+
+		sig.clear();
+		K__ASSERT(sig.getArgCount() == 0);
+		K__ASSERT(sig.empty());
+	}
+
+	// ベンチマーク：シグナルの生成、引数設定、配信、破棄を 1M 回繰り返す
+	{
+		const int NUM = 1000 * 1000;
+		const KName name("TEST");
+		KClock clock;
+
+		TEST_SIG_ALLOC_BEGIN();
+		clock.reset();
+		for (int i=0; i<NUM; i++) {
+			KSig sig(name);
+			sig.setInt("x", i);
+			sig.setFloat("y", 1.0f);
+			sig.setNode("node", dummy_node);
+			sig.setString("text", "a");
+			Test_sig_receive(sig);
+		}
+		int t_sig = clock.getTimeMsec();
+		int a_sig = TEST_SIG_ALLOC_END();
+
+		// 比較用：以前の実装と同じく unordered_map で引数を持つ場合
+		TEST_SIG_ALLOC_BEGIN();
+		clock.reset();
+		for (int i=0; i<NUM; i++) {
+			std::unordered_map<KName, KAny> args;
+			args["x"] = i;
+			args["y"] = 1.0f;
+			args["node"] = dummy_node;
+			args["text"] = "a";
+			Test_sig_receive_map(args);
+		}
+		int t_map = clock.getTimeMsec();
+		int a_map = TEST_SIG_ALLOC_END();
+
+		K__PRINT("Test_sig: %d signals: KSig %d msec (%d allocs), unordered_map %d msec (%d allocs)", NUM, t_sig, a_sig, t_map, a_map);
+		K__ASSERT(a_sig <= 0); // 引数が INLINE_ARGS 個以下ならヒープを使わない
+	}
+}
+
+} // Test
+
 } // namespace
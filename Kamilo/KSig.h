@@ -14,6 +14,10 @@ class KNode;
 
 class KSig {
 public:
+	/// 引数を格納するための固定長配列の大きさ。
+	/// これを超える個数の引数を設定した場合に限り、ヒープに確保した配列を使う
+	static const int INLINE_ARGS = 8;
+
 	KSig();
 	KSig(const KName &name);
 	bool check(const KName &name) const;
@@ -37,9 +41,11 @@ public:
 	void * getPointer(const char *key);
 	bool empty() const;
 	void clear();
+	int getArgCount() const;
+	const KName & getArgName(int index) const;
+	const KAny & getArgValue(int index) const;
 
 	KName mName;
-	std::unordered_map<KName, KAny> mArgs;
 	int mResult;
 	KNode *mBoss1_Node;
 	KNode *mBoss2_Node;
@@ -63,6 +69,23 @@ public:
 	KNode *eroTargetNode;
 	void *mArg_AyEroCommandArg;
 	int eroTargetIsBuse;
+
+private:
+	struct Arg {
+		KName key;
+		KAny val;
+	};
+	int find_arg(const KName &key) const;
+	Arg & arg_at(int index);
+	const Arg & arg_at(int index) const;
+	Arg mInlineArgs[INLINE_ARGS]; // 引数（先頭 INLINE_ARGS 個）
+	std::vector<Arg> mSpillArgs;  // INLINE_ARGS 個に入りきらなかった引数
+	int mNumArgs;
 };
 
+
+namespace Test {
+void Test_sig();
+}
+
 } // namespace
@@ -6,6 +6,8 @@
 #include "KDrawable.h"
 #include "KScreen.h"
 #include "KCamera.h"
+#include "KClock.h"
+#include "KThread.h"
 
 namespace Kamilo {
 
@@ -240,6 +242,36 @@ static void _DrawFloor(KGizmo *gizmo, const KMatrix4 &matrix, const KColor &colo
 	gizmo->addLineDash(matrix, c+a2, c+b2, color);
 	gizmo->addLineDash(matrix, c+a3, c+b3, color);
 }
+// 格子を step ごとに間引いて描画するときの、index の次の格子線の位置。
+// 最後の格子線 (num-1) は必ず含める。次が無ければ num を返す
+static int _NextGridLine(int index, int step, int num) {
+	if (index + 1 >= num) return num;
+	return KMath::min(index + step, num - 1);
+}
+static void _DrawHeightfield(KGizmo *gizmo, const KMatrix4 &matrix, const KColor &color, const KHeightfieldCollider *coll) {
+	const int MAX_LINES = 64; // 縦横それぞれの線の最大数。これより細かい格子は間引いて表示する
+	int cols = coll->get_cols();
+	int rows = coll->get_rows();
+	float cell = coll->get_cell_size();
+	int step = KMath::max(1, KMath::max(cols, rows) / MAX_LINES);
+	KVec3 c = coll->get_offset();
+	float x0 = -(cols - 1) * cell * 0.5f;
+	float z0 = -(rows - 1) * cell * 0.5f;
+	for (int iz=0; iz<rows; iz=_NextGridLine(iz, step, rows)) {
+		for (int ix=0, nx; (nx=_NextGridLine(ix, step, cols)) < cols; ix=nx) {
+			KVec3 a(x0 + ix * cell, coll->get_height(ix, iz), z0 + iz * cell);
+			KVec3 b(x0 + nx * cell, coll->get_height(nx, iz), z0 + iz * cell);
+			gizmo->addLine(matrix, c+a, c+b, color);
+		}
+	}
+	for (int ix=0; ix<cols; ix=_NextGridLine(ix, step, cols)) {
+		for (int iz=0, nz; (nz=_NextGridLine(iz, step, rows)) < rows; iz=nz) {
+			KVec3 a(x0 + ix * cell, coll->get_height(ix, iz), z0 + iz * cell);
+			KVec3 b(x0 + ix * cell, coll->get_height(ix, nz), z0 + nz * cell);
+			gizmo->addLine(matrix, c+a, c+b, color);
+		}
+	}
+}
 static void _DrawCapsule(KGizmo *gizmo, const KMatrix4 &matrix, const KColor &color, const KVec3 &pos, float radius, float halfheight) {
 	if (radius < 0) radius = 0;
 	if (halfheight < 0) halfheight = 0;
@@ -303,6 +335,12 @@ static void _DrawSphereWithAltitude(KGizmo *gizmo, const KMatrix4 &matrix, const
 
 const float EXT_D = 4;
 const KVec3 EXTENDS(EXT_D, EXT_D, EXT_D); // 最低でも D の厚みで判定するようにするための調整用
+const float BROADPHASE_MARGIN = 1.0f; // 空間分割で候補を絞り込むときの余裕。コライダー表面の交点の誤差を吸収する
+const int GROUND_BATCH_SIZE = 16; // getGroundPoints で一度にまとめて処理する点の最大数
+const float GROUND_BATCH_CELL = 128.0f; // getGroundPoints でまとめる点の範囲（XZ平面上のセルの大きさ）
+const int STATIC_GATHER_GRAIN = 16; // 地形との判定を並列に行うとき、ワーカーに一度に割り当てる動的剛体の数
+const int DEFAULT_SLEEP_FRAMES = 60; // 自動スリープまでのフレーム数の既定値
+const float SLEEP_SPEED = 0.01f; // 速度と１フレームあたりの移動量がこれ以下なら静止しているとみなす
 
 struct COL_INFO {
 	KVec3 aabb_min, aabb_max; // AABB（ワールド座標）
@@ -324,6 +362,37 @@ struct COL_INFO {
 	}
 };
 
+/// 動的剛体と壁の衝突（地形との判定の収集フェーズで求めたもの）
+struct SStaticContact {
+	KSolidBody *stBody;
+	KCollisionTest test;
+};
+
+/// 動的剛体ごとの、地形との判定の収集結果
+struct SStaticGather {
+	bool valid;        // 判定したかどうか（KCharacterCollider を持っているか）
+	KVec3 center;      // 判定したときのコライダー中心（ワールド座標）
+	int worker;        // 壁との衝突を格納したワーカー
+	int contact_start; // 壁との衝突の格納位置
+	int contact_count; // 壁との衝突の数
+	bool ground_found; // center の真下に地面があるか
+	float ground_alt;  // center から地面までの高度
+	KSolidBody *ground;
+};
+
+/// 地形との判定を並列に行うときの、ワーカーごとの作業領域
+struct SStaticWorker {
+	std::vector<SStaticContact> contacts;
+	KBodyList candidates;
+	std::vector<int> indices;
+};
+
+/// 眠っている動的剛体の AABB（X 座標の最小値でソートしておき、起きている剛体との接触を調べる）
+struct SSleepEntry {
+	KVec3 aabb_min, aabb_max; // EXTENDS だけ拡大した AABB（ワールド座標）
+	KSolidBody *body;
+};
+
 
 static void _GUI_ColliderAABB(KCollider *coll) {
 	if (coll) {
@@ -371,6 +440,783 @@ static void _BodyList_erase(KBodyList &bodynodes, KNode *knode) {
 }
 
 
+#pragma region CStaticBroadphase
+/// 静的剛体の AABB をキャッシュし、BVH またはルーズグリッドで判定候補を絞り込む。
+/// 候補は構築に使ったボディリスト内のインデックスの昇順で返すので、
+/// 総当たりで判定した場合と同じ順番で詳細判定を行うことができる。
+/// ※平面コライダーは AABB (ローカルのトリム範囲) が交点を包含しないため、空間分割に入れずに常に候補に含める。
+/// ※それ以外のコライダーは、レイや球との交点が AABB の内側（誤差 BROADPHASE_MARGIN 以内）にあるものとする
+///   （KQuadCollider は判定面に投影した頂点も AABB に含める。get_collider_aabb を参照）
+class CStaticBroadphase {
+	struct NODE {
+		KVec3 minp, maxp;
+		int left;  // 子ノードのインデックス（右の子は left+1）。葉なら -1
+		int first; // 葉の場合、m_Items 内の開始位置
+		int count; // 葉の場合、要素数
+	};
+	static const int BVH_LEAF_SIZE = 4;
+	static const int BVH_BINS = 12;
+	static const int GRID_MAX_CELLS = 256; // グリッドの縦横セル数の上限
+
+	KStaticBroadphase m_Type;
+	KBodyList m_Bodies;
+	std::vector<KCollider *> m_Colliders;
+	std::vector<KVec3> m_Min;
+	std::vector<KVec3> m_Max;
+	std::vector<int> m_Items;     // 空間分割に登録されている要素
+	std::vector<int> m_Unbounded; // 常に候補に含める要素
+	std::vector<int> m_Huge;      // グリッドのセルに入りきらない巨大な要素
+	mutable std::vector<int> m_TmpIndices;
+
+	// BVH
+	std::vector<NODE> m_Nodes;
+
+	// ルーズグリッド (XZ平面)
+	std::vector<int> m_CellStart; // セル i の要素は m_Items[m_CellStart[i] .. m_CellStart[i+1]]
+	float m_CellSize;
+	float m_OriginX, m_OriginZ;
+	int m_Cols, m_Rows;
+	float m_LooseX, m_LooseZ; // 要素の半径の最大値。セルの検索範囲をこれだけ広げる
+
+	uint32_t m_TransformRevision;
+	uint32_t m_ShapeRevision;
+	bool m_Dirty;
+	int m_NumRebuilds;
+	int m_NumRefits;
+	uint32_t m_ContentRevision;
+
+public:
+	CStaticBroadphase() {
+		m_Type = KStaticBroadphase_BVH;
+		m_CellSize = 0;
+		m_OriginX = m_OriginZ = 0;
+		m_Cols = m_Rows = 0;
+		m_LooseX = m_LooseZ = 0;
+		m_TransformRevision = 0;
+		m_ShapeRevision = 0;
+		m_Dirty = true;
+		m_NumRebuilds = 0;
+		m_NumRefits = 0;
+		m_ContentRevision = 0;
+	}
+	void setType(KStaticBroadphase type) {
+		if (m_Type != type) {
+			m_Type = type;
+			m_Dirty = true;
+		}
+	}
+	KStaticBroadphase getType() const {
+		return m_Type;
+	}
+	/// 静的剛体の追加、削除、形状の差し替えなどで構成が変わった
+	void markDirty() {
+		m_Dirty = true;
+	}
+	int getNumRebuilds() const {
+		return m_NumRebuilds;
+	}
+	int getNumRefits() const {
+		return m_NumRefits;
+	}
+	/// 再構築するか、どれかの AABB または形状が変化するたびに増える
+	uint32_t getContentRevision() const {
+		return m_ContentRevision;
+	}
+
+	/// bodylist に対応するように内部データを更新する。
+	/// ボディの構成が変わっていれば（markDirty されていれば）再構築し、どれかが移動していれば AABB を更新する（変化がなければ何もしない）
+	void validate(const KBodyList &bodylist) {
+		if (m_Dirty) {
+			rebuild(bodylist);
+			return;
+		}
+		if (m_TransformRevision != STransformData::getWatchedWorldMatrixRevision() || m_ShapeRevision != KCollider::get_shape_revision()) {
+			refit();
+		}
+	}
+
+	/// AABB が [minp, maxp] と交差する可能性のあるボディを、元のリストと同じ順番で得る
+	void queryAabb(const KVec3 &minp, const KVec3 &maxp, KBodyList &out) const {
+		queryAabb(minp, maxp, out, m_TmpIndices);
+	}
+
+	/// queryAabb と同じだが、作業領域 work を使う。
+	/// 内部データを書き換えないので、別々の作業領域を使えば複数のスレッドから同時に呼んでもよい
+	void queryAabb(const KVec3 &minp, const KVec3 &maxp, KBodyList &out, std::vector<int> &work) const {
+		query_aabb_indices(minp, maxp, work);
+		to_bodies(work, out);
+	}
+
+	/// start から dir 方向に伸びるレイ（maxdist が負なら無限長）が、
+	/// margin だけ拡大した AABB を通過する可能性のあるボディを元のリストと同じ順番で得る
+	void queryRay(const KVec3 &start, const KVec3 &dir, float maxdist, float margin, KBodyList &out) const {
+		query_ray_indices(start, dir, maxdist, margin, m_TmpIndices);
+		to_bodies(m_TmpIndices, out);
+	}
+
+	/// AABB が [minp, maxp] と交差する可能性のある要素のインデックスを昇順で得る
+	void queryAabbIndices(const KVec3 &minp, const KVec3 &maxp, std::vector<int> &out) const {
+		query_aabb_indices(minp, maxp, out);
+	}
+	KSolidBody * getBody(int index) const {
+		return m_Bodies[index];
+	}
+	KCollider * getCollider(int index) const {
+		return m_Colliders[index];
+	}
+	const KVec3 & getAabbMin(int index) const {
+		return m_Min[index];
+	}
+	const KVec3 & getAabbMax(int index) const {
+		return m_Max[index];
+	}
+	/// AABB を持たない（どの問い合わせにも必ず含まれる）要素かどうか
+	bool isUnbounded(int index) const {
+		return is_unbounded(index);
+	}
+
+	/// 全要素を包含する AABB を得る
+	bool getBounds(KVec3 *out_min, KVec3 *out_max) const {
+		if (m_Bodies.empty()) {
+			return false;
+		}
+		KVec3 minp = m_Min[0];
+		KVec3 maxp = m_Max[0];
+		for (int i=1; i<(int)m_Bodies.size(); i++) {
+			minp = minp.getmin(m_Min[i]);
+			maxp = maxp.getmax(m_Max[i]);
+		}
+		if (out_min) *out_min = minp;
+		if (out_max) *out_max = maxp;
+		return true;
+	}
+
+private:
+	void to_bodies(const std::vector<int> &indices, KBodyList &out) const {
+		out.resize(indices.size());
+		for (int i=0; i<(int)indices.size(); i++) {
+			out[i] = m_Bodies[indices[i]];
+		}
+	}
+	void query_aabb_indices(const KVec3 &minp, const KVec3 &maxp, std::vector<int> &out) const {
+		out.clear();
+		switch (m_Type) {
+		case KStaticBroadphase_BVH:
+			query_bvh(minp, maxp, out);
+			break;
+		case KStaticBroadphase_GRID:
+			query_grid(minp, maxp, out);
+			break;
+		default:
+			for (int i=0; i<(int)m_Bodies.size(); i++) {
+				out.push_back(i);
+			}
+			return; // 全要素を順番に入れたので、ソートも不要
+		}
+		out.insert(out.end(), m_Unbounded.begin(), m_Unbounded.end());
+		std::sort(out.begin(), out.end());
+	}
+	void query_ray_indices(const KVec3 &start, const KVec3 &dir, float maxdist, float margin, std::vector<int> &out) const {
+		out.clear();
+		if (m_Type == KStaticBroadphase_NONE) {
+			query_aabb_indices(KVec3(), KVec3(), out); // 総当たり
+			return;
+		}
+		KVec3 bmin, bmax;
+		if (!getBounds(&bmin, &bmax)) {
+			return;
+		}
+		const KVec3 pad(margin, margin, margin);
+
+		// コライダーによってはレイ始点の後ろ側の交点も返すので、
+		// レイではなく直線として扱い、全体の AABB で切り取った区間を得る
+		float t0 = -FLT_MAX;
+		float t1 =  FLT_MAX;
+		if (!clip_ray(start, dir, bmin - pad, bmax + pad, &t0, &t1)) {
+			out = m_Unbounded;
+			return;
+		}
+		KVec3 qmin = (start + dir * t0).getmin(start + dir * t1) - pad;
+		KVec3 qmax = (start + dir * t0).getmax(start + dir * t1) + pad;
+		if (maxdist > 0) {
+			// 長さが決まっている場合は、始点と終点を含む AABB と交差するものだけが対象になる
+			KVec3 end = start + dir * maxdist;
+			qmin = qmin.getmax(start.getmin(end) - pad);
+			qmax = qmax.getmin(start.getmax(end) + pad);
+		}
+		query_aabb_indices(qmin, qmax, out);
+
+		// 候補を個別のスラブ判定で絞り込む
+		int n = 0;
+		for (int i=0; i<(int)out.size(); i++) {
+			int idx = out[i];
+			float s0 = t0;
+			float s1 = t1;
+			if (is_unbounded(idx) || clip_ray(start, dir, m_Min[idx] - pad, m_Max[idx] + pad, &s0, &s1)) {
+				out[n++] = idx;
+			}
+		}
+		out.resize(n);
+	}
+	bool is_unbounded(int idx) const {
+		return std::binary_search(m_Unbounded.begin(), m_Unbounded.end(), idx);
+	}
+	static bool overlaps(const KVec3 &amin, const KVec3 &amax, const KVec3 &bmin, const KVec3 &bmax) {
+		if (amax.x < bmin.x || bmax.x < amin.x) return false;
+		if (amax.y < bmin.y || bmax.y < amin.y) return false;
+		if (amax.z < bmin.z || bmax.z < amin.z) return false;
+		return true;
+	}
+	// 空間分割に登録する AABB を得る。
+	// 四角形はコライダーの中心を通る平面でレイや球と判定するので、頂点がその平面上に無い場合に備えて、
+	// 平面に投影した頂点も含める。get_aabb の範囲だけでは、総当たりで当たるものを除外してしまう
+	static void get_collider_aabb(const KCollider *coll, KVec3 *out_min, KVec3 *out_max) {
+		coll->get_aabb(0, out_min, out_max);
+		if (coll->get_type() == KColliderType_QUAD) {
+			const KQuadCollider *quad = static_cast<const KQuadCollider *>(coll);
+			const KVec3 &n = quad->get_normal();
+			KVec3 wpos = coll->get_offset_world();
+			KVec3 points[4];
+			quad->get_points(points);
+			for (int i=0; i<4; i++) {
+				KVec3 proj = wpos + points[i] - n * points[i].dot(n);
+				*out_min = out_min->getmin(proj);
+				*out_max = out_max->getmax(proj);
+			}
+		}
+	}
+	static float surface_area(const KVec3 &minp, const KVec3 &maxp) {
+		KVec3 d = maxp - minp;
+		return d.x * d.y + d.y * d.z + d.z * d.x;
+	}
+	// レイの区間 [t0, t1] を AABB で切り取る（スラブ法）
+	static bool clip_ray(const KVec3 &start, const KVec3 &dir, const KVec3 &minp, const KVec3 &maxp, float *t0, float *t1) {
+		const float s[] = {start.x, start.y, start.z};
+		const float d[] = {dir.x, dir.y, dir.z};
+		const float lo[] = {minp.x, minp.y, minp.z};
+		const float hi[] = {maxp.x, maxp.y, maxp.z};
+		for (int a=0; a<3; a++) {
+			if (d[a] == 0) {
+				if (s[a] < lo[a] || hi[a] < s[a]) return false;
+				continue;
+			}
+			float inv = 1.0f / d[a];
+			float ta = (lo[a] - s[a]) * inv;
+			float tb = (hi[a] - s[a]) * inv;
+			if (ta > tb) std::swap(ta, tb);
+			if (ta > *t0) *t0 = ta;
+			if (tb < *t1) *t1 = tb;
+			if (*t0 > *t1) return false;
+		}
+		return true;
+	}
+	void update_aabbs() {
+		bool changed = m_ShapeRevision != KCollider::get_shape_revision();
+		for (int i=0; i<(int)m_Bodies.size(); i++) {
+			KCollider *coll = m_Colliders[i];
+			KVec3 minp, maxp;
+			if (coll) {
+				get_collider_aabb(coll, &minp, &maxp);
+			}
+			if (minp != m_Min[i] || maxp != m_Max[i]) {
+				m_Min[i] = minp;
+				m_Max[i] = maxp;
+				changed = true;
+			}
+		}
+		m_TransformRevision = STransformData::getWatchedWorldMatrixRevision();
+		m_ShapeRevision = KCollider::get_shape_revision();
+		if (changed) {
+			m_ContentRevision++;
+		}
+	}
+	void rebuild(const KBodyList &bodylist) {
+		m_Bodies = bodylist;
+		int num = (int)m_Bodies.size();
+		m_Colliders.resize(num);
+		m_Min.resize(num);
+		m_Max.resize(num);
+		m_Unbounded.clear();
+		for (int i=0; i<num; i++) {
+			KCollider *coll = m_Bodies[i]->getShape();
+			m_Colliders[i] = coll;
+			if (coll == nullptr || coll->get_type() == KColliderType_PLANE) {
+				m_Unbounded.push_back(i);
+			}
+		}
+		update_aabbs();
+		build_structure();
+		m_Dirty = false;
+		m_NumRebuilds++;
+		m_ContentRevision++;
+	}
+	void refit() {
+		update_aabbs();
+		if (m_Type == KStaticBroadphase_BVH) {
+			// 子ノードは必ず親ノードよりも後ろにあるので、逆順にたどれば葉から順に更新できる
+			for (int n=(int)m_Nodes.size()-1; n>=0; n--) {
+				NODE &node = m_Nodes[n];
+				if (node.left < 0) {
+					node.minp = m_Min[m_Items[node.first]];
+					node.maxp = m_Max[m_Items[node.first]];
+					for (int i=1; i<node.count; i++) {
+						int idx = m_Items[node.first + i];
+						node.minp = node.minp.getmin(m_Min[idx]);
+						node.maxp = node.maxp.getmax(m_Max[idx]);
+					}
+				} else {
+					const NODE &a = m_Nodes[node.left];
+					const NODE &b = m_Nodes[node.left + 1];
+					node.minp = a.minp.getmin(b.minp);
+					node.maxp = a.maxp.getmax(b.maxp);
+				}
+			}
+		} else {
+			build_structure(); // グリッドは作り直しても十分に安い
+		}
+		m_NumRefits++;
+	}
+	void build_structure() {
+		m_Items.clear();
+		m_Nodes.clear();
+		m_Huge.clear();
+		m_CellStart.clear();
+		m_Cols = m_Rows = 0;
+		if (m_Type == KStaticBroadphase_NONE) {
+			return;
+		}
+		for (int i=0; i<(int)m_Bodies.size(); i++) {
+			if (!is_unbounded(i)) {
+				m_Items.push_back(i);
+			}
+		}
+		if (m_Items.empty()) {
+			return;
+		}
+		if (m_Type == KStaticBroadphase_BVH) {
+			m_Nodes.reserve(m_Items.size() * 2);
+			m_Nodes.push_back(NODE());
+			build_bvh(0, 0, (int)m_Items.size());
+		} else {
+			build_grid();
+		}
+	}
+
+	#pragma region BVH
+	void build_bvh(int nodeindex, int first, int count) {
+		KVec3 minp = m_Min[m_Items[first]];
+		KVec3 maxp = m_Max[m_Items[first]];
+		KVec3 cmin = (m_Min[m_Items[first]] + m_Max[m_Items[first]]) * 0.5f;
+		KVec3 cmax = cmin;
+		for (int i=first+1; i<first+count; i++) {
+			int idx = m_Items[i];
+			KVec3 c = (m_Min[idx] + m_Max[idx]) * 0.5f;
+			minp = minp.getmin(m_Min[idx]);
+			maxp = maxp.getmax(m_Max[idx]);
+			cmin = cmin.getmin(c);
+			cmax = cmax.getmax(c);
+		}
+		{
+			NODE &node = m_Nodes[nodeindex];
+			node.minp = minp;
+			node.maxp = maxp;
+			node.left = -1;
+			node.first = first;
+			node.count = count;
+		}
+		if (count <= BVH_LEAF_SIZE) {
+			return;
+		}
+
+		// 各軸について、中心点をビンに分けて SAH コストが最小になる分割位置を探す
+		int best_axis = -1;
+		int best_split = 0;
+		float best_cost = surface_area(minp, maxp) * count; // 分割しない場合のコスト
+		for (int axis=0; axis<3; axis++) {
+			float lo = cmin.floats()[axis];
+			float hi = cmax.floats()[axis];
+			if (hi <= lo) continue;
+			float scale = BVH_BINS / (hi - lo);
+			int bin_count[BVH_BINS] = {0};
+			KVec3 bin_min[BVH_BINS], bin_max[BVH_BINS];
+			for (int i=first; i<first+count; i++) {
+				int idx = m_Items[i];
+				float c = (m_Min[idx].floats()[axis] + m_Max[idx].floats()[axis]) * 0.5f;
+				int b = KMath::min((int)((c - lo) * scale), BVH_BINS - 1);
+				if (bin_count[b] == 0) {
+					bin_min[b] = m_Min[idx];
+					bin_max[b] = m_Max[idx];
+				} else {
+					bin_min[b] = bin_min[b].getmin(m_Min[idx]);
+					bin_max[b] = bin_max[b].getmax(m_Max[idx]);
+				}
+				bin_count[b]++;
+			}
+			// 右側から累積した面積と要素数
+			float right_area[BVH_BINS];
+			int right_count[BVH_BINS];
+			{
+				KVec3 rmin, rmax;
+				int n = 0;
+				for (int b=BVH_BINS-1; b>0; b--) {
+					if (bin_count[b] > 0) {
+						rmin = (n > 0) ? rmin.getmin(bin_min[b]) : bin_min[b];
+						rmax = (n > 0) ? rmax.getmax(bin_max[b]) : bin_max[b];
+						n += bin_count[b];
+					}
+					right_count[b] = n;
+					right_area[b] = (n > 0) ? surface_area(rmin, rmax) : 0;
+				}
+			}
+			{
+				KVec3 lmin, lmax;
+				int n = 0;
+				for (int b=0; b<BVH_BINS-1; b++) {
+					if (bin_count[b] > 0) {
+						lmin = (n > 0) ? lmin.getmin(bin_min[b]) : bin_min[b];
+						lmax = (n > 0) ? lmax.getmax(bin_max[b]) : bin_max[b];
+						n += bin_count[b];
+					}
+					if (n == 0 || right_count[b+1] == 0) continue;
+					float cost = surface_area(lmin, lmax) * n + right_area[b+1] * right_count[b+1];
+					if (cost < best_cost) {
+						best_cost = cost;
+						best_axis = axis;
+						best_split = b + 1;
+					}
+				}
+			}
+		}
+
+		int mid;
+		if (best_axis >= 0) {
+			float lo = cmin.floats()[best_axis];
+			float hi = cmax.floats()[best_axis];
+			float scale = BVH_BINS / (hi - lo);
+			const std::vector<KVec3> &vmin = m_Min;
+			const std::vector<KVec3> &vmax = m_Max;
+			auto it = std::partition(m_Items.begin() + first, m_Items.begin() + first + count, [&](int idx) {
+				float c = (vmin[idx].floats()[best_axis] + vmax[idx].floats()[best_axis]) * 0.5f;
+				int b = KMath::min((int)((c - lo) * scale), BVH_BINS - 1);
+				return b < best_split;
+			});
+			mid = (int)(it - m_Items.begin());
+		} else {
+			// 分割してもコストが下がらない。
+			// 要素がそれなりに多いなら、最も長い軸の中央値で強制的に分割する
+			if (count <= BVH_LEAF_SIZE * 4) {
+				return;
+			}
+			KVec3 ext = cmax - cmin;
+			int axis = (ext.x >= ext.y && ext.x >= ext.z) ? 0 : (ext.y >= ext.z ? 1 : 2);
+			const std::vector<KVec3> &vmin = m_Min;
+			const std::vector<KVec3> &vmax = m_Max;
+			mid = first + count / 2;
+			std::nth_element(m_Items.begin() + first, m_Items.begin() + mid, m_Items.begin() + first + count, [&](int a, int b) {
+				return vmin[a].floats()[axis] + vmax[a].floats()[axis] < vmin[b].floats()[axis] + vmax[b].floats()[axis];
+			});
+		}
+		if (mid <= first || first + count <= mid) {
+			return; // 分割できなかった
+		}
+		int left = (int)m_Nodes.size();
+		m_Nodes.push_back(NODE());
+		m_Nodes.push_back(NODE());
+		m_Nodes[nodeindex].left = left;
+		m_Nodes[nodeindex].count = 0;
+		build_bvh(left,     first, mid - first);
+		build_bvh(left + 1, mid,   first + count - mid);
+	}
+	void query_bvh(const KVec3 &minp, const KVec3 &maxp, std::vector<int> &out) const {
+		if (m_Nodes.empty()) return;
+		int stack[64];
+		int sp = 0;
+		stack[sp++] = 0;
+		while (sp > 0) {
+			const NODE &node = m_Nodes[stack[--sp]];
+			if (!overlaps(node.minp, node.maxp, minp, maxp)) {
+				continue;
+			}
+			if (node.left < 0) {
+				for (int i=0; i<node.count; i++) {
+					int idx = m_Items[node.first + i];
+					if (overlaps(m_Min[idx], m_Max[idx], minp, maxp)) {
+						out.push_back(idx);
+					}
+				}
+			} else if (sp + 2 <= (int)(sizeof(stack) / sizeof(stack[0]))) {
+				stack[sp++] = node.left + 1;
+				stack[sp++] = node.left;
+			} else {
+				// 木が深すぎる（通常はありえない）。この部分木は総当たりする
+				query_bvh_recursive(node.left, minp, maxp, out);
+				query_bvh_recursive(node.left + 1, minp, maxp, out);
+			}
+		}
+	}
+	void query_bvh_recursive(int nodeindex, const KVec3 &minp, const KVec3 &maxp, std::vector<int> &out) const {
+		const NODE &node = m_Nodes[nodeindex];
+		if (!overlaps(node.minp, node.maxp, minp, maxp)) {
+			return;
+		}
+		if (node.left < 0) {
+			for (int i=0; i<node.count; i++) {
+				int idx = m_Items[node.first + i];
+				if (overlaps(m_Min[idx], m_Max[idx], minp, maxp)) {
+					out.push_back(idx);
+				}
+			}
+		} else {
+			query_bvh_recursive(node.left, minp, maxp, out);
+			query_bvh_recursive(node.left + 1, minp, maxp, out);
+		}
+	}
+	#pragma endregion // BVH
+
+	#pragma region Grid
+	void build_grid() {
+		// 要素の中心が入っているセルにだけ要素を登録する（ルーズグリッド）。
+		// セルサイズは要素の平均的な大きさの２倍とし、セルサイズの４倍を超える巨大な要素は別枠で扱う
+		KVec3 cmin, cmax;
+		float sum = 0;
+		for (int i=0; i<(int)m_Items.size(); i++) {
+			int idx = m_Items[i];
+			KVec3 c = (m_Min[idx] + m_Max[idx]) * 0.5f;
+			cmin = (i > 0) ? cmin.getmin(c) : c;
+			cmax = (i > 0) ? cmax.getmax(c) : c;
+			sum += KMath::max(m_Max[idx].x - m_Min[idx].x, m_Max[idx].z - m_Min[idx].z);
+		}
+		float cell = KMath::max(sum / m_Items.size() * 2.0f, 1.0f);
+		cell = KMath::max(cell, (cmax.x - cmin.x) / GRID_MAX_CELLS);
+		cell = KMath::max(cell, (cmax.z - cmin.z) / GRID_MAX_CELLS);
+		m_CellSize = cell;
+		m_OriginX = cmin.x;
+		m_OriginZ = cmin.z;
+		m_Cols = KMath::min((int)((cmax.x - cmin.x) / cell) + 1, GRID_MAX_CELLS);
+		m_Rows = KMath::min((int)((cmax.z - cmin.z) / cell) + 1, GRID_MAX_CELLS);
+		m_LooseX = 0;
+		m_LooseZ = 0;
+
+		// 計数ソートでセルごとに並べる
+		std::vector<int> cells(m_Items.size());
+		m_CellStart.assign(m_Cols * m_Rows + 1, 0);
+		std::vector<int> items;
+		items.reserve(m_Items.size());
+		for (int i=0; i<(int)m_Items.size(); i++) {
+			int idx = m_Items[i];
+			float hx = (m_Max[idx].x - m_Min[idx].x) * 0.5f;
+			float hz = (m_Max[idx].z - m_Min[idx].z) * 0.5f;
+			if (hx > cell * 4 || hz > cell * 4) {
+				m_Huge.push_back(idx);
+				cells[i] = -1;
+				continue;
+			}
+			m_LooseX = KMath::max(m_LooseX, hx);
+			m_LooseZ = KMath::max(m_LooseZ, hz);
+			int col = get_col((m_Min[idx].x + m_Max[idx].x) * 0.5f);
+			int row = get_row((m_Min[idx].z + m_Max[idx].z) * 0.5f);
+			cells[i] = row * m_Cols + col;
+			m_CellStart[cells[i] + 1]++;
+		}
+		for (int c=0; c<m_Cols*m_Rows; c++) {
+			m_CellStart[c + 1] += m_CellStart[c];
+		}
+		std::vector<int> pos(m_CellStart.begin(), m_CellStart.end() - 1);
+		items.resize(m_CellStart.back());
+		for (int i=0; i<(int)m_Items.size(); i++) {
+			if (cells[i] >= 0) {
+				items[pos[cells[i]]++] = m_Items[i];
+			}
+		}
+		m_Items.swap(items);
+	}
+	int get_col(float x) const {
+		return KMath::clampi((int)floorf((x - m_OriginX) / m_CellSize), 0, m_Cols - 1);
+	}
+	int get_row(float z) const {
+		return KMath::clampi((int)floorf((z - m_OriginZ) / m_CellSize), 0, m_Rows - 1);
+	}
+	void query_grid(const KVec3 &minp, const KVec3 &maxp, std::vector<int> &out) const {
+		if (m_Cols > 0 && m_Rows > 0) {
+			// 中心がこの範囲にある要素だけが交差する可能性がある
+			float x0 = minp.x - m_LooseX;
+			float x1 = maxp.x + m_LooseX;
+			float z0 = minp.z - m_LooseZ;
+			float z1 = maxp.z + m_LooseZ;
+			int col0 = get_col(x0);
+			int col1 = get_col(x1);
+			int row0 = get_row(z0);
+			int row1 = get_row(z1);
+			for (int row=row0; row<=row1; row++) {
+				for (int col=col0; col<=col1; col++) {
+					int c = row * m_Cols + col;
+					for (int i=m_CellStart[c]; i<m_CellStart[c+1]; i++) {
+						int idx = m_Items[i];
+						if (overlaps(m_Min[idx], m_Max[idx], minp, maxp)) {
+							out.push_back(idx);
+						}
+					}
+				}
+			}
+		}
+		for (int i=0; i<(int)m_Huge.size(); i++) {
+			int idx = m_Huge[i];
+			if (overlaps(m_Min[idx], m_Max[idx], minp, maxp)) {
+				out.push_back(idx);
+			}
+		}
+	}
+	#pragma endregion // Grid
+};
+#pragma endregion // CStaticBroadphase
+
+
+#pragma region CDynamicSweep
+/// 動的剛体同士の判定候補を絞り込むためのソート＆スイープ。
+/// 各剛体の X 方向の範囲を下端の昇順に並べておき、範囲が重なる可能性のある剛体だけを返す。
+/// 並び順はフレームをまたいで保持し、挿入ソートで更新する（キャラクターの移動量は小さいのでほぼ整列済みのまま）。
+/// めり込み解決で移動した剛体は update() でその場で並べ直すので、判定途中の位置変化も正しく反映される
+class CDynamicSweep {
+	struct ENTRY {
+		float minx, maxx;
+		int index; // 判定テーブル内でのインデックス
+		KSolidBody *body;
+	};
+	std::vector<ENTRY> m_Entries; // minx の昇順
+	std::vector<int> m_Slots; // インデックスから m_Entries 内の位置への対応
+	std::vector<char> m_TmpPlaced;
+	std::unordered_map<KSolidBody *, int> m_TmpIndices;
+	float m_MaxWidth;
+	int m_NumSwaps;
+public:
+	CDynamicSweep() {
+		m_MaxWidth = 0;
+		m_NumSwaps = 0;
+	}
+	/// 挿入ソートで要素を入れ替えた回数（テスト用）
+	int getNumSwaps() const {
+		return m_NumSwaps;
+	}
+
+	/// table の各剛体の AABB を infos で与えて並び順を更新する
+	void build(const KBodyList &table, const std::vector<COL_INFO> &infos) {
+		K__ASSERT(table.size() == infos.size());
+		int num = (int)table.size();
+		m_TmpIndices.clear();
+		for (int i=0; i<num; i++) {
+			m_TmpIndices[table[i]] = i;
+		}
+		m_TmpPlaced.assign(num, 0);
+
+		// 前回の並び順のうち、今回も存在するものをそのままの順番で残す
+		std::vector<ENTRY> &entries = m_Entries;
+		int count = 0;
+		for (int k=0; k<(int)entries.size(); k++) {
+			auto it = m_TmpIndices.find(entries[k].body);
+			if (it != m_TmpIndices.end() && !m_TmpPlaced[it->second]) {
+				m_TmpPlaced[it->second] = 1;
+				entries[count].index = it->second;
+				entries[count].body = it->first;
+				count++;
+			}
+		}
+		entries.resize(count);
+
+		// 新しく追加されたものを末尾に加える
+		for (int i=0; i<num; i++) {
+			if (!m_TmpPlaced[i]) {
+				ENTRY e;
+				e.index = i;
+				e.body = table[i];
+				entries.push_back(e);
+			}
+		}
+
+		// 範囲を更新して挿入ソート
+		m_MaxWidth = 0;
+		for (int k=0; k<num; k++) {
+			ENTRY &e = entries[k];
+			e.minx = infos[e.index].extended_whole_aabb_min.x;
+			e.maxx = infos[e.index].extended_whole_aabb_max.x;
+			m_MaxWidth = KMath::max(m_MaxWidth, e.maxx - e.minx);
+		}
+		for (int k=1; k<num; k++) {
+			ENTRY e = entries[k];
+			int n = k;
+			while (n > 0 && e.minx < entries[n-1].minx) {
+				entries[n] = entries[n-1];
+				n--;
+				m_NumSwaps++;
+			}
+			entries[n] = e;
+		}
+		m_Slots.resize(num);
+		for (int k=0; k<num; k++) {
+			m_Slots[entries[k].index] = k;
+		}
+	}
+
+	/// index 番目の剛体が移動したので、範囲を更新して並べ直す
+	void update(int index, const COL_INFO &info) {
+		int k = m_Slots[index];
+		ENTRY e = m_Entries[k];
+		e.minx = info.extended_whole_aabb_min.x;
+		e.maxx = info.extended_whole_aabb_max.x;
+		m_MaxWidth = KMath::max(m_MaxWidth, e.maxx - e.minx);
+		while (k > 0 && e.minx < m_Entries[k-1].minx) {
+			m_Entries[k] = m_Entries[k-1];
+			m_Slots[m_Entries[k].index] = k;
+			k--;
+			m_NumSwaps++;
+		}
+		while (k+1 < (int)m_Entries.size() && m_Entries[k+1].minx < e.minx) {
+			m_Entries[k] = m_Entries[k+1];
+			m_Slots[m_Entries[k].index] = k;
+			k++;
+			m_NumSwaps++;
+		}
+		m_Entries[k] = e;
+		m_Slots[index] = k;
+	}
+
+	/// index 番目の剛体（AABB は info）と X 方向の範囲が重なっていて、インデックスが index より大きいものをインデックスの昇順で得る。
+	/// 範囲が接しているだけのものも含む（K_GeomIntersectAabb と同じ判定）
+	void query(int index, const COL_INFO &info, std::vector<int> &out) const {
+		out.clear();
+		const float lo = info.extended_whole_aabb_min.x;
+		const float hi = info.extended_whole_aabb_max.x;
+
+		// maxx >= lo となるには minx >= lo - m_MaxWidth が必要。丸め誤差の分だけ余裕を持たせておく
+		const float start = lo - (m_MaxWidth * 1.01f + 1.0f);
+		int k = lower_bound(start);
+		for (; k<(int)m_Entries.size(); k++) {
+			const ENTRY &e = m_Entries[k];
+			if (hi < e.minx) break;
+			if (e.maxx < lo) continue;
+			if (e.index <= index) continue;
+			out.push_back(e.index);
+		}
+		std::sort(out.begin(), out.end());
+	}
+
+private:
+	int lower_bound(float minx) const {
+		int lo = 0;
+		int hi = (int)m_Entries.size();
+		while (lo < hi) {
+			int mid = (lo + hi) / 2;
+			if (m_Entries[mid].minx < minx) {
+				lo = mid + 1;
+			} else {
+				hi = mid;
+			}
+		}
+		return lo;
+	}
+};
+#pragma endregion // CDynamicSweep
+
+
 #pragma region CCollisionMgr
 class CCollisionMgr: public KManager, public KInspectorCallback {
 	KBodyList m_TmpTable;
@@ -383,12 +1229,37 @@ class CCollisionMgr: public KManager, public KInspectorCallback {
 	bool m_AlwaysShowDynamicCollider;
 	const char *m_GroupNames[sizeof(uint32_t) * 8];
 	mutable std::recursive_mutex m_Mutex;
-	mutable KBodyList m_TmpBodyList_Ground;
-	mutable KBodyList m_TmpBodyList_Altitude;
-	mutable KBodyList m_TmpBodyList_Ray;
-	mutable KBodyList m_TmpBodyList_SphereCast;
-	mutable KBodyList m_TmpBodyList_SphereCollide;
-	mutable KBodyList m_TmpStaticBody_Collision;
+	KBodyList m_ActiveStatics; // 判定対象になる静的剛体のリスト（m_Nodes の列挙順）
+	KBodyList m_TmpActiveStatics;
+	bool m_ActiveStaticsDirty;
+	uint32_t m_ActiveStaticsBitsInTreeRevision;
+	uint32_t m_ActiveStaticsEnableRevision;
+	int m_NumActiveStaticsScans;
+	int m_NumActiveStaticsQueries;
+	mutable KBodyList m_TmpCandidates_Ground;
+	mutable KBodyList m_TmpCandidates_Ray;
+	mutable KBodyList m_TmpCandidates_Sphere;
+	mutable KBodyList m_TmpCandidates_Wall;
+	std::vector<std::pair<int64_t, int>> m_TmpBatchOrder;
+	std::vector<int> m_TmpBatchIndices;
+	CStaticBroadphase m_StaticBroadphase;
+	CDynamicSweep m_DynamicSweep;
+	KDynamicBroadphase m_DynamicBroadphase;
+	std::vector<COL_INFO> m_TmpDynamicInfos;
+	std::vector<int> m_TmpDynamicPairs;
+	mutable std::vector<int> m_TmpGroundIndices;
+	std::vector<SStaticGather> m_TmpStaticGathers;
+	std::vector<SStaticWorker> m_StaticWorkers;
+	KParallelFor m_Parallel;
+	KBodyList m_AwakeDynamics;    // 起きている動的剛体
+	KBodyList m_SleepingDynamics; // 自動スリープで眠っている動的剛体
+	std::vector<KNode *> m_WakeRequests; // 起こす必要のある剛体のノード（次のフレームの最初に処理する）
+	std::vector<SSleepEntry> m_SleepEntries; // 眠っている剛体の AABB（X座標の最小値の昇順）
+	float m_SleepEntriesMaxWidth; // m_SleepEntries の AABB の X 方向の幅の最大値
+	bool m_SleepEntriesDirty;
+	int m_SleepFrames;
+	uint32_t m_SleepTransformRevision;
+	uint32_t m_SleepStaticRevision;
 
 	void lock() const {
 	#if K_THREAD_SAFE
@@ -408,6 +1279,17 @@ public:
 		m_AlwaysShowDynamicCollider = false;
 		m_Callback = nullptr;
 		memset(m_GroupNames, 0, sizeof(m_GroupNames));
+		m_DynamicBroadphase = KDynamicBroadphase_SWEEP;
+		m_ActiveStaticsDirty = true;
+		m_ActiveStaticsBitsInTreeRevision = 0;
+		m_ActiveStaticsEnableRevision = 0;
+		m_NumActiveStaticsScans = 0;
+		m_NumActiveStaticsQueries = 0;
+		m_SleepEntriesMaxWidth = 0;
+		m_SleepEntriesDirty = true;
+		m_SleepFrames = DEFAULT_SLEEP_FRAMES;
+		m_SleepTransformRevision = 0;
+		m_SleepStaticRevision = 0;
 
 		KEngine::addManager(this);
 		KEngine::addInspectorCallback(this, u8"衝突/物理"); // KInspectorCallback
@@ -454,8 +1336,12 @@ public:
 	virtual void on_manager_frame() override {
 		lock();
 		{
-			for (auto it=m_Nodes.begin(); it!=m_Nodes.end(); ++it) {
-				KSolidBody *bodynode = it->second;
+			// 速度や座標が変更された剛体、地形が変化した剛体を起こす
+			wake_changed_bodies_unsafe();
+
+			// 眠っている剛体の接触情報は、眠った時のものをそのまま残しておく
+			for (auto it=m_AwakeDynamics.begin(); it!=m_AwakeDynamics.end(); ++it) {
+				KSolidBody *bodynode = *it;
 				if (bodynode->getNode()->getEnableInTree()) {
 					if (bodynode->m_Desc.get_sleep_time() > 0) {
 						bodynode->m_Desc._sleep_time--;
@@ -463,6 +1349,12 @@ public:
 				}
 				bodynode->m_Desc._hits_with.clear();
 			}
+			{
+				const KBodyList &statics = get_active_static_body_list_unsafe();
+				for (auto it=statics.begin(); it!=statics.end(); ++it) {
+					(*it)->m_Desc._hits_with.clear();
+				}
+			}
 			if (1) {
 				if (m_Callback) m_Callback->on_collision_update_start();
 				// 衝突処理を行う必要があるエンティティだけをリストアップする
@@ -471,12 +1363,18 @@ public:
 				// 速度コンポーネントにしたがって位置更新（衝突考慮しない）
 				update_dynamicbody_positions_unsafe();
 
+				// 移動後の剛体と接触した剛体を起こし、衝突処理の対象に加える
+				wake_touched_bodies_unsafe();
+
 				// 物理判定同士の衝突処理
 				update_dynamicbody_collision_unsafe();
 
 				// 地形判定と物理判定の衝突処理
 				update_staticbody_collision_unsafe();
 
+				// 静止状態が続いている剛体を眠らせる
+				update_rest_states_unsafe();
+
 				if (m_Callback) m_Callback->on_collision_update_end();
 			} else {
 				// 座標だけ更新する。衝突判定しない
@@ -534,6 +1432,96 @@ public:
 	void setCallback(KSolidBodyCallback *cb) {
 		m_Callback = cb;
 	}
+	void setStaticBroadphase(KStaticBroadphase type) {
+		lock();
+		m_StaticBroadphase.setType(type);
+		unlock();
+	}
+	KStaticBroadphase getStaticBroadphase() const {
+		return m_StaticBroadphase.getType();
+	}
+	void setDynamicBroadphase(KDynamicBroadphase type) {
+		lock();
+		m_DynamicBroadphase = type;
+		unlock();
+	}
+	KDynamicBroadphase getDynamicBroadphase() const {
+		return m_DynamicBroadphase;
+	}
+	void setNumThreads(int num) {
+		lock();
+		m_Parallel.setNumThreads(num);
+		unlock();
+	}
+	int getNumThreads() const {
+		return m_Parallel.getNumThreads();
+	}
+	void setAutoSleepFrames(int frames) {
+		lock();
+		m_SleepFrames = frames;
+		if (frames <= 0) {
+			// 自動スリープしない。眠っている剛体をすべて起こす
+			while (!m_SleepingDynamics.empty()) {
+				wake_body_unsafe(m_SleepingDynamics.back());
+			}
+		}
+		unlock();
+	}
+	int getAutoSleepFrames() const {
+		return m_SleepFrames;
+	}
+	int getNumAwakeBodies() const {
+		return (int)m_AwakeDynamics.size();
+	}
+	int getNumSleepingBodies() const {
+		return (int)m_SleepingDynamics.size();
+	}
+	void wakeBody(KSolidBody *body) {
+		lock();
+		wake_body_unsafe(body);
+		unlock();
+	}
+	/// 次のフレームの最初に node の剛体を起こす。
+	/// Desc の変更から呼ばれるので、ここではリストを直接変更しない
+	void requestWake(KNode *node) {
+		lock();
+		m_WakeRequests.push_back(node);
+		unlock();
+	}
+	const CDynamicSweep & getDynamicSweepData() const {
+		return m_DynamicSweep;
+	}
+	/// 静的剛体の構成が変わった（形状の差し替え、マスクの変更など）
+	void markStaticBodiesDirty() {
+		lock();
+		m_ActiveStaticsDirty = true;
+		m_StaticBroadphase.markDirty();
+		unlock();
+	}
+	const CStaticBroadphase & getStaticBroadphaseData() const {
+		return m_StaticBroadphase;
+	}
+	/// 判定対象になっている静的剛体のリスト（テスト用）
+	KBodyList getActiveStaticBodies() {
+		KBodyList ret;
+		lock();
+		ret = get_active_static_body_list_unsafe();
+		unlock();
+		return ret;
+	}
+	/// キャッシュを使わずに静的剛体のリストを作る（テスト用）
+	void scanActiveStaticBodies(KBodyList &out_bodylist) {
+		lock();
+		scan_active_static_body_list_unsafe(out_bodylist);
+		unlock();
+	}
+	/// 有効な静的剛体リストを作り直した回数と、そのリストを要求された回数（テスト用）
+	int getNumActiveStaticsScans() const {
+		return m_NumActiveStaticsScans;
+	}
+	int getNumActiveStaticsQueries() const {
+		return m_NumActiveStaticsQueries;
+	}
 	void attachVelocity(KNode *node) {
 		// 速度コンポーネントは剛体と共有する。
 		addDynamicBody(node, false);
@@ -546,7 +1534,7 @@ public:
 			// それ以外がアタッチされている場合はエラー
 			KSolidBody *body = getBody(node);
 			if (body) {
-				if (dynamic_cast<KStaticSolidBody *>(body)) {
+				if (body->m_Desc.is_static()) {
 					return; // アタッチ済み
 				}
 				K__ERROR("Incompatible collision-body attached");
@@ -557,6 +1545,12 @@ public:
 			KStaticSolidBody *e = new KStaticSolidBody();
 			e->_setNode(node);
 			m_Nodes[node] = e;
+
+			// 静的剛体の移動と、ツリー内での有効状態の変化を検出できるようにしておく
+			node->_getTransformData().m_WatchWorldMatrix++;
+			node->_getFlagData().m_WatchBitsInTree = true;
+			m_ActiveStaticsDirty = true;
+			m_StaticBroadphase.markDirty();
 		}
 		unlock();
 	}
@@ -567,7 +1561,7 @@ public:
 			// それ以外がアタッチされている場合はエラー
 			KSolidBody *body = getBody(node);
 			if (body) {
-				if (dynamic_cast<KDynamicSolidBody *>(body)) {
+				if (!body->m_Desc.is_static()) {
 					return; // アタッチ済み
 				}
 				K__ERROR("Incompatible collision-body attached");
@@ -578,6 +1572,7 @@ public:
 			KDynamicSolidBody *e = new KDynamicSolidBody(with_default_shape);
 			e->_setNode(node);
 			m_Nodes[node] = e;
+			dynamic_list_add(m_AwakeDynamics, e);
 		}
 		unlock();
 	}
@@ -588,18 +1583,31 @@ public:
 		}
 		return nullptr;
 	}
+	// 剛体は KStaticSolidBody か KDynamicSolidBody のどちらかで、is_static() で区別できる
 	KStaticSolidBody * getStaticBody(KNode *node) {
-		return dynamic_cast<KStaticSolidBody *>(getBody(node));
+		KSolidBody *body = getBody(node);
+		return (body && body->m_Desc.is_static()) ? static_cast<KStaticSolidBody *>(body) : nullptr;
 	}
 	KDynamicSolidBody * getDynamicBody(KNode *node) {
-		return dynamic_cast<KDynamicSolidBody *>(getBody(node));
+		KSolidBody *body = getBody(node);
+		return (body && !body->m_Desc.is_static()) ? static_cast<KDynamicSolidBody *>(body) : nullptr;
 	}
 	void detachBody(KNode *node) {
 		lock();
 		{
 			auto it = m_Nodes.find(node);
 			if (it != m_Nodes.end()) {
+				if (it->second->m_Desc.is_static()) {
+					node->_getTransformData().m_WatchWorldMatrix--;
+					node->_getFlagData().m_WatchBitsInTree = false;
+					m_ActiveStaticsDirty = true;
+					m_StaticBroadphase.markDirty();
+				} else {
+					wake_body_unsafe(it->second);
+					dynamic_list_remove(m_AwakeDynamics, it->second);
+				}
 				it->second->drop();
+				wake_bodies_touching_unsafe(node);
 			}
 			m_Nodes.erase(node);
 		}
@@ -609,11 +1617,9 @@ public:
 		float ret = -1;
 		{
 			KSolidBody *node = nullptr;
-			KBodyList &bodylist = m_TmpBodyList_Altitude;
-			bodylist.clear();
-			get_active_static_body_list_unsafe(bodylist);
+			get_active_static_body_list_unsafe();
 			float alt = -1;
-			if (get_altitude(bodylist, point, max_penetration, &alt, &node)) {
+			if (get_altitude(point, max_penetration, &alt, &node)) {
 				if (out_ground) *out_ground = node->getNode();
 				ret = alt;
 			}
@@ -635,12 +1641,10 @@ public:
 		return ret;
 	}
 	bool getGroundPoint_unsafe(const KVec3 &pos, float max_penetration, float *out_ground_y, KNode **out_ground) {
-		KBodyList &bodylist = m_TmpBodyList_Ground;
-		bodylist.clear();
-		get_active_static_body_list_unsafe(bodylist);
+		get_active_static_body_list_unsafe();
 
 		KSolidBody *node = nullptr;
-		if (get_ground_point(bodylist, pos, max_penetration, out_ground_y, &node)) {
+		if (get_ground_point(pos, max_penetration, out_ground_y, &node)) {
 			if (out_ground) *out_ground = node->getNode();
 			return true;
 		}
@@ -661,6 +1665,17 @@ public:
 		unlock();
 		return ret;
 	}
+	/// count 個の点について getGroundPoint を行う。結果は getGroundPoint を一つずつ呼んだ場合と同じになる。
+	/// 地面が見つかった点の数を返す
+	int getGroundPoints(const KVec3 *points, int count, float max_penetration, bool *out_found, float *out_ground_y, KNode **out_ground) {
+		int ret = 0;
+		lock();
+		{
+			ret = get_ground_points_unsafe(points, count, max_penetration, out_found, out_ground_y, out_ground);
+		}
+		unlock();
+		return ret;
+	}
 	/// Body を持っているなら、その高度を得る。
 	/// ※高度とは、剛体の底面高さと、その直下にある地面高さの差を表す
 	/// Bodyが存在しないか、Bodyの真下に地面が全く存在せずに高度を定義できない場合、false を返す
@@ -741,39 +1756,45 @@ public:
 			rayAabbMin = start.getmin(end);
 			rayAabbMax = start.getmax(end);
 		}
-		uint32_t bitmask = 0;
 
 		lock();
 		{
-			KBodyList &bodylist = m_TmpBodyList_Ray;
-			bodylist.clear();
-			get_active_static_body_list_unsafe(bodylist); // 地形用オブジェクトリスト
+			get_active_static_body_list_unsafe(); // 地形用オブジェクトリスト
+			ray_cast_enumerate_unsafe(start, dir, nDir, maxdist, rayAabbMin, rayAabbMax, cb);
+		}
+		unlock();
+		return true;
+	}
+	/// ※ get_active_static_body_list_unsafe で空間分割を更新しておくこと
+	void ray_cast_enumerate_unsafe(const KVec3 &start, const KVec3 &dir, const KVec3 &nDir, float maxdist, const KVec3 &rayAabbMin, const KVec3 &rayAabbMax, KRayCallback *cb) {
+		uint32_t bitmask = 0;
 
-			for (auto it=bodylist.begin(); it!=bodylist.end(); ++it) {
-				KSolidBody *bodynode = *it;
-				KCollider *collider = bodynode->getShape();
-				if (maxdist > 0) {
-					if (!collider->is_collide_with_aabb(rayAabbMin, rayAabbMax, bitmask)) {
-						continue; // AABBの交差なし
-					}
+		// レイが通過する可能性のあるものだけを取り出す
+		KBodyList &candidates = m_TmpCandidates_Ray;
+		m_StaticBroadphase.queryRay(start, nDir, maxdist, BROADPHASE_MARGIN, candidates);
+
+		for (auto it=candidates.begin(); it!=candidates.end(); ++it) {
+			KSolidBody *bodynode = *it;
+			KCollider *collider = bodynode->getShape();
+			if (maxdist > 0) {
+				if (!collider->is_collide_with_aabb(rayAabbMin, rayAabbMax, bitmask)) {
+					continue; // AABBの交差なし
 				}
-				KVec3 pos, nor;
-				KCollider *coll = nullptr;
-				if (collider->get_ray_collision_point(start, nDir, bitmask, &pos, &nor, &coll)) {
-					float dist = (pos - start).getLength();
-					if (maxdist < 0 || dist < maxdist) {
-						KRayHit hit;
-						hit.pos = pos;
-						hit.dist = dist;
-						hit.normal = nor;
-						hit.collider = coll;
-						cb->on_ray_hit(start, dir, maxdist, hit);
-					}
+			}
+			KVec3 pos, nor;
+			KCollider *coll = nullptr;
+			if (collider->get_ray_collision_point(start, nDir, bitmask, &pos, &nor, &coll)) {
+				float dist = (pos - start).getLength();
+				if (maxdist < 0 || dist < maxdist) {
+					KRayHit hit;
+					hit.pos = pos;
+					hit.dist = dist;
+					hit.normal = nor;
+					hit.collider = coll;
+					cb->on_ray_hit(start, dir, maxdist, hit);
 				}
 			}
 		}
-		unlock();
-		return true;
 	}
 	
 	class CRayCB: public KRayCallback {
@@ -814,6 +1835,45 @@ public:
 		return false;
 	}
 
+	/// count 本のレイについて rayCast を行う。結果は rayCast を一つずつ呼んだ場合と同じになる。
+	/// ロックと地形リストの更新は一度だけ行う。何かに衝突したレイの数を返す
+	int rayCastBatch(const KVec3 *starts, const KVec3 *dirs, int count, float maxdist, bool *out_found, KRayHit *out_hits) {
+		K__ASSERT(starts);
+		K__ASSERT(dirs);
+		K__ASSERT(out_found);
+		int ret = 0;
+		lock();
+		{
+			get_active_static_body_list_unsafe(); // 地形用オブジェクトリスト
+			for (int i=0; i<count; i++) {
+				out_found[i] = false;
+				KVec3 nDir;
+				if (!dirs[i].getNormalizedSafe(&nDir)) continue; // レイの向きを定義できない
+				KVec3 rayAabbMin;
+				KVec3 rayAabbMax;
+				if (maxdist > 0) {
+					KVec3 end = starts[i] + nDir * maxdist;
+					rayAabbMin = starts[i].getmin(end);
+					rayAabbMax = starts[i].getmax(end);
+				}
+				CRayCB cb;
+				ray_cast_enumerate_unsafe(starts[i], dirs[i], nDir, maxdist, rayAabbMin, rayAabbMax, &cb);
+				if (cb.mCollider) {
+					if (out_hits) {
+						out_hits[i].pos = cb.mPos;
+						out_hits[i].dist = cb.mDist;
+						out_hits[i].normal = cb.mNormal;
+						out_hits[i].collider = cb.mCollider;
+					}
+					out_found[i] = true;
+					ret++;
+				}
+			}
+		}
+		unlock();
+		return ret;
+	}
+
 	/// pos から dir 方向に向かって判定球を飛ばす
 	bool sphereCast(const KVec3 &start, float radius, const KVec3 &dir, float maxdist, KRayHit *out_point) {
 		bool ret = false;
@@ -828,20 +1888,10 @@ public:
 		KVec3 nDir;
 		if (!dir.getNormalizedSafe(&nDir)) return false; // レイの向きを定義できない
 
-		KBodyList &bodylist = m_TmpBodyList_SphereCast;
-		bodylist.clear();
-		get_active_static_body_list_unsafe(bodylist); // 地形用オブジェクトリスト
+		get_active_static_body_list_unsafe(); // 地形用オブジェクトリスト
 
 		KVec3 aabb_min, aabb_max;
-		if (bodylist.size() > 0) {
-			bodylist[0]->getShape()->get_aabb(0, &aabb_min, &aabb_max);
-			for (int i=1; i<(int)bodylist.size(); i++) {
-				KVec3 minp, maxp;
-				bodylist[i]->getShape()->get_aabb(0, &minp, &maxp);
-				aabb_min = aabb_min.getmin(minp);
-				aabb_max = aabb_max.getmax(maxp);
-			}
-		}
+		m_StaticBroadphase.getBounds(&aabb_min, &aabb_max);
 
 		float step = radius;
 		if (step < 8) step = 8;
@@ -852,7 +1902,7 @@ public:
 			if (pos.x < aabb_min.x || aabb_max.x < pos.x) return false;
 			if (pos.y < aabb_min.y || aabb_max.y < pos.y) return false;
 			if (pos.z < aabb_min.z || aabb_max.z < pos.z) return false;
-			KCollider *coll = get_sphere_collide(pos, radius, bodylist);
+			KCollider *coll = get_sphere_collide(pos, radius);
 			if (coll) {
 				if (out_point) {
 					out_point->pos = pos;
@@ -871,10 +1921,8 @@ public:
 		bool ret = false;
 		lock();
 		{
-			KBodyList &bodylist = m_TmpBodyList_SphereCollide;
-			bodylist.clear();
-			get_active_static_body_list_unsafe(bodylist); // 地形用オブジェクトリスト
-			ret = get_sphere_collide(pos, radius, bodylist);
+			get_active_static_body_list_unsafe(); // 地形用オブジェクトリスト
+			ret = get_sphere_collide(pos, radius);
 		}
 		unlock();
 		return ret;
@@ -893,7 +1941,7 @@ public:
 		{
 			KSolidBody *body = getBody(node);
 			if (body) {
-				body->m_Desc.set_mask_bits(mask_bits);
+				body->m_Desc.set_mask_bits(mask_bits); // 静的剛体なら有効リストが作り直される
 			}
 		}
 		unlock();
@@ -992,6 +2040,7 @@ private:
 						KVec3 value = coll->get_offset_world();
 						ImGui::Text("Center in world: %g, %g, %g", value.x, value.y, value.z);
 						coll->update_inspector();
+						m_StaticBroadphase.markDirty(); // インスペクターから形状が直接変更されている可能性がある
 					}
 				}
 			}
@@ -1133,6 +2182,11 @@ private:
 			}
 		}
 		KImGui::PopTextColor();
+		if (bodynode->m_Sleeping) {
+			ImGui::Text("Auto Sleep: Sleeping");
+		} else {
+			ImGui::Text("Auto Sleep: Awake (rest %d frames)", bodynode->m_RestFrames);
+		}
 
 		if (bodynode->m_Desc._ground_node) {
 			KPath name = bodynode->m_Desc._ground_node->getNameInTree();
@@ -1153,14 +2207,25 @@ private:
 	
 	#endif // !NO_IMGUI
 	}
-	bool get_ground_point(const KBodyList &bodylist, const KVec3 &pos, float max_penetration, float *out_ground_y, KSolidBody **out_ground_bodynode) const {
+	// ※ get_active_static_body_list_unsafe で空間分割を更新しておくこと
+	bool get_ground_point(const KVec3 &pos, float max_penetration, float *out_ground_y, KSolidBody **out_ground_bodynode) const {
+		return get_ground_point(pos, max_penetration, out_ground_y, out_ground_bodynode, m_TmpCandidates_Ground, m_TmpGroundIndices);
+	}
+	// get_ground_point と同じだが、作業領域 candidates, work を使う。
+	// 別々の作業領域を使えば複数のスレッドから同時に呼んでもよい
+	bool get_ground_point(const KVec3 &pos, float max_penetration, float *out_ground_y, KSolidBody **out_ground_bodynode, KBodyList &candidates, std::vector<int> &work) const {
 		uint32_t bitmask = 0;
 
 		const float INVALID_Y = -1000000;
 		KSolidBody *gnd_bodynode = nullptr;
 		float ground_y = INVALID_Y;
 		KVec3 raypos = pos + KVec3(0.0f, max_penetration, 0.0f);
-		for (auto it=bodylist.begin(); it!=bodylist.end(); ++it) {
+
+		// 真下に向けたレイなので、XZ 平面上で raypos を含むものだけが候補になる
+		m_StaticBroadphase.queryAabb(
+			KVec3(raypos.x - BROADPHASE_MARGIN, -FLT_MAX, raypos.z - BROADPHASE_MARGIN),
+			KVec3(raypos.x + BROADPHASE_MARGIN,  FLT_MAX, raypos.z + BROADPHASE_MARGIN), candidates, work);
+		for (auto it=candidates.begin(); it!=candidates.end(); ++it) {
 			KSolidBody *bodynode = *it;
 			KVec3 hit;
 			KCollider *coll = bodynode->getShape();
@@ -1178,9 +2243,105 @@ private:
 		}
 		return false;
 	}
-	bool get_altitude(const KBodyList &bodylist, const KVec3 &point, float max_penetration, float *out_alt, KSolidBody **out_ground) const {
+	/// 複数の点について get_ground_point を行う。
+	/// XZ 平面上で近い点を GROUND_BATCH_SIZE 個ずつまとめ、空間分割の問い合わせを１回で済ませる。
+	/// 各点で調べる地形とその順番は get_ground_point と同じなので、結果も一致する
+	int get_ground_points_unsafe(const KVec3 *points, int count, float max_penetration, bool *out_found, float *out_ground_y, KNode **out_ground) {
+		K__ASSERT(points);
+		K__ASSERT(out_found);
+		get_active_static_body_list_unsafe();
+
+		// 近い点同士が並ぶように、XZ 平面上のセル順に並べ替える
+		std::vector<std::pair<int64_t, int>> &order = m_TmpBatchOrder;
+		order.resize(count);
+		for (int i=0; i<count; i++) {
+			int cx = (int)KMath::clampf(floorf(points[i].x / GROUND_BATCH_CELL), -1.0e9f, 1.0e9f);
+			int cz = (int)KMath::clampf(floorf(points[i].z / GROUND_BATCH_CELL), -1.0e9f, 1.0e9f);
+			order[i].first = ((int64_t)cz << 32) | (uint32_t)cx;
+			order[i].second = i;
+		}
+		std::sort(order.begin(), order.end());
+
+		const float INVALID_Y = -1000000;
+		const bool filter = m_StaticBroadphase.getType() != KStaticBroadphase_NONE; // 総当たりの場合は全部調べる
+		const uint32_t bitmask = 0;
+		int num_found = 0;
+		for (int head=0; head<count; ) {
+			// 同じセルにある点を最大 GROUND_BATCH_SIZE 個まとめる
+			int num = 1;
+			while (num < GROUND_BATCH_SIZE && head + num < count && order[head + num].first == order[head].first) {
+				num++;
+			}
+			float rx[GROUND_BATCH_SIZE], ry[GROUND_BATCH_SIZE], rz[GROUND_BATCH_SIZE];
+			float ground_y[GROUND_BATCH_SIZE];
+			KSolidBody *ground[GROUND_BATCH_SIZE];
+			bool test[GROUND_BATCH_SIZE];
+			KVec3 minp(FLT_MAX, -FLT_MAX, FLT_MAX);
+			KVec3 maxp(-FLT_MAX, FLT_MAX, -FLT_MAX);
+			for (int k=0; k<num; k++) {
+				const KVec3 &pos = points[order[head + k].second];
+				rx[k] = pos.x;
+				ry[k] = pos.y + max_penetration;
+				rz[k] = pos.z;
+				ground_y[k] = INVALID_Y;
+				ground[k] = nullptr;
+				minp.x = KMath::min(minp.x, rx[k] - BROADPHASE_MARGIN);
+				minp.z = KMath::min(minp.z, rz[k] - BROADPHASE_MARGIN);
+				maxp.x = KMath::max(maxp.x, rx[k] + BROADPHASE_MARGIN);
+				maxp.z = KMath::max(maxp.z, rz[k] + BROADPHASE_MARGIN);
+			}
+
+			// まとめた点の真下にある可能性のある地形（各点での get_ground_point の候補をすべて含む）
+			std::vector<int> &indices = m_TmpBatchIndices;
+			m_StaticBroadphase.queryAabbIndices(minp, maxp, indices);
+			for (auto it=indices.begin(); it!=indices.end(); ++it) {
+				const int idx = *it;
+				KCollider *coll = m_StaticBroadphase.getCollider(idx);
+				if (coll == nullptr) continue;
+
+				// get_ground_point でも候補になる点（XZ 平面上でこの地形の AABB に含まれる点）だけを調べる
+				int num_test = 0;
+				if (filter && !m_StaticBroadphase.isUnbounded(idx)) {
+					const KVec3 &amin = m_StaticBroadphase.getAabbMin(idx);
+					const KVec3 &amax = m_StaticBroadphase.getAabbMax(idx);
+					for (int k=0; k<num; k++) {
+						test[k] = !(amax.x < rx[k] - BROADPHASE_MARGIN || rx[k] + BROADPHASE_MARGIN < amin.x || amax.z < rz[k] - BROADPHASE_MARGIN || rz[k] + BROADPHASE_MARGIN < amin.z);
+						num_test += test[k] ? 1 : 0;
+					}
+				} else {
+					for (int k=0; k<num; k++) {
+						test[k] = true;
+					}
+					num_test = num;
+				}
+				if (num_test == 0) continue;
+				for (int k=0; k<num; k++) {
+					if (!test[k]) continue;
+					KVec3 hit;
+					if (coll->get_ray_collision_point(KVec3(rx[k], ry[k], rz[k]), KVec3(0, -1, 0), bitmask, &hit, nullptr, nullptr)) {
+						if (ground_y[k] < hit.y) {
+							ground_y[k] = hit.y;
+							ground[k] = m_StaticBroadphase.getBody(idx);
+						}
+					}
+				}
+			}
+			for (int k=0; k<num; k++) {
+				int i = order[head + k].second;
+				out_found[i] = ground[k] != nullptr;
+				if (ground[k]) {
+					if (out_ground_y) out_ground_y[i] = ground_y[k];
+					if (out_ground) out_ground[i] = ground[k]->getNode();
+					num_found++;
+				}
+			}
+			head += num;
+		}
+		return num_found;
+	}
+	bool get_altitude(const KVec3 &point, float max_penetration, float *out_alt, KSolidBody **out_ground) const {
 		float gnd_y;
-		if (get_ground_point(bodylist, point, max_penetration, &gnd_y, out_ground)) {
+		if (get_ground_point(point, max_penetration, &gnd_y, out_ground)) {
 			if (out_alt) *out_alt = point.y - gnd_y;
 			return true;
 		}
@@ -1193,8 +2354,7 @@ private:
 		cameranode->getWorld2LocalMatrix(&tr);
 
 		// オブジェクトリスト
-		KBodyList list;
-		get_active_static_body_list_unsafe(list);
+		KBodyList list = get_active_static_body_list_unsafe();
 
 		for (auto it=list.begin(); it!=list.end(); ++it) {
 			KSolidBody *body = *it;
@@ -1214,9 +2374,12 @@ private:
 		cNode->getNode()->getLocal2WorldMatrix(&matrix);
 		matrix = matrix * transform;
 
-		{
-			KQuadCollider *coll = dynamic_cast<KQuadCollider*>(cNode->getShape());
-			if (coll) {
+		KCollider *shape = cNode->getShape();
+		if (shape == nullptr) return;
+		switch (shape->get_type()) {
+		case KColliderType_QUAD:
+			{
+				KQuadCollider *coll = static_cast<KQuadCollider*>(shape);
 				KVec3 p[4], nor;
 				coll->get_points(p);
 				nor = coll->get_normal();
@@ -1226,28 +2389,31 @@ private:
 				} else {
 					_DrawQuad(gizmo, matrix, color, coll->get_offset(), nor, p, true);
 				}
-				return;
+				break;
 			}
-		}
-		{
-			KShearedBoxCollider *coll = dynamic_cast<KShearedBoxCollider*>(cNode->getShape());
-			if (coll) {
+		case KColliderType_SHEARED_BOX:
+			{
+				KShearedBoxCollider *coll = static_cast<KShearedBoxCollider*>(shape);
 				_DrawAabb(gizmo, matrix, color, coll->get_offset(), coll->get_halfsize(), coll->get_shearx());
-				return;
+				break;
 			}
-		}
-		{
-			KFloorCollider *coll = dynamic_cast<KFloorCollider*>(cNode->getShape());
-			if (coll) {
+		case KColliderType_FLOOR:
+			{
+				KFloorCollider *coll = static_cast<KFloorCollider*>(shape);
 				float heigths[4];
 				coll->get_heights(heigths);
 				_DrawFloor(gizmo, matrix, color, coll->get_offset(), coll->get_halfsize(), coll->get_shearx(), heigths);
-				return;
+				break;
 			}
-		}
-		{
-			KCapsuleCollider *coll = dynamic_cast<KCapsuleCollider*>(cNode->getShape());
-			if (coll) {
+		case KColliderType_HEIGHTFIELD:
+			{
+				KHeightfieldCollider *coll = static_cast<KHeightfieldCollider*>(shape);
+				_DrawHeightfield(gizmo, matrix, color, coll);
+				break;
+			}
+		case KColliderType_CAPSULE:
+			{
+				KCapsuleCollider *coll = static_cast<KCapsuleCollider*>(shape);
 				float radius = coll->get_radius();
 				float halfheight = coll->get_halfheight();
 				if (coll->get_cylinder()) {
@@ -1255,25 +2421,49 @@ private:
 				} else {
 					_DrawCapsule(gizmo, matrix, color, coll->get_offset(), radius, halfheight);
 				}
-				return;
+				break;
 			}
-		}
-		{
-			KAabbCollider *coll = dynamic_cast<KAabbCollider*>(cNode->getShape());
-			if (coll) {
+		case KColliderType_AABB:
+			{
+				KAabbCollider *coll = static_cast<KAabbCollider*>(shape);
 				_DrawAabb(gizmo, matrix, color, coll->get_offset(), coll->get_halfsize(), 0);
-				return;
+				break;
 			}
-		}
-		{
-			KPlaneCollider *coll = dynamic_cast<KPlaneCollider*>(cNode->getShape());
-			if (coll) {
+		case KColliderType_PLANE:
+			{
+				KPlaneCollider *coll = static_cast<KPlaneCollider*>(shape);
 				_DrawGround(gizmo, matrix, color, coll->get_offset());
-				return;
+				break;
+			}
+		default:
+			break;
+		}
+	}
+	/// 判定対象になる静的剛体のリストを得る。
+	/// 毎回 m_Nodes を走査するのではなく、剛体の追加削除、有効状態の変化、ノードのツリー内有効状態の変化、
+	/// マスクの変更があったときだけ作り直す。空間分割もこのリストに合わせて更新される。
+	/// ※マスクの変更は Desc::set_mask_bits 経由で行うこと。_mask_bits を直接書き換えた場合は検出できない
+	const KBodyList & get_active_static_body_list_unsafe() {
+		m_NumActiveStaticsQueries++;
+		if (m_ActiveStaticsDirty
+		 || m_ActiveStaticsBitsInTreeRevision != SFlagData::getWatchedBitsInTreeRevision()
+		 || m_ActiveStaticsEnableRevision != KCollider::get_enable_revision()) {
+			m_ActiveStaticsDirty = false;
+			m_ActiveStaticsBitsInTreeRevision = SFlagData::getWatchedBitsInTreeRevision();
+			m_ActiveStaticsEnableRevision = KCollider::get_enable_revision();
+			scan_active_static_body_list_unsafe(m_TmpActiveStatics);
+			m_NumActiveStaticsScans++;
+			if (m_TmpActiveStatics != m_ActiveStatics) {
+				m_ActiveStatics.swap(m_TmpActiveStatics);
+				m_StaticBroadphase.markDirty();
 			}
 		}
+
+		// 空間分割をこのリストに合わせる
+		m_StaticBroadphase.validate(m_ActiveStatics);
+		return m_ActiveStatics;
 	}
-	void get_active_static_body_list_unsafe(KBodyList &out_bodylist) {
+	void scan_active_static_body_list_unsafe(KBodyList &out_bodylist) const {
 		out_bodylist.clear();
 
 		// 静止オブジェクト側のフィルタリング
@@ -1302,10 +2492,9 @@ private:
 			out_bodylist.push_back(bodynode);
 		}
 	}
-	bool collide_ground(const KBodyList &bodylist, KSolidBody *dyBody, const KVec3 &dySpeed, KSolidBodyCallback *cb, KVec3 *out_dySpeed) {
+	bool collide_ground(KSolidBody *dyBody, const KVec3 &dySpeed, KSolidBodyCallback *cb, KVec3 *out_dySpeed) {
 		KCollider *collider = dyBody->getShape();
-		if (out_dySpeed) *out_dySpeed = dySpeed;
-	
+
 		// ボディ中央座標
 		KVec3 dy_center = collider->get_offset_world();
 
@@ -1313,11 +2502,20 @@ private:
 		// 基準点より上の地面がすべて無視される。
 		float alt = 0;
 		KSolidBody *stNode = nullptr;
-		if (!get_altitude(bodylist, dy_center, dyBody->m_Desc.get_snap_height(), &alt, &stNode)) {
+		bool found = get_altitude(dy_center, dyBody->m_Desc.get_snap_height(), &alt, &stNode);
+		return collide_ground_at(dyBody, found, alt, stNode, dySpeed, cb, out_dySpeed);
+	}
+	// ボディ中央から測った高度 center_alt と真下の地面 stNode を使って、地面との判定を行う
+	bool collide_ground_at(KSolidBody *dyBody, bool found, float center_alt, KSolidBody *stNode, const KVec3 &dySpeed, KSolidBodyCallback *cb, KVec3 *out_dySpeed) {
+		KCollider *collider = dyBody->getShape();
+		if (out_dySpeed) *out_dySpeed = dySpeed;
+
+		if (!found) {
 			// 地面が存在しない。高度値無効
 			dyBody->m_Desc.clear_altitude();
 			return false;
 		}
+		float alt = center_alt;
 
 		// ボディ底面からの高度値になおす
 		{
@@ -1429,9 +2627,12 @@ private:
 		KMatrix4 tr;
 		cameranode->getWorld2LocalMatrix(&tr);
 
-		// オブジェクトリスト
+		// オブジェクトリスト（眠っている剛体も含む）
 		KBodyList list;
 		update_dynamicbody_list_unsafe(nullptr, &list);
+		for (auto it=m_SleepingDynamics.begin(); it!=m_SleepingDynamics.end(); ++it) {
+			add_dynamicbody_to_list_unsafe(*it, nullptr, &list);
+		}
 
 		for (auto it=list.begin(); it!=list.end(); ++it) {
 			KSolidBody *body = *it;
@@ -1451,17 +2652,16 @@ private:
 		const float line_alpha = _GetGizmoBlinkingAlpha(dyNode->getNode());
 		KColor color1(0.0f, 0.0f, 1.0f, line_alpha);
 		KColor color2(0.4f, 0.4f, 0.4f, line_alpha);
-		{
-			KCharacterCollider *coll = dynamic_cast<KCharacterCollider*>(dyNode->getShape());
-			if (coll) {
-				KVec3 center = coll->get_offset_world(); // 判定中心
-				float alt = getAltitudeAtPoint_unsafe(center, 1.0f, nullptr);
-				// DynamicBodyの場合、実際にはカプセルというよりも円筒形で判定している
-				_DrawCylinderWithAltitude(gizmo, transform, color1, center, coll->get_radius(), coll->get_halfheight(), alt);
-			//	_DrawCylinderWithAltitude(gizmo, matrix, color1, center, coll->get_radius(), coll->get_halfheight(), alt);
-			//	_DrawCapsuleWithAltitude(gizmo, matrix, color1, center, coll->get_radius(), coll->get_halfheight(), alt);
-				return;
-			}
+		KCollider *shape = dyNode->getShape();
+		if (shape && shape->get_type() == KColliderType_CHARACTER) {
+			KCharacterCollider *coll = static_cast<KCharacterCollider*>(shape);
+			KVec3 center = coll->get_offset_world(); // 判定中心
+			float alt = getAltitudeAtPoint_unsafe(center, 1.0f, nullptr);
+			// DynamicBodyの場合、実際にはカプセルというよりも円筒形で判定している
+			_DrawCylinderWithAltitude(gizmo, transform, color1, center, coll->get_radius(), coll->get_halfheight(), alt);
+		//	_DrawCylinderWithAltitude(gizmo, matrix, color1, center, coll->get_radius(), coll->get_halfheight(), alt);
+		//	_DrawCapsuleWithAltitude(gizmo, matrix, color1, center, coll->get_radius(), coll->get_halfheight(), alt);
+			return;
 		}
 	}
 	void update_dynamicbody_list_unsafe(KBodyList *movelist, KBodyList *dynamiclist) {
@@ -1471,35 +2671,215 @@ private:
 		if (movelist) movelist->clear();
 		if (dynamiclist) dynamiclist->clear();
 
-		for (auto it=m_Nodes.begin(); it!=m_Nodes.end(); ++it) {
-			KSolidBody *bodynode = it->second;
-			if (bodynode->m_Desc.is_static()) continue;
+		// 自動スリープで眠っている剛体は最初から含まれていない
+		for (auto it=m_AwakeDynamics.begin(); it!=m_AwakeDynamics.end(); ++it) {
+			add_dynamicbody_to_list_unsafe(*it, movelist, dynamiclist);
+		}
+	}
+	void add_dynamicbody_to_list_unsafe(KSolidBody *bodynode, KBodyList *movelist, KBodyList *dynamiclist) {
+		// Entity がツリー内で disabled だったら判定しない
+		// （paused 状態は考慮しない。オブジェクトの動きが停止している時でも、勝手に衝突判定を突き抜けられては困る）
+		if (!bodynode->getNode()->getEnableInTree()) {
+			return;
+		}
 
-			// Entity がツリー内で disabled だったら判定しない
-			// （paused 状態は考慮しない。オブジェクトの動きが停止している時でも、勝手に衝突判定を突き抜けられては困る）
-			if (!bodynode->getNode()->getEnableInTree()) {
-				continue;
-			}
+		// CollisionMask が 0 の場合は誰とも衝突しない
+		if (bodynode->m_Desc.get_mask_bits() == 0) {
+			return;
+		}
 
-			// CollisionMask が 0 の場合は誰とも衝突しない
-			if (bodynode->m_Desc.get_mask_bits() == 0) {
-				continue;
-			}
+		// スリープ中だった場合は判定も移動もしない
+		if (bodynode->m_Desc.get_sleep_time() != 0) {
+			return;
+		}
 
-			// スリープ中だった場合は判定も移動もしない
-			if (bodynode->m_Desc.get_sleep_time() != 0) {
-				continue;
+		if (bodynode->getBodyEnabled()) {
+			// 衝突可能な形状を持っている
+			if (dynamiclist) dynamiclist->push_back(bodynode);
+
+		} else {
+			// 衝突可能な形状を持っていない。
+			// 衝突処理なしで移動する
+			if (movelist) movelist->push_back(bodynode); 
+		}
+	}
+	static void dynamic_list_add(KBodyList &list, KSolidBody *body) {
+		body->m_DynamicIndex = (int)list.size();
+		list.push_back(body);
+	}
+	static void dynamic_list_remove(KBodyList &list, KSolidBody *body) {
+		// 末尾の要素を空いた位置に移す
+		int index = body->m_DynamicIndex;
+		K__ASSERT(0 <= index && index < (int)list.size() && list[index] == body);
+		list[index] = list.back();
+		list[index]->m_DynamicIndex = index;
+		list.pop_back();
+		body->m_DynamicIndex = -1;
+	}
+	void sleep_body_unsafe(KSolidBody *body) {
+		if (body->m_Sleeping) return;
+		dynamic_list_remove(m_AwakeDynamics, body);
+		dynamic_list_add(m_SleepingDynamics, body);
+		body->m_Sleeping = true;
+		body->m_Desc._sleeping = true;
+		body->m_Desc._velocity = KVec3(); // 静止させる。set_velocity を使うと起きてしまう
+		body->m_SleepPos = body->getNode()->getWorldPosition();
+		body->getNode()->_getTransformData().m_WatchWorldMatrix++; // 座標の変化を検出できるようにする
+		m_SleepEntriesDirty = true;
+		if (m_SleepingDynamics.size() == 1) {
+			// 最初の１体が眠った。ここから後の地形の変化を調べる
+			m_SleepStaticRevision = m_StaticBroadphase.getContentRevision();
+		}
+	}
+	void wake_body_unsafe(KSolidBody *body) {
+		if (!body->m_Sleeping) return;
+		dynamic_list_remove(m_SleepingDynamics, body);
+		dynamic_list_add(m_AwakeDynamics, body);
+		body->m_Sleeping = false;
+		body->m_Desc._sleeping = false;
+		body->m_Desc._hits_with.clear();
+		body->m_RestFrames = 0;
+		body->getNode()->_getTransformData().m_WatchWorldMatrix--;
+		m_SleepEntriesDirty = true;
+	}
+	// node との接触情報を持ったまま眠っている剛体を起こす。
+	// 眠っている剛体の _hits_with は眠った時のまま残っているので、
+	// 接触相手が切り離されたり削除されたりしたら、そこから取り除かないといけない
+	void wake_bodies_touching_unsafe(KNode *node) {
+		for (int i=(int)m_SleepingDynamics.size()-1; i>=0; i--) {
+			KSolidBody *body = m_SleepingDynamics[i];
+			const KNodeArray &hits = body->m_Desc._hits_with;
+			if (std::find(hits.begin(), hits.end(), node) != hits.end()) {
+				wake_body_unsafe(body); // _hits_with もクリアされる
 			}
+		}
+	}
+	// 速度や座標が変更された剛体、地形の変化した剛体を起こす
+	void wake_changed_bodies_unsafe() {
+		// 速度やマスクが変更された
+		for (size_t i=0; i<m_WakeRequests.size(); i++) {
+			KSolidBody *body = getBody(m_WakeRequests[i]);
+			if (body && !body->m_Desc.is_static()) {
+				wake_body_unsafe(body);
+			}
+		}
+		m_WakeRequests.clear();
+		if (m_SleepingDynamics.empty()) {
+			return;
+		}
 
-			if (bodynode->getBodyEnabled()) {
-				// 衝突可能な形状を持っている
-				if (dynamiclist) dynamiclist->push_back(bodynode);
+		// 地形が変化した。どの剛体が影響を受けるか分からないので、すべて起こす
+		get_active_static_body_list_unsafe();
+		if (m_SleepStaticRevision != m_StaticBroadphase.getContentRevision()) {
+			m_SleepStaticRevision = m_StaticBroadphase.getContentRevision();
+			while (!m_SleepingDynamics.empty()) {
+				wake_body_unsafe(m_SleepingDynamics.back());
+			}
+			return;
+		}
 
-			} else {
-				// 衝突可能な形状を持っていない。
-				// 衝突処理なしで移動する
-				if (movelist) movelist->push_back(bodynode); 
+		// 眠っている剛体（または地形）のどれかが移動した
+		uint32_t rev = STransformData::getWatchedWorldMatrixRevision();
+		if (m_SleepTransformRevision != rev) {
+			for (int i=(int)m_SleepingDynamics.size()-1; i>=0; i--) {
+				KSolidBody *body = m_SleepingDynamics[i];
+				if (body->getNode()->getWorldPosition() != body->m_SleepPos) {
+					wake_body_unsafe(body);
+				}
+			}
+			m_SleepTransformRevision = STransformData::getWatchedWorldMatrixRevision();
+		}
+	}
+	// 移動後の剛体と AABB が重なっている、眠っている剛体を起こす。
+	// 起こした剛体も m_TmpDynamicNodes に加えるので、接触が連鎖していればそれらもすべて起きる
+	void wake_touched_bodies_unsafe() {
+		if (m_SleepingDynamics.empty()) {
+			return;
+		}
+		if (m_SleepEntriesDirty) {
+			rebuild_sleep_entries_unsafe();
+		}
+		uint32_t bitmask = 0;
+		for (size_t i=0; i<m_TmpDynamicNodes.size(); i++) {
+			KSolidBody *dyNode = m_TmpDynamicNodes[i];
+			COL_INFO info;
+			info.update(dyNode->getShape(), bitmask, dyNode->m_Desc.get_velocity());
+
+			// X 方向の範囲が重なる可能性のあるところから調べる
+			float lo = info.extended_whole_aabb_min.x - m_SleepEntriesMaxWidth;
+			auto it = std::lower_bound(m_SleepEntries.begin(), m_SleepEntries.end(), lo, [](const SSleepEntry &e, float x) {
+				return e.aabb_min.x < x;
+			});
+			for (; it!=m_SleepEntries.end() && it->aabb_min.x <= info.extended_whole_aabb_max.x; ++it) {
+				KSolidBody *body = it->body;
+				if (!body->m_Sleeping) {
+					continue; // すでに起きている
+				}
+				if (!KGeom::K_GeomIntersectAabb(info.extended_whole_aabb_min, info.extended_whole_aabb_max, it->aabb_min, it->aabb_max, nullptr, nullptr)) {
+					continue;
+				}
+				wake_body_unsafe(body);
+				add_dynamicbody_to_list_unsafe(body, nullptr, &m_TmpDynamicNodes);
+			}
+		}
+	}
+	void rebuild_sleep_entries_unsafe() {
+		uint32_t bitmask = 0;
+		m_SleepEntries.clear();
+		m_SleepEntriesMaxWidth = 0;
+		for (auto it=m_SleepingDynamics.begin(); it!=m_SleepingDynamics.end(); ++it) {
+			KSolidBody *body = *it;
+			if (!body->getBodyEnabled()) {
+				continue; // 接触しない
+			}
+			SSleepEntry e;
+			body->getShape()->get_aabb(bitmask, &e.aabb_min, &e.aabb_max);
+			e.aabb_min -= EXTENDS;
+			e.aabb_max += EXTENDS;
+			e.body = body;
+			m_SleepEntries.push_back(e);
+			m_SleepEntriesMaxWidth = KMath::max(m_SleepEntriesMaxWidth, e.aabb_max.x - e.aabb_min.x);
+		}
+		std::sort(m_SleepEntries.begin(), m_SleepEntries.end(), [](const SSleepEntry &a, const SSleepEntry &b) {
+			return a.aabb_min.x < b.aabb_min.x;
+		});
+		m_SleepEntriesDirty = false;
+	}
+	// 速度と移動量がほぼゼロで接触相手が変化しない状態が m_SleepFrames 続いた剛体を眠らせる
+	void update_rest_states_unsafe() {
+		if (m_SleepFrames <= 0) {
+			return;
+		}
+		for (auto it=m_TmpMovingNodes.begin(); it!=m_TmpMovingNodes.end(); ++it) {
+			update_rest_state_unsafe(*it);
+		}
+		for (auto it=m_TmpDynamicNodes.begin(); it!=m_TmpDynamicNodes.end(); ++it) {
+			update_rest_state_unsafe(*it);
+		}
+	}
+	void update_rest_state_unsafe(KSolidBody *body) {
+		if (body->m_Sleeping) {
+			return;
+		}
+		// 接触相手の組み合わせを表す値
+		const KNodeArray &hits = body->m_Desc._hits_with;
+		uint32_t hits_hash = (uint32_t)hits.size();
+		for (size_t i=0; i<hits.size(); i++) {
+			hits_hash = hits_hash * 31 + (uint32_t)(uintptr_t)hits[i];
+		}
+		KVec3 move = body->getNode()->getPosition() - body->m_Desc.get_prev_pos();
+		bool rest = true;
+		if (body->m_Desc.get_velocity().getLengthSq() > SLEEP_SPEED * SLEEP_SPEED) rest = false;
+		if (move.getLengthSq() > SLEEP_SPEED * SLEEP_SPEED) rest = false;
+		if (body->m_RestHits != hits_hash) rest = false;
+		body->m_RestHits = hits_hash;
+		if (rest) {
+			body->m_RestFrames++;
+			if (body->m_RestFrames >= m_SleepFrames) {
+				sleep_body_unsafe(body);
 			}
+		} else {
+			body->m_RestFrames = 0;
 		}
 	}
 	void simple_move(KSolidBody *dyNode) {
@@ -1538,9 +2918,13 @@ private:
 			simple_move(dyNode);
 		}
 	}
-	KCollider * get_sphere_collide(const KVec3 &pos, float radius, const KBodyList &bodylist) const {
+	// ※ get_active_static_body_list_unsafe で空間分割を更新しておくこと
+	KCollider * get_sphere_collide(const KVec3 &pos, float radius) const {
 		uint32_t bitmask = 0;
-		for (auto it=bodylist.begin(); it!=bodylist.end(); ++it) {
+		float r = radius + BROADPHASE_MARGIN;
+		KBodyList &candidates = m_TmpCandidates_Sphere;
+		m_StaticBroadphase.queryAabb(pos - KVec3(r, r, r), pos + KVec3(r, r, r), candidates);
+		for (auto it=candidates.begin(); it!=candidates.end(); ++it) {
 			KSolidBody *bodynode = *it;
 			KCollider *collider = bodynode->getShape();
 			if (collider->get_sphere_collision(pos, radius, bitmask, nullptr, nullptr)) {
@@ -1550,200 +2934,292 @@ private:
 		return nullptr;
 	}
 	void update_staticbody_collision_unsafe() {
-		// 地形用オブジェクトリスト
-		KBodyList &bodylist = m_TmpStaticBody_Collision;
-		bodylist.clear();
-		get_active_static_body_list_unsafe(bodylist);
+		// 地形用オブジェクトリストと空間分割を更新する
+		const KBodyList &statics = get_active_static_body_list_unsafe();
 
 		// 高度情報を初期化する
 		clear_dynamicbody_altitudes();
 
-		for (auto dit=m_TmpDynamicNodes.begin(); dit!=m_TmpDynamicNodes.end(); ++dit) {
-			KSolidBody *dyNode = *dit;
-			KCollider *dyCollider = dyNode->getShape();
-			uint32_t bitmask = 0;
+		// ワールド行列は参照したときに計算されてキャッシュされるので、
+		// 複数のスレッドから参照する前に計算を済ませておく
+		for (auto it=statics.begin(); it!=statics.end(); ++it) {
+			KCollider *stCollider = (*it)->getShape();
+			if (stCollider) stCollider->get_offset_world();
+		}
+		for (auto it=m_TmpDynamicNodes.begin(); it!=m_TmpDynamicNodes.end(); ++it) {
+			KCollider *dyCollider = (*it)->getShape();
+			if (dyCollider) dyCollider->get_offset_world();
+		}
 
-			KCharacterCollider *dyChara = dynamic_cast<KCharacterCollider*>(dyCollider);
-			if (dyChara == nullptr) {
-				// 運動している物体は KCharacterCollider のみ対応
-				continue;
-			}
+		// 収集フェーズ
+		// 動的剛体ごとに、壁との衝突と地面までの高度を並列に求める。
+		// ここではノードの状態を読むだけで、コールバックも呼ばない
+		int num = (int)m_TmpDynamicNodes.size();
+		int num_workers = m_Parallel.getNumThreads();
+		if ((int)m_StaticWorkers.size() < num_workers) {
+			m_StaticWorkers.resize(num_workers);
+		}
+		for (size_t i=0; i<m_StaticWorkers.size(); i++) {
+			m_StaticWorkers[i].contacts.clear();
+		}
+		m_TmpStaticGathers.resize(num);
+		m_Parallel.run(num, STATIC_GATHER_GRAIN, gather_static_contacts_cb, this);
+
+		// 適用フェーズ
+		// コールバックの呼び出しと位置の修正を、動的剛体リストの順番で行う。
+		// 収集結果はワーカーの数や割り当てに依存しないので、結果はスレッド数によらず同じになる
+		for (int i=0; i<num; i++) {
+			apply_static_contacts(i);
+		}
+	}
+	static void gather_static_contacts_cb(void *data, int begin, int end, int worker) {
+		CCollisionMgr *mgr = reinterpret_cast<CCollisionMgr *>(data);
+		for (int i=begin; i<end; i++) {
+			mgr->gather_static_contacts(i, worker);
+		}
+	}
+	// 動的剛体 m_TmpDynamicNodes[index] と地形の判定を行い、m_TmpStaticGathers[index] にセットする。
+	// ノードの状態を書き換えないので、ワーカーが異なれば複数のスレッドから同時に呼んでもよい
+	void gather_static_contacts(int index, int worker) {
+		KSolidBody *dyNode = m_TmpDynamicNodes[index];
+		SStaticGather &gather = m_TmpStaticGathers[index];
+		SStaticWorker &work = m_StaticWorkers[worker];
+		gather.valid = false;
+		gather.worker = worker;
+		gather.contact_start = (int)work.contacts.size();
+		gather.contact_count = 0;
+		gather.ground_found = false;
+		gather.ground_alt = 0;
+		gather.ground = nullptr;
+
+		KCollider *dyCollider = dyNode->getShape();
+		uint32_t bitmask = 0;
+
+		if (dyCollider == nullptr || dyCollider->get_type() != KColliderType_CHARACTER) {
+			// 運動している物体は KCharacterCollider のみ対応
+			return;
+		}
+		KCharacterCollider *dyChara = static_cast<KCharacterCollider*>(dyCollider);
 
 #if 1
-			// paused なダイナミックノードの判定をスキップしてしまうと、
-			// 高度情報が更新されずに接地しているかどうかが分からなくなってしまうので、
-			// スキップしちゃダメ
+		// paused なダイナミックノードの判定をスキップしてしまうと、
+		// 高度情報が更新されずに接地しているかどうかが分からなくなってしまうので、
+		// スキップしちゃダメ
 #else
-			// pause 中の場合、地形との判定は行わない
-			// ※pause中でも動的剛体同士の判定をするために m_TmpDynamicNodes には paused なノードも入っている.
-			//   update_dynamicbody_list を参照せよ
-			if (dyNode->knode->getPauseInTree()) {
-				continue;
-			}
+		// pause 中の場合、地形との判定は行わない
+		// ※pause中でも動的剛体同士の判定をするために m_TmpDynamicNodes には paused なノードも入っている.
+		//   update_dynamicbody_list を参照せよ
+		if (dyNode->knode->getPauseInTree()) {
+			return;
+		}
 #endif
-			COL_INFO info;
-			info.update(dyCollider, bitmask, dyNode->m_Desc.get_velocity());
-
-			struct HIT {
-				KVec3 delta;
-				KVec3 normal;
-				KNode *node;
-			};
-			const int MAX_HITS = 4;
-			HIT hitlist[MAX_HITS];
-			int num_hits = 0;
-
-			for (auto sit=bodylist.begin(); sit!=bodylist.end(); ++sit) {
-				KSolidBody *stBody = *sit;
-				KCollider *stCollider = stBody->getShape();
-
-				KVec3 stMinW, stMaxW;
-				stCollider->get_aabb(bitmask, &stMinW, &stMaxW);
-				stMinW -= EXTENDS;
-				stMaxW += EXTENDS;
-
-				// AABB同士の重なりをチェック
-				if (!KGeom::K_GeomIntersectAabb(info.extended_whole_aabb_min, info.extended_whole_aabb_max, stMinW, stMaxW, nullptr, nullptr)) {
-					continue; // 重なりなし。詳細な衝突判定をスキップ
+		gather.valid = true;
+		gather.center = dyCollider->get_offset_world();
+
+		COL_INFO info;
+		info.update(dyCollider, bitmask, dyNode->m_Desc.get_velocity());
+
+		// AABB が重なる可能性のある地形だけを取り出す（順番は有効な静的剛体リストと同じ）
+		KBodyList &candidates = work.candidates;
+		{
+			const KVec3 pad = EXTENDS + KVec3(BROADPHASE_MARGIN, BROADPHASE_MARGIN, BROADPHASE_MARGIN);
+			m_StaticBroadphase.queryAabb(info.extended_whole_aabb_min - pad, info.extended_whole_aabb_max + pad, candidates, work.indices);
+		}
+		for (auto sit=candidates.begin(); sit!=candidates.end(); ++sit) {
+			KSolidBody *stBody = *sit;
+			KCollider *stCollider = stBody->getShape();
+
+			KVec3 stMinW, stMaxW;
+			stCollider->get_aabb(bitmask, &stMinW, &stMaxW);
+			stMinW -= EXTENDS;
+			stMaxW += EXTENDS;
+
+			// AABB同士の重なりをチェック
+			if (!KGeom::K_GeomIntersectAabb(info.extended_whole_aabb_min, info.extended_whole_aabb_max, stMinW, stMaxW, nullptr, nullptr)) {
+				continue; // 重なりなし。詳細な衝突判定をスキップ
+			}
+
+			// カプセルの下側半球と重なる球で判定する
+			float h = dyChara->get_halfheight() - dyChara->get_radius(); // カプセル中心から、カプセル下側半球中心までの長さ
+			KCollisionTest test;
+			test.ball_pos = gather.center + KVec3(0.0f, -h, 0.0f); // カプセルの下側半球の中心座標。これを中心とする球で判定する
+			test.ball_radius = dyChara->get_radius();
+			test.ball_speed = dyNode->m_Desc.get_velocity();
+			test.ball_climb = dyNode->m_Desc.get_climb_height();
+			test.ball_skin = 0.5f;
+			if (KCollider::dispatch_collision_result(dyCollider, stCollider, test)) {
+				// 衝突した
+				bool isground = false;
+				bool iswall = false;
+				getSurfaceType(test.result_normal, &isground, &iswall);
+
+				// 地面とみなせる部分との判定は後で行う。
+				// 地面でも壁でもない部分（天井など）は無視する。
+				// 壁とみなせる部分に衝突していれば、適用フェーズで処理するために記録しておく
+				if (iswall) {
+					SStaticContact contact;
+					contact.stBody = stBody;
+					contact.test = test;
+					work.contacts.push_back(contact);
+					gather.contact_count++;
 				}
+			}
+		}
+
+		// 現在地における高度と真下の地面ノードを得る。
+		// 壁との衝突で位置が変わった場合は、適用フェーズで求めなおす
+		float ground_y = 0;
+		gather.ground_found = get_ground_point(gather.center, dyNode->m_Desc.get_snap_height(), &ground_y, &gather.ground, candidates, work.indices);
+		if (gather.ground_found) {
+			gather.ground_alt = gather.center.y - ground_y;
+		}
+	}
+	// 収集フェーズで求めた m_TmpStaticGathers[index] を動的剛体 m_TmpDynamicNodes[index] に適用する。
+	// コールバックを呼び、ノードの位置を変更するので、必ず１スレッドで順番に呼ぶこと
+	void apply_static_contacts(int index) {
+		KSolidBody *dyNode = m_TmpDynamicNodes[index];
+		KCollider *dyCollider = dyNode->getShape();
+		if (dyCollider == nullptr || dyCollider->get_type() != KColliderType_CHARACTER) {
+			return;
+		}
+		KCharacterCollider *dyChara = static_cast<KCharacterCollider*>(dyCollider);
 
-				KVec3 cur_cpos = dyCollider->get_offset_world();
-				KVec3 new_cpos = dyCollider->get_offset_world();
-			
-				if (1/*dyChara*/) {
-					// カプセルの下側半球と重なる球で判定する
-					float h = dyChara->get_halfheight() - dyChara->get_radius(); // カプセル中心から、カプセル下側半球中心までの長さ
-					KCollisionTest test;
-					test.ball_pos = cur_cpos + KVec3(0.0f, -h, 0.0f); // カプセルの下側半球の中心座標。これを中心とする球で判定する
-					test.ball_radius = dyChara->get_radius();
-					test.ball_speed = dyNode->m_Desc.get_velocity();
-					test.ball_climb = dyNode->m_Desc.get_climb_height();
-					test.ball_skin = 0.5f;
-					if (stCollider->get_collision_result(test)) {
-						// 衝突した
-						bool isground = false;
-						bool iswall = false;
-						getSurfaceType(test.result_normal, &isground, &iswall);
-
-						if (isground) {
-							// 地面とみなせる部分に衝突している。地面との判定は後で行うので、ここでは無視する
-					
-						} else if (iswall) {
-							// 壁とみなせる部分に衝突している
-
-							KVec3 calcpos = test.result_newpos + KVec3(0.0f, h, 0.0f); // test.result_newpos はカプセル下部半球の位置なので、これをカプセル位置に直す
-							KVec3 pos0 = new_cpos; // newpos(変更前)
-							KVec3 pos1 = calcpos; // newpos(変更後)
-							bool deny = false;
-							if (m_Callback) {
-								m_Callback->on_collision_wall(stBody->getNode(), dyNode->getNode(), test, pos0, pos1, &deny);
-							}
-							if (!deny) {
-								new_cpos = pos1;
-								if (num_hits < MAX_HITS) {
-									HIT hit;
-									hit.normal = test.result_normal;
-									hit.delta = new_cpos - cur_cpos;
-									hit.node = stBody->getNode();
-									hitlist[num_hits] = hit;
-									dyNode->m_Desc._hits_with.push_back(stBody->getNode());
-									num_hits++;
-								}
-							}
-						} else {
-							// 地面でも壁でもない（天井など）
-						}
-					}
+		// 先に処理した剛体のコールバックなどで、収集後にこの剛体が移動していたら判定しなおす
+		if (!m_TmpStaticGathers[index].valid || dyCollider->get_offset_world() != m_TmpStaticGathers[index].center) {
+			gather_static_contacts(index, 0);
+		}
+		const SStaticGather &gather = m_TmpStaticGathers[index];
+		const SStaticWorker &work = m_StaticWorkers[gather.worker];
+
+		struct HIT {
+			KVec3 delta;
+			KVec3 normal;
+			KNode *node;
+		};
+		const int MAX_HITS = 4;
+		HIT hitlist[MAX_HITS];
+		int num_hits = 0;
+
+		// 壁とみなせる部分との衝突
+		float h = dyChara->get_halfheight() - dyChara->get_radius(); // カプセル中心から、カプセル下側半球中心までの長さ
+		for (int c=0; c<gather.contact_count; c++) {
+			const SStaticContact &contact = work.contacts[gather.contact_start + c];
+			const KCollisionTest &test = contact.test;
+			KSolidBody *stBody = contact.stBody;
+			KVec3 cur_cpos = gather.center;
+			KVec3 new_cpos = gather.center;
+
+			KVec3 calcpos = test.result_newpos + KVec3(0.0f, h, 0.0f); // test.result_newpos はカプセル下部半球の位置なので、これをカプセル位置に直す
+			KVec3 pos0 = new_cpos; // newpos(変更前)
+			KVec3 pos1 = calcpos; // newpos(変更後)
+			bool deny = false;
+			if (m_Callback) {
+				m_Callback->on_collision_wall(stBody->getNode(), dyNode->getNode(), test, pos0, pos1, &deny);
+			}
+			if (!deny) {
+				new_cpos = pos1;
+				if (num_hits < MAX_HITS) {
+					HIT hit;
+					hit.normal = test.result_normal;
+					hit.delta = new_cpos - cur_cpos;
+					hit.node = stBody->getNode();
+					hitlist[num_hits] = hit;
+					dyNode->m_Desc._hits_with.push_back(stBody->getNode());
+					num_hits++;
 				}
 			}
+		}
 
-			if (num_hits > 0) {
-				// 衝突した。めりこみ解消位置に移動する
+		if (num_hits > 0) {
+			// 衝突した。めりこみ解消位置に移動する
 
-				// ゆっくり移動しているときはスリップするが、高速で衝突したら逸れずにその場で止まる
-				bool allow_slip = true; // デフォルトでは常に衝突スリップ可能
-				if (dyNode->m_Desc._slip_control) {
-					const KVec3 &vel = dyNode->m_Desc.get_velocity();
-					if (dyNode->m_Desc._slip_limit_speed <= vel.getLength()) {
-						// 現在の速度が dyNode->m_Desc._slip_slower_than 以上になった。衝突してもスリップせずにその場で停止する
-						allow_slip = false;
-					}
+			// ゆっくり移動しているときはスリップするが、高速で衝突したら逸れずにその場で止まる
+			bool allow_slip = true; // デフォルトでは常に衝突スリップ可能
+			if (dyNode->m_Desc._slip_control) {
+				const KVec3 &vel = dyNode->m_Desc.get_velocity();
+				if (dyNode->m_Desc._slip_limit_speed <= vel.getLength()) {
+					// 現在の速度が dyNode->m_Desc._slip_slower_than 以上になった。衝突してもスリップせずにその場で停止する
+					allow_slip = false;
 				}
+			}
+
+			// 衝突壁が１個だけの場合、裏側からの衝突は無視してよい
+			if (num_hits == 1) {
+				KVec3 vel = dyNode->m_Desc.get_velocity();
+				float dot = vel.dot(hitlist[0].normal); // 速度と壁の法線向きの一致度
+				if (dot > 0) {
+					// 移動方向と法線向きが同じ。
+					// 壁から離れる方向に移動しているので、この衝突を無視する
 
-				// 衝突壁が１個だけの場合、裏側からの衝突は無視してよい
-				if (num_hits == 1) {
-					KVec3 vel = dyNode->m_Desc.get_velocity();
-					float dot = vel.dot(hitlist[0].normal); // 速度と壁の法線向きの一致度
-					if (dot > 0) {
-						// 移動方向と法線向きが同じ。
-						// 壁から離れる方向に移動しているので、この衝突を無視する
-
-					} else {
-						// 衝突後の座標を計算
-						KVec3 pos = dyNode->getNode()->getPosition();
-						KVec3 newpos = pos + hitlist[0].delta; // スリップ込みの新座標
-						if (!allow_slip) {
-							// スリップなし
-							// 進行方向と補正方向が30度(cos>=0.5)以上開いている場合はXYを移動前の位置に戻す
-							// ※Yはスリップしたままで良い、そうしないと壁にぶつかったときに落下してくれない）
-							KVec3 prevpos = pos - vel; // 位置更新前の座標
-
-							// 衝突前速度、衝突後速度を正規化したもの（高低差を無視するので y を 0 にしておく）
-							KVec3 nor_vel_xz = KVec3(vel.x, 0.0f, vel.z).getNormalized(); // 正規化速度
-							KVec3 nor_adj_xz = KVec3(newpos.x - prevpos.x, 0.0f, newpos.z - prevpos.z).getNormalized(); // 衝突後の速度（移動前と補正後移動先の差）
-
-							// 衝突前速度、衝突後速度の一致度を調べる
-							float dot_adj = nor_vel_xz.dot(nor_adj_xz);
-
-							// 閾値角度。衝突前、衝突後の角度がこれ未満だったら正面衝突とみなし、スリップせずに停止する
-							float thr_deg = dyNode->m_Desc._slip_limit_degrees;
-							float thr_val = cosf(KMath::degToRad(thr_deg));
-							if (dot_adj < thr_val) {
-								newpos.x = pos.x - vel.x; // 速度適用前の位置. newpos ではなく pos から引くことに注意
-								newpos.z = pos.z - vel.z;
-							}
-						}
-						dyNode->getNode()->setPosition(newpos);
-					}
 				} else {
-					// 複数の壁とヒットしている。
-					// 法線と速度向きの組み合わせに関係なく、すべての壁との判定を行う
-					//
-					// 例えば
-					//    A
-					//   / 
-					//  / 〇
-					// B-----------C
-					//
-					// という地形があり、〇の速度がABよりも（BCに対して）垂直に近い速度（決して垂直ではない）設定されていて、〇本体をBCにこすりつけながら左に移動しているとする。
-					// 〇は常にBCと衝突し押し返されることにより左に移動しているが、
-					// 〇の速度設定は AB よりも垂直に近くなっており、ABの法線と〇の速度が同じ向きになってしまうためABはそのまますり抜けてしまう
+					// 衝突後の座標を計算
 					KVec3 pos = dyNode->getNode()->getPosition();
-					KVec3 newpos = pos;
-
-					// まずスリップありの新座標を得る
-					for (int i=0; i<num_hits; i++) {
-						const HIT &hit = hitlist[i];
-						newpos += hit.delta;
-					}
+					KVec3 newpos = pos + hitlist[0].delta; // スリップ込みの新座標
 					if (!allow_slip) {
-						// スリップなしの場合はXYを移動前の位置に戻す
+						// スリップなし
+						// 進行方向と補正方向が30度(cos>=0.5)以上開いている場合はXYを移動前の位置に戻す
 						// ※Yはスリップしたままで良い、そうしないと壁にぶつかったときに落下してくれない）
-						KVec3 vel = dyNode->m_Desc.get_velocity();
-						newpos.x = pos.x - vel.x; // 速度適用前の位置. newpos ではなく pos から引くことに注意
-						newpos.z = pos.z - vel.z;
+						KVec3 prevpos = pos - vel; // 位置更新前の座標
+
+						// 衝突前速度、衝突後速度を正規化したもの（高低差を無視するので y を 0 にしておく）
+						KVec3 nor_vel_xz = KVec3(vel.x, 0.0f, vel.z).getNormalized(); // 正規化速度
+						KVec3 nor_adj_xz = KVec3(newpos.x - prevpos.x, 0.0f, newpos.z - prevpos.z).getNormalized(); // 衝突後の速度（移動前と補正後移動先の差）
+
+						// 衝突前速度、衝突後速度の一致度を調べる
+						float dot_adj = nor_vel_xz.dot(nor_adj_xz);
+
+						// 閾値角度。衝突前、衝突後の角度がこれ未満だったら正面衝突とみなし、スリップせずに停止する
+						float thr_deg = dyNode->m_Desc._slip_limit_degrees;
+						float thr_val = cosf(KMath::degToRad(thr_deg));
+						if (dot_adj < thr_val) {
+							newpos.x = pos.x - vel.x; // 速度適用前の位置. newpos ではなく pos から引くことに注意
+							newpos.z = pos.z - vel.z;
+						}
 					}
 					dyNode->getNode()->setPosition(newpos);
 				}
+			} else {
+				// 複数の壁とヒットしている。
+				// 法線と速度向きの組み合わせに関係なく、すべての壁との判定を行う
+				//
+				// 例えば
+				//    A
+				//   / 
+				//  / 〇
+				// B-----------C
+				//
+				// という地形があり、〇の速度がABよりも（BCに対して）垂直に近い速度（決して垂直ではない）設定されていて、〇本体をBCにこすりつけながら左に移動しているとする。
+				// 〇は常にBCと衝突し押し返されることにより左に移動しているが、
+				// 〇の速度設定は AB よりも垂直に近くなっており、ABの法線と〇の速度が同じ向きになってしまうためABはそのまますり抜けてしまう
+				KVec3 pos = dyNode->getNode()->getPosition();
+				KVec3 newpos = pos;
+
+				// まずスリップありの新座標を得る
+				for (int i=0; i<num_hits; i++) {
+					const HIT &hit = hitlist[i];
+					newpos += hit.delta;
+				}
+				if (!allow_slip) {
+					// スリップなしの場合はXYを移動前の位置に戻す
+					// ※Yはスリップしたままで良い、そうしないと壁にぶつかったときに落下してくれない）
+					KVec3 vel = dyNode->m_Desc.get_velocity();
+					newpos.x = pos.x - vel.x; // 速度適用前の位置. newpos ではなく pos から引くことに注意
+					newpos.z = pos.z - vel.z;
+				}
+				dyNode->getNode()->setPosition(newpos);
 			}
+		}
 
-			// 地面との判定
-			// 現在地における高度と真下の地面ノードを得る
-			KVec3 dySpeed = dyNode->m_Desc.get_velocity();
-			KVec3 newSpeed = dySpeed;
-			collide_ground(bodylist, dyNode, dySpeed, m_Callback/*KSolidBodyCallback*/, &newSpeed);
-			dyNode->m_Desc.set_velocity(newSpeed);
+		// 地面との判定
+		// 位置が変わっていなければ、収集フェーズで求めた高度をそのまま使う
+		KVec3 dySpeed = dyNode->m_Desc.get_velocity();
+		KVec3 newSpeed = dySpeed;
+		if (dyCollider->get_offset_world() == gather.center) {
+			collide_ground_at(dyNode, gather.ground_found, gather.ground_alt, gather.ground, dySpeed, m_Callback/*KSolidBodyCallback*/, &newSpeed);
+		} else {
+			collide_ground(dyNode, dySpeed, m_Callback/*KSolidBodyCallback*/, &newSpeed);
 		}
+		dyNode->m_Desc.set_velocity(newSpeed);
 	}
 	void update_dynamicbody_collision_unsafe() { // 動的剛体同士で相互作用するものを処理する
 		// 相互作用する可能性のある剛体リストを作成
@@ -1752,22 +3228,49 @@ private:
 		for (auto it=m_TmpDynamicNodes.begin(); it!=m_TmpDynamicNodes.end(); ++it) {
 			KSolidBody *dyNode = *it;
 			// 動的衝突に対応しているのは KCharacterCollider のみ
-			if (dynamic_cast<KCharacterCollider*>(dyNode->getShape())) {
+			KCollider *coll = dyNode->getShape();
+			if (coll && coll->get_type() == KColliderType_CHARACTER) {
 				m_TmpTable.push_back(dyNode);
 			}
 		}
 
-		for (int i=0; i<(int)m_TmpTable.size()-1; i++) {
+		// 各剛体の AABB。めり込み解決で移動したら更新する
+		const int num = (int)m_TmpTable.size();
+		const uint32_t bitmask = 0;
+		m_TmpDynamicInfos.resize(num);
+		for (int i=0; i<num; i++) {
+			KSolidBody *dyNode = m_TmpTable[i];
+			m_TmpDynamicInfos[i].update(dyNode->getShape(), bitmask, dyNode->m_Desc.get_velocity());
+		}
+		const bool use_sweep = m_DynamicBroadphase == KDynamicBroadphase_SWEEP;
+		if (use_sweep) {
+			m_DynamicSweep.build(m_TmpTable, m_TmpDynamicInfos);
+		}
+
+		// 剛体の組 (i, j) を i, j の昇順で処理する。
+		// 判定候補を絞り込んでも、処理する組とその順番は総当たりの場合と変わらない
+		for (int i=0; i<num-1; i++) {
 			KSolidBody *dyNode1 = m_TmpTable[i];
 			KCollider *dyCollider1 = dyNode1->getShape();
-			uint32_t bitmask = 0;
 
-			float radius1 = dynamic_cast<KCharacterCollider*>(dyCollider1)->get_radius();
+			float radius1 = static_cast<KCharacterCollider*>(dyCollider1)->get_radius();
 
-			COL_INFO info1;
-			info1.update(dyCollider1, bitmask, dyNode1->m_Desc.get_velocity());
+			// ※ i の処理中に dyNode1 が移動しても info1 は更新しない
+			const COL_INFO info1 = m_TmpDynamicInfos[i];
 
-			for (int j=i+1; j<(int)m_TmpTable.size(); j++) {
+			// AABB が X 方向に重なる可能性のある相手を得る
+			std::vector<int> &pairs = m_TmpDynamicPairs;
+			if (use_sweep) {
+				m_DynamicSweep.query(i, info1, pairs);
+			} else {
+				pairs.clear();
+				for (int j=i+1; j<num; j++) {
+					pairs.push_back(j);
+				}
+			}
+
+			for (auto pit=pairs.begin(); pit!=pairs.end(); ++pit) {
+				const int j = *pit;
 				KSolidBody *dyNode2 = m_TmpTable[j];
 				KCollider *dyCollider2 = dyNode2->getShape();
 
@@ -1776,8 +3279,7 @@ private:
 					continue;
 				}
 		
-				COL_INFO info2;
-				info2.update(dyCollider2, bitmask, dyNode2->m_Desc.get_velocity());
+				const COL_INFO &info2 = m_TmpDynamicInfos[j];
 
 				// AABBでの判定
 				if (!KGeom::K_GeomIntersectAabb(
@@ -1788,7 +3290,7 @@ private:
 					continue;
 				}
 
-				float radius2 = dynamic_cast<KCharacterCollider*>(dyCollider2)->get_radius();
+				float radius2 = static_cast<KCharacterCollider*>(dyCollider2)->get_radius();
 
 				// 2体間の中心距離
 				KVec3 wpos1 = dyNode1->getNode()->getWorldPosition();
@@ -1849,6 +3351,13 @@ private:
 					pos2.x += penet_x * response2;
 					pos2.z += penet_z * response2;
 					dyNode2->getNode()->setPosition(pos2);
+
+					// dyNode2 は後で別の剛体と判定するので AABB を更新しておく。
+					// dyNode1 はこのフレームではもう判定相手にならない（以降の組はすべて i より大きい）
+					m_TmpDynamicInfos[j].update(dyCollider2, bitmask, dyNode2->m_Desc.get_velocity());
+					if (use_sweep) {
+						m_DynamicSweep.update(j, m_TmpDynamicInfos[j]);
+					}
 				}
 
 				dyNode1->m_Desc._hits_with.push_back(dyNode2->getNode());
@@ -1889,6 +3398,46 @@ KSolidBody * KSolidBody::of(KNode *node) {
 	K__ASSERT(g_CollisionMgr);
 	return g_CollisionMgr->getBody(node);
 }
+void KSolidBody::setStaticBroadphase(KStaticBroadphase type) {
+	K__ASSERT(g_CollisionMgr);
+	g_CollisionMgr->setStaticBroadphase(type);
+}
+KStaticBroadphase KSolidBody::getStaticBroadphase() {
+	K__ASSERT(g_CollisionMgr);
+	return g_CollisionMgr->getStaticBroadphase();
+}
+void KSolidBody::setDynamicBroadphase(KDynamicBroadphase type) {
+	K__ASSERT(g_CollisionMgr);
+	g_CollisionMgr->setDynamicBroadphase(type);
+}
+KDynamicBroadphase KSolidBody::getDynamicBroadphase() {
+	K__ASSERT(g_CollisionMgr);
+	return g_CollisionMgr->getDynamicBroadphase();
+}
+void KSolidBody::setNumThreads(int num) {
+	K__ASSERT(g_CollisionMgr);
+	g_CollisionMgr->setNumThreads(num);
+}
+int KSolidBody::getNumThreads() {
+	K__ASSERT(g_CollisionMgr);
+	return g_CollisionMgr->getNumThreads();
+}
+void KSolidBody::setAutoSleepFrames(int frames) {
+	K__ASSERT(g_CollisionMgr);
+	g_CollisionMgr->setAutoSleepFrames(frames);
+}
+int KSolidBody::getAutoSleepFrames() {
+	K__ASSERT(g_CollisionMgr);
+	return g_CollisionMgr->getAutoSleepFrames();
+}
+int KSolidBody::getNumAwakeBodies() {
+	K__ASSERT(g_CollisionMgr);
+	return g_CollisionMgr->getNumAwakeBodies();
+}
+int KSolidBody::getNumSleepingBodies() {
+	K__ASSERT(g_CollisionMgr);
+	return g_CollisionMgr->getNumSleepingBodies();
+}
 void KSolidBody::attachVelocity(KNode *node) {
 	K__ASSERT(g_CollisionMgr);
 	g_CollisionMgr->attachVelocity(node);
@@ -1909,6 +3458,14 @@ bool KSolidBody::rayCast(const KVec3 &pos, const KVec3 &dir, float maxdist, KRay
 	K__ASSERT(g_CollisionMgr);
 	return g_CollisionMgr->rayCast(pos, dir, maxdist, out_hit);
 }
+int KSolidBody::getGroundPoints(const KVec3 *points, int count, float max_penetration, bool *out_found, float *out_ground_y, KNode **out_ground) {
+	K__ASSERT(g_CollisionMgr);
+	return g_CollisionMgr->getGroundPoints(points, count, max_penetration, out_found, out_ground_y, out_ground);
+}
+int KSolidBody::rayCastBatch(const KVec3 *starts, const KVec3 *dirs, int count, float maxdist, bool *out_found, KRayHit *out_hits) {
+	K__ASSERT(g_CollisionMgr);
+	return g_CollisionMgr->rayCastBatch(starts, dirs, count, maxdist, out_found, out_hits);
+}
 void KSolidBody::setDebugLineVisible(bool static_lines, bool dynamic_lines) {
 	K__ASSERT(g_CollisionMgr);
 	g_CollisionMgr->setDebugLineVisible(static_lines, dynamic_lines);
@@ -1955,6 +3512,10 @@ void KSolidBody::setCollisionMaskBits(uint32_t mask_bits) {
 KSolidBody::KSolidBody() {
 	m_Node = nullptr;
 	m_Shape = nullptr;
+	m_DynamicIndex = -1;
+	m_RestFrames = 0;
+	m_RestHits = 0;
+	m_Sleeping = false;
 }
 KSolidBody::~KSolidBody() {
 	K__DROP(m_Shape);
@@ -1978,10 +3539,22 @@ void KSolidBody::setShape(KCollider *co) {
 		m_Shape->grab();
 		m_Shape->_setNode(m_Node);
 	}
+	if (g_CollisionMgr && m_Desc.is_static()) {
+		g_CollisionMgr->markStaticBodiesDirty();
+	}
+	wakeUp();
 }
 KCollider * KSolidBody::getShape() {
 	return m_Shape;
 }
+bool KSolidBody::isSleeping() const {
+	return m_Sleeping;
+}
+void KSolidBody::wakeUp() {
+	if (m_Sleeping && g_CollisionMgr) {
+		g_CollisionMgr->wakeBody(this);
+	}
+}
 void KSolidBody::setShapeCenter(const KVec3 &pos) {
 	KCollider *coll = getShape();
 	if (coll) coll->set_offset(pos);
@@ -2013,11 +3586,31 @@ bool KSolidBody::getAabbWorld(KVec3 *out_min, KVec3 *out_max) {
 void KSolidBody::setBodyEnabled(bool value) {
 	KCollider *coll = getShape();
 	coll->setEnable(value);
+	wakeUp();
 }
 bool KSolidBody::getBodyEnabled() {
 	KCollider *coll = getShape();
 	return coll ? coll->getEnable() : false;
 }
+void KSolidBody::Desc::set_mask_bits(uint32_t value) {
+	if (_mask_bits != value) {
+		_mask_bits = value;
+		if (_is_static && g_CollisionMgr) {
+			g_CollisionMgr->markStaticBodiesDirty(); // マスクが 0 かどうかで判定対象が変わる
+		}
+		if (_sleeping && g_CollisionMgr) {
+			g_CollisionMgr->requestWake(knode);
+		}
+	}
+}
+void KSolidBody::Desc::set_velocity(const KVec3 &vel) {
+	if (_velocity != vel) {
+		_velocity = vel;
+		if (_sleeping && g_CollisionMgr) {
+			g_CollisionMgr->requestWake(knode);
+		}
+	}
+}
 #pragma endregion // KSolidBody
 
 
@@ -2103,6 +3696,11 @@ void KStaticSolidBody::setShapeFloor(const KVec3 &halfsize, float shearx, const
 	setShape(coll);
 	coll->drop();
 }
+void KStaticSolidBody::setShapeHeightfield(int cols, int rows, float cell_size, const float *heights) {
+	KCollider *coll = KHeightfieldCollider::create(KVec3(), cols, rows, cell_size, heights);
+	setShape(coll);
+	coll->drop();
+}
 void KStaticSolidBody::setShapeWall(float x0, float z0, float x1, float z1) {
 	float delta_x = x1 - x0;
 	float delta_z = z1 - z0;
@@ -2292,6 +3890,1114 @@ void Test_collision() {
 	K__ASSERT(KMath::equals(adj_y,  0));
 #endif // _DEBUG
 }
+
+void Test_static_broadphase() {
+	bool install_tree = !KNodeTree::isInstalled();
+	if (install_tree) KNodeTree::install();
+	bool install = g_CollisionMgr == nullptr;
+	if (install) KSolidBody::install();
+	KStaticBroadphase old_type = KSolidBody::getStaticBroadphase();
+
+	uint32_t seed = 12345;
+	auto rnd = [&seed](float lo, float hi) {
+		seed = seed * 1664525 + 1013904223;
+		return lo + (hi - lo) * ((seed >> 8) / (float)(1 << 24));
+	};
+
+	// 5000 個の地形と 500 個のキャラクターを作る
+	const int NUM_STATICS = 5000;
+	const int NUM_DYNAMICS = 500;
+	const int NUM_FRAMES = 4;
+	const int NUM_QUERIES = 200;
+	const float WORLD = 4000;
+	KNode *root = KNode::create();
+	root->setParent(KNodeTree::getRoot());
+	std::vector<KNode *> statics;
+	std::vector<KNode *> dynamics;
+	for (int i=0; i<NUM_STATICS; i++) {
+		KNode *node = KNode::create();
+		node->setParent(root);
+		node->setPosition(KVec3(rnd(0, WORLD), rnd(-20, 20), rnd(0, WORLD)));
+		KStaticSolidBody::attach(node);
+		KStaticSolidBody *body = KStaticSolidBody::of(node);
+		switch (i % 5) {
+		case 0:
+			if (i == 0) {
+				body->setShapeGround(); // 全体を覆う平面
+			} else if (i % 10 == 5) {
+				// 頂点がコライダーの中心から離れた床。
+				// 判定面は中心を通るので、頂点から求めた AABB の外側にある
+				float h = rnd(10, 20) * ((i % 20 == 5) ? 1 : -1);
+				KVec3 p[] = {KVec3(-40.0f, h, -40.0f), KVec3(-40.0f, h, 40.0f), KVec3(40.0f, h, 40.0f), KVec3(40.0f, h, -40.0f)};
+				KCollider *coll = KQuadCollider::create(KVec3(), p);
+				body->setShape(coll);
+				coll->drop();
+			} else {
+				float h = rnd(-20, 20); // 傾斜した床。面はコライダーの中心を通る
+				KVec3 p[] = {KVec3(-40.0f, -h, -40.0f), KVec3(-40.0f, h, 40.0f), KVec3(40.0f, h, 40.0f), KVec3(40.0f, -h, -40.0f)};
+				KCollider *coll = KQuadCollider::create(KVec3(), p);
+				body->setShape(coll);
+				coll->drop();
+			}
+			break;
+		case 1:
+			body->setShapeBox(KVec3(rnd(8, 40), rnd(8, 40), rnd(8, 40)));
+			break;
+		case 2:
+			{
+				float heights[] = {rnd(0, 30), rnd(0, 30), rnd(0, 30), rnd(0, 30)};
+				body->setShapeFloor(KVec3(rnd(16, 48), 0.0f, rnd(16, 48)), rnd(0, 8), heights);
+			}
+			break;
+		case 3:
+			body->setShapeCapsule(rnd(8, 24), rnd(24, 64));
+			break;
+		case 4:
+			{
+				float x = rnd(0, WORLD);
+				float z = rnd(0, WORLD);
+				body->setShapeWall(x, z, x + rnd(-80, 80), z + rnd(-80, 80));
+			}
+			break;
+		}
+		statics.push_back(node);
+		node->drop();
+	}
+	std::vector<KVec3> dynamic_pos;
+	std::vector<KSolidBody::Desc> dynamic_desc;
+	for (int i=0; i<NUM_DYNAMICS; i++) {
+		KNode *node = KNode::create();
+		node->setParent(root);
+		KVec3 pos(rnd(0, WORLD), rnd(20, 60), rnd(0, WORLD));
+		node->setPosition(pos);
+		KDynamicSolidBody::attachEx(node, false);
+		KDynamicSolidBody *body = KDynamicSolidBody::of(node);
+		body->setShapeCapsule(8, 16);
+		body->setVelocity(KVec3(rnd(-4, 4), 0.0f, rnd(-4, 4)));
+		dynamics.push_back(node);
+		dynamic_pos.push_back(pos);
+		dynamic_desc.push_back(body->m_Desc);
+		node->drop();
+	}
+	std::vector<KVec3> query_pos;
+	std::vector<KVec3> query_dir;
+	for (int i=0; i<NUM_QUERIES; i++) {
+		query_pos.push_back(KVec3(rnd(0, WORLD), rnd(0, 100), rnd(0, WORLD)));
+		query_dir.push_back(KVec3(rnd(-1, 1), rnd(-1, 0), rnd(-1, 1)));
+	}
+
+	struct RESULT {
+		std::vector<KVec3> pos;
+		std::vector<float> alt;
+		std::vector<KNode *> ground;
+		std::vector<int> hits;
+		std::vector<float> query_y;
+		std::vector<KNode *> query_node;
+		std::vector<KVec3> ray_pos;
+		std::vector<KCollider *> ray_coll;
+		std::vector<float> sphere_dist;
+		std::vector<KCollider *> sphere_coll;
+	};
+	auto record_bodies = [&](RESULT &r) {
+		for (int i=0; i<NUM_DYNAMICS; i++) {
+			KSolidBody *body = KSolidBody::of(dynamics[i]);
+			r.pos.push_back(dynamics[i]->getPosition());
+			r.alt.push_back(body->m_Desc._has_altitude ? body->m_Desc._altitude : -1);
+			r.ground.push_back(body->m_Desc._ground_node);
+			r.hits.push_back((int)body->m_Desc._hits_with.size());
+		}
+	};
+	auto record_queries = [&](RESULT &r) {
+		for (int i=0; i<NUM_QUERIES; i++) {
+			float y = 0;
+			KNode *gnd = nullptr;
+			bool ok = KSolidBody::getGroundPoint(query_pos[i], 10, &y, &gnd);
+			r.query_y.push_back(ok ? y : -1);
+			r.query_node.push_back(gnd);
+
+			KRayHit hit;
+			float maxdist = (i % 2) ? 300.0f : -1.0f; // 有限長と無限長のレイ
+			ok = KSolidBody::rayCast(query_pos[i], query_dir[i], maxdist, &hit);
+			r.ray_pos.push_back(ok ? hit.pos : KVec3());
+			r.ray_coll.push_back(ok ? hit.collider : nullptr);
+
+			KRayHit shit;
+			ok = g_CollisionMgr->sphereCast(query_pos[i], 8, query_dir[i], 400, &shit);
+			r.sphere_dist.push_back(ok ? shit.dist : -1);
+			r.sphere_coll.push_back(ok ? shit.collider : nullptr);
+		}
+	};
+
+	const KStaticBroadphase types[] = {KStaticBroadphase_NONE, KStaticBroadphase_BVH, KStaticBroadphase_GRID};
+	const char *names[] = {"none", "bvh", "grid"};
+	RESULT results[3];
+	for (int t=0; t<3; t++) {
+		KSolidBody::setStaticBroadphase(types[t]);
+		for (int i=0; i<NUM_DYNAMICS; i++) {
+			dynamics[i]->setPosition(dynamic_pos[i]);
+			KSolidBody::of(dynamics[i])->m_Desc = dynamic_desc[i];
+		}
+		KClock clock;
+		for (int f=0; f<NUM_FRAMES; f++) {
+			g_CollisionMgr->on_manager_frame();
+		}
+		int frame_usec = (int)(clock.getTimeNano64() / 1000 / NUM_FRAMES);
+		record_bodies(results[t]);
+
+		clock.reset();
+		record_queries(results[t]);
+		int query_usec = (int)(clock.getTimeNano64() / 1000);
+
+		// 一部の地形を移動、無効化する
+		int rebuilds = g_CollisionMgr->getStaticBroadphaseData().getNumRebuilds();
+		int refits = g_CollisionMgr->getStaticBroadphaseData().getNumRefits();
+		for (int i=1; i<NUM_STATICS; i+=50) {
+			statics[i]->setPosition(statics[i]->getPosition() + KVec3(30, 15, -30));
+		}
+		record_queries(results[t]);
+		if (types[t] == KStaticBroadphase_BVH) {
+			// 移動だけなら再構築せずに AABB を更新する
+			K__ASSERT(g_CollisionMgr->getStaticBroadphaseData().getNumRebuilds() == rebuilds);
+			K__ASSERT(g_CollisionMgr->getStaticBroadphaseData().getNumRefits() == refits + 1);
+		}
+		for (int i=2; i<NUM_STATICS; i+=40) {
+			KSolidBody::of(statics[i])->setBodyEnabled(false);
+		}
+		for (int i=3; i<NUM_STATICS; i+=40) {
+			KSolidBody::of(statics[i])->setCollisionMaskBits(0);
+		}
+		for (int f=0; f<NUM_FRAMES; f++) {
+			g_CollisionMgr->on_manager_frame();
+		}
+		record_bodies(results[t]);
+		record_queries(results[t]);
+
+		// 元に戻す
+		for (int i=1; i<NUM_STATICS; i+=50) {
+			statics[i]->setPosition(statics[i]->getPosition() - KVec3(30, 15, -30));
+		}
+		for (int i=2; i<NUM_STATICS; i+=40) {
+			KSolidBody::of(statics[i])->setBodyEnabled(true);
+		}
+		for (int i=3; i<NUM_STATICS; i+=40) {
+			KSolidBody::of(statics[i])->setCollisionMaskBits(0xFFFFFFFF);
+		}
+		K__PRINT("Test_static_broadphase: %s: %d statics / %d dynamics: %d usec/frame, queries x%d: %d usec",
+			names[t], NUM_STATICS, NUM_DYNAMICS, frame_usec, NUM_QUERIES, query_usec);
+	}
+
+	// 総当たりの結果と完全に一致する
+	for (int t=1; t<3; t++) {
+		const RESULT &a = results[0];
+		const RESULT &b = results[t];
+		K__ASSERT(a.pos == b.pos);
+		K__ASSERT(a.alt == b.alt);
+		K__ASSERT(a.ground == b.ground);
+		K__ASSERT(a.hits == b.hits);
+		K__ASSERT(a.query_y == b.query_y);
+		K__ASSERT(a.query_node == b.query_node);
+		K__ASSERT(a.ray_pos == b.ray_pos);
+		K__ASSERT(a.ray_coll == b.ray_coll);
+		K__ASSERT(a.sphere_dist == b.sphere_dist);
+		K__ASSERT(a.sphere_coll == b.sphere_coll);
+	}
+
+	KSolidBody::setStaticBroadphase(old_type);
+	for (size_t i=0; i<statics.size(); i++) {
+		g_CollisionMgr->on_manager_detach(statics[i]);
+	}
+	for (size_t i=0; i<dynamics.size(); i++) {
+		g_CollisionMgr->on_manager_detach(dynamics[i]);
+	}
+	root->remove();
+	root->drop();
+	KNodeTree::destroyMarkedNodes(nullptr);
+	if (install) KSolidBody::uninstall();
+	if (install_tree) KNodeTree::uninstall();
+}
+
+void Test_static_body_list() {
+	bool install_tree = !KNodeTree::isInstalled();
+	if (install_tree) KNodeTree::install();
+	bool install = g_CollisionMgr == nullptr;
+	if (install) KSolidBody::install();
+
+	uint32_t seed = 67890;
+	auto rnd = [&seed](float lo, float hi) {
+		seed = seed * 1664525 + 1013904223;
+		return lo + (hi - lo) * ((seed >> 8) / (float)(1 << 24));
+	};
+
+	// 20 個のグループに 100 個ずつ、合計 2000 個の地形を作る
+	const int NUM_GROUPS = 20;
+	const int NUM_STATICS = 2000;
+	const int NUM_QUERIES = 1000;
+	const int NUM_FRAMES = 20;
+	const float WORLD = 2000;
+	KNode *root = KNode::create();
+	root->setParent(KNodeTree::getRoot());
+	std::vector<KNode *> groups;
+	std::vector<KNode *> statics;
+	for (int i=0; i<NUM_GROUPS; i++) {
+		KNode *node = KNode::create();
+		node->setParent(root);
+		groups.push_back(node);
+		node->drop();
+	}
+	for (int i=0; i<NUM_STATICS; i++) {
+		KNode *node = KNode::create();
+		node->setParent(groups[i % NUM_GROUPS]);
+		node->setPosition(KVec3(rnd(0, WORLD), rnd(-20, 20), rnd(0, WORLD)));
+		KStaticSolidBody::attach(node);
+		KStaticSolidBody *body = KStaticSolidBody::of(node);
+		if (i % 2) {
+			body->setShapeBox(KVec3(rnd(16, 60), rnd(8, 40), rnd(16, 60)));
+		} else {
+			float heights[] = {rnd(0, 30), rnd(0, 30), rnd(0, 30), rnd(0, 30)};
+			body->setShapeFloor(KVec3(rnd(16, 60), 0.0f, rnd(16, 60)), rnd(0, 8), heights);
+		}
+		statics.push_back(node);
+		node->drop();
+	}
+	std::vector<KVec3> query_pos;
+	for (int i=0; i<NUM_QUERIES; i++) {
+		query_pos.push_back(KVec3(rnd(0, WORLD), 100.0f, rnd(0, WORLD)));
+	}
+	auto run_queries = [&](std::vector<KNode *> &out) {
+		out.clear();
+		for (int i=0; i<NUM_QUERIES; i++) {
+			KNode *gnd = nullptr;
+			float y = 0;
+			KSolidBody::getGroundPoint(query_pos[i], 10, &y, &gnd);
+			out.push_back(gnd);
+		}
+	};
+
+	// キャッシュされたリストが、毎回作り直したリストと一致し、クエリ結果も変わらないことを確認する
+	int num_errors = 0;
+	auto check = [&]() {
+		KBodyList cached = g_CollisionMgr->getActiveStaticBodies();
+		KBodyList scanned;
+		g_CollisionMgr->scanActiveStaticBodies(scanned);
+		if (cached != scanned) num_errors++;
+
+		std::vector<KNode *> a, b;
+		run_queries(a);
+		g_CollisionMgr->markStaticBodiesDirty();
+		run_queries(b);
+		if (a != b) num_errors++;
+	};
+	// 変化がなければ作り直さない。変化があれば次のクエリで一度だけ作り直す
+	auto expect_scans = [&](int num) {
+		int scans = g_CollisionMgr->getNumActiveStaticsScans();
+		g_CollisionMgr->getActiveStaticBodies();
+		g_CollisionMgr->getActiveStaticBodies();
+		if (g_CollisionMgr->getNumActiveStaticsScans() != scans + num) num_errors++;
+	};
+	check();
+	expect_scans(0);
+
+	// 剛体の無効化
+	for (int i=0; i<NUM_STATICS; i+=7) {
+		KSolidBody::of(statics[i])->setBodyEnabled(false);
+	}
+	expect_scans(1);
+	check();
+
+	// ノードのツリー内での無効化（親の無効化）
+	groups[3]->setEnable(false);
+	groups[11]->setEnable(false);
+	expect_scans(1);
+	check();
+
+	// 無効なグループへの付け替え
+	statics[0]->setParent(groups[3]);
+	expect_scans(1);
+	check();
+
+	// マスクの変更
+	for (int i=1; i<NUM_STATICS; i+=9) {
+		KSolidBody::of(statics[i])->setCollisionMaskBits(0);
+	}
+	expect_scans(1);
+	check();
+
+	// 判定対象に影響しない変更（移動）では作り直さない
+	statics[5]->setPosition(statics[5]->getPosition() + KVec3(10, 0, 10));
+	expect_scans(0);
+	check();
+
+	// 元に戻す
+	statics[0]->setParent(groups[0]);
+	groups[3]->setEnable(true);
+	groups[11]->setEnable(true);
+	for (int i=0; i<NUM_STATICS; i+=7) {
+		KSolidBody::of(statics[i])->setBodyEnabled(true);
+	}
+	for (int i=1; i<NUM_STATICS; i+=9) {
+		KSolidBody::of(statics[i])->setCollisionMaskBits(0xFFFFFFFF);
+	}
+	check();
+
+	// 1フレームあたり 1000 回の地面クエリ。毎フレーム1個の地形の有効状態が変わる
+	int queries0 = g_CollisionMgr->getNumActiveStaticsQueries();
+	int scans0 = g_CollisionMgr->getNumActiveStaticsScans();
+	KClock clock;
+	std::vector<KNode *> tmp;
+	for (int f=0; f<NUM_FRAMES; f++) {
+		KSolidBody *body = KSolidBody::of(statics[f]);
+		body->setBodyEnabled(!body->getBodyEnabled());
+		run_queries(tmp);
+	}
+	int cached_usec = (int)(clock.getTimeNano64() / 1000 / NUM_FRAMES);
+	int num_queries = g_CollisionMgr->getNumActiveStaticsQueries() - queries0;
+	int num_scans = g_CollisionMgr->getNumActiveStaticsScans() - scans0;
+	if (num_scans != NUM_FRAMES) num_errors++;
+
+	// 以前のようにクエリのたびにリストを作り直した場合の走査コスト
+	clock.reset();
+	KBodyList scanned;
+	for (int i=0; i<NUM_QUERIES; i++) {
+		g_CollisionMgr->scanActiveStaticBodies(scanned);
+	}
+	int scan_usec = (int)(clock.getTimeNano64() / 1000);
+
+	K__PRINT("Test_static_body_list: %d statics: %d queries/frame: %d usec/frame, %d queries, %d scans (rescan per query: %d scans/frame, %d usec/frame)",
+		NUM_STATICS, NUM_QUERIES, cached_usec, num_queries, num_scans, NUM_QUERIES, scan_usec);
+	K__ASSERT(num_errors == 0);
+
+	for (size_t i=0; i<statics.size(); i++) {
+		g_CollisionMgr->on_manager_detach(statics[i]);
+	}
+	root->remove();
+	root->drop();
+	KNodeTree::destroyMarkedNodes(nullptr);
+	if (install) KSolidBody::uninstall();
+	if (install_tree) KNodeTree::uninstall();
+}
+
+void Test_dynamic_broadphase() {
+	bool install_tree = !KNodeTree::isInstalled();
+	if (install_tree) KNodeTree::install();
+	bool install = g_CollisionMgr == nullptr;
+	if (install) KSolidBody::install();
+	KDynamicBroadphase old_type = KSolidBody::getDynamicBroadphase();
+
+	uint32_t seed = 24680;
+	auto rnd = [&seed](float lo, float hi) {
+		seed = seed * 1664525 + 1013904223;
+		return lo + (hi - lo) * ((seed >> 8) / (float)(1 << 24));
+	};
+
+	// キャラクター１体あたり 40x40 の広さになるように密集させる
+	const int counts[] = {100, 500, 1000, 2000, 5000};
+	const int NUM_FRAMES = 3;
+	int num_errors = 0;
+	for (int c=0; c<5; c++) {
+		const int num = counts[c];
+		const float WORLD = sqrtf((float)num) * 40;
+		KNode *root = KNode::create();
+		root->setParent(KNodeTree::getRoot());
+		std::vector<KNode *> nodes;
+		std::vector<KVec3> init_pos;
+		std::vector<KSolidBody::Desc> init_desc;
+		for (int i=0; i<num; i++) {
+			KNode *node = KNode::create();
+			node->setParent(root);
+			KVec3 pos(rnd(0, WORLD), 0.0f, rnd(0, WORLD));
+			node->setPosition(pos);
+			KDynamicSolidBody::attachEx(node, false);
+			KDynamicSolidBody *body = KDynamicSolidBody::of(node);
+			body->setShapeCapsule(rnd(8, 16), 16);
+			body->setVelocity(KVec3(rnd(-2, 2), 0.0f, rnd(-2, 2)));
+			body->m_Desc.set_gravity(0);
+			nodes.push_back(node);
+			init_pos.push_back(pos);
+			init_desc.push_back(body->m_Desc);
+			node->drop();
+		}
+
+		std::vector<KVec3> result_pos[2];
+		std::vector<int> result_hits[2];
+		int usec[2];
+		const KDynamicBroadphase types[] = {KDynamicBroadphase_NONE, KDynamicBroadphase_SWEEP};
+		for (int t=0; t<2; t++) {
+			KSolidBody::setDynamicBroadphase(types[t]);
+			for (int i=0; i<num; i++) {
+				nodes[i]->setPosition(init_pos[i]);
+				KSolidBody::of(nodes[i])->m_Desc = init_desc[i];
+			}
+			KClock clock;
+			for (int f=0; f<NUM_FRAMES; f++) {
+				g_CollisionMgr->on_manager_frame();
+			}
+			usec[t] = (int)(clock.getTimeNano64() / 1000 / NUM_FRAMES);
+			for (int i=0; i<num; i++) {
+				result_pos[t].push_back(nodes[i]->getPosition());
+				result_hits[t].push_back((int)KSolidBody::of(nodes[i])->m_Desc._hits_with.size());
+			}
+		}
+
+		// 総当たりと完全に同じ位置に解決される
+		if (result_pos[0] != result_pos[1]) num_errors++;
+		if (result_hits[0] != result_hits[1]) num_errors++;
+		K__PRINT("Test_dynamic_broadphase: %d characters: none %d usec/frame, sweep %d usec/frame",
+			num, usec[0], usec[1]);
+
+		for (size_t i=0; i<nodes.size(); i++) {
+			g_CollisionMgr->on_manager_detach(nodes[i]);
+		}
+		root->remove();
+		root->drop();
+		KNodeTree::destroyMarkedNodes(nullptr);
+	}
+	K__ASSERT(num_errors == 0);
+
+	KSolidBody::setDynamicBroadphase(old_type);
+	if (install) KSolidBody::uninstall();
+	if (install_tree) KNodeTree::uninstall();
+}
+
+void Test_ground_batch() {
+	bool install_tree = !KNodeTree::isInstalled();
+	if (install_tree) KNodeTree::install();
+	bool install = g_CollisionMgr == nullptr;
+	if (install) KSolidBody::install();
+
+	uint32_t seed = 97531;
+	auto rnd = [&seed](float lo, float hi) {
+		seed = seed * 1664525 + 1013904223;
+		return lo + (hi - lo) * ((seed >> 8) / (float)(1 << 24));
+	};
+
+	// 1000 個の地形の上に 2000 個の影を落とす
+	const int NUM_STATICS = 1000;
+	const int NUM_POINTS = 2000;
+	const int NUM_RAYS = 500;
+	const int NUM_FRAMES = 10;
+	const float WORLD = 3000;
+	KNode *root = KNode::create();
+	root->setParent(KNodeTree::getRoot());
+	std::vector<KNode *> statics;
+	for (int i=0; i<NUM_STATICS; i++) {
+		KNode *node = KNode::create();
+		node->setParent(root);
+		node->setPosition(KVec3(rnd(0, WORLD), rnd(-20, 20), rnd(0, WORLD)));
+		KStaticSolidBody::attach(node);
+		KStaticSolidBody *body = KStaticSolidBody::of(node);
+		switch (i % 4) {
+		case 0:
+			if (i == 0) {
+				body->setShapeGround(); // 全体を覆う平面
+			} else {
+				float h = rnd(-20, 20);
+				KVec3 p[] = {KVec3(-60.0f, -h, -60.0f), KVec3(-60.0f, h, 60.0f), KVec3(60.0f, h, 60.0f), KVec3(60.0f, -h, -60.0f)};
+				KCollider *coll = KQuadCollider::create(KVec3(), p);
+				body->setShape(coll);
+				coll->drop();
+			}
+			break;
+		case 1:
+			body->setShapeBox(KVec3(rnd(16, 60), rnd(8, 40), rnd(16, 60)));
+			break;
+		case 2:
+			{
+				float heights[] = {rnd(0, 30), rnd(0, 30), rnd(0, 30), rnd(0, 30)};
+				body->setShapeFloor(KVec3(rnd(16, 60), 0.0f, rnd(16, 60)), rnd(0, 8), heights);
+			}
+			break;
+		case 3:
+			body->setShapeCapsule(rnd(8, 24), rnd(24, 64));
+			break;
+		}
+		statics.push_back(node);
+		node->drop();
+	}
+	std::vector<KVec3> points;
+	for (int i=0; i<NUM_POINTS; i++) {
+		points.push_back(KVec3(rnd(0, WORLD), rnd(0, 100), rnd(0, WORLD)));
+	}
+	std::vector<KVec3> dirs;
+	for (int i=0; i<NUM_RAYS; i++) {
+		dirs.push_back(KVec3(rnd(-1, 1), rnd(-1, 0), rnd(-1, 1)));
+	}
+
+	int num_errors = 0;
+	const KStaticBroadphase types[] = {KStaticBroadphase_NONE, KStaticBroadphase_BVH, KStaticBroadphase_GRID};
+	const char *names[] = {"none", "bvh", "grid"};
+	KStaticBroadphase old_type = KSolidBody::getStaticBroadphase();
+	for (int t=0; t<3; t++) {
+		KSolidBody::setStaticBroadphase(types[t]);
+
+		// １点ずつ問い合わせる
+		std::vector<char> found1(NUM_POINTS);
+		std::vector<float> y1(NUM_POINTS);
+		std::vector<KNode *> gnd1(NUM_POINTS);
+		KClock clock;
+		for (int f=0; f<NUM_FRAMES; f++) {
+			for (int i=0; i<NUM_POINTS; i++) {
+				float y = 0;
+				KNode *gnd = nullptr;
+				found1[i] = KSolidBody::getGroundPoint(points[i], 16, &y, &gnd);
+				y1[i] = y;
+				gnd1[i] = gnd;
+			}
+		}
+		int single_usec = (int)(clock.getTimeNano64() / 1000 / NUM_FRAMES);
+
+		// まとめて問い合わせる
+		bool found2[NUM_POINTS];
+		float y2[NUM_POINTS];
+		KNode *gnd2[NUM_POINTS];
+		clock.reset();
+		for (int f=0; f<NUM_FRAMES; f++) {
+			KSolidBody::getGroundPoints(points.data(), NUM_POINTS, 16, found2, y2, gnd2);
+		}
+		int batch_usec = (int)(clock.getTimeNano64() / 1000 / NUM_FRAMES);
+
+		// 点ごとに完全に一致する
+		int num_found = 0;
+		for (int i=0; i<NUM_POINTS; i++) {
+			if ((found1[i] != 0) != found2[i]) { num_errors++; continue; }
+			if (found2[i]) {
+				if (y1[i] != y2[i]) num_errors++;
+				if (gnd1[i] != gnd2[i]) num_errors++;
+				num_found++;
+			}
+		}
+
+		// レイ
+		bool ray_found[NUM_RAYS];
+		KRayHit ray_hits[NUM_RAYS];
+		KSolidBody::rayCastBatch(points.data(), dirs.data(), NUM_RAYS, 400, ray_found, ray_hits);
+		for (int i=0; i<NUM_RAYS; i++) {
+			KRayHit hit;
+			bool ok = KSolidBody::rayCast(points[i], dirs[i], 400, &hit);
+			if (ok != ray_found[i]) { num_errors++; continue; }
+			if (ok) {
+				if (hit.pos != ray_hits[i].pos) num_errors++;
+				if (hit.dist != ray_hits[i].dist) num_errors++;
+				if (hit.collider != ray_hits[i].collider) num_errors++;
+			}
+		}
+		K__PRINT("Test_ground_batch: %s: %d points / %d statics: getGroundPoint %d usec, getGroundPoints %d usec (%d found)",
+			names[t], NUM_POINTS, NUM_STATICS, single_usec, batch_usec, num_found);
+	}
+	K__ASSERT(num_errors == 0);
+	KSolidBody::setStaticBroadphase(old_type);
+
+	for (size_t i=0; i<statics.size(); i++) {
+		g_CollisionMgr->on_manager_detach(statics[i]);
+	}
+	root->remove();
+	root->drop();
+	KNodeTree::destroyMarkedNodes(nullptr);
+	if (install) KSolidBody::uninstall();
+	if (install_tree) KNodeTree::uninstall();
+}
+void Test_static_gather() {
+	bool install_tree = !KNodeTree::isInstalled();
+	if (install_tree) KNodeTree::install();
+	bool install = g_CollisionMgr == nullptr;
+	if (install) KSolidBody::install();
+	int old_threads = KSolidBody::getNumThreads();
+
+	uint32_t seed = 11235;
+	auto rnd = [&seed](float lo, float hi) {
+		seed = seed * 1664525 + 1013904223;
+		return lo + (hi - lo) * ((seed >> 8) / (float)(1 << 24));
+	};
+
+	// 1000 個の地形の中を 4000 体のキャラクターが動き回る
+	const int NUM_STATICS = 1000;
+	const int NUM_CHARAS = 4000;
+	const int NUM_FRAMES = 10;
+	const float WORLD = 3000;
+	KNode *root = KNode::create();
+	root->setParent(KNodeTree::getRoot());
+	std::vector<KNode *> nodes;
+	for (int i=0; i<NUM_STATICS; i++) {
+		KNode *node = KNode::create();
+		node->setParent(root);
+		node->setPosition(KVec3(rnd(0, WORLD), rnd(-20, 20), rnd(0, WORLD)));
+		KStaticSolidBody::attach(node);
+		KStaticSolidBody *body = KStaticSolidBody::of(node);
+		switch (i % 3) {
+		case 0:
+			if (i == 0) {
+				body->setShapeGround(); // 全体を覆う平面
+			} else {
+				body->setShapeCapsule(rnd(8, 24), rnd(24, 64));
+			}
+			break;
+		case 1:
+			body->setShapeBox(KVec3(rnd(16, 60), rnd(8, 40), rnd(16, 60)));
+			break;
+		case 2:
+			{
+				float heights[] = {rnd(0, 30), rnd(0, 30), rnd(0, 30), rnd(0, 30)};
+				body->setShapeFloor(KVec3(rnd(16, 60), 0.0f, rnd(16, 60)), rnd(0, 8), heights);
+			}
+			break;
+		}
+		nodes.push_back(node);
+		node->drop();
+	}
+	std::vector<KNode *> charas;
+	std::vector<KVec3> init_pos;
+	std::vector<KSolidBody::Desc> init_desc;
+	for (int i=0; i<NUM_CHARAS; i++) {
+		KNode *node = KNode::create();
+		node->setParent(root);
+		KVec3 pos(rnd(0, WORLD), rnd(0, 40), rnd(0, WORLD));
+		node->setPosition(pos);
+		KDynamicSolidBody::attachEx(node, false);
+		KDynamicSolidBody *body = KDynamicSolidBody::of(node);
+		body->setShapeCapsule(rnd(8, 16), 16);
+		body->setVelocity(KVec3(rnd(-4, 4), 0.0f, rnd(-4, 4)));
+		body->m_Desc.set_gravity(-0.5f);
+		charas.push_back(node);
+		init_pos.push_back(pos);
+		init_desc.push_back(body->m_Desc);
+		nodes.push_back(node);
+		node->drop();
+	}
+
+	// スレッド数を変えて同じ状態から動かし、結果が完全に一致することを確認する
+	const int thread_counts[] = {1, 2, 4, 8};
+	const int NUM_RUNS = 4;
+	std::vector<KVec3> result_pos[NUM_RUNS];
+	std::vector<KVec3> result_vel[NUM_RUNS];
+	std::vector<float> result_alt[NUM_RUNS];
+	std::vector<int> result_hits[NUM_RUNS];
+	int usec[NUM_RUNS];
+	int num_errors = 0;
+	for (int r=0; r<NUM_RUNS; r++) {
+		KSolidBody::setNumThreads(thread_counts[r]);
+		for (int i=0; i<NUM_CHARAS; i++) {
+			charas[i]->setPosition(init_pos[i]);
+			KSolidBody::of(charas[i])->m_Desc = init_desc[i];
+		}
+		g_CollisionMgr->on_manager_frame(); // ワーカースレッドの作成を計測に含めない
+		KClock clock;
+		for (int f=0; f<NUM_FRAMES; f++) {
+			g_CollisionMgr->on_manager_frame();
+		}
+		usec[r] = (int)(clock.getTimeNano64() / 1000 / NUM_FRAMES);
+		for (int i=0; i<NUM_CHARAS; i++) {
+			KSolidBody *body = KSolidBody::of(charas[i]);
+			float alt = 0;
+			KSolidBody::getDynamicBodyAltitude(charas[i], &alt);
+			result_pos[r].push_back(charas[i]->getPosition());
+			result_vel[r].push_back(body->m_Desc.get_velocity());
+			result_alt[r].push_back(alt);
+			result_hits[r].push_back((int)body->m_Desc._hits_with.size());
+		}
+	}
+	int num_walls = 0;
+	for (int i=0; i<NUM_CHARAS; i++) {
+		num_walls += result_hits[0][i];
+	}
+	for (int r=1; r<NUM_RUNS; r++) {
+		if (result_pos[r] != result_pos[0]) num_errors++;
+		if (result_vel[r] != result_vel[0]) num_errors++;
+		if (result_alt[r] != result_alt[0]) num_errors++;
+		if (result_hits[r] != result_hits[0]) num_errors++;
+	}
+	K__PRINT("Test_static_gather: %d characters, %d statics, %d wall hits in last frame: 1 thread %d usec/frame, 2 threads %d, 4 threads %d, 8 threads %d",
+		NUM_CHARAS, NUM_STATICS, num_walls, usec[0], usec[1], usec[2], usec[3]);
+	K__ASSERT(num_errors == 0);
+
+	for (size_t i=0; i<nodes.size(); i++) {
+		g_CollisionMgr->on_manager_detach(nodes[i]);
+	}
+	root->remove();
+	root->drop();
+	KNodeTree::destroyMarkedNodes(nullptr);
+
+	KSolidBody::setNumThreads(old_threads);
+	if (install) KSolidBody::uninstall();
+	if (install_tree) KNodeTree::uninstall();
+}
+
+void Test_auto_sleep() {
+	bool install_tree = !KNodeTree::isInstalled();
+	if (install_tree) KNodeTree::install();
+	bool install = g_CollisionMgr == nullptr;
+	if (install) KSolidBody::install();
+	int old_frames = KSolidBody::getAutoSleepFrames();
+
+	uint32_t seed = 31415;
+	auto rnd = [&seed](float lo, float hi) {
+		seed = seed * 1664525 + 1013904223;
+		return lo + (hi - lo) * ((seed >> 8) / (float)(1 << 24));
+	};
+
+	// 地面の上に 10000 体を並べ、そのうち 100 体だけが動き回る
+	const int NUM_BODIES = 10000;
+	const int NUM_MOVERS = 100;
+	const int COLS = 100;
+	const float SPACING = 60;
+	const int SETTLE_FRAMES = 70;
+	const int NUM_FRAMES = 30;
+	KNode *root = KNode::create();
+	root->setParent(KNodeTree::getRoot());
+	std::vector<KNode *> nodes;
+	{
+		KNode *node = KNode::create();
+		node->setParent(root);
+		KStaticSolidBody::attach(node);
+		KStaticSolidBody::of(node)->setShapeGround();
+		nodes.push_back(node);
+		node->drop();
+	}
+	std::vector<KNode *> bodies;
+	std::vector<KVec3> init_pos;
+	std::vector<KVec3> init_vel;
+	for (int i=0; i<NUM_BODIES; i++) {
+		KNode *node = KNode::create();
+		node->setParent(root);
+		KVec3 pos((i % COLS) * SPACING, 16.0f, (i / COLS) * SPACING);
+		KVec3 vel;
+		if (i % (NUM_BODIES / NUM_MOVERS) == 0) {
+			vel = KVec3(rnd(-3, 3), 0.0f, rnd(-3, 3));
+		}
+		node->setPosition(pos);
+		KDynamicSolidBody::attachEx(node, false);
+		KDynamicSolidBody *body = KDynamicSolidBody::of(node);
+		body->setShapeCapsule(rnd(8, 16), 16);
+		body->setVelocity(vel);
+		bodies.push_back(node);
+		init_pos.push_back(pos);
+		init_vel.push_back(vel);
+		nodes.push_back(node);
+		node->drop();
+	}
+	auto reset = [&]() {
+		for (int i=0; i<NUM_BODIES; i++) {
+			KSolidBody *body = KSolidBody::of(bodies[i]);
+			bodies[i]->setPosition(init_pos[i]);
+			body->wakeUp();
+			body->m_Desc.set_velocity(init_vel[i]);
+		}
+	};
+
+	int num_errors = 0;
+	int usec[2];
+	int num_awake[2];
+	int num_sleeping[2];
+	const int sleep_frames[] = {0, DEFAULT_SLEEP_FRAMES};
+	for (int r=0; r<2; r++) {
+		KSolidBody::setAutoSleepFrames(sleep_frames[r]);
+		reset();
+		for (int f=0; f<SETTLE_FRAMES; f++) {
+			g_CollisionMgr->on_manager_frame();
+		}
+		KClock clock;
+		for (int f=0; f<NUM_FRAMES; f++) {
+			g_CollisionMgr->on_manager_frame();
+		}
+		usec[r] = (int)(clock.getTimeNano64() / 1000 / NUM_FRAMES);
+		num_awake[r] = KSolidBody::getNumAwakeBodies();
+		num_sleeping[r] = KSolidBody::getNumSleepingBodies();
+	}
+	K__PRINT("Test_auto_sleep: %d bodies (%d moving): sleep off %d usec/frame, sleep on %d usec/frame (%d awake, %d sleeping)",
+		NUM_BODIES, NUM_MOVERS, usec[0], usec[1], num_awake[1], num_sleeping[1]);
+	if (num_sleeping[0] != 0) num_errors++;
+	if (num_awake[1] + num_sleeping[1] != NUM_BODIES) num_errors++;
+	if (num_sleeping[1] < NUM_BODIES - NUM_MOVERS * 10) num_errors++; // ほとんど眠っている
+
+	// 眠っている剛体を探す
+	std::vector<KSolidBody *> sleepers;
+	for (int i=0; i<NUM_BODIES && sleepers.size() < 3; i++) {
+		KSolidBody *body = KSolidBody::of(bodies[i]);
+		if (body->isSleeping()) {
+			sleepers.push_back(body);
+		}
+	}
+	if (sleepers.size() < 3) num_errors++;
+	if (sleepers.size() == 3) {
+		// 眠っている間は高度と接地状態を保っている
+		float alt = -1;
+		if (!KSolidBody::getDynamicBodyAltitude(sleepers[0]->getNode(), &alt) || alt != 0) num_errors++;
+
+		// 速度を与えると起きる
+		KVec3 pos0 = sleepers[0]->getNode()->getPosition();
+		static_cast<KDynamicSolidBody *>(sleepers[0])->setVelocity(KVec3(2, 0, 0));
+		g_CollisionMgr->on_manager_frame();
+		if (sleepers[0]->isSleeping()) num_errors++;
+		if (sleepers[0]->getNode()->getPosition().x != pos0.x + 2) num_errors++;
+
+		// 座標を変えると起きる
+		KVec3 pos1 = sleepers[1]->getNode()->getPosition() + KVec3(0, 0, 5);
+		sleepers[1]->getNode()->setPosition(pos1);
+		g_CollisionMgr->on_manager_frame();
+		if (sleepers[1]->isSleeping()) num_errors++;
+
+		// 起きている剛体が接触すると起きる
+		KVec3 pos2 = sleepers[2]->getNode()->getPosition();
+		KSolidBody *mover = sleepers[1];
+		mover->getNode()->setPosition(pos2 + KVec3(-40, 0, 0));
+		static_cast<KDynamicSolidBody *>(mover)->setVelocity(KVec3(4, 0, 0));
+		for (int f=0; f<10 && sleepers[2]->isSleeping(); f++) {
+			g_CollisionMgr->on_manager_frame();
+		}
+		if (sleepers[2]->isSleeping()) num_errors++;
+	}
+
+	// 接触相手が切り離されると、その相手との接触情報を持って眠っている剛体は起きる。
+	// （眠っている剛体の _hits_with が切り離されたノードを指したままにならない）
+	{
+		KSolidBody *sleeper = nullptr;
+		for (int i=NUM_BODIES-1; i>=0 && sleeper == nullptr; i--) {
+			KSolidBody *body = KSolidBody::of(bodies[i]);
+			if (body->isSleeping()) {
+				sleeper = body;
+			}
+		}
+		if (sleeper == nullptr) num_errors++;
+		if (sleeper) {
+			KNode *other = KNode::create();
+			other->setParent(root);
+			other->setPosition(sleeper->getNode()->getPosition() + KVec3(20, 0, 0));
+			KDynamicSolidBody::attachEx(other, false);
+			KDynamicSolidBody::of(other)->setShapeCapsule(8, 16);
+			sleeper->m_Desc._hits_with.push_back(other); // 眠る直前に other と接触していた
+			g_CollisionMgr->on_manager_detach(other);
+			if (sleeper->isSleeping()) num_errors++;
+			if (!sleeper->m_Desc._hits_with.empty()) num_errors++;
+			other->drop();
+		}
+	}
+
+	// 自動スリープを無効にするとすべて起きる
+	KSolidBody::setAutoSleepFrames(0);
+	if (KSolidBody::getNumSleepingBodies() != 0) num_errors++;
+	K__ASSERT(num_errors == 0);
+
+	for (size_t i=0; i<nodes.size(); i++) {
+		g_CollisionMgr->on_manager_detach(nodes[i]);
+	}
+	root->remove();
+	root->drop();
+	KNodeTree::destroyMarkedNodes(nullptr);
+
+	KSolidBody::setAutoSleepFrames(old_frames);
+	if (install) KSolidBody::uninstall();
+	if (install_tree) KNodeTree::uninstall();
+}
+void Test_heightfield() {
+	bool install_tree = !KNodeTree::isInstalled();
+	if (install_tree) KNodeTree::install();
+	bool install = g_CollisionMgr == nullptr;
+	if (install) KSolidBody::install();
+
+	uint32_t seed = 27182;
+	auto rnd = [&seed](float lo, float hi) {
+		seed = seed * 1664525 + 1013904223;
+		return lo + (hi - lo) * ((seed >> 8) / (float)(1 << 24));
+	};
+	int num_errors = 0;
+
+	// 地面の問い合わせ：
+	// 同じ地形を１個の高さマップと、セルごとの KFloorCollider（４隅の高さを持つ四角形）の集まりで作って比べる
+	{
+		const int CELLS = 64;
+		const int POINTS = CELLS + 1;
+		const float CELL = 32;
+		const float HALF = CELLS * CELL * 0.5f;
+		const KVec3 FLOOR_OFFSET(4000, 0, 0); // 四角形の集まりを置く場所
+		const int NUM_POINTS = 20000;
+		const int NUM_FRAMES = 5;
+		std::vector<float> heights(POINTS * POINTS);
+		for (int iz=0; iz<POINTS; iz++) {
+			for (int ix=0; ix<POINTS; ix++) {
+				heights[iz * POINTS + ix] = 40 + 30 * sinf(ix * 0.3f) * cosf(iz * 0.2f) + rnd(0, 5);
+			}
+		}
+		KNode *root = KNode::create();
+		root->setParent(KNodeTree::getRoot());
+		std::vector<KNode *> statics;
+		KNode *terrain = KNode::create();
+		terrain->setParent(root);
+		KStaticSolidBody::attach(terrain);
+		KStaticSolidBody::of(terrain)->setShapeHeightfield(POINTS, POINTS, CELL, heights.data());
+		statics.push_back(terrain);
+		terrain->drop();
+		for (int iz=0; iz<CELLS; iz++) {
+			for (int ix=0; ix<CELLS; ix++) {
+				KNode *node = KNode::create();
+				node->setParent(root);
+				node->setPosition(FLOOR_OFFSET + KVec3(-HALF + (ix + 0.5f) * CELL, 0.0f, -HALF + (iz + 0.5f) * CELL));
+				KStaticSolidBody::attach(node);
+				const float *h0 = &heights[iz * POINTS + ix];
+				const float *h1 = h0 + POINTS;
+				float h[] = {h0[0], h1[0], h1[1], h0[1]}; // (-X,-Z), (-X,+Z), (+X,+Z), (+X,-Z)
+				KStaticSolidBody::of(node)->setShapeFloor(KVec3(CELL * 0.5f, 0.0f, CELL * 0.5f), 0, h);
+				statics.push_back(node);
+				node->drop();
+			}
+		}
+		std::vector<KVec3> points;
+		for (int i=0; i<NUM_POINTS; i++) {
+			points.push_back(KVec3(rnd(-HALF+1, HALF-1), 200.0f, rnd(-HALF+1, HALF-1)));
+		}
+		std::vector<char> found1(NUM_POINTS), found2(NUM_POINTS);
+		std::vector<float> y1(NUM_POINTS), y2(NUM_POINTS);
+		std::vector<KNode *> gnd1(NUM_POINTS);
+		KClock clock;
+		for (int f=0; f<NUM_FRAMES; f++) {
+			for (int i=0; i<NUM_POINTS; i++) {
+				float y = 0;
+				KNode *gnd = nullptr;
+				found1[i] = KSolidBody::getGroundPoint(points[i], 16, &y, &gnd);
+				y1[i] = y;
+				gnd1[i] = gnd;
+			}
+		}
+		int heightfield_usec = (int)(clock.getTimeNano64() / 1000 / NUM_FRAMES);
+		clock.reset();
+		for (int f=0; f<NUM_FRAMES; f++) {
+			for (int i=0; i<NUM_POINTS; i++) {
+				float y = 0;
+				found2[i] = KSolidBody::getGroundPoint(points[i] + FLOOR_OFFSET, 16, &y, nullptr);
+				y2[i] = y;
+			}
+		}
+		int floors_usec = (int)(clock.getTimeNano64() / 1000 / NUM_FRAMES);
+		KHeightfieldCollider *coll = static_cast<KHeightfieldCollider *>(KStaticSolidBody::of(terrain)->getShape());
+		for (int i=0; i<NUM_POINTS; i++) {
+			if (!found1[i] || !found2[i]) { num_errors++; continue; }
+			if (fabsf(y1[i] - y2[i]) > 0.01f) num_errors++;
+			if (gnd1[i] != terrain) num_errors++;
+			float y;
+			if (!coll->get_height_at(points[i].x, points[i].z, &y, nullptr) || y != y1[i]) num_errors++;
+		}
+		K__PRINT("Test_heightfield: %d points: 1 heightfield (%dx%d) %d usec, %d floor colliders %d usec",
+			NUM_POINTS, CELLS, CELLS, heightfield_usec, CELLS * CELLS, floors_usec);
+
+		for (size_t i=0; i<statics.size(); i++) {
+			g_CollisionMgr->on_manager_detach(statics[i]);
+		}
+		root->remove();
+		root->drop();
+		KNodeTree::destroyMarkedNodes(nullptr);
+	}
+
+	// 任意方向のレイ：セルをたどる判定と、全三角形の総当たりが一致する
+	{
+		const int POINTS = 17;
+		const float CELL = 16;
+		std::vector<float> heights(POINTS * POINTS);
+		for (size_t i=0; i<heights.size(); i++) {
+			heights[i] = rnd(0, 40);
+		}
+		KHeightfieldCollider *coll = KHeightfieldCollider::create(KVec3(10, 5, -20), POINTS, POINTS, CELL, heights.data());
+		KVec3 base = coll->get_offset() + KVec3(-(POINTS-1) * CELL * 0.5f, 0.0f, -(POINTS-1) * CELL * 0.5f);
+		std::vector<KTriangle> tris;
+		for (int iz=0; iz+1<POINTS; iz++) {
+			for (int ix=0; ix+1<POINTS; ix++) {
+				KVec3 p00 = base + KVec3(ix * CELL,     coll->get_height(ix,   iz),   iz * CELL);
+				KVec3 p10 = base + KVec3((ix+1) * CELL, coll->get_height(ix+1, iz),   iz * CELL);
+				KVec3 p01 = base + KVec3(ix * CELL,     coll->get_height(ix,   iz+1), (iz+1) * CELL);
+				KVec3 p11 = base + KVec3((ix+1) * CELL, coll->get_height(ix+1, iz+1), (iz+1) * CELL);
+				tris.push_back(KTriangle(p00, p11, p10)); // 時計回りを表にする
+				tris.push_back(KTriangle(p00, p01, p11));
+			}
+		}
+		int num_hits = 0;
+		for (int i=0; i<2000; i++) {
+			KVec3 pos(rnd(-200, 200), rnd(0, 120), rnd(-200, 200));
+			KVec3 dir(rnd(-1, 1), rnd(-1, 0.2f), rnd(-1, 1));
+			KRay ray(pos, dir);
+			KRayDesc best;
+			best.dist = FLT_MAX;
+			bool found = false;
+			for (size_t t=0; t<tris.size(); t++) {
+				KRayDesc hit;
+				if (tris[t].getNormal().dot(dir) < 0 && tris[t].rayTest(ray, &hit) && hit.dist < best.dist) {
+					best = hit;
+					found = true;
+				}
+			}
+			KVec3 hitpos, hitnor;
+			bool ok = coll->get_ray_collision_point(pos, dir, 0, &hitpos, &hitnor, nullptr);
+			if (ok != found) { num_errors++; continue; }
+			if (ok) {
+				if (!hitpos.equals(best.pos, 0.01f)) num_errors++;
+				if (!hitnor.equals(best.normal, 0.001f)) num_errors++;
+				num_hits++;
+			}
+		}
+		K__ASSERT(num_hits > 0);
+		coll->drop();
+	}
+
+	// キャラクターとの接触：平らな高さマップと、同じ平面上の KQuadCollider の結果が一致する
+	{
+		const int POINTS = 9;
+		const float CELL = 32;
+		const float HALF = (POINTS - 1) * CELL * 0.5f;
+		auto plane_y = [](float x, float z) { return 10 + 0.3f * x - 0.2f * z; };
+		std::vector<float> heights(POINTS * POINTS);
+		for (int iz=0; iz<POINTS; iz++) {
+			for (int ix=0; ix<POINTS; ix++) {
+				heights[iz * POINTS + ix] = plane_y(-HALF + ix * CELL, -HALF + iz * CELL);
+			}
+		}
+		KCollider *field = KHeightfieldCollider::create(KVec3(), POINTS, POINTS, CELL, heights.data());
+		// KQuadCollider の平面はオフセット位置を通るので、中心の高さをオフセットにする
+		float y0 = plane_y(0, 0);
+		KVec3 p[] = {
+			KVec3(-HALF, plane_y(-HALF, -HALF) - y0, -HALF),
+			KVec3(-HALF, plane_y(-HALF,  HALF) - y0,  HALF),
+			KVec3( HALF, plane_y( HALF,  HALF) - y0,  HALF),
+			KVec3( HALF, plane_y( HALF, -HALF) - y0, -HALF),
+		};
+		KCollider *quad = KQuadCollider::create(KVec3(0.0f, y0, 0.0f), p);
+		KCollider *chara = KCharacterCollider::create(KVec3(), 12, 24);
+		int num_hits = 0;
+		for (int i=0; i<2000; i++) {
+			KCollisionTest test;
+			float x = rnd(-100, 100);
+			float z = rnd(-100, 100);
+			test.ball_pos = KVec3(x, plane_y(x, z) + rnd(-10, 20), z);
+			test.ball_radius = 12;
+			test.ball_speed = KVec3(rnd(-8, 8), rnd(-8, 8), rnd(-8, 8));
+			test.ball_climb = (i % 2) ? 16.0f : 0.0f;
+			KCollisionTest a = test;
+			KCollisionTest b = test;
+			bool ha = KCollider::dispatch_collision_result(chara, field, a);
+			bool hb = KCollider::dispatch_collision_result(chara, quad, b);
+			if (ha != hb) { num_errors++; continue; }
+			if (ha) {
+				if (!a.result_newpos.equals(b.result_newpos, 0.01f)) num_errors++;
+				if (!a.result_normal.equals(b.result_normal, 0.001f)) num_errors++;
+				if (a.result_collider != field) num_errors++;
+				num_hits++;
+			}
+		}
+		K__ASSERT(num_hits > 0);
+		quad->drop();
+		field->drop();
+
+		// 稜線の真上にある球は、どちらの斜面の垂線の足も三角形から外れるが、押し出される
+		float ridge[] = {0, 20, 0, 0, 20, 0};
+		field = KHeightfieldCollider::create(KVec3(), 3, 2, CELL, ridge);
+		KCollisionTest test;
+		test.ball_pos = KVec3(0, 28, 0);
+		test.ball_radius = 12;
+		if (!KCollider::dispatch_collision_result(chara, field, test)) num_errors++;
+		else if (test.result_newpos.y <= test.ball_pos.y) num_errors++;
+		field->drop();
+		chara->drop();
+	}
+	K__ASSERT(num_errors == 0);
+
+	if (install) KSolidBody::uninstall();
+	if (install_tree) KNodeTree::uninstall();
+}
+
 } // Test
 #pragma endregion // CCollisionMgr
 
@@ -41,6 +41,19 @@ public:
 
 
 
+/// 静的剛体の判定候補を絞り込むための空間分割の種類
+enum KStaticBroadphase {
+	KStaticBroadphase_NONE, ///< 空間分割しない（総当たり）
+	KStaticBroadphase_BVH,  ///< SAH で構築した BVH（既定）
+	KStaticBroadphase_GRID, ///< XZ平面上のルーズグリッド
+};
+
+/// 動的剛体同士の判定候補を絞り込む方法
+enum KDynamicBroadphase {
+	KDynamicBroadphase_NONE,  ///< 絞り込まない（総当たり）
+	KDynamicBroadphase_SWEEP, ///< X軸上でのソート＆スイープ（既定）
+};
+
 class KSolidBody: public KRef {
 public:
 	static void install();
@@ -49,6 +62,15 @@ public:
 	static bool getDynamicBodyAltitude(KNode *node, float *alt);
 	static float getAltitudeAtPoint(const KVec3 &point, float max_penetration=1.0f, KNode **out_ground=nullptr);
 	static bool rayCast(const KVec3 &pos, const KVec3 &dir, float maxdist, KRayHit *out_hit);
+
+	/// count 個の点について getGroundPoint をまとめて行う（ロックと地形の絞り込みを共有する）。
+	/// 地面が見つかった点は out_found[i] が true になり、out_ground_y[i], out_ground[i] がセットされる。
+	/// 地面が見つかった点の数を返す
+	static int getGroundPoints(const KVec3 *points, int count, float max_penetration, bool *out_found, float *out_ground_y, KNode **out_ground=nullptr);
+
+	/// count 本のレイについて rayCast をまとめて行う。
+	/// 衝突したレイは out_found[i] が true になり、out_hits[i] がセットされる。衝突したレイの数を返す
+	static int rayCastBatch(const KVec3 *starts, const KVec3 *dirs, int count, float maxdist, bool *out_found, KRayHit *out_hits);
 	static void setDebugLineVisible(bool static_lines, bool dynamic_lines);
 	static void setDebug_alwaysShowDebug(bool value);
 	static bool getDebug_alwaysShowDebug();
@@ -60,6 +82,28 @@ public:
 	static void attachVelocity(KNode *node);
 	static bool isAttached(KNode *node);
 	static KSolidBody * of(KNode *node);
+	static void setStaticBroadphase(KStaticBroadphase type);
+	static KStaticBroadphase getStaticBroadphase();
+	static void setDynamicBroadphase(KDynamicBroadphase type);
+	static KDynamicBroadphase getDynamicBroadphase();
+
+	/// 動的剛体と地形の判定に使うスレッド数（呼び出し元スレッドを含む）を設定する。
+	/// 0 ならハードウェアのスレッド数を使う（既定）。1 なら並列化しない。
+	/// 衝突の収集だけを並列に行い、コールバックの呼び出しと位置の修正は常に呼び出し元スレッドで順番に行うので、
+	/// 結果はスレッド数によらず同じになる
+	static void setNumThreads(int num);
+	static int getNumThreads();
+
+	/// 自動スリープまでのフレーム数を設定する。0 なら自動スリープしない（既定値は 60）。
+	/// 速度と移動量がほぼゼロで、接触相手が変化しない状態がこのフレーム数続いた動的剛体は眠り、
+	/// 移動、衝突判定、リストアップの対象から外れる。
+	/// 眠っている剛体は、起きている剛体との接触、速度の変更、座標の変更、地形の変化で起きる
+	static void setAutoSleepFrames(int frames);
+	static int getAutoSleepFrames();
+
+	/// 起きている動的剛体と、眠っている動的剛体の数
+	static int getNumAwakeBodies();
+	static int getNumSleepingBodies();
 public:
 	KSolidBody();
 	virtual ~KSolidBody();
@@ -77,6 +121,12 @@ public:
 	void setShape(KCollider *co);
 	KCollider * getShape();
 
+	/// 自動スリープで眠っているかどうか（Desc::set_sleep_time による手動のスリープは含まない）
+	bool isSleeping() const;
+
+	/// 自動スリープで眠っていれば起こす
+	void wakeUp();
+
 	struct Desc {
 		Desc() {
 			_gravity = 0.0f;
@@ -95,6 +145,7 @@ public:
 			_sleep_time = 0;
 			_mask_bits  = 0xFFFFFFFF;
 			_is_static = true;
+			_sleeping = false;
 			_slip_control = false;
 			_slip_limit_speed = 0;
 			_slip_limit_degrees = 0;
@@ -138,11 +189,11 @@ public:
 		int get_sleep_time() const { return _sleep_time; }
 		void set_sleep_time(int value) { _sleep_time = value; }
 		uint32_t get_mask_bits() const { return _mask_bits; }
-		void set_mask_bits(uint32_t value) { _mask_bits = value; }
+		void set_mask_bits(uint32_t value); // 静的剛体の場合は判定対象リストの更新も行う
 		bool is_static() const { return _is_static; }
 		void set_static(bool value) { _is_static = value; }
 		const KVec3 & get_velocity() const { return _velocity; }
-		void set_velocity(const KVec3 &vel) { _velocity = vel; }
+		void set_velocity(const KVec3 &vel); // 眠っている剛体の速度を変えた場合は起こす
 		void set_altitude(float alt, KNode *ground) {
 			_altitude = alt;
 			_has_altitude = true;
@@ -182,10 +233,18 @@ public:
 		KNodeArray _hits_with; // 他の Body との接触
 		int _sleep_time;
 		bool _is_static; // 動かない
+		bool _sleeping; // 自動スリープで眠っている（CCollisionMgr が設定する）
 	};
 	KNode *m_Node;
 	KCollider *m_Shape;
 	Desc m_Desc;
+
+	// 自動スリープの状態（CCollisionMgr が管理する）
+	int m_DynamicIndex;  // 起きている剛体リスト、または眠っている剛体リスト内での位置
+	int m_RestFrames;    // 静止状態が続いているフレーム数
+	uint32_t m_RestHits; // 前フレームでの接触相手から計算した値。接触相手が変化したかどうかの判定に使う
+	KVec3 m_SleepPos;    // 眠った時のワールド座標
+	bool m_Sleeping;
 };
 
 class KStaticSolidBody: public KSolidBody {
@@ -202,6 +261,7 @@ public:
 	void setShapeCapsule(float radius, float halfheight);
 	void setShapeCylinder(float radius, float halfheight);
 	void setShapeFloor(const KVec3 &halfsize, float shearx, const float *heights);
+	void setShapeHeightfield(int cols, int rows, float cell_size, const float *heights);
 	void setShapeWall(float x0, float z0, float x1, float z1);
 };
 
@@ -247,6 +307,13 @@ public:
 
 namespace Test {
 void Test_collision();
+void Test_static_broadphase();
+void Test_static_body_list();
+void Test_dynamic_broadphase();
+void Test_ground_batch();
+void Test_static_gather();
+void Test_auto_sleep();
+void Test_heightfield();
 }
 
 
@@ -580,6 +580,18 @@ void KSpriteDrawable::getRenderLayers(KNode *node, std::vector<RenderLayerDesc>
 		}
 	}
 }
+bool KSpriteDrawable::onDrawable_prepare(KNode *node, const RenderArgs *opt) {
+	// 実際に描画するべきレイヤーを、描画するべき順番で取得する。
+	// スプライトやテクスチャのバンクを使うので、ここで済ませておく
+	m_render_layers.clear();
+	if (node) {
+		getRenderLayers(node, m_render_layers);
+	}
+
+	// 描画コールバックの呼び出しと、グループ化（レンダーテクスチャへの描画）は
+	// 呼び出し元スレッドで行う必要がある
+	return opt && opt->cb == nullptr && !isGrouping();
+}
 void KSpriteDrawable::onDrawable_draw(KNode *node, const RenderArgs *opt, KDrawList *drawlist) {
 	if (node == nullptr) return;
 	if (opt == nullptr) return;
@@ -593,9 +605,7 @@ void KSpriteDrawable::onDrawable_draw(KNode *node, const RenderArgs *opt, KDrawL
 		}
 	}
 
-	// 実際に描画するべきレイヤーを、描画するべき順番で取得する
-	m_render_layers.clear();
-	getRenderLayers(node, m_render_layers);
+	// 描画するレイヤーは onDrawable_prepare で取得済み
 
 	// マスターカラー
 	KColor master_col = node->getColorInTree();
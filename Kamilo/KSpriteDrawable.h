@@ -84,6 +84,7 @@ public:
 	virtual void onDrawable_inspector() override;
 	virtual bool onDrawable_getBoundingAabb(KVec3 *min_point, KVec3 *max_point) override;
 	virtual void onDrawable_getGroupImageSize(int *w, int *h, KVec3 *pivot) override;
+	virtual bool onDrawable_prepare(KNode *node, const RenderArgs *opt) override;
 	virtual void onDrawable_draw(KNode *node, const RenderArgs *opt, KDrawList *drawlist) override;
 
 	void unpackInTexture(KTEXID target, const KMatrix4 &transform, const KMesh &mesh, KTEXID texid);
@@ -2,6 +2,13 @@
 //
 #include <process.h> // _beginthreadex
 #include <Windows.h>
+#include <condition_variable>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+#include "KClock.h"
+#include "KInternal.h"
 
 namespace Kamilo {
 
@@ -33,4 +40,260 @@ bool KThread::isRunning() const {
 	return WaitForSingleObject((HANDLE)m_thread, 0) == WAIT_TIMEOUT;
 }
 
+
+
+#pragma region KParallelFor
+class CParallelForImpl {
+	std::vector<std::thread> m_Threads; // 呼び出し元スレッド以外のワーカー
+	std::mutex m_Mutex;
+	std::condition_variable m_StartCond;
+	std::condition_variable m_DoneCond;
+	uint32_t m_Generation; // run のたびに増える。ワーカーはこれが変わったら処理を開始する
+	int m_Pending; // 現在の run をまだ処理しているワーカーの数
+	bool m_Exit;
+	int m_NumThreads; // 設定値。0 ならハードウェアのスレッド数
+
+	// 現在の run の内容
+	KParallelFor::Func m_Func;
+	void *m_Data;
+	int m_Count;
+	int m_Grain;
+	std::atomic<int> m_Next;
+
+public:
+	CParallelForImpl() {
+		m_Generation = 0;
+		m_Pending = 0;
+		m_Exit = false;
+		m_NumThreads = 0;
+		m_Func = nullptr;
+		m_Data = nullptr;
+		m_Count = 0;
+		m_Grain = 1;
+		m_Next = 0;
+	}
+	~CParallelForImpl() {
+		stop_threads();
+	}
+	void setNumThreads(int num) {
+		K__ASSERT(num >= 0);
+		if (m_NumThreads != num) {
+			stop_threads();
+			m_NumThreads = num;
+		}
+	}
+	int getNumThreads() const {
+		if (m_NumThreads > 0) {
+			return m_NumThreads;
+		}
+		int hw = (int)std::thread::hardware_concurrency();
+		return (hw > 0) ? hw : 1;
+	}
+	void run(int count, int grain, KParallelFor::Func func, void *data) {
+		K__ASSERT(func);
+		if (grain < 1) grain = 1;
+		int num_threads = getNumThreads();
+		if (num_threads <= 1 || count <= grain) {
+			// 分担しない。呼び出し元スレッドで順番に処理する
+			for (int begin=0; begin<count; begin+=grain) {
+				int end = (begin + grain < count) ? begin + grain : count;
+				func(data, begin, end, 0);
+			}
+			return;
+		}
+		if ((int)m_Threads.size() != num_threads - 1) {
+			stop_threads();
+			for (int i=1; i<num_threads; i++) {
+				m_Threads.push_back(std::thread(&CParallelForImpl::worker_loop, this, i, m_Generation));
+			}
+		}
+		{
+			std::lock_guard<std::mutex> lock(m_Mutex);
+			m_Func = func;
+			m_Data = data;
+			m_Count = count;
+			m_Grain = grain;
+			m_Next = 0;
+			m_Pending = (int)m_Threads.size();
+			m_Generation++;
+		}
+		m_StartCond.notify_all();
+		process(0);
+		{
+			std::unique_lock<std::mutex> lock(m_Mutex);
+			m_DoneCond.wait(lock, [this]() { return m_Pending == 0; });
+		}
+	}
+
+private:
+	void process(int worker) {
+		for (;;) {
+			int begin = m_Next.fetch_add(m_Grain);
+			if (begin >= m_Count) break;
+			int end = (begin + m_Grain < m_Count) ? begin + m_Grain : m_Count;
+			m_Func(m_Data, begin, end, worker);
+		}
+	}
+	void worker_loop(int worker, uint32_t gen) {
+		for (;;) {
+			{
+				std::unique_lock<std::mutex> lock(m_Mutex);
+				m_StartCond.wait(lock, [this, gen]() { return m_Exit || m_Generation != gen; });
+				if (m_Exit) return;
+				gen = m_Generation;
+			}
+			process(worker);
+			{
+				std::lock_guard<std::mutex> lock(m_Mutex);
+				m_Pending--;
+				if (m_Pending == 0) {
+					m_DoneCond.notify_one();
+				}
+			}
+		}
+	}
+	void stop_threads() {
+		{
+			std::lock_guard<std::mutex> lock(m_Mutex);
+			m_Exit = true;
+		}
+		m_StartCond.notify_all();
+		for (size_t i=0; i<m_Threads.size(); i++) {
+			m_Threads[i].join();
+		}
+		m_Threads.clear();
+		m_Exit = false;
+	}
+};
+
+KParallelFor::KParallelFor() {
+	m_Impl = std::make_shared<CParallelForImpl>();
+}
+void KParallelFor::setNumThreads(int num) {
+	m_Impl->setNumThreads(num);
+}
+int KParallelFor::getNumThreads() const {
+	return m_Impl->getNumThreads();
+}
+void KParallelFor::run(int count, int grain, Func func, void *data) {
+	m_Impl->run(count, grain, func, data);
+}
+#pragma endregion // KParallelFor
+
+
+
+namespace Test {
+
+struct STestMpscItem {
+	int producer;
+	int seq;
+};
+
+// 複数スレッドから push しつつ、別スレッドで pop する。
+// pop 側で全要素を受け取れたこと、スレッドごとの順番が保たれていることを確認する。
+// 戻り値は push １回あたりの平均時間（ナノ秒）
+template <class PUSH, class POP> static int Test_mpsc_run(int num_producers, int num_items, PUSH push, POP pop) {
+	std::vector<int> next_seq(num_producers, 0);
+	std::vector<uint64_t> push_nano(num_producers, 0);
+	std::atomic<int> running(num_producers);
+	int received = 0;
+	bool order_ok = true;
+
+	std::vector<std::thread> producers;
+	for (int p=0; p<num_producers; p++) {
+		producers.push_back(std::thread([&, p]() {
+			KClock clock;
+			for (int i=0; i<num_items; i++) {
+				STestMpscItem item = {p, i};
+				while (!push(item)) {
+					std::this_thread::yield(); // 満杯。読み出し側が追い付くのを待つ
+				}
+			}
+			push_nano[p] = clock.getTimeNano64();
+			running--;
+		}));
+	}
+	// 読み出し側（このスレッド）
+	for (;;) {
+		bool done = running.load() == 0; // 先に終了判定を取っておき、そのあとで空になるまで読む
+		STestMpscItem item;
+		while (pop(item)) {
+			if (next_seq[item.producer] != item.seq) order_ok = false;
+			next_seq[item.producer] = item.seq + 1;
+			received++;
+		}
+		if (done) break;
+		std::this_thread::yield();
+	}
+	for (size_t i=0; i<producers.size(); i++) {
+		producers[i].join();
+	}
+	K__ASSERT(order_ok);
+	K__ASSERT(received == num_producers * num_items);
+
+	uint64_t total = 0;
+	for (int p=0; p<num_producers; p++) {
+		total += push_nano[p];
+	}
+	return (int)(total / (num_producers * num_items));
+}
+
+void Test_mpscqueue() {
+	// 単一スレッドでの基本動作
+	{
+		KMpscQueue<int> q(3);
+		K__ASSERT(q.capacity() == 4);
+		int val = 0;
+		K__ASSERT(!q.pop(val));
+		K__ASSERT(q.push(1));
+		K__ASSERT(q.push(2));
+		K__ASSERT(q.push(3));
+		K__ASSERT(q.push(4));
+		K__ASSERT(!q.push(5)); // 満杯
+		K__ASSERT(q.pop(val) && val == 1);
+		K__ASSERT(q.push(5));
+		K__ASSERT(q.pop(val) && val == 2);
+		K__ASSERT(q.pop(val) && val == 3);
+		K__ASSERT(q.pop(val) && val == 4);
+		K__ASSERT(q.pop(val) && val == 5);
+		K__ASSERT(!q.pop(val));
+	}
+
+	// 8 スレッドからの同時書き込み
+	const int NUM_PRODUCERS = 8;
+	const int NUM_ITEMS = 100 * 1000;
+	int nano_lockfree;
+	int nano_mutex;
+	{
+		KMpscQueue<STestMpscItem> q(1024);
+		nano_lockfree = Test_mpsc_run(NUM_PRODUCERS, NUM_ITEMS,
+			[&](const STestMpscItem &item) { return q.push(item); },
+			[&](STestMpscItem &item) { return q.pop(item); }
+		);
+	}
+	// 比較用：mutex で保護した std::queue
+	{
+		std::mutex mtx;
+		std::queue<STestMpscItem> q;
+		nano_mutex = Test_mpsc_run(NUM_PRODUCERS, NUM_ITEMS,
+			[&](const STestMpscItem &item) {
+				std::lock_guard<std::mutex> lock(mtx);
+				q.push(item);
+				return true;
+			},
+			[&](STestMpscItem &item) {
+				std::lock_guard<std::mutex> lock(mtx);
+				if (q.empty()) return false;
+				item = q.front();
+				q.pop();
+				return true;
+			}
+		);
+	}
+	K__PRINT("Test_mpscqueue: %d producers x %d items: post latency KMpscQueue %d nsec, mutex+queue %d nsec",
+		NUM_PRODUCERS, NUM_ITEMS, nano_lockfree, nano_mutex);
+}
+
+} // Test
+
 } // namespace
@@ -1,5 +1,7 @@
 ﻿#pragma once
 #include <inttypes.h>
+#include <atomic>
+#include <memory> // std::unique_ptr
 
 namespace Kamilo {
 
@@ -22,4 +24,119 @@ private:
 #pragma endregion
 
 
+#pragma region KParallelFor
+class CParallelForImpl; // internal
+
+/// インデックス範囲 [0, count) を複数のスレッドで分担して処理する。
+///
+/// ワーカースレッドは最初に必要になった時に作成され、以後使いまわす。
+/// 呼び出し元のスレッドも処理に参加し、run はすべての範囲を処理し終わるまで戻らない。
+/// 範囲は grain 個ずつ早い者勝ちで割り当てるので、どの範囲をどのワーカーが処理するかは実行するたびに変わる。
+/// 結果を決定的にしたい場合は、インデックスごとに決まった場所に結果を書くこと
+class KParallelFor {
+public:
+	/// [begin, end) を処理する関数。
+	/// worker はワーカー番号 (0 .. getNumThreads()-1) で、0 は呼び出し元スレッドを表す。
+	/// 同じワーカー番号の関数が同時に呼ばれることはないので、ワーカーごとの作業領域を使ってよい
+	typedef void (*Func)(void *data, int begin, int end, int worker);
+
+	KParallelFor();
+
+	/// 使用するスレッド数（呼び出し元スレッドを含む）を設定する。
+	/// 0 ならハードウェアのスレッド数を使う。1 なら常に呼び出し元スレッドだけで処理する
+	void setNumThreads(int num);
+
+	/// 実際に使用するスレッド数（呼び出し元スレッドを含む）
+	int getNumThreads() const;
+
+	/// [0, count) を grain 個ずつに分けて func を呼ぶ。
+	/// count が grain 以下の場合は呼び出し元スレッドだけで処理する
+	void run(int count, int grain, Func func, void *data);
+
+private:
+	std::shared_ptr<CParallelForImpl> m_Impl;
+};
+#pragma endregion // KParallelFor
+
+
+#pragma region KMpscQueue
+/// 複数スレッドから書き込み、単一スレッドから読み出す固定長のロックフリーキュー。
+///
+/// 各セルが持つ通し番号で書き込み完了を判定するリングバッファ（Dmitry Vyukov の bounded queue）で、
+/// push はどのスレッドから呼んでもよいが、pop は常に同じひとつのスレッドから呼ぶこと。
+/// 同じスレッドから push した要素は push した順番で取り出される。
+/// @note 容量は 2 のべき乗に切り上げられる
+template <class T> class KMpscQueue {
+public:
+	explicit KMpscQueue(size_t capacity=1024) {
+		size_t n = 2;
+		while (n < capacity) n *= 2;
+		m_Cells.reset(new Cell[n]);
+		m_Mask = n - 1;
+		for (size_t i=0; i<n; i++) {
+			m_Cells[i].seq.store(i, std::memory_order_relaxed);
+		}
+		m_PushPos.store(0, std::memory_order_relaxed);
+		m_PopPos = 0;
+	}
+
+	/// 要素を追加する。キューが満杯の場合は何もせずに false を返す
+	bool push(const T &val) {
+		size_t pos = m_PushPos.load(std::memory_order_relaxed);
+		Cell *cell;
+		for (;;) {
+			cell = &m_Cells[pos & m_Mask];
+			size_t seq = cell->seq.load(std::memory_order_acquire);
+			intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+			if (dif == 0) {
+				// このセルは空いている。書き込み位置の確保を試みる
+				if (m_PushPos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+					break;
+				}
+			} else if (dif < 0) {
+				return false; // 満杯
+			} else {
+				pos = m_PushPos.load(std::memory_order_relaxed); // 他のスレッドに先を越された
+			}
+		}
+		cell->data = val;
+		cell->seq.store(pos + 1, std::memory_order_release); // 書き込み完了
+		return true;
+	}
+
+	/// 先頭の要素を取り出す。キューが空の場合は false を返す。
+	/// ※読み出し側のスレッドからのみ呼ぶこと
+	bool pop(T &out) {
+		Cell *cell = &m_Cells[m_PopPos & m_Mask];
+		size_t seq = cell->seq.load(std::memory_order_acquire);
+		if ((intptr_t)seq - (intptr_t)(m_PopPos + 1) < 0) {
+			return false; // 空、または書き込み途中
+		}
+		out = cell->data;
+		cell->seq.store(m_PopPos + m_Mask + 1, std::memory_order_release); // セルを次の周回のために空ける
+		m_PopPos++;
+		return true;
+	}
+
+	size_t capacity() const {
+		return m_Mask + 1;
+	}
+
+private:
+	struct Cell {
+		std::atomic<size_t> seq;
+		T data;
+	};
+	std::unique_ptr<Cell[]> m_Cells;
+	size_t m_Mask;
+	alignas(64) std::atomic<size_t> m_PushPos; // 書き込み側で共有する。読み出し側と同じキャッシュラインに載らないようにする
+	alignas(64) size_t m_PopPos; // 読み出し側だけが使う
+};
+#pragma endregion // KMpscQueue
+
+
+namespace Test {
+void Test_mpscqueue();
+}
+
 } // namespace
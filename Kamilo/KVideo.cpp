@@ -1,13 +1,17 @@
 ﻿#include "KVideo.h"
 
 #include <mutex>
+#include "KClock.h"
 #include "KMath.h"
 #include "KMatrix.h"
 #include "KInternal.h"
 
 
 // Use Direct3D9
-#define K_USE_D3D9
+// K_USE_SOFTWARE_VIDEO を定義した場合は Direct3D9 を使わず、CPU だけで描画する（GPU もウィンドウも不要）
+#ifndef K_USE_SOFTWARE_VIDEO
+#	define K_USE_D3D9
+#endif
 
 // Check error strictly
 #define K_USE_STRICT_CHECK 1
@@ -19,8 +23,10 @@
 #	define _DXGetErrorStringW(hr)  DXGetErrorString9W(hr)
 #endif
 
+#ifdef K_USE_SOFTWARE_VIDEO
+#	include "KThread.h"
+#endif
 
-#ifdef K_USE_D3D9
 
 #define K__VIDEO_ERR(fmt, ...)    K__ERROR(fmt, ##__VA_ARGS__)
 #define K__VIDEO_WRN(fmt, ...)    K::print(fmt, ##__VA_ARGS__)
@@ -61,6 +67,7 @@ static const char * K__DX9_SHADERPARAM_MATRIX_VIEW         = "mo__MatrixView";
 static const char * K__DX9_SHADERPARAM_MATRIX_PROJ         = "mo__MatrixProj";
 static const char * K__DX9_SHADERPARAM_TIME_SEC            = "mo__TimeSec";
 
+#ifdef K_USE_D3D9
 static const DWORD K__DX9_COLOR_WHITE = 0xFFFFFFFF;
 static const DWORD K__DX9_COLOR_ZERO  = 0x00000000;
 static const DWORD K__DX9_FVF_VERTEX  = D3DFVF_XYZ | D3DFVF_DIFFUSE | D3DFVF_SPECULAR | D3DFVF_TEX1 | D3DFVF_TEX2;
@@ -73,6 +80,16 @@ struct DX9_VERTEX {
 	float uv2[2];
 };
 
+// KVertexCompact 用の頂点。固定機能パイプラインは 16 ビット正規化整数のテクスチャ座標を読めないので、
+// テクスチャ座標だけ float に広げる（24 バイト）
+static const DWORD K__DX9_FVF_VERTEX_COMPACT = D3DFVF_XYZ | D3DFVF_DIFFUSE | D3DFVF_TEX1;
+
+struct DX9_VERTEX_COMPACT {
+	float xyz[3];
+	DWORD dif;
+	float uv1[2];
+};
+
 static std::string K__StdSprintf(const char *fmt, ...) {
 	char s[1024 * 4];
 	va_list args;
@@ -90,6 +107,7 @@ static std::string K__GetErrorStringUtf8(HRESULT hr) {
 	WideCharToMultiByte(CP_UTF8, WC_ERR_INVALID_CHARS, ws, -1, s, sizeof(s), nullptr, nullptr);
 	return std::string(s);
 }
+#endif // K_USE_D3D9
 static float K__Clamp01(float t) {
 	if (t < 0) return 0;
 	if (t < 1) return t;
@@ -140,9 +158,194 @@ static const float K__MAT4_IDENTITY[] = {
 /// この数未満の頂点ストリームにしか対応していない環境で実行しようとした場合、正しい描画は保証されない
 static const int SYSTEMREQ_MAX_VERTEX_ELMS = 8;
 
+/// ストリームバッファの最小サイズ（要素数）
+static const int K__STREAM_MIN_VERTICES = 1024 * 64;
+static const int K__STREAM_MIN_INDICES = 1024 * 96;
+
+/// 動的バッファをリングバッファとして使うときの書き込み位置の管理。
+/// バッファの実体は各バックエンドが持つ
+struct SStreamRing {
+	int capacity; ///< バッファの要素数
+	int pos;      ///< 次に書き込む位置
+
+	SStreamRing() {
+		capacity = 0;
+		pos = 0;
+	}
+	/// 必要ならバッファを大きくする。大きくする必要があれば新しい要素数を、そうでなければ 0 を返す
+	int reserve(int count, int min_capacity) {
+		if (count <= capacity) return 0;
+		int cap = KMath::max(capacity * 2, min_capacity);
+		while (cap < count) cap *= 2;
+		return cap;
+	}
+	/// count 個の要素を書き込む位置を返す。
+	/// 後ろに空きがなければ先頭に戻り、*discard に true をセットする（それまでの内容は破棄してよい）
+	int alloc(int count, bool *discard) {
+		K__ASSERT(0 < count && count <= capacity);
+		*discard = (pos == 0) || (capacity < pos + count);
+		if (capacity < pos + count) {
+			pos = 0;
+		}
+		int start = pos;
+		pos += count;
+		return start;
+	}
+};
+
+/// 頂点とインデックスの転送量の記録
+struct SStreamStats {
+	int bytes;
+	int locks;
+	int discards;
+
+	SStreamStats() {
+		clear();
+	}
+	void clear() {
+		bytes = 0;
+		locks = 0;
+		discards = 0;
+	}
+	void add(int nbytes, bool discard) {
+		bytes += nbytes;
+		locks++;
+		if (discard) discards++;
+	}
+};
+
 #pragma endregion // Def/Type/Utils
 
 
+#pragma region Blit
+// dst に src をマテリアル mat で描画する
+// dst = nullptr だった場合はバックバッファに描画する
+static void _BlitEx(KTexture *dst, KTexture *src, KMaterial *mat, const KVideoRect *src_rect, const KVideoRect *dst_rect, const KMatrix4 *transform) {
+	K__ASSERT_RETURN(src != nullptr);
+	K__ASSERT_RETURN(src != dst);
+	static const KMatrix4 identity;
+	KVideo::pushRenderState();
+	if (dst) KVideo::pushRenderTarget(dst->getId());
+	// ブレンドモード
+	if (mat) {
+		mat->texture = src->getId();
+		KVideo::setProjection(identity.m);
+		KVideo::setTransform(identity.m);
+
+		if (mat->shader) {
+			KVideo::setShader(mat->shader);
+
+			KShaderArg arg;
+			arg.blend = mat->blend;
+			arg.texture = mat->texture;
+			arg.color = mat->color;
+			arg.specular = mat->specular;
+			KVideo::setDefaultShaderParams(arg);
+			// ここのコールバックを削るときはayakashiの雷天気がちゃんと再生されるか確認すること
+			if (mat && mat->cb) {
+				mat->cb->onMaterial_Begin(mat);
+				mat->cb->onMaterial_SetShaderVariable(mat);
+			}
+		} else {
+			KVideo::setShader(nullptr);
+			KVideo::setBlend(mat->blend);
+			KVideo::setFilter(mat->filter);
+			KVideo::setTextureAddressing(mat->wrap);
+			KVideo::setColor(mat->color32());
+			KVideo::setSpecular(mat->specular32());
+			KVideo::setTexture(mat->texture);
+		}
+		KVideo::beginShader();
+	} else {
+		// 変換済み頂点 XYZEHW で描画するため行列設定は不要
+		// m_d3ddev->SetTransform(D3DTS_PROJECTION, ...);
+		// m_d3ddev->SetTransform(D3DTS_VIEW, ...);
+		KVideo::setFilter(KFilter_NONE);
+		KVideo::setTextureAddressing(false);
+		KVideo::setProjection(identity.m);
+		KVideo::setTransform(identity.m);
+		KVideo::setBlend(KBlend_ONE);
+		KVideo::setColor(K__COLOR32_WHITE);
+		KVideo::setSpecular(K__COLOR32_ZERO);
+		KVideo::setTexture(src->getId());
+	}
+
+	KVideo::drawTexture(src->getId(), src_rect, dst_rect, transform);
+
+	// 後始末
+	if (mat) {
+		if (mat && mat->cb) {
+			mat->cb->onMaterial_End(mat);
+		}
+		KVideo::endShader();
+		KVideo::setShader(nullptr);
+	}
+	if (dst) KVideo::popRenderTarget();
+	KVideo::popRenderState();
+}
+
+// channel: -1=RGBA, 0=R, 1=G, 2=B, 3=A
+static void _BmpWrite(KBmp *bmp, const void *rgba, int pitch, int width, int height, int channel) {
+	K__ASSERT_RETURN(bmp);
+	K__ASSERT_RETURN(rgba);
+	K__ASSERT_RETURN(bmp);
+	K__ASSERT_RETURN(bmp->w == width);
+	K__ASSERT_RETURN(bmp->h == height);
+	if (bmp->pitch == pitch) {
+		// ピッチが同じ。 memcpy で一括コピーできる
+		memcpy(bmp->data, rgba, pitch * height);
+	} else {
+		// ピッチが異なる。ラインごとにコピーする
+		for (int y=0; y<height; y++) {
+			memcpy(
+				bmp->data + (bmp->pitch * y),
+				(uint8_t*)rgba + (pitch * y),
+				width * 4
+			);
+		}
+	}
+	// Direct3Dのテクスチャには色が BGRA の順で格納されている (ARGBのリトルエンディアン)
+	// これを RGBA の順番に並び替える
+	if (channel == 3) { //0=R, 1=G, 2=B, 3=A
+		// アルファチャンネルが指定された。
+		// アルファチャンネルをグレースケールに変えておく
+		// BGRA ==> RGBA
+		for (int y=0; y<bmp->h; y++) {
+			for (int x=0; x<bmp->w; x++) {
+				const int i = bmp->get_offset(x, y);
+			//	const uint8_t b = bmp->data[i+0];
+			//	const uint8_t g = bmp->data[i+1];
+			//	const uint8_t r = bmp->data[i+2];
+				const uint8_t a = bmp->data[i+3];
+				bmp->data[i+0] = a;
+				bmp->data[i+1] = a;
+				bmp->data[i+2] = a;
+				bmp->data[i+3] = 255;
+			}
+		}
+	} else if (channel == -1) {
+		// BGRA ==> RGBA
+		for (int y=0; y<bmp->h; y++) {
+			for (int x=0; x<bmp->w; x++) {
+				const int i = bmp->get_offset(x, y);
+				const uint8_t b = bmp->data[i+0];
+				const uint8_t g = bmp->data[i+1];
+				const uint8_t r = bmp->data[i+2];
+				const uint8_t a = bmp->data[i+3];
+				bmp->data[i+0] = r;
+				bmp->data[i+1] = g;
+				bmp->data[i+2] = b;
+				bmp->data[i+3] = a;
+			}
+		}
+	}
+}
+
+#pragma endregion // Blit
+
+
+#ifdef K_USE_D3D9
+
 #pragma region D3D9 Functions
 /// HRESULT 表示用のマクロ
 /// S_OK ならば通常ログを出力し、エラーコードであればエラーログを出力する
@@ -480,160 +683,35 @@ static IDirect3DDevice9 * DX9_initDevice(IDirect3D9 *d3d9, HWND hWnd, D3DPRESENT
 
 
 #pragma region CD3DTex
+static int g_NewTexId = 0;
 
-// dst に src をマテリアル mat で描画する
-// dst = nullptr だった場合はバックバッファに描画する
-static void _BlitEx(KTexture *dst, KTexture *src, KMaterial *mat, const KVideoRect *src_rect, const KVideoRect *dst_rect, const KMatrix4 *transform) {
-	K__ASSERT_RETURN(src != nullptr);
-	K__ASSERT_RETURN(src != dst);
-	static const KMatrix4 identity;
-	KVideo::pushRenderState();
-	if (dst) KVideo::pushRenderTarget(dst->getId());
-	// ブレンドモード
-	if (mat) {
-		mat->texture = src->getId();
-		KVideo::setProjection(identity.m);
-		KVideo::setTransform(identity.m);
-
-		if (mat->shader) {
-			KVideo::setShader(mat->shader);
-
-			KShaderArg arg;
-			arg.blend = mat->blend;
-			arg.texture = mat->texture;
-			arg.color = mat->color;
-			arg.specular = mat->specular;
-			KVideo::setDefaultShaderParams(arg);
-			// ここのコールバックを削るときはayakashiの雷天気がちゃんと再生されるか確認すること
-			if (mat && mat->cb) {
-				mat->cb->onMaterial_Begin(mat);
-				mat->cb->onMaterial_SetShaderVariable(mat);
-			}
-		} else {
-			KVideo::setShader(nullptr);
-			KVideo::setBlend(mat->blend);
-			KVideo::setFilter(mat->filter);
-			KVideo::setTextureAddressing(mat->wrap);
-			KVideo::setColor(mat->color32());
-			KVideo::setSpecular(mat->specular32());
-			KVideo::setTexture(mat->texture);
-		}
-		KVideo::beginShader();
-	} else {
-		// 変換済み頂点 XYZEHW で描画するため行列設定は不要
-		// m_d3ddev->SetTransform(D3DTS_PROJECTION, ...);
-		// m_d3ddev->SetTransform(D3DTS_VIEW, ...);
-		KVideo::setFilter(KFilter_NONE);
-		KVideo::setTextureAddressing(false);
-		KVideo::setProjection(identity.m);
-		KVideo::setTransform(identity.m);
-		KVideo::setBlend(KBlend_ONE);
-		KVideo::setColor(K__COLOR32_WHITE);
-		KVideo::setSpecular(K__COLOR32_ZERO);
-		KVideo::setTexture(src->getId());
-	}
+class CD3DTex: public KTexture {
+public:
+	D3DSURFACE_DESC m_desc;
+	D3DCAPS9 m_caps;
+	IDirect3DDevice9  *m_d3ddev;
+	IDirect3DTexture9 *m_d3dtex;
+	IDirect3DSurface9 *m_color_surf;
+	IDirect3DSurface9 *m_depth_surf;
+	IDirect3DSurface9 *m_target_surf;
+	IDirect3DSurface9 *m_lockable_surf; // ロック可能なサーフェス。レンダーターゲットからのコピー作業用
+	UINT m_pitch;
+	UINT m_original_w;
+	UINT m_original_h;
+	UINT m_required_w;
+	UINT m_required_h;
+	IDirect3DTexture9 *m_backup_tex; // デバイスリセット時にレンダーターゲットの内容を保持するためのテクスチャ
 
-	KVideo::drawTexture(src->getId(), src_rect, dst_rect, transform);
+public:
+	KTexture::Format m_kfmt;
+	KTEXID m_ktexid;
 
-	// 後始末
-	if (mat) {
-		if (mat && mat->cb) {
-			mat->cb->onMaterial_End(mat);
-		}
-		KVideo::endShader();
-		KVideo::setShader(nullptr);
+	CD3DTex() {
+		zero_clear();
+		g_NewTexId++;
+		m_ktexid = (KTEXID)g_NewTexId;
 	}
-	if (dst) KVideo::popRenderTarget();
-	KVideo::popRenderState();
-}
-
-// channel: -1=RGBA, 0=R, 1=G, 2=B, 3=A
-static void _BmpWrite(KBmp *bmp, const void *rgba, int pitch, int width, int height, int channel) {
-	K__ASSERT_RETURN(bmp);
-	K__ASSERT_RETURN(rgba);
-	K__ASSERT_RETURN(bmp);
-	K__ASSERT_RETURN(bmp->w == width);
-	K__ASSERT_RETURN(bmp->h == height);
-	if (bmp->pitch == pitch) {
-		// ピッチが同じ。 memcpy で一括コピーできる
-		memcpy(bmp->data, rgba, pitch * height);
-	} else {
-		// ピッチが異なる。ラインごとにコピーする
-		for (int y=0; y<height; y++) {
-			memcpy(
-				bmp->data + (bmp->pitch * y),
-				(uint8_t*)rgba + (pitch * y),
-				width * 4
-			);
-		}
-	}
-	// Direct3Dのテクスチャには色が BGRA の順で格納されている (ARGBのリトルエンディアン)
-	// これを RGBA の順番に並び替える
-	if (channel == 3) { //0=R, 1=G, 2=B, 3=A
-		// アルファチャンネルが指定された。
-		// アルファチャンネルをグレースケールに変えておく
-		// BGRA ==> RGBA
-		for (int y=0; y<bmp->h; y++) {
-			for (int x=0; x<bmp->w; x++) {
-				const int i = bmp->get_offset(x, y);
-			//	const uint8_t b = bmp->data[i+0];
-			//	const uint8_t g = bmp->data[i+1];
-			//	const uint8_t r = bmp->data[i+2];
-				const uint8_t a = bmp->data[i+3];
-				bmp->data[i+0] = a;
-				bmp->data[i+1] = a;
-				bmp->data[i+2] = a;
-				bmp->data[i+3] = 255;
-			}
-		}
-	} else if (channel == -1) {
-		// BGRA ==> RGBA
-		for (int y=0; y<bmp->h; y++) {
-			for (int x=0; x<bmp->w; x++) {
-				const int i = bmp->get_offset(x, y);
-				const uint8_t b = bmp->data[i+0];
-				const uint8_t g = bmp->data[i+1];
-				const uint8_t r = bmp->data[i+2];
-				const uint8_t a = bmp->data[i+3];
-				bmp->data[i+0] = r;
-				bmp->data[i+1] = g;
-				bmp->data[i+2] = b;
-				bmp->data[i+3] = a;
-			}
-		}
-	}
-}
-
-
-static int g_NewTexId = 0;
-
-class CD3DTex: public KTexture {
-public:
-	D3DSURFACE_DESC m_desc;
-	D3DCAPS9 m_caps;
-	IDirect3DDevice9  *m_d3ddev;
-	IDirect3DTexture9 *m_d3dtex;
-	IDirect3DSurface9 *m_color_surf;
-	IDirect3DSurface9 *m_depth_surf;
-	IDirect3DSurface9 *m_target_surf;
-	IDirect3DSurface9 *m_lockable_surf; // ロック可能なサーフェス。レンダーターゲットからのコピー作業用
-	UINT m_pitch;
-	UINT m_original_w;
-	UINT m_original_h;
-	UINT m_required_w;
-	UINT m_required_h;
-	IDirect3DTexture9 *m_backup_tex; // デバイスリセット時にレンダーターゲットの内容を保持するためのテクスチャ
-
-public:
-	KTexture::Format m_kfmt;
-	KTEXID m_ktexid;
-
-	CD3DTex() {
-		zero_clear();
-		g_NewTexId++;
-		m_ktexid = (KTEXID)g_NewTexId;
-	}
-	virtual ~CD3DTex() {
+	virtual ~CD3DTex() {
 	}
 	void zero_clear() {
 		m_d3ddev = nullptr;
@@ -1587,6 +1665,13 @@ class CD3D9 {
 	std::recursive_mutex m_mutex;
 	uint32_t m_video_thread_id;
 	int m_drawcalls;
+	IDirect3DVertexBuffer9 *m_stream_vb; // D3DPOOL_DEFAULT なのでデバイスロスト時に解放する
+	IDirect3DVertexBuffer9 *m_stream_cvb; // KVertexCompact 用。D3DPOOL_DEFAULT なのでデバイスロスト時に解放する
+	IDirect3DIndexBuffer9 *m_stream_ib;
+	SStreamRing m_stream_vring;
+	SStreamRing m_stream_cring; // m_stream_cvb 用
+	SStreamRing m_stream_iring;
+	SStreamStats m_stream_stats;
 	int m_drawbuf_maxvert;
 	bool m_drawbuf_using_index;
 	bool m_shader_available;
@@ -1618,6 +1703,13 @@ public:
 		m_d3d9 = nullptr;
 		m_d3ddev = nullptr;
 		m_drawcalls = 0;
+		m_stream_vb = nullptr;
+		m_stream_cvb = nullptr;
+		m_stream_ib = nullptr;
+		m_stream_vring = SStreamRing();
+		m_stream_cring = SStreamRing();
+		m_stream_iring = SStreamRing();
+		m_stream_stats.clear();
 		m_drawbuf_maxvert = 0;
 		m_drawbuf_using_index = false;
 		m_shader_available = false;
@@ -1705,6 +1797,9 @@ public:
 		m_texlist.clear();
 		K__ASSERT(m_d3dblocks.empty()); // pushRenderState と popRenderState が等しく呼ばれていること
 		m_d3dblocks.clear();
+		K__DX9_RELEASE(m_stream_vb);
+		K__DX9_RELEASE(m_stream_cvb);
+		K__DX9_RELEASE(m_stream_ib);
 		K__DX9_RELEASE(m_d3ddev);
 		K__DX9_RELEASE(m_d3d9);
 		init_init(false);
@@ -2442,6 +2537,13 @@ public:
 			for (auto it=m_shaderlist.begin(); it!=m_shaderlist.end(); ++it) {
 				it->second->onDeviceLost();
 			}
+			// ストリームバッファは次に書き込むときに作り直す
+			K__DX9_RELEASE(m_stream_vb);
+			K__DX9_RELEASE(m_stream_cvb);
+			K__DX9_RELEASE(m_stream_ib);
+			m_stream_vring = SStreamRing();
+			m_stream_cring = SStreamRing();
+			m_stream_iring = SStreamRing();
 		}
 	}
 	bool canFullscreen(int w, int h) {
@@ -2548,6 +2650,19 @@ public:
 	#pragma endregion // device
 
 	#pragma region draw
+	/// プリミティブタイプと、count 個の頂点（インデックス）で描画されるプリミティブ数を得る
+	static int get_primitive_count(KPrimitive primitive, int count, D3DPRIMITIVETYPE *d3dpt) {
+		switch (primitive) {
+		case KPrimitive_POINTS:         *d3dpt=D3DPT_POINTLIST;     return count;
+		case KPrimitive_LINES:          *d3dpt=D3DPT_LINELIST;      return count / 2;
+		case KPrimitive_LINE_STRIP:     *d3dpt=D3DPT_LINESTRIP;     return count - 1;
+		case KPrimitive_TRIANGLES:      *d3dpt=D3DPT_TRIANGLELIST;  return count / 3;
+		case KPrimitive_TRIANGLE_STRIP: *d3dpt=D3DPT_TRIANGLESTRIP; return count - 2;
+		case KPrimitive_TRIANGLE_FAN:   *d3dpt=D3DPT_TRIANGLEFAN;   return count - 2;
+		}
+		*d3dpt = D3DPT_TRIANGLELIST;
+		return 0;
+	}
 	void drawUserPtrV(const KVertex *vertices, int count, KPrimitive primitive) {
 		K__ASSERT(m_d3ddev);
 		K__ASSERT(count >= 0);
@@ -2561,16 +2676,8 @@ public:
 		m_drawcalls++;
 
 		// プリミティブ数を計算
-		D3DPRIMITIVETYPE d3dpt = D3DPT_TRIANGLELIST;
-		int numface = 0;
-		switch (primitive) {
-		case KPrimitive_POINTS:         d3dpt=D3DPT_POINTLIST;     numface=count; break;
-		case KPrimitive_LINES:          d3dpt=D3DPT_LINELIST;      numface=count / 2; break;
-		case KPrimitive_LINE_STRIP:     d3dpt=D3DPT_LINESTRIP;     numface=count - 1; break;
-		case KPrimitive_TRIANGLES:      d3dpt=D3DPT_TRIANGLELIST;  numface=count / 3; break;
-		case KPrimitive_TRIANGLE_STRIP: d3dpt=D3DPT_TRIANGLESTRIP; numface=count - 2; break;
-		case KPrimitive_TRIANGLE_FAN:   d3dpt=D3DPT_TRIANGLEFAN;   numface=count - 2; break;
-		}
+		D3DPRIMITIVETYPE d3dpt;
+		int numface = get_primitive_count(primitive, count, &d3dpt);
 
 		// 描画
 		if (numface > 0 && count > 0) {
@@ -2578,6 +2685,7 @@ public:
 			K__ASSERT(sizeof(DX9_VERTEX) == sizeof(KVertex)); // 最低限、サイズが同じであることを確認
 			m_d3ddev->SetFVF(K__DX9_FVF_VERTEX);
 			m_d3ddev->DrawPrimitiveUP(d3dpt, numface, vertices, sizeof(DX9_VERTEX));
+			m_stream_stats.add(sizeof(DX9_VERTEX) * count, false);
 		}
 	}
 	void drawIndexedUserPtrV(const KVertex *vertices, int vertex_count, const int *indices, int index_count, KPrimitive primitive) {
@@ -2593,22 +2701,143 @@ public:
 		m_drawcalls++;
 
 		// プリミティブ数を計算
-		D3DPRIMITIVETYPE d3dpt = D3DPT_TRIANGLELIST;
-		int numface = 0;
-		switch (primitive) {
-		case KPrimitive_POINTS:         d3dpt=D3DPT_POINTLIST;     numface=index_count; break;
-		case KPrimitive_LINES:          d3dpt=D3DPT_LINELIST;      numface=index_count / 2; break;
-		case KPrimitive_LINE_STRIP:     d3dpt=D3DPT_LINESTRIP;     numface=index_count - 1; break;
-		case KPrimitive_TRIANGLES:      d3dpt=D3DPT_TRIANGLELIST;  numface=index_count / 3; break;
-		case KPrimitive_TRIANGLE_STRIP: d3dpt=D3DPT_TRIANGLESTRIP; numface=index_count - 2; break;
-		case KPrimitive_TRIANGLE_FAN:   d3dpt=D3DPT_TRIANGLEFAN;   numface=index_count - 2; break;
-		}
+		D3DPRIMITIVETYPE d3dpt;
+		int numface = get_primitive_count(primitive, index_count, &d3dpt);
 
 		// 描画
 		if (numface > 0) {
 			// https://msdn.microsoft.com/ja-jp/library/ee422176(v=vs.85).aspx
 			m_d3ddev->SetFVF(K__DX9_FVF_VERTEX);
 			m_d3ddev->DrawIndexedPrimitiveUP(d3dpt, 0, vertex_count, numface, indices, D3DFMT_INDEX32, vertices, sizeof(DX9_VERTEX));
+			m_stream_stats.add(sizeof(DX9_VERTEX) * vertex_count + sizeof(int) * index_count, false);
+		}
+	}
+	/// 頂点ストリームバッファ vb の count 個分 (1 個 stride バイト) をロックして *out に書き込み先をセットし、先頭の頂点番号を返す。
+	/// 失敗した場合は -1 を返す。成功した場合は書き込み後に Unlock すること
+	int lock_stream_vertices(IDirect3DVertexBuffer9 **vb, SStreamRing *ring, int stride, DWORD fvf, int count, void **out) {
+		K__ASSERT(m_d3ddev);
+		int cap = ring->reserve(count, K__STREAM_MIN_VERTICES);
+		if (cap > 0) {
+			// 足りなければ作り直す。デバイスロスト後は ring->capacity が 0 になっているので、ここで作り直される
+			K__DX9_RELEASE(*vb);
+			*ring = SStreamRing();
+			HRESULT hr = m_d3ddev->CreateVertexBuffer(stride * cap, D3DUSAGE_DYNAMIC|D3DUSAGE_WRITEONLY, fvf, D3DPOOL_DEFAULT, vb, nullptr);
+			if (FAILED(hr)) {
+				K__VIDEO_ERR("E_FAIL_D3D: Failed to CreateVertexBuffer: Count=%d, HRESULT='%s'", cap, K__GetErrorStringUtf8(hr).c_str());
+				return -1;
+			}
+			ring->capacity = cap;
+		}
+		bool discard;
+		int start = ring->alloc(count, &discard);
+		HRESULT hr = (*vb)->Lock(stride * start, stride * count, out, discard ? D3DLOCK_DISCARD : D3DLOCK_NOOVERWRITE);
+		if (FAILED(hr)) {
+			K__VIDEO_ERR("E_FAIL_D3D: Failed to Lock vertex buffer: HRESULT='%s'", K__GetErrorStringUtf8(hr).c_str());
+			return -1;
+		}
+		m_stream_stats.add(stride * count, discard);
+		return start;
+	}
+	int writeStreamVertices(const KVertex *vertices, int count) {
+		if (vertices == nullptr || count <= 0) return -1;
+		void *dst = nullptr;
+		int start = lock_stream_vertices(&m_stream_vb, &m_stream_vring, sizeof(DX9_VERTEX), K__DX9_FVF_VERTEX, count, &dst);
+		if (start < 0) return -1;
+		memcpy(dst, vertices, sizeof(DX9_VERTEX) * count);
+		m_stream_vb->Unlock();
+		return start;
+	}
+	int writeStreamVertices(const KVertexCompact *vertices, int count) {
+		// KVertex とは別のリングバッファに書き込むので、互いの DISCARD で破棄されることはない
+		if (vertices == nullptr || count <= 0) return -1;
+		void *ptr = nullptr;
+		int start = lock_stream_vertices(&m_stream_cvb, &m_stream_cring, sizeof(DX9_VERTEX_COMPACT), K__DX9_FVF_VERTEX_COMPACT, count, &ptr);
+		if (start < 0) return -1;
+		DX9_VERTEX_COMPACT *dst = (DX9_VERTEX_COMPACT *)ptr;
+		for (int i=0; i<count; i++) {
+			const KVertexCompact &src = vertices[i];
+			dst[i].xyz[0] = src.pos.x;
+			dst[i].xyz[1] = src.pos.y;
+			dst[i].xyz[2] = src.pos.z;
+			memcpy(&dst[i].dif, &src.dif32, sizeof(DWORD)); // KVertex と同じく KColor32 のメモリ配置のまま渡す
+			dst[i].uv1[0] = src.u / 65535.0f;
+			dst[i].uv1[1] = src.v / 65535.0f;
+		}
+		m_stream_cvb->Unlock();
+		return start;
+	}
+	int writeStreamIndices(const int *indices, int count) {
+		K__ASSERT(m_d3ddev);
+		if (indices == nullptr || count <= 0) return -1;
+		int cap = m_stream_iring.reserve(count, K__STREAM_MIN_INDICES);
+		if (cap > 0) {
+			// 足りなければ作り直す。デバイスロスト後は m_stream_iring.capacity が 0 になっているので、ここで作り直される
+			K__DX9_RELEASE(m_stream_ib);
+			m_stream_iring = SStreamRing();
+			HRESULT hr = m_d3ddev->CreateIndexBuffer(sizeof(int) * cap, D3DUSAGE_DYNAMIC|D3DUSAGE_WRITEONLY, D3DFMT_INDEX32, D3DPOOL_DEFAULT, &m_stream_ib, nullptr);
+			if (FAILED(hr)) {
+				K__VIDEO_ERR("E_FAIL_D3D: Failed to CreateIndexBuffer: Count=%d, HRESULT='%s'", cap, K__GetErrorStringUtf8(hr).c_str());
+				return -1;
+			}
+			m_stream_iring.capacity = cap;
+		}
+		bool discard;
+		int start = m_stream_iring.alloc(count, &discard);
+		void *ptr = nullptr;
+		HRESULT hr = m_stream_ib->Lock(sizeof(int) * start, sizeof(int) * count, &ptr, discard ? D3DLOCK_DISCARD : D3DLOCK_NOOVERWRITE);
+		if (FAILED(hr)) {
+			K__VIDEO_ERR("E_FAIL_D3D: Failed to Lock index buffer: HRESULT='%s'", K__GetErrorStringUtf8(hr).c_str());
+			return -1;
+		}
+		memcpy(ptr, indices, sizeof(int) * count);
+		m_stream_ib->Unlock();
+		m_stream_stats.add(sizeof(int) * count, discard);
+		return start;
+	}
+	void set_stream_source(bool compact) {
+		if (compact) {
+			m_d3ddev->SetFVF(K__DX9_FVF_VERTEX_COMPACT);
+			m_d3ddev->SetStreamSource(0, m_stream_cvb, 0, sizeof(DX9_VERTEX_COMPACT));
+		} else {
+			m_d3ddev->SetFVF(K__DX9_FVF_VERTEX);
+			m_d3ddev->SetStreamSource(0, m_stream_vb, 0, sizeof(DX9_VERTEX));
+		}
+	}
+	void drawStreamV(int start, int count, KPrimitive primitive, KVertexLayout layout) {
+		K__ASSERT(m_d3ddev);
+		bool compact = (layout == KVertexLayout_COMPACT);
+		K__ASSERT(compact ? m_stream_cvb : m_stream_vb);
+		K__ASSERT(0 <= start && start + count <= (compact ? m_stream_cring : m_stream_vring).capacity);
+		if (m_color_tex_changed) {
+			m_color_tex_changed = false;
+			setTextureAndColors();
+		}
+		m_drawcalls++;
+		D3DPRIMITIVETYPE d3dpt;
+		int numface = get_primitive_count(primitive, count, &d3dpt);
+		if (numface > 0 && count > 0) {
+			// ユーザーポインタ描画はストリーム 0 の設定を解除するので、毎回設定する
+			set_stream_source(compact);
+			m_d3ddev->DrawPrimitive(d3dpt, start, numface);
+		}
+	}
+	void drawIndexedStreamV(int base_vertex, int vertex_count, int start_index, int index_count, KPrimitive primitive, KVertexLayout layout) {
+		K__ASSERT(m_d3ddev);
+		bool compact = (layout == KVertexLayout_COMPACT);
+		K__ASSERT((compact ? m_stream_cvb : m_stream_vb) && m_stream_ib);
+		K__ASSERT(0 <= base_vertex && base_vertex + vertex_count <= (compact ? m_stream_cring : m_stream_vring).capacity);
+		K__ASSERT(0 <= start_index && start_index + index_count <= m_stream_iring.capacity);
+		if (m_color_tex_changed) {
+			m_color_tex_changed = false;
+			setTextureAndColors();
+		}
+		m_drawcalls++;
+		D3DPRIMITIVETYPE d3dpt;
+		int numface = get_primitive_count(primitive, index_count, &d3dpt);
+		if (numface > 0 && vertex_count > 0) {
+			set_stream_source(compact);
+			m_d3ddev->SetIndices(m_stream_ib);
+			m_d3ddev->DrawIndexedPrimitive(d3dpt, base_vertex, 0, vertex_count, start_index, numface);
 		}
 	}
 	#pragma endregion // draw
@@ -2746,6 +2975,13 @@ public:
 			m_drawcalls = 0;
 			return;
 
+		case KVideo::PARAM_STREAM_STATS:
+			pIntData[0] = m_stream_stats.bytes;
+			pIntData[1] = m_stream_stats.locks;
+			pIntData[2] = m_stream_stats.discards;
+			m_stream_stats.clear();
+			return;
+
 		case KVideo::PARAM_MAX_TEXTURE_REQUIRE:
 			pIntData[0] = g_video_limit.max_texture_size_require;
 			return;
@@ -2783,11 +3019,1593 @@ public:
 #pragma endregion // CD3D9
 
 
-static CD3D9 g_Video;
+static CD3D9 g_Video;
+
+#endif // K_USE_D3D9
+
+
+#ifdef K_USE_SOFTWARE_VIDEO
+
+#pragma region CSoftTex
+/// CPU 描画で使うピクセルバッファ。
+/// Direct3D9 の D3DFMT_A8R8G8B8 と同じく、１ピクセルを 0xAARRGGBB の uint32_t で表す。
+/// （メモリ上では BGRA の順に並ぶので、lockData で得られるメモリの形式も Direct3D9 版と同じになる）
+struct SSoftSurface {
+	SSoftSurface() {
+		w = 0;
+		h = 0;
+	}
+	void resize(int _w, int _h, bool with_depth_stencil) {
+		w = _w;
+		h = _h;
+		color.assign(w * h, 0);
+		if (with_depth_stencil) {
+			depth.assign(w * h, 1.0f);
+			stencil.assign(w * h, 0);
+		} else {
+			depth.clear();
+			stencil.clear();
+		}
+	}
+	int w;
+	int h;
+	std::vector<uint32_t> color;
+	std::vector<float> depth;     ///< 深度バッファ（レンダーターゲットのみ）
+	std::vector<uint8_t> stencil; ///< ステンシルバッファ（レンダーターゲットのみ）
+};
+
+static void CSoftVideo_flush();
+static void CSoftVideo_fill(KTEXID target, const float *color_rgba, KColorChannels channels);
+static const SSoftSurface * CSoftVideo_getRenderTarget();
+
+static int g_NewTexId = 0;
+
+class CSoftTex: public KTexture {
+public:
+	SSoftSurface m_surf;
+	int m_original_w;
+	int m_original_h;
+	bool m_is_render_target;
+	KTexture::Format m_kfmt;
+	KTEXID m_ktexid;
+
+	CSoftTex() {
+		m_original_w = 0;
+		m_original_h = 0;
+		m_is_render_target = false;
+		m_kfmt = KTexture::FMT_NONE;
+		g_NewTexId++;
+		m_ktexid = (KTEXID)g_NewTexId;
+	}
+	bool make(int w, int h, KTexture::Format fmt, bool is_render_target) {
+		K__ASSERT_RETURN_ZERO(w > 0);
+		K__ASSERT_RETURN_ZERO(h > 0);
+		// FMT_ARGB64F も各チャンネル 8 ビットで保持する
+		m_kfmt = fmt;
+		m_is_render_target = is_render_target;
+		m_original_w = w;
+		m_original_h = h;
+		m_surf.resize(w, h, is_render_target);
+		return true;
+	}
+	void destroy() {
+		m_surf.resize(0, 0, false);
+	}
+	virtual int getWidth() const override {
+		return m_surf.w;
+	}
+	virtual int getHeight() const override {
+		return m_surf.h;
+	}
+	virtual Format getFormat() const override {
+		return m_kfmt;
+	}
+	virtual KTEXID getId() const override {
+		return m_ktexid;
+	}
+	virtual bool isRenderTarget() const override {
+		return m_is_render_target;
+	}
+	virtual int getSizeInBytes() const override {
+		return m_surf.w * m_surf.h * 4;
+	}
+	virtual void fill(const KColor &color) override {
+		CSoftVideo_fill(m_ktexid, color.floats(), KColorChannel_RGBA);
+	}
+	virtual void fillEx(const KColor &color, KColorChannels channels) override {
+		CSoftVideo_fill(m_ktexid, color.floats(), channels);
+	}
+	virtual void getDesc(Desc *desc) const override {
+		if (desc == nullptr) return;
+		memset(desc, 0, sizeof(*desc));
+		desc->w = m_surf.w;
+		desc->h = m_surf.h;
+		desc->original_w = m_original_w;
+		desc->original_h = m_original_h;
+		desc->original_u = (float)m_original_w / m_surf.w;
+		desc->original_v = (float)m_original_h / m_surf.h;
+		desc->pitch = m_surf.w * 4;
+		desc->size_in_bytes = m_surf.w * m_surf.h * 4;
+		desc->pixel_format = KColorFormat_RGBA32;
+		desc->is_render_target = m_is_render_target;
+		desc->d3dtex9 = nullptr;
+	}
+	virtual void * getDirect3DTexture9() override {
+		return nullptr;
+	}
+	virtual KVec4 getPixelValue(int x, int y) override {
+		KVec4 ret;
+		if (0 <= x && x < m_surf.w && 0 <= y && y < m_surf.h) {
+			CSoftVideo_flush();
+			KColor col = KColor32::fromARGB32(m_surf.color[m_surf.w * y + x]).toColor();
+			ret = KVec4(col.r, col.g, col.b, col.a);
+		}
+		return ret;
+	}
+	virtual void * lockData() override {
+		// 未描画のコマンドがこのテクスチャを参照している可能性があるので、先に描画を済ませておく
+		CSoftVideo_flush();
+		return m_surf.color.empty() ? nullptr : m_surf.color.data();
+	}
+	virtual void unlockData() override {
+	}
+	virtual KImage exportTextureImage(int channel) override {
+		CSoftVideo_flush();
+		KImage img = KImage::createFromPixels(m_surf.w, m_surf.h, KColorFormat_RGBA32, nullptr);
+		KBmp bmp;
+		img.lock(&bmp);
+		_BmpWrite(&bmp, m_surf.color.data(), m_surf.w * 4, m_surf.w, m_surf.h, channel);
+		img.unlock();
+		return img;
+	}
+	virtual void writeImageToTexture(const KImage &image, float u, float v) override {
+		KBmp bmp;
+		image.lock(&bmp);
+		writeImage(&bmp, u, v);
+		image.unlock();
+	}
+	virtual bool writeImageFromBackBuffer() override {
+		const SSoftSurface *back = CSoftVideo_getRenderTarget();
+		if (back == nullptr) return false;
+		uint32_t *dst = (uint32_t *)lockData();
+		if (dst == nullptr) return false;
+		int w = KMath::min(m_surf.w, back->w);
+		int h = KMath::min(m_surf.h, back->h);
+		for (int y=0; y<h; y++) {
+			memcpy(dst + m_surf.w * y, back->color.data() + back->w * y, sizeof(uint32_t) * w);
+		}
+		return true;
+	}
+	virtual KVec2 getTextureUVFromOriginalUV(const KVec2 &orig_uv) override {
+		K__ASSERT(m_surf.w > 0 && m_surf.h > 0);
+		return KVec2(
+			orig_uv.x * m_original_w / (float)m_surf.w,
+			orig_uv.y * m_original_h / (float)m_surf.h
+		);
+	}
+	virtual KVec2 getTextureUVFromOriginalPoint(const KVec2 &pixel) override {
+		K__ASSERT(m_surf.w > 0 && m_surf.h > 0);
+		return KVec2(
+			pixel.x / (float)m_surf.w,
+			pixel.y / (float)m_surf.h
+		);
+	}
+	virtual void blit(KTexture *src, KMaterial *mat) override {
+		_BlitEx(this, src, mat, nullptr, nullptr, nullptr);
+	}
+	virtual void blitEx(KTexture *src, KMaterial *mat, const KVideoRect *src_rect, const KVideoRect *dst_rect, const KMatrix4 *transform) override {
+		_BlitEx(this, src, mat, src_rect, dst_rect, transform);
+	}
+	void writeImage(const KBmp *bmp, float u, float v) {
+		if (!KBmp::isvalid(bmp)) return;
+		uint8_t *dstBuf = (uint8_t *)lockData();
+		if (dstBuf == nullptr) return;
+
+		m_original_w = bmp->w;
+		m_original_h = bmp->h;
+
+		// テクスチャは常に要求通りのサイズで作成されるので、
+		// UV 範囲 (u, v) が 1.0 x 1.0 または省略 (0.0) であれば拡縮なしでコピーできる
+		bool stretch = !(K__EQUALS(u, 0.0f) || K__EQUALS(v, 0.0f)) && !(K__EQUALS(u, 1.0f) && K__EQUALS(v, 1.0f));
+		int w = stretch ? m_surf.w : KMath::min(m_surf.w, bmp->w);
+		int h = stretch ? m_surf.h : KMath::min(m_surf.h, bmp->h);
+		int dstPitch = m_surf.w * 4;
+
+		// BGRA 順で書き込む
+		for (int y=0; y<h; y++) {
+			int sy = stretch ? KMath::min((int)(bmp->h * v * y / m_surf.h), bmp->h - 1) : y;
+			auto src = bmp->data + bmp->pitch * sy;
+			auto dst = dstBuf + dstPitch * y;
+			for (int x=0; x<w; x++) {
+				int sx = stretch ? KMath::min((int)(bmp->w * u * x / m_surf.w), bmp->w - 1) : x;
+				const int srcIdx = sx * 4;
+				const int dstIdx = x * 4;
+				dst[dstIdx + 0] = src[srcIdx + 2];
+				dst[dstIdx + 1] = src[srcIdx + 1];
+				dst[dstIdx + 2] = src[srcIdx + 0];
+				dst[dstIdx + 3] = src[srcIdx + 3];
+			}
+		}
+		unlockData();
+	}
+	virtual void clearRenderTargetStencil(int stencil) {
+		if (isRenderTarget()) {
+			KVideo::pushRenderState();
+			KVideo::pushRenderTarget(m_ktexid);
+			KVideo::clearStencil(stencil);
+			KVideo::popRenderTarget();
+			KVideo::popRenderState();
+		}
+	}
+	virtual void clearRenderTargetDepth(float depth) {
+		if (isRenderTarget()) {
+			KVideo::pushRenderState();
+			KVideo::pushRenderTarget(m_ktexid);
+			KVideo::clearDepth(depth);
+			KVideo::popRenderTarget();
+			KVideo::popRenderState();
+		}
+	}
+};
+#pragma endregion // CSoftTex
+
+
+#pragma region CSoftVideo
+/// CPU だけで描画する KVideo の実装。GPU もウィンドウも使わない。
+///
+/// 描画関数は頂点を変換・クリップして三角形（線、点）のリストに溜めておくだけで、
+/// レンダーターゲットの内容が必要になった時点（ターゲットの切り替え、クリア、テクスチャの読み書き、endScene など）で
+/// ターゲットを TILE_SIZE 四方のタイルに分割し、タイルごとに KParallelFor で並列にラスタライズする。
+/// 各タイルはプリミティブを追加された順番に処理し、タイル同士が同じピクセルに書き込むことはないので、
+/// 結果はスレッド数に関係なく常に同じになる。
+///
+/// ピクセル中心は Direct3D9 と同じく整数座標にあり、三角形の辺の上にあるピクセルはトップレフトルールで判定する。
+/// 合成は Direct3D9 版の固定機能パイプライン（setTextureAndColors, DX9_setBlend）と同じ式で行う。
+/// プログラマブルシェーダーには対応しない
+class CSoftVideo {
+	static const int TILE_SIZE = 64;
+	static const int SUBPIXEL_BITS = 8; ///< ラスタライズ時の頂点座標の小数部のビット数
+	static const int NUM_ATTRS = 9;     ///< 補間する頂点属性の数 (ディフューズRGBA, UV, スペキュラRGB)
+	static const int MAX_SCREEN_COORD = 1 << 20; ///< 変換済み頂点で受け付ける座標の範囲
+	static constexpr float GUARD_BAND = 16.0f;   ///< クリッピングするときの X, Y 方向の範囲（ビューポートの大きさを 1 とする）
+	static constexpr float MIN_W = 1.0f / 65536;
+
+	/// レンダーステート。pushRenderState で丸ごと保存する
+	struct SState {
+		float projection[16];
+		float transform[16];
+		int vp_x, vp_y, vp_w, vp_h;
+		KTEXID texture;
+		uint32_t diffuse;  ///< Direct3D9 版の D3DRS_TEXTUREFACTOR に相当
+		uint32_t specular; ///< Direct3D9 版の D3DTSS_CONSTANT に相当
+		KBlend blend;
+		KFilter filter;
+		bool wrap;
+		KColorChannels color_mask;
+		bool depth_test;
+		bool stencil;
+		KVideo::StencilFunc stencil_func;
+		KVideo::StencilOp stencil_op;
+		int stencil_ref;
+		int cull; ///< 0=なし 1=時計回りを除去 2=反時計回りを除去（画面上での向き）
+	};
+
+	/// ラスタライズで使う描画設定。プリミティブを追加した時点での SState から作る
+	struct SDrawState {
+		const SSoftSurface *texture;
+		float diffuse[4];
+		float specular[3];
+		KBlend blend;
+		bool linear;
+		bool wrap;
+		uint32_t color_mask; ///< 書き込むビットのマスク (0xAARRGGBB)
+		bool depth_test;
+		bool depth_write;
+		bool stencil;
+		KVideo::StencilFunc stencil_func;
+		KVideo::StencilOp stencil_op;
+		int stencil_ref;
+		int cull;
+		int clip_x0, clip_y0, clip_x1, clip_y1; ///< ビューポートとターゲットの共通部分（x1, y1 は含まない）
+	};
+
+	/// 頂点。クリップ前は pos にクリップ空間座標 (x, y, z, w) を、
+	/// クリップ後はスクリーン座標 (x, y, z, 1/w) を入れる
+	struct SVert {
+		float pos[4];
+		float attr[NUM_ATTRS];
+	};
+
+	struct SPrim {
+		SVert v[3];
+		int num_verts; ///< 1=点 2=線 3=三角形
+		int state;     ///< m_DrawStates のインデックス
+		int x0, y0, x1, y1; ///< 描画範囲（x1, y1 は含まない）
+	};
+
+	std::vector<SState> m_StateStack;
+	std::vector<KTEXID> m_RenderTargetStack;
+	std::unordered_map<KTEXID, CSoftTex*> m_TexList;
+	std::recursive_mutex m_Mutex;
+	SState m_State;
+	SSoftSurface m_BackBuffer;
+	SSoftSurface *m_Target; // nullptr なら描画しない（無効なレンダーターゲットが指定されている）
+	KTEXID m_TargetId;
+	std::vector<SVert> m_TmpVerts;
+	std::vector<SPrim> m_Prims;
+	std::vector<SDrawState> m_DrawStates;
+	std::vector<std::vector<int>> m_Bins; // タイルごとの m_Prims のインデックス
+	int m_NumTilesX;
+	int m_CurrDrawState; // m_State に対応する m_DrawStates のインデックス。-1 なら未作成
+	int m_DrawCalls;
+	std::vector<KVertex> m_StreamVerts; // ストリームバッファ。Direct3D9 版の動的頂点バッファに相当
+	std::vector<KVertexCompact> m_StreamCompactVerts;
+	std::vector<int> m_StreamIndices;
+	SStreamRing m_StreamVRing;
+	SStreamRing m_StreamCRing; // m_StreamCompactVerts 用
+	SStreamRing m_StreamIRing;
+	SStreamStats m_StreamStats;
+	bool m_IsInit;
+	KParallelFor m_Parallel;
+public:
+	CSoftVideo() {
+		m_Target = nullptr;
+		m_TargetId = nullptr;
+		m_NumTilesX = 0;
+		m_CurrDrawState = -1;
+		m_DrawCalls = 0;
+		m_IsInit = false;
+		reset_state();
+	}
+	~CSoftVideo() {
+		shutdown();
+	}
+	void init_init(bool check_flag) {
+	}
+	bool init() {
+		if (m_BackBuffer.w == 0) {
+			m_BackBuffer.resize(640, 480, true);
+		}
+		m_Target = &m_BackBuffer;
+		m_TargetId = nullptr;
+		m_State.vp_x = 0;
+		m_State.vp_y = 0;
+		m_State.vp_w = m_BackBuffer.w;
+		m_State.vp_h = m_BackBuffer.h;
+		setupDeviceStates();
+		m_IsInit = true;
+		return true;
+	}
+	bool isInit() {
+		return m_IsInit;
+	}
+	void shutdown() {
+		m_Prims.clear();
+		m_DrawStates.clear();
+		m_CurrDrawState = -1;
+		K__DX9_LOCK_GUARD(m_Mutex);
+		for (auto it=m_TexList.begin(); it!=m_TexList.end(); ++it) {
+			CSoftTex *tex = it->second;
+			tex->destroy();
+			tex->drop();
+		}
+		m_TexList.clear();
+		K__ASSERT(m_StateStack.empty()); // pushRenderState と popRenderState が等しく呼ばれていること
+		m_StateStack.clear();
+		m_RenderTargetStack.clear();
+		m_StreamVerts.clear();
+		m_StreamCompactVerts.clear();
+		m_StreamIndices.clear();
+		m_StreamVRing = SStreamRing();
+		m_StreamCRing = SStreamRing();
+		m_StreamIRing = SStreamRing();
+		m_StreamStats.clear();
+		m_Target = nullptr;
+		m_TargetId = nullptr;
+		m_IsInit = false;
+	}
+	void reset_state() {
+		memcpy(m_State.projection, K__MAT4_IDENTITY, sizeof(K__MAT4_IDENTITY));
+		memcpy(m_State.transform, K__MAT4_IDENTITY, sizeof(K__MAT4_IDENTITY));
+		m_State.vp_x = 0;
+		m_State.vp_y = 0;
+		m_State.vp_w = 0;
+		m_State.vp_h = 0;
+		m_State.texture = nullptr;
+		m_State.diffuse = K__COLOR32_WHITE;
+		m_State.specular = K__COLOR32_ZERO;
+		m_State.blend = KBlend_ALPHA;
+		m_State.filter = KFilter_NONE;
+		m_State.wrap = false;
+		m_State.color_mask = KColorChannel_RGBA;
+		m_State.depth_test = false;
+		m_State.stencil = false;
+		m_State.stencil_func = KVideo::STENCILFUNC_ALWAYS;
+		m_State.stencil_op = KVideo::STENCILOP_KEEP;
+		m_State.stencil_ref = 0;
+		m_State.cull = 0;
+	}
+	void setupDeviceStates() {
+		// ビューポートはそのまま
+		int x = m_State.vp_x;
+		int y = m_State.vp_y;
+		int w = m_State.vp_w;
+		int h = m_State.vp_h;
+		reset_state();
+		m_State.vp_x = x;
+		m_State.vp_y = y;
+		m_State.vp_w = w;
+		m_State.vp_h = h;
+		m_CurrDrawState = -1;
+	}
+
+	#pragma region texture
+	KTexture * createTexture(int w, int h, KTexture::Format fmt, bool is_render_tex) {
+		CSoftTex *tex = new CSoftTex();
+		if (tex->make(w, h, fmt, is_render_tex)) {
+			K__DX9_LOCK_GUARD(m_Mutex);
+			m_TexList[tex->m_ktexid] = tex;
+			return tex;
+		} else {
+			tex->drop();
+			return nullptr;
+		}
+	}
+	KTexture * createTextureFromImage(const KImage &img, KTexture::Format fmt) {
+		KTexture *tex = createTexture(img.getWidth(), img.getHeight(), fmt, false);
+		if (tex) {
+			tex->writeImageToTexture(img, 1.0f, 1.0f);
+		}
+		return tex;
+	}
+	void deleteTexture(KTEXID texid) {
+		K__DX9_LOCK_GUARD(m_Mutex);
+		auto it = m_TexList.find(texid);
+		if (it != m_TexList.end()) {
+			// 未描画のコマンドが参照している可能性がある
+			flush();
+			CSoftTex *tex = it->second;
+			if (m_Target == &tex->m_surf) {
+				m_Target = nullptr;
+			}
+			tex->destroy();
+			tex->drop();
+			m_TexList.erase(it);
+		}
+	}
+	CSoftTex * findTexture(KTEXID texid) {
+		K__DX9_LOCK_GUARD(m_Mutex);
+		auto it = m_TexList.find(texid);
+		if (it != m_TexList.end()) {
+			return it->second;
+		}
+		return nullptr;
+	}
+	void setFilter(KFilter filter) {
+		m_State.filter = filter;
+		m_CurrDrawState = -1;
+	}
+	void setBlend(KBlend blend) {
+		m_State.blend = blend;
+		m_CurrDrawState = -1;
+	}
+	void setTextureAddressing(bool wrap) {
+		m_State.wrap = wrap;
+		m_CurrDrawState = -1;
+	}
+	void drawTexture(KTEXID src, const KVideoRect *src_rect, const KVideoRect *dst_rect, const KMatrix4 *matrix) {
+		// Direct3D9 版と同じく、変換済み頂点 (XYZRHW) の四角形で描画する
+		KVec4 xyzw[4];
+		float x0, y0, x1, y1;
+		if (dst_rect) {
+			x0 = dst_rect->xmin;
+			y0 = dst_rect->ymin;
+			x1 = dst_rect->xmax;
+			y1 = dst_rect->ymax;
+		} else {
+			x0 = (float)m_State.vp_x;
+			y0 = (float)m_State.vp_y;
+			x1 = (float)(m_State.vp_x + m_State.vp_w);
+			y1 = (float)(m_State.vp_y + m_State.vp_h);
+		}
+		xyzw[0] = KVec4(x0-K_HALF_PIXEL, y0-K_HALF_PIXEL, 0.0f, 1.0f); // ピクセル単位で指定することに注意
+		xyzw[1] = KVec4(x1-K_HALF_PIXEL, y0-K_HALF_PIXEL, 0.0f, 1.0f);
+		xyzw[2] = KVec4(x0-K_HALF_PIXEL, y1-K_HALF_PIXEL, 0.0f, 1.0f);
+		xyzw[3] = KVec4(x1-K_HALF_PIXEL, y1-K_HALF_PIXEL, 0.0f, 1.0f);
+		if (matrix) {
+			for (int i=0; i<4; i++) {
+				xyzw[i] = matrix->transform(xyzw[i]);
+			}
+		}
+		float u0 = 0.0f;
+		float v0 = 0.0f;
+		float u1 = 1.0f;
+		float v1 = 1.0f;
+		if (src_rect) {
+			// 入力 rect が指定されている。ピクセル単位で指定されているものとして、UV範囲に直す
+			CSoftTex *srctex = findTexture(src);
+			K__ASSERT_RETURN(srctex);
+			float src_w = (float)srctex->getWidth();
+			float src_h = (float)srctex->getHeight();
+			u0 = src_rect->xmin / src_w;
+			v0 = src_rect->ymin / src_h;
+			u1 = src_rect->xmax / src_w;
+			v1 = src_rect->ymax / src_h;
+		}
+		const float uv[4][2] = {{u0, v0}, {u1, v0}, {u0, v1}, {u1, v1}};
+		SVert quad[4];
+		for (int i=0; i<4; i++) {
+			SVert &q = quad[i];
+			q.pos[0] = xyzw[i].x;
+			q.pos[1] = xyzw[i].y;
+			q.pos[2] = xyzw[i].z;
+			q.pos[3] = xyzw[i].w; // RHW
+			q.attr[0] = q.attr[1] = q.attr[2] = q.attr[3] = 1.0f; // 頂点色なし（白）
+			q.attr[4] = uv[i][0];
+			q.attr[5] = uv[i][1];
+			q.attr[6] = q.attr[7] = q.attr[8] = 0.0f;
+		}
+		add_screen_triangle(quad[0], quad[1], quad[2]);
+		add_screen_triangle(quad[2], quad[1], quad[3]);
+	}
+	void fill(KTEXID target, const float *color_rgba, KColorChannels channels) {
+		CSoftTex *tex = findTexture(target);
+		if (tex == nullptr) return;
+		flush();
+		uint32_t color32 = K__Color32FromRgba(color_rgba);
+		uint32_t mask = _ChannelMask(channels);
+		for (size_t i=0; i<tex->m_surf.color.size(); i++) {
+			uint32_t &dst = tex->m_surf.color[i];
+			dst = (color32 & mask) | (dst & ~mask);
+		}
+	}
+	#pragma endregion // texture
+
+	#pragma region shader
+	KShader * createShaderFromHLSL_impl(const char *code, const char *name) {
+		K__VIDEO_WRN(u8"ソフトウェア描画ではプログラマブルシェーダーは利用できません。'%s' はロードされませんでした", name);
+		return nullptr;
+	}
+	void deleteShader(KSHADERID s) {
+	}
+	KShader * findShader(KSHADERID sid) {
+		return nullptr;
+	}
+	void setDefaultShaderParams(const KShaderArg &arg) {
+	}
+	void beginShader() {
+	}
+	void endShader() {
+	}
+	void setShader(KSHADERID sid) {
+	}
+	void setShaderInt(const char *name, const int *values, int count) {
+	}
+	void setShaderFloat(const char *name, const float *values, int count) {
+	}
+	void setShaderTexture(const char *name, KTEXID texid) {
+	}
+	bool getShaderDesc(KSHADERID s, KShader::Desc *desc) {
+		return false;
+	}
+	#pragma endregion // shader
+
+	#pragma region render state
+	void setTextureAndColors() {
+		// 描画時に m_State から SDrawState を作るので、ここでは何もしない
+	}
+	void setColor(uint32_t color) {
+		m_State.diffuse = color;
+		m_CurrDrawState = -1;
+	}
+	void setSpecular(uint32_t specular) {
+		m_State.specular = specular;
+		m_CurrDrawState = -1;
+	}
+	void setTexture(KTEXID texture) {
+		m_State.texture = texture;
+		m_CurrDrawState = -1;
+	}
+	void setProjection(const float *matrix4x4) {
+		memcpy(m_State.projection, matrix4x4, sizeof(float) * 16);
+	}
+	void setTransform(const float *matrix4x4) {
+		memcpy(m_State.transform, matrix4x4, sizeof(float) * 16);
+	}
+	void pushRenderState() {
+		m_StateStack.push_back(m_State);
+	}
+	void popRenderState() {
+		if (m_StateStack.size() > 0) {
+			m_State = m_StateStack.back();
+			m_StateStack.pop_back();
+			m_CurrDrawState = -1;
+		}
+	}
+	void pushRenderTarget(KTEXID render_target) {
+		K__DX9_LOCK_GUARD(m_Mutex);
+		flush();
+		// 現在のターゲットを退避（描画先なしの状態は無効な ID で表す）
+		m_RenderTargetStack.push_back(m_Target ? m_TargetId : (KTEXID)-1);
+
+		// 無効なターゲットが指定された場合は、描画先なしにする
+		SSoftSurface *surf = &m_BackBuffer;
+		if (render_target) {
+			CSoftTex *texobj = findTexture(render_target);
+			if (texobj && texobj->isRenderTarget()) {
+				surf = &texobj->m_surf;
+			} else {
+				// render_target が非nullptrなのに、存在しない or レンダーテクスチャではない
+				K__VIDEO_ERR("E_VIDEO_INVALID_RENDER_TEXTURE");
+				surf = nullptr;
+			}
+		}
+		set_target(render_target, surf);
+	}
+	void popRenderTarget() {
+		K__DX9_LOCK_GUARD(m_Mutex);
+		flush();
+		// 退避しておいたターゲットを元に戻す
+		if (! m_RenderTargetStack.empty()) {
+			KTEXID id = m_RenderTargetStack.back();
+			m_RenderTargetStack.pop_back();
+			if (id == nullptr) {
+				set_target(nullptr, &m_BackBuffer);
+			} else {
+				CSoftTex *texobj = findTexture(id);
+				set_target(id, texobj ? &texobj->m_surf : nullptr);
+			}
+		} else {
+			K__VIDEO_ERR("E_EMPTY_REDNER_STACK");
+		}
+	}
+	void set_target(KTEXID id, SSoftSurface *surf) {
+		m_Target = surf;
+		m_TargetId = id;
+		// Direct3D9 の SetRenderTarget と同じく、ビューポートをターゲット全体にリセットする
+		m_State.vp_x = 0;
+		m_State.vp_y = 0;
+		m_State.vp_w = surf ? surf->w : 0;
+		m_State.vp_h = surf ? surf->h : 0;
+		m_CurrDrawState = -1;
+	}
+	void setViewport(int x, int y, int w, int h) {
+		m_State.vp_x = KMath::max(x, 0);
+		m_State.vp_y = KMath::max(y, 0);
+		m_State.vp_w = KMath::max(w, 0);
+		m_State.vp_h = KMath::max(h, 0);
+		m_CurrDrawState = -1;
+	}
+	void getViewport(int *x, int *y, int *w, int *h) {
+		if (x) *x = m_State.vp_x;
+		if (y) *y = m_State.vp_y;
+		if (w) *w = m_State.vp_w;
+		if (h) *h = m_State.vp_h;
+	}
+	void setColorWriteMask(KColorChannels channels) {
+		m_State.color_mask = channels;
+		m_CurrDrawState = -1;
+	}
+	void setDepthTestEnabled(bool value) {
+		m_State.depth_test = value;
+		m_CurrDrawState = -1;
+	}
+	void setStencilEnabled(bool value) {
+		// Direct3D9 版と同じく、ステンシル有効中は深度バッファに書き込まない
+		m_State.stencil = value;
+		m_CurrDrawState = -1;
+	}
+	void setStencilFunc(KVideo::StencilFunc func, int val, KVideo::StencilOp pass_op) {
+		m_State.stencil_func = func;
+		m_State.stencil_ref = val;
+		m_State.stencil_op = pass_op;
+		m_CurrDrawState = -1;
+	}
+	#pragma endregion // render state
+
+	#pragma region device
+	void resetDevice_lost() {
+	}
+	bool canFullscreen(int w, int h) {
+		return false;
+	}
+	void resetDevice_reset(void *new_pp) {
+	}
+	bool resetDevice(int w, int h, int fullscreen) {
+		K::print("ResetDevice %dx%d", w, h);
+		flush();
+		if (w <= 0) w = m_BackBuffer.w;
+		if (h <= 0) h = m_BackBuffer.h;
+		if (w != m_BackBuffer.w || h != m_BackBuffer.h) {
+			m_BackBuffer.resize(w, h, true);
+			if (m_Target == &m_BackBuffer) {
+				set_target(nullptr, &m_BackBuffer);
+			}
+		}
+		return true;
+	}
+	bool shouldReset() {
+		return false;
+	}
+	bool beginScene() {
+		setupDeviceStates();
+		return true;
+	}
+	bool endScene() {
+		flush();
+		return true;
+	}
+	void clearColor(const float *color_rgba) {
+		flush();
+		uint32_t color32 = color_rgba ? K__Color32FromRgba(color_rgba) : 0;
+		clear_viewport(&SSoftSurface::color, color32);
+	}
+	void clearDepth(float z) {
+		flush();
+		clear_viewport(&SSoftSurface::depth, z);
+	}
+	void clearStencil(int s) {
+		flush();
+		clear_viewport(&SSoftSurface::stencil, (uint8_t)s);
+	}
+	template <typename T> void clear_viewport(std::vector<T> SSoftSurface::*buffer, T value) {
+		// Direct3D9 の Clear と同じく、ビューポートの範囲だけを消去する
+		if (m_Target == nullptr) return;
+		std::vector<T> &buf = m_Target->*buffer;
+		if (buf.empty()) return;
+		int x0 = KMath::max(m_State.vp_x, 0);
+		int y0 = KMath::max(m_State.vp_y, 0);
+		int x1 = KMath::min(m_State.vp_x + m_State.vp_w, m_Target->w);
+		int y1 = KMath::min(m_State.vp_y + m_State.vp_h, m_Target->h);
+		for (int y=y0; y<y1; y++) {
+			std::fill(buf.begin() + m_Target->w * y + x0, buf.begin() + m_Target->w * y + x1, value);
+		}
+	}
+	#pragma endregion // device
+
+	#pragma region draw
+	void drawUserPtrV(const KVertex *vertices, int count, KPrimitive primitive) {
+		K__ASSERT(count >= 0);
+		m_DrawCalls++;
+		if (count > 0) {
+			m_StreamStats.add(sizeof(KVertex) * count, false);
+			draw_primitives(vertices, count, nullptr, count, primitive);
+		}
+	}
+	void drawIndexedUserPtrV(const KVertex *vertices, int vertex_count, const int *indices, int index_count, KPrimitive primitive) {
+		K__ASSERT(index_count >= 0);
+		m_DrawCalls++;
+		if (vertex_count > 0 && index_count > 0) {
+			m_StreamStats.add(sizeof(KVertex) * vertex_count + sizeof(int) * index_count, false);
+			draw_primitives(vertices, vertex_count, indices, index_count, primitive);
+		}
+	}
+	int writeStreamVertices(const KVertex *vertices, int count) {
+		if (vertices == nullptr || count <= 0) return -1;
+		int cap = m_StreamVRing.reserve(count, K__STREAM_MIN_VERTICES);
+		if (cap > 0) {
+			m_StreamVRing = SStreamRing();
+			m_StreamVRing.capacity = cap;
+			m_StreamVerts.resize(cap);
+		}
+		bool discard;
+		int start = m_StreamVRing.alloc(count, &discard);
+		memcpy(&m_StreamVerts[start], vertices, sizeof(KVertex) * count);
+		m_StreamStats.add(sizeof(KVertex) * count, discard);
+		return start;
+	}
+	int writeStreamVertices(const KVertexCompact *vertices, int count) {
+		if (vertices == nullptr || count <= 0) return -1;
+		int cap = m_StreamCRing.reserve(count, K__STREAM_MIN_VERTICES);
+		if (cap > 0) {
+			m_StreamCRing = SStreamRing();
+			m_StreamCRing.capacity = cap;
+			m_StreamCompactVerts.resize(cap);
+		}
+		bool discard;
+		int start = m_StreamCRing.alloc(count, &discard);
+		memcpy(&m_StreamCompactVerts[start], vertices, sizeof(KVertexCompact) * count);
+		m_StreamStats.add(sizeof(KVertexCompact) * count, discard);
+		return start;
+	}
+	int writeStreamIndices(const int *indices, int count) {
+		if (indices == nullptr || count <= 0) return -1;
+		int cap = m_StreamIRing.reserve(count, K__STREAM_MIN_INDICES);
+		if (cap > 0) {
+			m_StreamIRing = SStreamRing();
+			m_StreamIRing.capacity = cap;
+			m_StreamIndices.resize(cap);
+		}
+		bool discard;
+		int start = m_StreamIRing.alloc(count, &discard);
+		memcpy(&m_StreamIndices[start], indices, sizeof(int) * count);
+		m_StreamStats.add(sizeof(int) * count, discard);
+		return start;
+	}
+	void drawStreamV(int start, int count, KPrimitive primitive, KVertexLayout layout) {
+		K__ASSERT(count >= 0);
+		const bool compact = (layout == KVertexLayout_COMPACT);
+		K__ASSERT(0 <= start && start + count <= (compact ? m_StreamCRing : m_StreamVRing).capacity);
+		m_DrawCalls++;
+		if (count > 0) {
+			if (compact) {
+				draw_primitives(&m_StreamCompactVerts[start], count, nullptr, count, primitive);
+			} else {
+				draw_primitives(&m_StreamVerts[start], count, nullptr, count, primitive);
+			}
+		}
+	}
+	void drawIndexedStreamV(int base_vertex, int vertex_count, int start_index, int index_count, KPrimitive primitive, KVertexLayout layout) {
+		K__ASSERT(index_count >= 0);
+		const bool compact = (layout == KVertexLayout_COMPACT);
+		K__ASSERT(0 <= base_vertex && base_vertex + vertex_count <= (compact ? m_StreamCRing : m_StreamVRing).capacity);
+		K__ASSERT(0 <= start_index && start_index + index_count <= m_StreamIRing.capacity);
+		m_DrawCalls++;
+		if (vertex_count > 0 && index_count > 0) {
+			if (compact) {
+				draw_primitives(&m_StreamCompactVerts[base_vertex], vertex_count, &m_StreamIndices[start_index], index_count, primitive);
+			} else {
+				draw_primitives(&m_StreamVerts[base_vertex], vertex_count, &m_StreamIndices[start_index], index_count, primitive);
+			}
+		}
+	}
+	/// 頂点の色とテクスチャ座標を、補間する頂点属性にする
+	static void load_attrs(const KVertex &src, SVert &dst) {
+		dst.attr[0] = src.dif32.r / 255.0f;
+		dst.attr[1] = src.dif32.g / 255.0f;
+		dst.attr[2] = src.dif32.b / 255.0f;
+		dst.attr[3] = src.dif32.a / 255.0f;
+		dst.attr[4] = src.tex.x;
+		dst.attr[5] = src.tex.y;
+		dst.attr[6] = src.spe32.r / 255.0f;
+		dst.attr[7] = src.spe32.g / 255.0f;
+		dst.attr[8] = src.spe32.b / 255.0f;
+	}
+	static void load_attrs(const KVertexCompact &src, SVert &dst) {
+		dst.attr[0] = src.dif32.r / 255.0f;
+		dst.attr[1] = src.dif32.g / 255.0f;
+		dst.attr[2] = src.dif32.b / 255.0f;
+		dst.attr[3] = src.dif32.a / 255.0f;
+		dst.attr[4] = src.u / 65535.0f;
+		dst.attr[5] = src.v / 65535.0f;
+		dst.attr[6] = 0;
+		dst.attr[7] = 0;
+		dst.attr[8] = 0;
+	}
+	template <typename VERTEX> void draw_primitives(const VERTEX *vertices, int vertex_count, const int *indices, int count, KPrimitive primitive) {
+		if (m_Target == nullptr) return;
+
+		// 頂点をクリップ空間に変換する。
+		// Direct3D9 と同じく行ベクトルなので clip = [x y z 1] * transform * projection
+		float m[16];
+		for (int r=0; r<4; r++) {
+			for (int c=0; c<4; c++) {
+				m[r*4+c] =
+					m_State.transform[r*4+0] * m_State.projection[0*4+c] +
+					m_State.transform[r*4+1] * m_State.projection[1*4+c] +
+					m_State.transform[r*4+2] * m_State.projection[2*4+c] +
+					m_State.transform[r*4+3] * m_State.projection[3*4+c];
+			}
+		}
+		m_TmpVerts.resize(vertex_count);
+		for (int i=0; i<vertex_count; i++) {
+			const VERTEX &src = vertices[i];
+			SVert &dst = m_TmpVerts[i];
+			for (int c=0; c<4; c++) {
+				dst.pos[c] = src.pos.x * m[0*4+c] + src.pos.y * m[1*4+c] + src.pos.z * m[2*4+c] + m[3*4+c];
+			}
+			load_attrs(src, dst);
+		}
+
+		// プリミティブを組み立てる
+		#define VERT(k)  m_TmpVerts[indices ? indices[k] : (k)]
+		if (indices) {
+			for (int k=0; k<count; k++) {
+				if (indices[k] < 0 || vertex_count <= indices[k]) {
+					K__VIDEO_ERR("E_VIDEO_INVALID_INDEX: %d", indices[k]);
+					return;
+				}
+			}
+		}
+		switch (primitive) {
+		case KPrimitive_POINTS:
+			for (int k=0; k<count; k++) {
+				add_point(VERT(k));
+			}
+			break;
+		case KPrimitive_LINES:
+			for (int k=0; k+1<count; k+=2) {
+				add_line(VERT(k), VERT(k+1));
+			}
+			break;
+		case KPrimitive_LINE_STRIP:
+			for (int k=0; k+1<count; k++) {
+				add_line(VERT(k), VERT(k+1));
+			}
+			break;
+		case KPrimitive_TRIANGLES:
+			for (int k=0; k+2<count; k+=3) {
+				add_triangle(VERT(k), VERT(k+1), VERT(k+2));
+			}
+			break;
+		case KPrimitive_TRIANGLE_STRIP:
+			for (int k=0; k+2<count; k++) {
+				if (k % 2 == 0) {
+					add_triangle(VERT(k), VERT(k+1), VERT(k+2));
+				} else {
+					add_triangle(VERT(k+1), VERT(k), VERT(k+2));
+				}
+			}
+			break;
+		case KPrimitive_TRIANGLE_FAN:
+			for (int k=1; k+1<count; k++) {
+				add_triangle(VERT(0), VERT(k), VERT(k+1));
+			}
+			break;
+		}
+		#undef VERT
+	}
+	#pragma endregion // draw
+
+	KImage getBackbufferImage() {
+		flush();
+		if (m_Target == nullptr) return KImage();
+		KImage img = KImage::createFromPixels(m_Target->w, m_Target->h, KColorFormat_RGBA32, nullptr);
+		KBmp bmp;
+		img.lock(&bmp);
+		_BmpWrite(&bmp, m_Target->color.data(), m_Target->w * 4, m_Target->w, m_Target->h, -1);
+		img.unlock();
+		return img;
+	}
+	const SSoftSurface * getRenderTarget() {
+		flush();
+		return m_Target;
+	}
+	void command(const char *cmd) {
+		if (K__STREQ(cmd, "wireframe on") || K__STREQ(cmd, "wireframe off")) {
+			return; // ワイヤーフレーム表示には対応しない
+		}
+		if (K__STREQ(cmd, "cull cw")) {
+			m_State.cull = 1;
+			m_CurrDrawState = -1;
+			return;
+		}
+		if (K__STREQ(cmd, "cull ccw")) {
+			m_State.cull = 2;
+			m_CurrDrawState = -1;
+			return;
+		}
+		if (K__STREQ(cmd, "cull none")) {
+			m_State.cull = 0;
+			m_CurrDrawState = -1;
+			return;
+		}
+		K__VIDEO_ERR("Unknown video command: %s", cmd);
+	}
+	void getParameter(KVideo::Param param, void *data) {
+		if (data == nullptr) return;
+		void **ppData = (void **)data;
+		int *pIntData = (int*)data;
+
+		switch (param) {
+		case KVideo::PARAM_ADAPTERNAME:
+			strcpy((char*)data, "Software");
+			return;
+
+		case KVideo::PARAM_HAS_SHADER:
+		case KVideo::PARAM_HAS_HLSL:
+		case KVideo::PARAM_HAS_GLSL:
+		case KVideo::PARAM_IS_FULLSCREEN:
+		case KVideo::PARAM_DEVICELOST:
+			pIntData[0] = 0;
+			return;
+
+		case KVideo::PARAM_D3DDEV9:
+		case KVideo::PARAM_HWND:
+			ppData[0] = nullptr;
+			return;
+
+		case KVideo::PARAM_VS_VER:
+		case KVideo::PARAM_PS_VER:
+			pIntData[0] = 0;
+			pIntData[1] = 0;
+			return;
+
+		case KVideo::PARAM_MAXTEXSIZE:
+			pIntData[0] = g_video_limit.limit_texture_size > 0 ? g_video_limit.limit_texture_size : 8192;
+			pIntData[1] = g_video_limit.limit_texture_size > 0 ? g_video_limit.limit_texture_size : 8192;
+			return;
+
+		case KVideo::PARAM_DRAWCALLS:
+			pIntData[0] = m_DrawCalls;
+			m_DrawCalls = 0;
+			return;
+
+		case KVideo::PARAM_STREAM_STATS:
+			pIntData[0] = m_StreamStats.bytes;
+			pIntData[1] = m_StreamStats.locks;
+			pIntData[2] = m_StreamStats.discards;
+			m_StreamStats.clear();
+			return;
+
+		case KVideo::PARAM_MAX_TEXTURE_REQUIRE:
+			pIntData[0] = g_video_limit.max_texture_size_require;
+			return;
+
+		case KVideo::PARAM_MAX_TEXTURE_SUPPORT:
+			pIntData[0] = g_video_limit.limit_texture_size;
+			return;
+
+		case KVideo::PARAM_USE_SQUARE_TEXTURE_ONLY:
+			pIntData[0] = g_video_limit.use_square_texture_only;
+			return;
+
+		case KVideo::PARAM_DISABLE_PIXEL_SHADER:
+			pIntData[0] = g_video_limit.disable_pixel_shader;
+			return;
+
+		case KVideo::PARAM_RENDER_THREADS:
+			pIntData[0] = m_Parallel.getNumThreads();
+			return;
+		}
+	}
+	void setParameter(KVideo::Param param, intptr_t data) {
+		switch (param) {
+		case KVideo::PARAM_MAX_TEXTURE_REQUIRE:
+			g_video_limit.max_texture_size_require = data;
+			break;
+		case KVideo::PARAM_MAX_TEXTURE_SUPPORT:
+			g_video_limit.limit_texture_size = data;
+			break;
+		case KVideo::PARAM_USE_SQUARE_TEXTURE_ONLY:
+			g_video_limit.use_square_texture_only = (data!=0);
+			break;
+		case KVideo::PARAM_DISABLE_PIXEL_SHADER:
+			g_video_limit.disable_pixel_shader = (data!=0);
+			break;
+		case KVideo::PARAM_RENDER_THREADS:
+			m_Parallel.setNumThreads((int)data);
+			break;
+		}
+	}
+
+	#pragma region rasterize
+	/// 溜めておいたプリミティブをすべて現在のレンダーターゲットに描画する
+	void flush() {
+		if (m_Prims.empty()) return;
+		if (m_Target) {
+			// タイルごとに、そのタイルにかかるプリミティブを追加順に並べる
+			m_NumTilesX = (m_Target->w + TILE_SIZE - 1) / TILE_SIZE;
+			int num_tiles_y = (m_Target->h + TILE_SIZE - 1) / TILE_SIZE;
+			int num_tiles = m_NumTilesX * num_tiles_y;
+			if ((int)m_Bins.size() < num_tiles) {
+				m_Bins.resize(num_tiles);
+			}
+			for (int i=0; i<(int)m_Prims.size(); i++) {
+				const SPrim &prim = m_Prims[i];
+				int tx0 = prim.x0 / TILE_SIZE;
+				int ty0 = prim.y0 / TILE_SIZE;
+				int tx1 = (prim.x1 - 1) / TILE_SIZE;
+				int ty1 = (prim.y1 - 1) / TILE_SIZE;
+				for (int ty=ty0; ty<=ty1; ty++) {
+					for (int tx=tx0; tx<=tx1; tx++) {
+						m_Bins[m_NumTilesX * ty + tx].push_back(i);
+					}
+				}
+			}
+			m_Parallel.run(num_tiles, 1, raster_tiles_cb, this);
+			for (int i=0; i<num_tiles; i++) {
+				m_Bins[i].clear();
+			}
+		}
+		m_Prims.clear();
+		m_DrawStates.clear();
+		m_CurrDrawState = -1;
+	}
+	static void raster_tiles_cb(void *data, int begin, int end, int worker) {
+		CSoftVideo *self = (CSoftVideo *)data;
+		for (int i=begin; i<end; i++) {
+			self->raster_tile(i);
+		}
+	}
+	void raster_tile(int tile) {
+		const int tx0 = (tile % m_NumTilesX) * TILE_SIZE;
+		const int ty0 = (tile / m_NumTilesX) * TILE_SIZE;
+		const std::vector<int> &bin = m_Bins[tile];
+		for (size_t i=0; i<bin.size(); i++) {
+			const SPrim &prim = m_Prims[bin[i]];
+			const SDrawState &ds = m_DrawStates[prim.state];
+			int x0 = KMath::max(prim.x0, tx0);
+			int y0 = KMath::max(prim.y0, ty0);
+			int x1 = KMath::min(prim.x1, tx0 + TILE_SIZE);
+			int y1 = KMath::min(prim.y1, ty0 + TILE_SIZE);
+			switch (prim.num_verts) {
+			case 1: raster_point(prim, ds, x0, y0, x1, y1); break;
+			case 2: raster_line(prim, ds, x0, y0, x1, y1); break;
+			case 3: raster_triangle(prim, ds, x0, y0, x1, y1); break;
+			}
+		}
+	}
+	void raster_triangle(const SPrim &prim, const SDrawState &ds, int rx0, int ry0, int rx1, int ry1) {
+		// 固定小数点座標。辺関数を整数で計算するので、隣り合う三角形の共有辺で隙間や重なりができない
+		int64_t X[3], Y[3];
+		for (int i=0; i<3; i++) {
+			X[i] = (int64_t)floorf(prim.v[i].pos[0] * (1 << SUBPIXEL_BITS) + 0.5f);
+			Y[i] = (int64_t)floorf(prim.v[i].pos[1] * (1 << SUBPIXEL_BITS) + 0.5f);
+		}
+		int64_t area = (X[1] - X[0]) * (Y[2] - Y[0]) - (X[2] - X[0]) * (Y[1] - Y[0]);
+		if (area == 0) return;
+		// area > 0 は画面上で時計回り（Y軸下向き）
+		if (ds.cull == 1 && area > 0) return;
+		if (ds.cull == 2 && area < 0) return;
+		const SVert *v[3] = {&prim.v[0], &prim.v[1], &prim.v[2]};
+		if (area < 0) {
+			std::swap(v[1], v[2]);
+			std::swap(X[1], X[2]);
+			std::swap(Y[1], Y[2]);
+			area = -area;
+		}
+
+		// 辺 k は頂点 k の対辺。内側で正になる
+		int64_t A[3], B[3], E_row[3];
+		const int64_t px0 = (int64_t)rx0 * (1 << SUBPIXEL_BITS);
+		const int64_t py0 = (int64_t)ry0 * (1 << SUBPIXEL_BITS);
+		for (int k=0; k<3; k++) {
+			int a = (k + 1) % 3;
+			int b = (k + 2) % 3;
+			int64_t dx = X[b] - X[a];
+			int64_t dy = Y[b] - Y[a];
+			A[k] = -dy;
+			B[k] = dx;
+			// トップレフトルール：上辺と左辺の上にあるピクセルだけを含める
+			bool top_left = (dy < 0) || (dy == 0 && dx > 0);
+			E_row[k] = A[k] * (px0 - X[a]) + B[k] * (py0 - Y[a]) + (top_left ? 0 : -1);
+		}
+		const int64_t one = 1 << SUBPIXEL_BITS;
+		const int64_t step_x[3] = {A[0] * one, A[1] * one, A[2] * one};
+		const int64_t step_y[3] = {B[0] * one, B[1] * one, B[2] * one};
+
+		// 使う属性だけを補間する。テクスチャがなければ色だけ、頂点スペキュラが 0 ならスペキュラを省く
+		int num_attrs = 4;
+		if (ds.texture) {
+			num_attrs = 6;
+			for (int i=0; i<3; i++) {
+				if (v[i]->attr[6] != 0 || v[i]->attr[7] != 0 || v[i]->attr[8] != 0) num_attrs = 9;
+			}
+		}
+		// 属性を 1/w 倍しておき、ピクセルごとに補間した 1/w で割る（パースペクティブ補正）
+		float attr_w[3][NUM_ATTRS];
+		const bool perspective = !(v[0]->pos[3] == v[1]->pos[3] && v[0]->pos[3] == v[2]->pos[3]);
+		for (int i=0; i<3; i++) {
+			float rhw = perspective ? v[i]->pos[3] : 1.0f;
+			for (int j=0; j<NUM_ATTRS; j++) {
+				attr_w[i][j] = (j < num_attrs) ? v[i]->attr[j] * rhw : 0.0f;
+			}
+		}
+		const float inv_area = 1.0f / (float)area;
+		SSoftSurface *rt = m_Target;
+		float attr[NUM_ATTRS] = {0};
+		for (int y=ry0; y<ry1; y++) {
+			int64_t E0 = E_row[0];
+			int64_t E1 = E_row[1];
+			int64_t E2 = E_row[2];
+			for (int x=rx0; x<rx1; x++) {
+				if ((E0 | E1 | E2) >= 0) {
+					float b0 = (float)E0 * inv_area;
+					float b1 = (float)E1 * inv_area;
+					float b2 = 1.0f - b0 - b1;
+					float z = b0 * v[0]->pos[2] + b1 * v[1]->pos[2] + b2 * v[2]->pos[2];
+					float inv_w = 1.0f;
+					if (perspective) {
+						inv_w = 1.0f / (b0 * v[0]->pos[3] + b1 * v[1]->pos[3] + b2 * v[2]->pos[3]);
+					}
+					for (int j=0; j<num_attrs; j++) {
+						attr[j] = (b0 * attr_w[0][j] + b1 * attr_w[1][j] + b2 * attr_w[2][j]) * inv_w;
+					}
+					shade_pixel(ds, rt, rt->w * y + x, z, attr);
+				}
+				E0 += step_x[0];
+				E1 += step_x[1];
+				E2 += step_x[2];
+			}
+			E_row[0] += step_y[0];
+			E_row[1] += step_y[1];
+			E_row[2] += step_y[2];
+		}
+	}
+	void raster_line(const SPrim &prim, const SDrawState &ds, int rx0, int ry0, int rx1, int ry1) {
+		// 始点を含み終点を含まない 1 ピクセル幅の線
+		const SVert &a = prim.v[0];
+		const SVert &b = prim.v[1];
+		float dx = b.pos[0] - a.pos[0];
+		float dy = b.pos[1] - a.pos[1];
+		int n = (int)ceilf(KMath::max(fabsf(dx), fabsf(dy)));
+		SSoftSurface *rt = m_Target;
+		float attr[NUM_ATTRS];
+		for (int i=0; i<n; i++) {
+			float t = (float)i / n;
+			int x = (int)floorf(a.pos[0] + dx * t + 0.5f);
+			int y = (int)floorf(a.pos[1] + dy * t + 0.5f);
+			if (x < rx0 || rx1 <= x || y < ry0 || ry1 <= y) continue;
+			for (int j=0; j<NUM_ATTRS; j++) {
+				attr[j] = a.attr[j] + (b.attr[j] - a.attr[j]) * t;
+			}
+			float z = a.pos[2] + (b.pos[2] - a.pos[2]) * t;
+			shade_pixel(ds, rt, rt->w * y + x, z, attr);
+		}
+	}
+	void raster_point(const SPrim &prim, const SDrawState &ds, int rx0, int ry0, int rx1, int ry1) {
+		const SVert &a = prim.v[0];
+		int x = (int)floorf(a.pos[0] + 0.5f);
+		int y = (int)floorf(a.pos[1] + 0.5f);
+		if (x < rx0 || rx1 <= x || y < ry0 || ry1 <= y) return;
+		shade_pixel(ds, m_Target, m_Target->w * y + x, a.pos[2], a.attr);
+	}
+	void shade_pixel(const SDrawState &ds, SSoftSurface *rt, int idx, float z, const float *attr) {
+		// ステンシルテスト
+		bool use_stencil = ds.stencil && !rt->stencil.empty();
+		if (use_stencil) {
+			if (!_StencilTest(ds.stencil_func, ds.stencil_ref, rt->stencil[idx])) {
+				return; // D3DRS_STENCILFAIL = KEEP
+			}
+		}
+		// 深度テスト (D3DCMP_LESSEQUAL)
+		if (ds.depth_test && !rt->depth.empty()) {
+			if (z > rt->depth[idx]) {
+				return; // D3DRS_STENCILZFAIL = KEEP
+			}
+			if (ds.depth_write) {
+				rt->depth[idx] = z;
+			}
+		}
+		if (use_stencil) {
+			uint8_t &s = rt->stencil[idx];
+			switch (ds.stencil_op) {
+			case KVideo::STENCILOP_KEEP:    break;
+			case KVideo::STENCILOP_REPLACE: s = (uint8_t)ds.stencil_ref; break;
+			case KVideo::STENCILOP_INC:     if (s < 255) s++; break;
+			case KVideo::STENCILOP_DEC:     if (s > 0) s--; break;
+			}
+		}
+		if (ds.color_mask == 0) return;
+
+		// 色の合成（Direct3D9 版の setTextureAndColors と同じ式）
+		float c[4];
+		if (ds.texture) {
+			float tex[4];
+			_SampleTexture(ds.texture, attr[4], attr[5], ds.linear, ds.wrap, tex);
+			for (int i=0; i<4; i++) {
+				c[i] = tex[i] * attr[i] * ds.diffuse[i]; // テクスチャ x 頂点色 x 定数色
+			}
+			for (int i=0; i<3; i++) {
+				c[i] = K__Clamp01(c[i] + c[3] * attr[6+i]);     // D3DTOP_MODULATEALPHA_ADDCOLOR (頂点スペキュラ)
+				c[i] = K__Clamp01(c[i] + c[3] * ds.specular[i]); // D3DTOP_MODULATEALPHA_ADDCOLOR (定数スペキュラ)
+			}
+		} else {
+			for (int i=0; i<4; i++) {
+				c[i] = ds.diffuse[i] * attr[i]; // 定数色 x 頂点色
+			}
+			for (int i=0; i<3; i++) {
+				c[i] = K__Clamp01(c[i] + ds.specular[i]); // D3DTOP_ADD (定数スペキュラ)
+			}
+		}
+		const int sr = (int)(K__Clamp01(c[0]) * 255.0f + 0.5f);
+		const int sg = (int)(K__Clamp01(c[1]) * 255.0f + 0.5f);
+		const int sb = (int)(K__Clamp01(c[2]) * 255.0f + 0.5f);
+		const int sa = (int)(K__Clamp01(c[3]) * 255.0f + 0.5f);
+
+		// ブレンド
+		uint32_t &dst = rt->color[idx];
+		const int da = (dst >> 24) & 0xFF;
+		const int dr = (dst >> 16) & 0xFF;
+		const int dg = (dst >>  8) & 0xFF;
+		const int db = (dst >>  0) & 0xFF;
+		uint32_t out =
+			(_BlendChannel(ds.blend, sa, da, sa) << 24) |
+			(_BlendChannel(ds.blend, sr, dr, sa) << 16) |
+			(_BlendChannel(ds.blend, sg, dg, sa) <<  8) |
+			(_BlendChannel(ds.blend, sb, db, sa) <<  0);
+		dst = (out & ds.color_mask) | (dst & ~ds.color_mask);
+	}
+	static bool _StencilTest(KVideo::StencilFunc func, int ref, int val) {
+		switch (func) {
+		case KVideo::STENCILFUNC_NEVER:        return false;
+		case KVideo::STENCILFUNC_LESS:         return ref <  val;
+		case KVideo::STENCILFUNC_EQUAL:        return ref == val;
+		case KVideo::STENCILFUNC_LESSEQUAL:    return ref <= val;
+		case KVideo::STENCILFUNC_GREATER:      return ref >  val;
+		case KVideo::STENCILFUNC_NOTEQUAL:     return ref != val;
+		case KVideo::STENCILFUNC_GREATEREQUAL: return ref >= val;
+		case KVideo::STENCILFUNC_ALWAYS:       return true;
+		}
+		return true;
+	}
+	static inline int _Mul255(int a, int b) {
+		return (a * b + 127) / 255;
+	}
+	/// DX9_setBlend で設定するブレンド式を１チャンネル分計算する。
+	/// s, d はソースとターゲットのチャンネル値、sa はソースのアルファ (0..255)。
+	/// アルファチャンネルの計算では、D3DBLEND_SRCCOLOR などの色係数がアルファ値として扱われるので、同じ式でよい
+	static inline uint32_t _BlendChannel(KBlend blend, int s, int d, int sa) {
+		int val;
+		switch (blend) {
+		case KBlend_ONE:    val = s; break;
+		case KBlend_ADD:    val = _Mul255(s, sa) + d; break;
+		case KBlend_SUB:    val = _Mul255(d, 255 - s) - _Mul255(s, sa); break;
+		case KBlend_MUL:    val = _Mul255(d, s); break;
+		case KBlend_ALPHA:  val = _Mul255(s, sa) + _Mul255(d, 255 - sa); break;
+		case KBlend_SCREEN: val = _Mul255(s, 255 - d) + d; break;
+		case KBlend_MAX:    val = (s > d) ? s : d; break;
+		default:            val = s; break;
+		}
+		return (uint32_t)(val < 0 ? 0 : (val > 255 ? 255 : val));
+	}
+	static inline uint32_t _Texel(const SSoftSurface *tex, int x, int y, bool wrap) {
+		if (wrap) {
+			x %= tex->w; if (x < 0) x += tex->w;
+			y %= tex->h; if (y < 0) y += tex->h;
+		} else {
+			x = (x < 0) ? 0 : (x >= tex->w ? tex->w - 1 : x);
+			y = (y < 0) ? 0 : (y >= tex->h ? tex->h - 1 : y);
+		}
+		return tex->color[tex->w * y + x];
+	}
+	static void _SampleTexture(const SSoftSurface *tex, float u, float v, bool linear, bool wrap, float *out_rgba) {
+		// テクセル中心は (i + 0.5) / w にある
+		const float lim = (float)MAX_SCREEN_COORD;
+		float fx = u * tex->w;
+		float fy = v * tex->h;
+		fx = (fx > -lim) ? (fx < lim ? fx : lim) : -lim; // NaN も -lim になる
+		fy = (fy > -lim) ? (fy < lim ? fy : lim) : -lim;
+		if (linear) {
+			fx -= 0.5f;
+			fy -= 0.5f;
+			float x0 = floorf(fx);
+			float y0 = floorf(fy);
+			float tx = fx - x0;
+			float ty = fy - y0;
+			int ix = (int)x0;
+			int iy = (int)y0;
+			uint32_t t00 = _Texel(tex, ix,   iy,   wrap);
+			uint32_t t10 = _Texel(tex, ix+1, iy,   wrap);
+			uint32_t t01 = _Texel(tex, ix,   iy+1, wrap);
+			uint32_t t11 = _Texel(tex, ix+1, iy+1, wrap);
+			static const int shift[4] = {16, 8, 0, 24}; // R, G, B, A
+			for (int i=0; i<4; i++) {
+				float c00 = (float)((t00 >> shift[i]) & 0xFF);
+				float c10 = (float)((t10 >> shift[i]) & 0xFF);
+				float c01 = (float)((t01 >> shift[i]) & 0xFF);
+				float c11 = (float)((t11 >> shift[i]) & 0xFF);
+				float top = c00 + (c10 - c00) * tx;
+				float btm = c01 + (c11 - c01) * tx;
+				out_rgba[i] = (top + (btm - top) * ty) / 255.0f;
+			}
+		} else {
+			uint32_t t = _Texel(tex, (int)floorf(fx), (int)floorf(fy), wrap);
+			out_rgba[0] = ((t >> 16) & 0xFF) / 255.0f;
+			out_rgba[1] = ((t >>  8) & 0xFF) / 255.0f;
+			out_rgba[2] = ((t >>  0) & 0xFF) / 255.0f;
+			out_rgba[3] = ((t >> 24) & 0xFF) / 255.0f;
+		}
+	}
+	static uint32_t _ChannelMask(KColorChannels channels) {
+		uint32_t mask = 0;
+		if (channels & KColorChannel_A) mask |= 0xFF000000;
+		if (channels & KColorChannel_R) mask |= 0x00FF0000;
+		if (channels & KColorChannel_G) mask |= 0x0000FF00;
+		if (channels & KColorChannel_B) mask |= 0x000000FF;
+		return mask;
+	}
+
+	/// 現在のレンダーステートに対応する SDrawState のインデックス
+	int get_draw_state() {
+		if (m_CurrDrawState >= 0) {
+			return m_CurrDrawState;
+		}
+		SDrawState ds;
+		CSoftTex *tex = m_State.texture ? findTexture(m_State.texture) : nullptr;
+		ds.texture = (tex && tex->m_surf.w > 0) ? &tex->m_surf : nullptr;
+		KColor dif = KColor32::fromARGB32(m_State.diffuse).toColor();
+		KColor spe = KColor32::fromARGB32(m_State.specular).toColor();
+		ds.diffuse[0] = dif.r;
+		ds.diffuse[1] = dif.g;
+		ds.diffuse[2] = dif.b;
+		ds.diffuse[3] = dif.a;
+		ds.specular[0] = spe.r;
+		ds.specular[1] = spe.g;
+		ds.specular[2] = spe.b;
+		ds.blend = m_State.blend;
+		ds.linear = m_State.filter == KFilter_LINEAR;
+		ds.wrap = m_State.wrap;
+		ds.color_mask = _ChannelMask(m_State.color_mask);
+		ds.depth_test = m_State.depth_test;
+		ds.depth_write = !m_State.stencil;
+		ds.stencil = m_State.stencil;
+		ds.stencil_func = m_State.stencil_func;
+		ds.stencil_op = m_State.stencil_op;
+		ds.stencil_ref = m_State.stencil_ref & 0xFF;
+		ds.cull = m_State.cull;
+		ds.clip_x0 = KMath::max(m_State.vp_x, 0);
+		ds.clip_y0 = KMath::max(m_State.vp_y, 0);
+		ds.clip_x1 = m_Target ? KMath::min(m_State.vp_x + m_State.vp_w, m_Target->w) : 0;
+		ds.clip_y1 = m_Target ? KMath::min(m_State.vp_y + m_State.vp_h, m_Target->h) : 0;
+		m_DrawStates.push_back(ds);
+		m_CurrDrawState = (int)m_DrawStates.size() - 1;
+		return m_CurrDrawState;
+	}
+	static float _ClipDistance(const SVert &v, int plane) {
+		const float *p = v.pos;
+		switch (plane) {
+		case 0: return p[2];                        // z >= 0
+		case 1: return p[3] - p[2];                 // z <= w
+		case 2: return p[3] - MIN_W;                // w > 0
+		case 3: return GUARD_BAND * p[3] - p[0];    // x <= GB * w
+		case 4: return GUARD_BAND * p[3] + p[0];    // x >= -GB * w
+		case 5: return GUARD_BAND * p[3] - p[1];    // y <= GB * w
+		case 6: return GUARD_BAND * p[3] + p[1];    // y >= -GB * w
+		}
+		return 0;
+	}
+	static const int NUM_CLIP_PLANES = 7;
+	static int _ClipOutcode(const SVert &v) {
+		int code = 0;
+		for (int i=0; i<NUM_CLIP_PLANES; i++) {
+			if (_ClipDistance(v, i) < 0) code |= 1 << i;
+		}
+		return code;
+	}
+	static SVert _Lerp(const SVert &a, const SVert &b, float t) {
+		SVert r;
+		for (int i=0; i<4; i++) r.pos[i] = a.pos[i] + (b.pos[i] - a.pos[i]) * t;
+		for (int i=0; i<NUM_ATTRS; i++) r.attr[i] = a.attr[i] + (b.attr[i] - a.attr[i]) * t;
+		return r;
+	}
+	/// クリップ空間からスクリーン座標に変換する
+	SVert to_screen(const SVert &v) const {
+		SVert r = v;
+		float rhw = 1.0f / v.pos[3];
+		r.pos[0] = m_State.vp_x + (v.pos[0] * rhw + 1.0f) * 0.5f * m_State.vp_w;
+		r.pos[1] = m_State.vp_y + (1.0f - v.pos[1] * rhw) * 0.5f * m_State.vp_h;
+		r.pos[2] = v.pos[2] * rhw;
+		r.pos[3] = rhw;
+		return r;
+	}
+	void add_triangle(const SVert &a, const SVert &b, const SVert &c) {
+		int code_a = _ClipOutcode(a);
+		int code_b = _ClipOutcode(b);
+		int code_c = _ClipOutcode(c);
+		if (code_a & code_b & code_c) {
+			return; // 全ての頂点が同じ面の外側にある
+		}
+		if ((code_a | code_b | code_c) == 0) {
+			add_screen_triangle(to_screen(a), to_screen(b), to_screen(c));
+			return;
+		}
+		// Sutherland-Hodgman 法でクリップし、結果の多角形を扇状に分割する
+		SVert buf[2][3 + NUM_CLIP_PLANES];
+		int num = 3;
+		buf[0][0] = a;
+		buf[0][1] = b;
+		buf[0][2] = c;
+		int cur = 0;
+		for (int plane=0; plane<NUM_CLIP_PLANES && num>0; plane++) {
+			const SVert *in = buf[cur];
+			SVert *out = buf[1 - cur];
+			int n = 0;
+			for (int i=0; i<num; i++) {
+				const SVert &p = in[i];
+				const SVert &q = in[(i + 1) % num];
+				float dp = _ClipDistance(p, plane);
+				float dq = _ClipDistance(q, plane);
+				if (dp >= 0) out[n++] = p;
+				if ((dp >= 0) != (dq >= 0)) out[n++] = _Lerp(p, q, dp / (dp - dq));
+			}
+			num = n;
+			cur = 1 - cur;
+		}
+		if (num < 3) return;
+		SVert s0 = to_screen(buf[cur][0]);
+		SVert s1 = to_screen(buf[cur][1]);
+		for (int i=2; i<num; i++) {
+			SVert s2 = to_screen(buf[cur][i]);
+			add_screen_triangle(s0, s1, s2);
+			s1 = s2;
+		}
+	}
+	void add_line(const SVert &a, const SVert &b) {
+		SVert p = a;
+		SVert q = b;
+		for (int plane=0; plane<NUM_CLIP_PLANES; plane++) {
+			float dp = _ClipDistance(p, plane);
+			float dq = _ClipDistance(q, plane);
+			if (dp < 0 && dq < 0) return;
+			if (dp < 0) p = _Lerp(p, q, dp / (dp - dq));
+			else if (dq < 0) q = _Lerp(p, q, dp / (dp - dq));
+		}
+		SVert v[2] = {to_screen(p), to_screen(q)};
+		push_prim(v, 2);
+	}
+	void add_point(const SVert &a) {
+		if (_ClipOutcode(a) == 0) {
+			SVert v = to_screen(a);
+			push_prim(&v, 1);
+		}
+	}
+	void add_screen_triangle(const SVert &a, const SVert &b, const SVert &c) {
+		SVert v[3] = {a, b, c};
+		push_prim(v, 3);
+	}
+	void push_prim(const SVert *v, int num_verts) {
+		if (m_Target == nullptr) return;
+		float minx = v[0].pos[0], maxx = v[0].pos[0];
+		float miny = v[0].pos[1], maxy = v[0].pos[1];
+		for (int i=1; i<num_verts; i++) {
+			minx = KMath::min(minx, v[i].pos[0]);
+			maxx = KMath::max(maxx, v[i].pos[0]);
+			miny = KMath::min(miny, v[i].pos[1]);
+			maxy = KMath::max(maxy, v[i].pos[1]);
+		}
+		// 固定小数点で計算できない座標（と NaN）は描画しない
+		const float lim = (float)MAX_SCREEN_COORD;
+		if (!(-lim < minx && maxx < lim && -lim < miny && maxy < lim)) return;
+
+		const SDrawState &ds = m_DrawStates[get_draw_state()];
+		SPrim prim;
+		if (num_verts == 3) {
+			// ピクセル中心（整数座標）が範囲内にあるピクセル
+			prim.x0 = (int)ceilf(minx);
+			prim.y0 = (int)ceilf(miny);
+			prim.x1 = (int)floorf(maxx) + 1;
+			prim.y1 = (int)floorf(maxy) + 1;
+		} else {
+			// 四捨五入した座標のピクセル
+			prim.x0 = (int)floorf(minx + 0.5f);
+			prim.y0 = (int)floorf(miny + 0.5f);
+			prim.x1 = (int)floorf(maxx + 0.5f) + 1;
+			prim.y1 = (int)floorf(maxy + 0.5f) + 1;
+		}
+		prim.x0 = KMath::max(prim.x0, ds.clip_x0);
+		prim.y0 = KMath::max(prim.y0, ds.clip_y0);
+		prim.x1 = KMath::min(prim.x1, ds.clip_x1);
+		prim.y1 = KMath::min(prim.y1, ds.clip_y1);
+		if (prim.x0 >= prim.x1 || prim.y0 >= prim.y1) return;
+		for (int i=0; i<num_verts; i++) {
+			prim.v[i] = v[i];
+		}
+		prim.num_verts = num_verts;
+		prim.state = m_CurrDrawState;
+		m_Prims.push_back(prim);
+	}
+	#pragma endregion // rasterize
+};
+#pragma endregion // CSoftVideo
+
+
+static CSoftVideo g_Video;
+
+static void CSoftVideo_flush() {
+	g_Video.flush();
+}
+static void CSoftVideo_fill(KTEXID target, const float *color_rgba, KColorChannels channels) {
+	g_Video.fill(target, color_rgba, channels);
+}
+static const SSoftSurface * CSoftVideo_getRenderTarget() {
+	return g_Video.getRenderTarget();
+}
+
+#endif // K_USE_SOFTWARE_VIDEO
 
 
 #pragma region KVideo
 bool KVideo::init(void *hWnd, void *d3d9, void *d3ddev9) {
+#ifdef K_USE_SOFTWARE_VIDEO
+	// ソフトウェア描画ではウィンドウもデバイスも使わない。
+	// バックバッファの大きさは resetDevice で変更する
+	g_Video.init_init(true);
+	if (g_Video.init()) {
+		return true;
+	}
+#else
 	// 有効な HWND であることを確認
 	K__ASSERT_RETURN_ZERO(IsWindow((HWND)hWnd));
 
@@ -2795,6 +4613,7 @@ bool KVideo::init(void *hWnd, void *d3d9, void *d3ddev9) {
 	if (g_Video.init((HWND)hWnd, (IDirect3D9 *)d3d9, (IDirect3DDevice9 *)d3ddev9)) {
 		return true;
 	}
+#endif
 	// ERR
 	g_Video.shutdown();
 	return false;
@@ -2977,6 +4796,21 @@ void KVideo::drawUserPtrV(const KVertex *vertices, int count, KPrimitive primiti
 void KVideo::drawIndexedUserPtrV(const KVertex *vertices, int vertex_count, const int *indices, int index_count, KPrimitive primitive) {
 	g_Video.drawIndexedUserPtrV(vertices, vertex_count, indices, index_count, primitive);
 }
+int KVideo::writeStreamVertices(const KVertex *vertices, int count) {
+	return g_Video.writeStreamVertices(vertices, count);
+}
+int KVideo::writeStreamVertices(const KVertexCompact *vertices, int count) {
+	return g_Video.writeStreamVertices(vertices, count);
+}
+int KVideo::writeStreamIndices(const int *indices, int count) {
+	return g_Video.writeStreamIndices(indices, count);
+}
+void KVideo::drawStreamV(int start, int count, KPrimitive primitive, KVertexLayout layout) {
+	g_Video.drawStreamV(start, count, primitive, layout);
+}
+void KVideo::drawIndexedStreamV(int base_vertex, int vertex_count, int start_index, int index_count, KPrimitive primitive, KVertexLayout layout) {
+	g_Video.drawIndexedStreamV(base_vertex, vertex_count, start_index, index_count, primitive, layout);
+}
 KImage KVideo::getBackbufferImage() {
 	return g_Video.getBackbufferImage();
 }
@@ -3016,13 +4850,12 @@ KShader * KShader::create(const char *hlsl_u8, const char *name) {
 #pragma endregion // KShader
 
 
+#ifdef K_USE_D3D9
 #pragma region Forward Impl
 static CD3DTex * CD3D9_findTexture(KTEXID tex) {
 	return g_Video.findTexture(tex);
 }
 #pragma endregion // Forward Impl
-
-
 #endif // K_USE_D3D9
 
 
@@ -3035,7 +4868,10 @@ static CD3DTex * CD3D9_findTexture(KTEXID tex) {
 
 
 #pragma region KMesh
+static_assert(sizeof(KVertexCompact) == 20, "KVertexCompact must be 20 bytes");
+
 KMesh::KMesh() {
+	m_layout = KVertexLayout_COMPACT;
 	m_changed = 0;
 }
 bool KMesh::getAabb(KVec3 *minpoint, KVec3 *maxpoint) const {
@@ -3088,6 +4924,7 @@ bool KMesh::getAabb(int offset, int count, KVec3 *minpoint, KVec3 *maxpoint) con
 void KMesh::clear() {
 	m_whole_aabb_min = KVec3();
 	m_whole_aabb_max = KVec3();
+	m_layout = KVertexLayout_COMPACT;
 	m_changed = 0;
 	m_indices.clear();
 	m_vertices.clear();
@@ -3416,6 +5253,20 @@ int KMesh::getVertexCount() const {
 int KMesh::getIndexCount() const {
 	return m_indices.size();
 }
+KVertexLayout KMesh::getVertexLayout() const {
+	if (m_changed & LAYOUT) {
+		m_changed &= ~LAYOUT;
+		m_layout = KVertexLayout_COMPACT;
+		const KVertex *v = m_vertices.data();
+		for (int i=0; i<m_vertices.size(); i++) {
+			if (!KVertexCompact::canPack(v[i])) {
+				m_layout = KVertexLayout_FULL;
+				break;
+			}
+		}
+	}
+	return m_layout;
+}
 KVertex * KMesh::lock(int offset, int count) {
 	if (offset >= 0 && count > 0) {
 		if ((int)m_vertices.size() <= offset + count) {
@@ -3517,7 +5368,29 @@ void MeshShape::makeRectSkew(KMesh *mesh, const KVec2 &p0, const KVec2 &p1, cons
 
 
 #pragma region KDrawList
+// マテリアル m1 と m2 が完全に同じかどうか。
+// 同じなら、続けて描画するときにマテリアルを設定し直さなくてよい
+static bool K__IsSameMaterial(const KMaterial &m1, const KMaterial &m2) {
+	if (m1.cb || m2.cb) return false; // コールバックはマテリアルの開始と終了を知る必要がある
+	if (m1.shader != m2.shader) return false;
+	if (m1.color != m2.color) return false;
+	if (m1.specular != m2.specular) return false;
+	if (m1.texture != m2.texture) return false;
+	if (m1.blend != m2.blend) return false;
+	if (m1.filter != m2.filter) return false;
+	if (m1.wrap != m2.wrap) return false;
+	return true;
+}
+
 KDrawList::KDrawList() {
+	m_pretransform = false;
+	m_stream = true;
+	m_layout = KVertexLayout_FULL;
+	m_compact = false;
+	m_adding_layout = KVertexLayout_ENUM_MAX;
+	m_num_compact_vertices = 0;
+	m_drawcalls = 0;
+	m_statechanges = 0;
 	clear();
 }
 KDrawList::~KDrawList() {
@@ -3583,8 +5456,11 @@ bool KDrawList::is_changed() {
 }
 void KDrawList::clear() {
 	m_unimesh.clear();
+	m_num_compact_vertices = 0;
+	m_compact = (m_layout == KVertexLayout_COMPACT);
 	m_next = KDrawListItem();
 	m_last = KDrawListItem();
+	m_first = KDrawListItem();
 	m_items.clear();
 	m_changed = 0;
 }
@@ -3600,6 +5476,93 @@ void KDrawList::setProjection(const KMatrix4 &m) {
 void KDrawList::setPrimitive(KPrimitive prim) {
 	m_next.prim = prim;
 }
+void KDrawList::setStreamBuffer(bool value) {
+	m_stream = value;
+}
+void KDrawList::setVertexLayout(KVertexLayout layout) {
+	m_layout = layout;
+	if (getVertexCount() == 0) {
+		m_compact = (layout == KVertexLayout_COMPACT);
+	} else if (layout == KVertexLayout_FULL && m_compact) {
+		widen();
+	}
+}
+KVertexLayout KDrawList::getVertexLayout() const {
+	return m_compact ? KVertexLayout_COMPACT : KVertexLayout_FULL;
+}
+int KDrawList::getVertexCount() const {
+	return m_compact ? m_num_compact_vertices : m_unimesh.getVertexCount();
+}
+void KDrawList::widen_if_needed(const KVertex *v, int count) {
+	if (!m_compact) return;
+	if (m_next.material.shader) {
+		widen(); // シェーダーはテクスチャ座標2やスペキュラ色を使うかもしれない
+		return;
+	}
+	if (m_adding_layout == KVertexLayout_COMPACT) {
+		return; // 追加中のメッシュは全て KVertexCompact で表現できる
+	}
+	for (int i=0; i<count; i++) {
+		if (!KVertexCompact::canPack(v[i])) {
+			widen();
+			return;
+		}
+	}
+}
+void KDrawList::widen() {
+	if (!m_compact) return;
+	const int numv = m_num_compact_vertices;
+	if (numv > 0) {
+		KVertex *dst = m_unimesh.lock(0, numv);
+		for (int i=0; i<numv; i++) {
+			dst[i] = m_compact_vertices[i].unpack();
+		}
+		m_unimesh.unlock();
+	}
+	m_num_compact_vertices = 0;
+	m_compact = false;
+}
+void KDrawList::put_vertices(int offset, const KVertex *v, int count) {
+	if (m_compact) {
+		K__ASSERT(offset == m_num_compact_vertices);
+		m_num_compact_vertices = offset + count;
+		if ((int)m_compact_vertices.size() < m_num_compact_vertices) {
+			m_compact_vertices.resize(KMath::max(m_num_compact_vertices, (int)m_compact_vertices.size() * 2));
+		}
+		KVertexCompact *dst = m_compact_vertices.data() + offset;
+		for (int i=0; i<count; i++) {
+			dst[i].pack(v[i]);
+		}
+	} else {
+		m_unimesh.setVertices(offset, v, count);
+	}
+}
+void KDrawList::setPreTransform(bool value) {
+	m_pretransform = value;
+}
+const KVertex * KDrawList::pre_transform(const KVertex *v, int count) {
+	if (!m_pretransform) return v;
+	if (m_next.material.cb) return v; // コールバックが transform を使うかもしれない
+	const KMatrix4 &m = m_next.transform;
+	if (m._14 != 0 || m._24 != 0 || m._34 != 0 || m._44 != 1) {
+		return v; // 射影成分がある。頂点ごとに w で割ると補間結果が変わってしまう
+	}
+	if (m != KMatrix4()) {
+		m_tmp_vertices.resize(count);
+		for (int i=0; i<count; i++) {
+			const KVec3 &p = v[i].pos;
+			m_tmp_vertices[i] = v[i];
+			m_tmp_vertices[i].pos = KVec3(
+				p.x * m._11 + p.y * m._21 + p.z * m._31 + m._41,
+				p.x * m._12 + p.y * m._22 + p.z * m._32 + m._42,
+				p.x * m._13 + p.y * m._23 + p.z * m._33 + m._43
+			);
+		}
+		v = m_tmp_vertices.data();
+	}
+	m_next.transform = KMatrix4();
+	return v;
+}
 void KDrawList::setColorWrite(bool value) {
 	m_next.color_write = value;
 }
@@ -3623,11 +5586,17 @@ void KDrawList::addMesh(const KMesh *mesh, int submeshIndex) {
 	m_next.cb_submesh = submeshIndex;
 
 	setPrimitive(subMesh->primitive);
+
+	// メッシュが覚えている頂点レイアウトを使い、頂点ごとの判定を省く
+	if (m_compact) {
+		m_adding_layout = mesh->getVertexLayout();
+	}
 	if (mesh->getIndexCount() > 0) {
 		addVerticesWithIndex(mesh->getVertices(), mesh->getVertexCount(), mesh->getIndices()+subMesh->start, subMesh->count);
 	} else {
 		addVertices(mesh->getVertices()+subMesh->start, subMesh->count);
 	}
+	m_adding_layout = KVertexLayout_ENUM_MAX;
 }
 static void copy_mem(void *dst, int dst_stride, const void *src, int src_stride, int copysize, int copycount) {
 	// p の型に関係なく x バイトだけずらしたアドレス
@@ -3649,7 +5618,14 @@ void KDrawList::addVertices(const KVertex *v, int count) {
 	if (v == nullptr) return;
 	if (count <= 0) return;
 	if (DRAWLIST_UNIDRAW_TEST) {
-		int numv = m_unimesh.getVertexCount();
+		widen_if_needed(v, count);
+		int numv = getVertexCount();
+		KMatrix4 transform = m_next.transform;
+		v = pre_transform(v, count);
+		if (m_items.empty() && m_last.count == 0) {
+			m_first = m_next;
+			m_first.with_index = false;
+		}
 
 		if (m_last.with_index==true || is_changed()) {
 			// 前回 addPrimitive を呼んだ時とは描画設定が変わっている。
@@ -3662,11 +5638,10 @@ void KDrawList::addVertices(const KVertex *v, int count) {
 			m_next.count = 0;
 			m_next.with_index = false;
 		}
-		{
-			m_unimesh.setVertices(numv, v, count);
-		}
+		put_vertices(numv, v, count);
 		m_next.count += count;
 		m_last = m_next; // 今回の addPrimitive で更新された描画アイテム
+		m_next.transform = transform;
 
 	} else {
 		#if 1
@@ -3684,12 +5659,17 @@ void KDrawList::addVerticesWithIndex(const KVertex *v, int vcount, const int *i,
 	if (v == nullptr || vcount == 0) return;
 	if (i == nullptr || icount == 0) return;
 	if (DRAWLIST_UNIDRAW_TEST) {
-		int numv = m_unimesh.getVertexCount();
+		widen_if_needed(v, vcount);
+		int numv = getVertexCount();
 		int numi = m_unimesh.getIndexCount();
+		KMatrix4 transform = m_next.transform;
+		v = pre_transform(v, vcount);
+		if (m_items.empty() && m_last.count == 0) {
+			m_first = m_next;
+			m_first.with_index = true;
+		}
 		
-		// インデックス付きの描画は結合できない（インデックスをずらさないといけないので）
-		// 常に独立して描画する
-		if (1/*m_last.with_index==false || ischanged()*/) {
+		if (m_last.with_index==false || is_changed()) {
 			// 前回 addPrimitive を呼んだ時とは描画設定が変わっている。
 			// 既存の描画をコミットし、新しい描画単位として登録する
 			if (m_last.count > 0) {
@@ -3700,10 +5680,20 @@ void KDrawList::addVerticesWithIndex(const KVertex *v, int vcount, const int *i,
 			m_next.count = 0;
 			m_next.with_index = true;
 		}
-		m_unimesh.setVertices(numv, v, vcount);
-		m_unimesh.setIndices(numi, i, icount);
+		put_vertices(numv, v, vcount);
+		{
+			// 描画アイテムの頂点は index_number_offset から始まるので、
+			// 結合した頂点を指すようにインデックスをずらしておく
+			const int base = numv - m_next.index_number_offset;
+			int *dst = m_unimesh.lockIndices(numi, icount);
+			for (int k=0; k<icount; k++) {
+				dst[k] = i[k] + base;
+			}
+			m_unimesh.unlockIndices();
+		}
 		m_next.count += icount;
 		m_last = m_next; // 今回の addPrimitive で更新された描画アイテム
+		m_next.transform = transform;
 
 	} else {
 		#if 1
@@ -3717,6 +5707,91 @@ void KDrawList::addVerticesWithIndex(const KVertex *v, int vcount, const int *i,
 		#endif
 	}
 }
+void KDrawList::append(const KDrawList &src) {
+	if (!DRAWLIST_UNIDRAW_TEST) return;
+	if (src.m_items.empty() && src.m_last.count == 0) return; // 何も記録されていない
+	if (m_compact && !src.m_compact) {
+		widen();
+	}
+	const int numv = getVertexCount();
+	const int numi = m_unimesh.getIndexCount();
+	const int src_numv = src.getVertexCount();
+	const int src_numi = src.m_unimesh.getIndexCount();
+
+	// 頂点とインデックスをそのまま後ろにつなげる。
+	// インデックスは描画アイテムの index_number_offset からの相対値なので、書き換えなくてよい
+	if (m_compact) {
+		m_num_compact_vertices = numv + src_numv;
+		if ((int)m_compact_vertices.size() < m_num_compact_vertices) {
+			m_compact_vertices.resize(KMath::max(m_num_compact_vertices, (int)m_compact_vertices.size() * 2));
+		}
+		if (src_numv > 0) {
+			memcpy(m_compact_vertices.data() + numv, src.m_compact_vertices.data(), sizeof(KVertexCompact) * src_numv);
+		}
+	} else if (src.m_compact) {
+		if (src_numv > 0) {
+			KVertex *dst = m_unimesh.lock(numv, src_numv);
+			for (int i=0; i<src_numv; i++) {
+				dst[i] = src.m_compact_vertices[i].unpack();
+			}
+			m_unimesh.unlock();
+		}
+	} else {
+		m_unimesh.setVertices(numv, src.m_unimesh.getVertices(), src_numv);
+	}
+	if (src_numi > 0) {
+		int *dst = m_unimesh.lockIndices(numi, src_numi);
+		memcpy(dst, src.m_unimesh.getIndices(), sizeof(int) * src_numi);
+		m_unimesh.unlockIndices();
+	}
+
+	// src の最初の追加を、このリストに対して行ったとしたら直前のアイテムと結合されたかどうか
+	bool unite = false;
+	if (m_last.count > 0 && m_last.with_index == src.m_first.with_index) {
+		KDrawListItem next = m_next;
+		m_next = src.m_first;
+		unite = !is_changed();
+		m_next = next;
+	}
+	int num_items = (int)src.m_items.size() + (src.m_last.count > 0 ? 1 : 0);
+	for (int k=0; k<num_items; k++) {
+		KDrawListItem item = (k < (int)src.m_items.size()) ? src.m_items[k] : src.m_last;
+		if (item.with_index) {
+			item.start += numi;
+			item.index_number_offset += numv;
+		} else {
+			item.start += numv;
+		}
+		if (k == 0 && unite) {
+			// 直前のアイテムに結合する。
+			// 結合先の index_number_offset を基準にしたインデックスに書き換える
+			if (item.with_index) {
+				const int base = item.index_number_offset - m_last.index_number_offset;
+				int *dst = m_unimesh.lockIndices(item.start, item.count);
+				for (int j=0; j<item.count; j++) {
+					dst[j] += base;
+				}
+				m_unimesh.unlockIndices();
+			}
+			item.start = m_last.start;
+			item.index_number_offset = m_last.index_number_offset;
+			item.count += m_last.count;
+		} else if (m_last.count > 0) {
+			m_items.push_back(m_last);
+		}
+		m_last = item;
+	}
+
+	// 描画設定は src の続きになる。
+	// 次の追加が m_last に結合される場合に備えて、範囲は m_last と同じにしておく
+	KMatrix4 transform = src.m_next.transform;
+	m_next = src.m_next;
+	m_next.start = m_last.start;
+	m_next.count = m_last.count;
+	m_next.index_number_offset = m_last.index_number_offset;
+	m_next.with_index = m_last.with_index;
+	m_next.transform = transform;
+}
 void KDrawList::endList() {
 	if (DRAWLIST_UNIDRAW_TEST) {
 		if (m_last.count > 0) {
@@ -3729,57 +5804,166 @@ void KDrawList::endList() {
 size_t KDrawList::size() const {
 	return m_items.size();
 }
+// 描画アイテムが使う最初の頂点の番号
+static int K__GetFirstVertex(const KDrawListItem &item) {
+	return item.with_index ? item.index_number_offset : item.start;
+}
 void KDrawList::draw() {
+	m_drawcalls = 0;
+	m_statechanges = 0;
 	if (m_items.empty()) return;
 	if (DRAWLIST_UNIDRAW_TEST) {
-		// メッシュの内容を転送
-		int vnum = m_unimesh.getVertexCount();
-		int inum = m_unimesh.getIndexCount();
+		const int numv = getVertexCount();
+		const int numi = m_unimesh.getIndexCount();
+		const KVertexLayout layout = getVertexLayout();
+
+		// ストリームバッファを使う場合は、描画アイテムごとにコピーするのではなく
+		// 全ての頂点とインデックスを一度に書き込んでおく。
+		// ただし、ユーザー定義の描画がストリームバッファに書き込むと、ここで書き込んだ内容が破棄されることがあるので、
+		// ユーザー定義の描画を含む場合は使わない
+		bool use_stream = m_stream;
+		for (size_t i=0; i<m_items.size() && use_stream; i++) {
+			if (m_items[i].material.cb) use_stream = false;
+		}
+		int stream_v = -1;
+		int stream_i = 0;
+		if (use_stream) {
+			if (m_compact) {
+				stream_v = KVideo::writeStreamVertices(m_compact_vertices.data(), numv);
+			} else {
+				stream_v = KVideo::writeStreamVertices(m_unimesh.getVertices(), numv);
+			}
+			if (numi > 0) {
+				stream_i = KVideo::writeStreamIndices(m_unimesh.getIndices(), numi);
+			}
+		}
+		const bool stream = stream_v >= 0 && stream_i >= 0;
+
+		// ユーザーポインタ描画は KVertex しか受け付けないので、KVertexCompact は広げてから渡す
+		const KVertex *vertices = nullptr;
+		if (!stream && m_compact) {
+			m_tmp_vertices.resize(numv);
+			for (int i=0; i<numv; i++) {
+				m_tmp_vertices[i] = m_compact_vertices[i].unpack();
+			}
+			vertices = m_tmp_vertices.data();
+		} else if (!stream) {
+			vertices = m_unimesh.getVertices();
+		}
+
 		KVideo::pushRenderState();
+
+		// 直前に描画したアイテム。レンダーステートはこのアイテムの設定になっているので、
+		// 同じ設定が続く場合は設定し直さない。nullptr ならば全て設定し直す
+		const KDrawListItem *curr = nullptr;
+		bool stencil = false;
+		bool color_write = true;
 		for (size_t i=0; i<m_items.size(); i++) {
 			const KDrawListItem &item = m_items[i];
-			bool done = false;
 			if (item.material.cb) {
+				// ユーザー定義の描画はレンダーステートを変更するかもしれないので、ここで状態の引き継ぎを打ち切る。
+				// また、ユーザー定義の描画には直前のアイテムのステンシルや書き込みマスクを引き継がない
+				if (curr) {
+					KVideoUtils::endMaterial(&curr->material);
+					curr = nullptr;
+				}
+				if (stencil) {
+					KVideo::setStencilEnabled(false);
+					stencil = false;
+					m_statechanges++;
+				}
+				if (!color_write) {
+					KVideo::setColorWriteMask(KColorChannel_RGBA);
+					color_write = true;
+					m_statechanges++;
+				}
+				bool done = false;
 				item.material.cb->onMaterial_Draw(&item, &done);
+				if (done) {
+					continue; // ユーザーによって描画が完了した
+				}
 			}
-			if (!done) { // ユーザーによって描画が完了していないなら、続ける
+			if (curr == nullptr || curr->projection != item.projection) {
 				KVideo::setProjection(item.projection);
+				m_statechanges++;
+			}
+			if (curr == nullptr || curr->transform != item.transform) {
 				KVideo::setTransform(item.transform);
-
-				if (item.with_stencil) {
+				m_statechanges++;
+			}
+			if (item.with_stencil) {
+				bool same = stencil && curr &&
+					curr->stencil_fn  == item.stencil_fn &&
+					curr->stencil_ref == item.stencil_ref &&
+					curr->stencil_op  == item.stencil_op;
+				if (!same) {
 					KVideo::setStencilEnabled(true);
 					KVideo::setStencilFunc(item.stencil_fn, item.stencil_ref, item.stencil_op);
+					stencil = true;
+					m_statechanges++;
 				}
-				if (!item.color_write) {
-					KVideo::setColorWriteMask(0);
+			} else if (stencil) {
+				KVideo::setStencilEnabled(false);
+				stencil = false;
+				m_statechanges++;
+			}
+			if (item.color_write != color_write) {
+				KVideo::setColorWriteMask(item.color_write ? KColorChannel_RGBA : 0);
+				color_write = item.color_write;
+				m_statechanges++;
+			}
+			if (curr == nullptr || !K__IsSameMaterial(curr->material, item.material)) {
+				if (curr) {
+					KVideoUtils::endMaterial(&curr->material);
 				}
-
 				KVideoUtils::beginMaterial(&item.material);
-				if (item.with_index) {
+				m_statechanges++;
+			}
+
+			if (item.with_index) {
+				// 頂点は追加順に並んでいるので、この描画アイテムが使う頂点は次の描画アイテムの頂点の手前まで
+				const int vend = (i + 1 < m_items.size()) ? K__GetFirstVertex(m_items[i + 1]) : numv;
+				const int vcount = vend - item.index_number_offset;
+				if (stream) {
+					KVideo::drawIndexedStreamV(stream_v + item.index_number_offset, vcount, stream_i + item.start, item.count, item.prim, layout);
+				} else {
 					KVideo::drawIndexedUserPtrV(
-						m_unimesh.getVertices() + item.index_number_offset,
-						m_unimesh.getVertexCount() - item.index_number_offset,
+						vertices + item.index_number_offset,
+						vcount,
 						m_unimesh.getIndices() + item.start,
 						item.count,
 						item.prim
 					);
+				}
+			} else {
+				if (stream) {
+					KVideo::drawStreamV(stream_v + item.start, item.count, item.prim, layout);
 				} else {
 					KVideo::drawUserPtrV(
-						m_unimesh.getVertices() + item.start,
+						vertices + item.start,
 						item.count,
 						item.prim
 					);
 				}
-				KVideoUtils::endMaterial(&item.material);
+			}
+			m_drawcalls++;
 
-				if (!item.color_write) {
-					KVideo::setColorWriteMask(KColorChannel_RGBA);
-				}
-				if (item.with_stencil) {
-					KVideo::setStencilEnabled(false);
-				}
+			if (item.material.cb) {
+				KVideoUtils::endMaterial(&item.material);
+				curr = nullptr;
+			} else {
+				curr = &item;
 			}
 		}
+		if (curr) {
+			KVideoUtils::endMaterial(&curr->material);
+		}
+		if (!color_write) {
+			KVideo::setColorWriteMask(KColorChannel_RGBA);
+		}
+		if (stencil) {
+			KVideo::setStencilEnabled(false);
+		}
 		KVideo::popRenderState();
 	}
 }
@@ -3787,6 +5971,18 @@ void KDrawList::draw() {
 KDrawListItem & KDrawList::operator[](size_t index) {
 	return m_items[index];
 }
+const KMesh * KDrawList::getMesh() const {
+	return &m_unimesh;
+}
+const KVertexCompact * KDrawList::getCompactVertices() const {
+	return m_compact_vertices.data();
+}
+int KDrawList::getDrawCallCount() const {
+	return m_drawcalls;
+}
+int KDrawList::getStateChangeCount() const {
+	return m_statechanges;
+}
 #pragma endregion // KDrawList
 
 
@@ -4760,5 +6956,959 @@ void CPathDraw::addEllipse(KMesh *mesh, const KVec2 &pos, const KVec2 &r, const
 #pragma endregion // CPathDraw
 
 
+#ifdef K_USE_SOFTWARE_VIDEO
+namespace Test {
+void Test_video_soft() {
+	bool own_init = !KVideo::isInit();
+	if (own_init) KVideo::init(nullptr, nullptr, nullptr);
+	int old_threads = 0;
+	KVideo::getParameter(KVideo::PARAM_RENDER_THREADS, &old_threads);
+
+	uint32_t seed = 27182;
+	auto rnd = [&seed](float lo, float hi) {
+		seed = seed * 1664525 + 1013904223;
+		return lo + (hi - lo) * ((seed >> 8) / (float)(1 << 24));
+	};
+	// 頂点座標をそのままピクセル座標として使う射影行列（ピクセル中心は整数座標にある）
+	auto pixel_proj = [](int w, int h) {
+		return KMatrix4(
+			2.0f / w, 0, 0, 0,
+			0, -2.0f / h, 0, 0,
+			0, 0, 1, 0,
+			-1, 1, 0, 1
+		);
+	};
+	// ピクセル範囲 [x0, x1) x [y0, y1) をちょうど覆う四角形
+	auto add_rect = [](KDrawList &dl, int x0, int y0, int x1, int y1, const KColor32 &color, float u0, float v0, float u1, float v1) {
+		const float fx0 = x0 - K_HALF_PIXEL;
+		const float fy0 = y0 - K_HALF_PIXEL;
+		const float fx1 = x1 - K_HALF_PIXEL;
+		const float fy1 = y1 - K_HALF_PIXEL;
+		KVertex v[6];
+		v[0].pos = KVec3(fx0, fy0, 0.0f); v[0].tex = KVec2(u0, v0);
+		v[1].pos = KVec3(fx1, fy0, 0.0f); v[1].tex = KVec2(u1, v0);
+		v[2].pos = KVec3(fx0, fy1, 0.0f); v[2].tex = KVec2(u0, v1);
+		v[3] = v[2];
+		v[4] = v[1];
+		v[5].pos = KVec3(fx1, fy1, 0.0f); v[5].tex = KVec2(u1, v1);
+		for (int i=0; i<6; i++) {
+			v[i].dif32 = color;
+		}
+		dl.addVertices(v, 6);
+	};
+	// 期待値の計算用。ラスタライザとは別に浮動小数で計算する (0..255)
+	auto blend_ref = [](KBlend blend, float s, float d, float sa) {
+		float r = s;
+		switch (blend) {
+		case KBlend_ONE:    r = s; break;
+		case KBlend_ADD:    r = s * sa / 255 + d; break;
+		case KBlend_SUB:    r = d * (255 - s) / 255 - s * sa / 255; break;
+		case KBlend_MUL:    r = d * s / 255; break;
+		case KBlend_ALPHA:  r = s * sa / 255 + d * (255 - sa) / 255; break;
+		case KBlend_SCREEN: r = s * (255 - d) / 255 + d; break;
+		case KBlend_MAX:    r = KMath::max(s, d); break;
+		default: break;
+		}
+		return KMath::clampf(r, 0, 255);
+	};
+	int num_errors = 0;
+
+	// 基本的な描画結果をピクセル単位で確認する
+	{
+		const int W = 128;
+		const int H = 128;
+		KTEXID rt = KVideo::createRenderTexture(W, H);
+		std::vector<float> ref(W * H * 4); // RGBA
+		for (int i=0; i<W*H; i++) {
+			ref[i*4+0] = 0;
+			ref[i*4+1] = 0;
+			ref[i*4+2] = 0;
+			ref[i*4+3] = 255;
+		}
+		auto ref_rect = [&](int x0, int y0, int x1, int y1, KBlend blend, const float *src) {
+			for (int y=y0; y<y1; y++) {
+				for (int x=x0; x<x1; x++) {
+					float *d = &ref[(W * y + x) * 4];
+					for (int c=0; c<4; c++) {
+						d[c] = blend_ref(blend, src[c], d[c], src[3]);
+					}
+				}
+			}
+		};
+		// 4x4 のテクスチャ
+		KImage img = KImage::createFromPixels(4, 4, KColorFormat_RGBA32, nullptr);
+		{
+			KBmp bmp;
+			img.lock(&bmp);
+			for (int y=0; y<4; y++) {
+				for (int x=0; x<4; x++) {
+					uint8_t *p = bmp.data + bmp.get_offset(x, y);
+					p[0] = (uint8_t)(x * 80);
+					p[1] = (uint8_t)(y * 80);
+					p[2] = (uint8_t)(255 - x * 40);
+					p[3] = (uint8_t)(255 - y * 60);
+				}
+			}
+			img.unlock();
+		}
+		KTEXID tex = KVideo::createTextureFromImage(img);
+
+		KDrawList dl;
+		KMaterial mat;
+		dl.setProjection(pixel_proj(W, H));
+		dl.setTransform(KMatrix4());
+		dl.setPrimitive(KPrimitive_TRIANGLES);
+
+		// 背景
+		const float bg[] = {60, 120, 180, 200};
+		mat.blend = KBlend_ONE;
+		dl.setMaterial(mat);
+		add_rect(dl, 0, 40, W, 72, KColor32(60, 120, 180, 200), 0, 0, 0, 0);
+		ref_rect(0, 40, W, 72, KBlend_ONE, bg);
+
+		// ブレンドモードごとに１つずつ
+		const KBlend blends[] = {KBlend_ONE, KBlend_ADD, KBlend_ALPHA, KBlend_SUB, KBlend_MUL, KBlend_SCREEN, KBlend_MAX};
+		const float src[] = {200, 100, 50, 160};
+		for (int i=0; i<7; i++) {
+			mat.blend = blends[i];
+			dl.setMaterial(mat);
+			add_rect(dl, 4 + i * 17, 44, 18 + i * 17, 68, KColor32(200, 100, 50, 160), 0, 0, 0, 0);
+			ref_rect(4 + i * 17, 44, 18 + i * 17, 68, blends[i], src);
+		}
+
+		// テクスチャ。テクセル１つが 8x8 ピクセルになる
+		mat.blend = KBlend_ONE;
+		mat.texture = tex;
+		dl.setMaterial(mat);
+		add_rect(dl,  8, 80,  40, 112, KColor32(255, 255, 255, 255), 0, 0, 1, 1); // そのまま
+		add_rect(dl, 48, 80,  80, 112, KColor32(128, 255,  64, 255), 0, 0, 1, 1); // 頂点色を乗算
+		mat.wrap = true;
+		dl.setMaterial(mat);
+		add_rect(dl, 88, 80, 120, 112, KColor32(255, 255, 255, 255), 0, 0, 2, 2); // ２回繰り返す
+		mat.wrap = false;
+		mat.texture = nullptr;
+		for (int r=0; r<3; r++) {
+			const int x0 = 8 + r * 40;
+			const float dif[] = {(r == 1) ? 128.0f : 255.0f, 255.0f, (r == 1) ? 64.0f : 255.0f};
+			for (int y=0; y<32; y++) {
+				for (int x=0; x<32; x++) {
+					int tx = (r == 2) ? (x / 4) % 4 : x / 8;
+					int ty = (r == 2) ? (y / 4) % 4 : y / 8;
+					float texel[] = {tx * 80.0f, ty * 80.0f, 255.0f - tx * 40, 255.0f - ty * 60};
+					float s[4];
+					for (int c=0; c<3; c++) s[c] = texel[c] * dif[c] / 255;
+					s[3] = texel[3];
+					ref_rect(x0 + x, 80 + y, x0 + x + 1, 81 + y, KBlend_ONE, s);
+				}
+			}
+		}
+
+		// ステンシル。色を書かずにステンシルだけ 1 にし、ステンシルが 1 の部分にだけ緑を描く
+		mat.blend = KBlend_ONE;
+		dl.setMaterial(mat);
+		dl.setStencil(true);
+		dl.setStencilOpt(KVideo::STENCILFUNC_ALWAYS, 1, KVideo::STENCILOP_REPLACE);
+		dl.setColorWrite(false);
+		add_rect(dl, 8, 4, 40, 36, KColor32(255, 0, 0, 255), 0, 0, 0, 0);
+		dl.setColorWrite(true);
+		dl.setStencilOpt(KVideo::STENCILFUNC_EQUAL, 1, KVideo::STENCILOP_KEEP);
+		add_rect(dl, 0, 0, 64, 38, KColor32(0, 255, 0, 255), 0, 0, 0, 0);
+		dl.setStencil(false);
+		const float green[] = {0, 255, 0, 255};
+		ref_rect(8, 4, 40, 36, KBlend_ONE, green);
+		dl.endList();
+
+		KVideo::pushRenderTarget(rt);
+		KVideo::clearColor(KColor(0, 0, 0, 1));
+		KVideo::clearStencil(0);
+		dl.draw();
+		KVideo::popRenderTarget();
+
+		KImage out = KVideo::findTexture(rt)->exportTextureImage();
+		KBmp bmp;
+		out.lock(&bmp);
+		for (int y=0; y<H; y++) {
+			for (int x=0; x<W; x++) {
+				const uint8_t *p = bmp.data + bmp.get_offset(x, y);
+				const float *e = &ref[(W * y + x) * 4];
+				for (int c=0; c<4; c++) {
+					if (fabsf(p[c] - e[c]) > 1.0f) {
+						if (num_errors < 10) {
+							K__PRINT("Test_video_soft: (%d, %d) = [%d %d %d %d], expected [%g %g %g %g]",
+								x, y, p[0], p[1], p[2], p[3], e[0], e[1], e[2], e[3]);
+						}
+						num_errors++;
+						break;
+					}
+				}
+			}
+		}
+		out.unlock();
+
+		// チャンネルを指定した塗りつぶし。青だけが変わる
+		const uint32_t *argb = (const uint32_t *)KVideo::findTexture(rt)->lockData();
+		std::vector<uint32_t> before(argb, argb + W * H);
+		KVideo::findTexture(rt)->unlockData();
+		KVideo::fill(rt, KColor(0, 0, 1, 0), KColorChannel_B);
+		argb = (const uint32_t *)KVideo::findTexture(rt)->lockData();
+		for (int i=0; i<W*H; i++) {
+			if (argb[i] != ((before[i] & 0xFFFFFF00) | 0xFF)) {
+				num_errors++;
+			}
+		}
+		KVideo::findTexture(rt)->unlockData();
+		KVideo::deleteTexture(tex);
+		KVideo::deleteTexture(rt);
+	}
+
+	// 共有辺を持つ三角形同士で、隙間も重なりもできないことを確認する。
+	// 加算合成で扇形の多角形を描き、どのピクセルも１回だけ描かれていればよい
+	{
+		const int W = 128;
+		const int H = 128;
+		KTEXID rt = KVideo::createRenderTexture(W, H);
+		const int N = 24;
+		const KVec2 center(64.3f, 63.7f);
+		std::vector<KVertex> fan(N + 2);
+		fan[0].pos = KVec3(center.x, center.y, 0.0f);
+		float area = 0;
+		for (int i=0; i<=N; i++) {
+			float r = (i < N) ? rnd(20, 50) : 0;
+			float t = KMath::PI * 2 * i / N;
+			if (i < N) {
+				fan[i+1].pos = KVec3(center.x + r * cosf(t), center.y + r * sinf(t), 0.0f);
+			} else {
+				fan[i+1].pos = fan[1].pos;
+			}
+		}
+		for (int i=1; i<=N; i++) {
+			const KVec3 &a = fan[i].pos;
+			const KVec3 &b = fan[i+1].pos;
+			area += 0.5f * fabsf((a.x - center.x) * (b.y - center.y) - (b.x - center.x) * (a.y - center.y));
+		}
+		for (size_t i=0; i<fan.size(); i++) {
+			fan[i].dif32 = KColor32(16, 16, 16, 255);
+		}
+		KMaterial mat;
+		mat.blend = KBlend_ADD;
+		KVideo::pushRenderTarget(rt);
+		KVideo::clearColor(KColor(0, 0, 0, 1));
+		KVideo::pushRenderState();
+		KVideo::setProjection(pixel_proj(W, H));
+		KVideo::setTransform(KMatrix4());
+		KVideoUtils::beginMaterial(&mat);
+		KVideo::drawUserPtrV(fan.data(), (int)fan.size(), KPrimitive_TRIANGLE_FAN);
+		KVideoUtils::endMaterial(&mat);
+		KVideo::popRenderState();
+		KVideo::popRenderTarget();
+		const uint32_t *argb = (const uint32_t *)KVideo::findTexture(rt)->lockData();
+		int covered = 0;
+		for (int i=0; i<W*H; i++) {
+			int r = (argb[i] >> 16) & 0xFF;
+			if (r == 16) {
+				covered++;
+			} else if (r != 0) {
+				num_errors++; // 重なっている
+			}
+		}
+		if (fabsf(covered - area) > area * 0.02f) {
+			K__PRINT("Test_video_soft: fan covers %d pixels, area %g", covered, area);
+			num_errors++;
+		}
+		KVideo::findTexture(rt)->unlockData();
+		KVideo::deleteTexture(rt);
+	}
+
+	// 10000 個のスプライト (16x16) を描画する。
+	// スレッド数ごとに時間を計り、結果が同じになることを確認する
+	{
+		const int W = 1280;
+		const int H = 720;
+		const int NUM_SPRITES = 10000;
+		const int NUM_FRAMES = 5;
+		KTEXID rt = KVideo::createRenderTexture(W, H);
+		KImage img = KImage::createFromPixels(16, 16, KColorFormat_RGBA32, nullptr);
+		{
+			KBmp bmp;
+			img.lock(&bmp);
+			for (int i=0; i<16*16*4; i++) {
+				bmp.data[i] = (uint8_t)rnd(0, 256);
+			}
+			img.unlock();
+		}
+		KTEXID tex = KVideo::createTextureFromImage(img);
+		KDrawList dl;
+		KMaterial mat;
+		mat.texture = tex;
+		mat.filter = KFilter_LINEAR;
+		dl.setProjection(pixel_proj(W, H));
+		dl.setTransform(KMatrix4());
+		dl.setPrimitive(KPrimitive_TRIANGLES);
+		for (int i=0; i<NUM_SPRITES; i++) {
+			// 回転したスプライトも混ぜる。ブレンドはまとめて切り替える（描画コマンドが結合されるように）
+			const KBlend blends[] = {KBlend_ALPHA, KBlend_ALPHA, KBlend_ADD, KBlend_SCREEN};
+			mat.blend = blends[i * 4 / NUM_SPRITES];
+			dl.setMaterial(mat);
+			const float cx = rnd(-8, W + 8);
+			const float cy = rnd(-8, H + 8);
+			const float deg = (i % 3 == 0) ? rnd(0, 360) : 0;
+			const float c = cosf(KMath::degToRad(deg)) * 8;
+			const float s = sinf(KMath::degToRad(deg)) * 8;
+			const KColor32 color(255, 255, 255, (int)rnd(64, 256));
+			KVertex v[6];
+			v[0].pos = KVec3(cx - c + s, cy - s - c, 0.0f); v[0].tex = KVec2(0, 0);
+			v[1].pos = KVec3(cx + c + s, cy + s - c, 0.0f); v[1].tex = KVec2(1, 0);
+			v[2].pos = KVec3(cx - c - s, cy - s + c, 0.0f); v[2].tex = KVec2(0, 1);
+			v[3] = v[2];
+			v[4] = v[1];
+			v[5].pos = KVec3(cx + c - s, cy + s + c, 0.0f); v[5].tex = KVec2(1, 1);
+			for (int k=0; k<6; k++) {
+				v[k].dif32 = color;
+			}
+			dl.addVertices(v, 6);
+		}
+		dl.endList();
+
+		const int thread_counts[] = {1, 4, 0};
+		std::vector<uint32_t> result[3];
+		int usec[3];
+		int drawcalls = 0;
+		for (int t=0; t<3; t++) {
+			KVideo::setParameter(KVideo::PARAM_RENDER_THREADS, thread_counts[t]);
+			int64_t nano = 0;
+			for (int f=0; f<NUM_FRAMES; f++) {
+				KClock clock;
+				KVideo::pushRenderTarget(rt);
+				KVideo::clearColor(KColor(0, 0, 0, 1));
+				KVideo::getParameter(KVideo::PARAM_DRAWCALLS, &drawcalls); // リセット
+				dl.draw();
+				KVideo::getParameter(KVideo::PARAM_DRAWCALLS, &drawcalls);
+				KVideo::popRenderTarget(); // ここでラスタライズする
+				nano += clock.getTimeNano64();
+			}
+			usec[t] = (int)(nano / 1000 / NUM_FRAMES);
+			const uint32_t *argb = (const uint32_t *)KVideo::findTexture(rt)->lockData();
+			result[t].assign(argb, argb + W * H);
+			KVideo::findTexture(rt)->unlockData();
+		}
+		int hw_threads = 0;
+		KVideo::getParameter(KVideo::PARAM_RENDER_THREADS, &hw_threads);
+		K__PRINT("Test_video_soft: %d sprites on %dx%d, %d draw calls: 1 thread %d usec/frame, 4 threads %d usec/frame, %d threads %d usec/frame",
+			NUM_SPRITES, W, H, drawcalls, usec[0], usec[1], hw_threads, usec[2]);
+		if (result[0] != result[1] || result[0] != result[2]) {
+			num_errors++;
+		}
+		KVideo::deleteTexture(tex);
+		KVideo::deleteTexture(rt);
+	}
+	K__ASSERT(num_errors == 0);
+
+	KVideo::setParameter(KVideo::PARAM_RENDER_THREADS, old_threads);
+	if (own_init) KVideo::shutdown();
+}
+
+void Test_drawlist_batch() {
+	bool own_init = !KVideo::isInit();
+	if (own_init) KVideo::init(nullptr, nullptr, nullptr);
+
+	uint32_t seed = 31415;
+	auto rnd = [&seed](float lo, float hi) {
+		seed = seed * 1664525 + 1013904223;
+		return lo + (hi - lo) * ((seed >> 8) / (float)(1 << 24));
+	};
+	auto pixel_proj = [](int w, int h) {
+		return KMatrix4(
+			2.0f / w, 0, 0, 0,
+			0, -2.0f / h, 0, 0,
+			0, 0, 1, 0,
+			-1, 1, 0, 1
+		);
+	};
+	auto read_pixels = [](KTEXID rt, int w, int h) {
+		const uint32_t *argb = (const uint32_t *)KVideo::findTexture(rt)->lockData();
+		std::vector<uint32_t> out(argb, argb + w * h);
+		KVideo::findTexture(rt)->unlockData();
+		return out;
+	};
+	int num_errors = 0;
+
+	// インデックス付きの頂点配列が１つの描画アイテムに結合され、インデックスが正しくずらされていること
+	{
+		const int W = 16;
+		const int H = 16;
+		KTEXID rt = KVideo::createRenderTexture(W, H);
+		KDrawList dl;
+		KMaterial mat;
+		mat.blend = KBlend_ONE;
+		dl.setMaterial(mat);
+		dl.setProjection(pixel_proj(W, H));
+		dl.setPrimitive(KPrimitive_TRIANGLES);
+		const int idx[] = {0, 1, 2, 2, 1, 3};
+		for (int q=0; q<4; q++) {
+			// 4x4 ピクセルの四角形を対角線上に並べる
+			const float x0 = q * 4 - K_HALF_PIXEL;
+			const float y0 = q * 4 - K_HALF_PIXEL;
+			KVertex v[4];
+			v[0].pos = KVec3(x0,     y0,     0.0f);
+			v[1].pos = KVec3(x0 + 4, y0,     0.0f);
+			v[2].pos = KVec3(x0,     y0 + 4, 0.0f);
+			v[3].pos = KVec3(x0 + 4, y0 + 4, 0.0f);
+			for (int k=0; k<4; k++) {
+				v[k].dif32 = KColor32(255, 64 * q, 0, 255);
+			}
+			dl.addVerticesWithIndex(v, 4, idx, 6);
+		}
+		dl.endList();
+		if (dl.size() != 1) num_errors++;
+
+		KVideo::pushRenderTarget(rt);
+		KVideo::clearColor(KColor(0, 0, 0, 1));
+		dl.draw();
+		KVideo::popRenderTarget();
+		if (dl.getDrawCallCount() != 1) num_errors++;
+
+		std::vector<uint32_t> pixels = read_pixels(rt, W, H);
+		for (int y=0; y<H; y++) {
+			for (int x=0; x<W; x++) {
+				uint32_t expected = 0xFF000000;
+				if (x / 4 == y / 4) {
+					expected = 0xFFFF0000 | ((64 * (x / 4)) << 8);
+				}
+				if (pixels[W * y + x] != expected) num_errors++;
+			}
+		}
+		KVideo::deleteTexture(rt);
+	}
+
+	// 10000 個のスプライトをそれぞれ異なる変形行列で描画する。
+	// 事前変形なしの場合と、事前変形して結合した場合とで描画コマンド数と結果を比べる
+	{
+		const int W = 1280;
+		const int H = 720;
+		const int NUM_SPRITES = 10000;
+		KTEXID rt = KVideo::createRenderTexture(W, H);
+		KTEXID tex[2];
+		for (int t=0; t<2; t++) {
+			KImage img = KImage::createFromPixels(16, 16, KColorFormat_RGBA32, nullptr);
+			KBmp bmp;
+			img.lock(&bmp);
+			for (int i=0; i<16*16*4; i++) {
+				bmp.data[i] = (uint8_t)rnd(0, 256);
+			}
+			img.unlock();
+			tex[t] = KVideo::createTextureFromImage(img);
+		}
+		struct SSprite {
+			KMatrix4 transform;
+			KColor32 color;
+			int tex;
+		};
+		std::vector<SSprite> sprites(NUM_SPRITES);
+		for (int i=0; i<NUM_SPRITES; i++) {
+			SSprite &sp = sprites[i];
+			// スプライトごとに平行移動と回転を持つ。テクスチャは 4 回だけ切り替わる
+			const float deg = (i % 3 == 0) ? rnd(0, 360) : 0;
+			const float c = cosf(KMath::degToRad(deg));
+			const float s = sinf(KMath::degToRad(deg));
+			sp.transform = KMatrix4(
+				c, s, 0, 0,
+				-s, c, 0, 0,
+				0, 0, 1, 0,
+				floorf(rnd(0, W)) + 0.5f, floorf(rnd(0, H)) + 0.5f, 0, 1 // 角をピクセル境界に置く
+			);
+			sp.color = KColor32(255, 255, 255, (int)rnd(64, 256));
+			sp.tex = (i * 4 / NUM_SPRITES) % 2;
+		}
+		const int idx[] = {0, 1, 2, 2, 1, 3};
+		std::vector<uint32_t> result[2];
+		int usec[2];
+		int drawcalls[2];
+		int statechanges[2];
+		int items[2];
+		for (int mode=0; mode<2; mode++) {
+			KDrawList dl;
+			dl.setPreTransform(mode == 1);
+			dl.setProjection(pixel_proj(W, H));
+			dl.setPrimitive(KPrimitive_TRIANGLES);
+			KMaterial mat;
+			mat.blend = KBlend_ALPHA;
+			for (int i=0; i<NUM_SPRITES; i++) {
+				const SSprite &sp = sprites[i];
+				mat.texture = tex[sp.tex];
+				dl.setMaterial(mat);
+				dl.setTransform(sp.transform);
+				KVertex v[4];
+				v[0].pos = KVec3(-8.0f, -8.0f, 0.0f); v[0].tex = KVec2(0, 0);
+				v[1].pos = KVec3( 8.0f, -8.0f, 0.0f); v[1].tex = KVec2(1, 0);
+				v[2].pos = KVec3(-8.0f,  8.0f, 0.0f); v[2].tex = KVec2(0, 1);
+				v[3].pos = KVec3( 8.0f,  8.0f, 0.0f); v[3].tex = KVec2(1, 1);
+				for (int k=0; k<4; k++) {
+					v[k].dif32 = sp.color;
+				}
+				dl.addVerticesWithIndex(v, 4, idx, 6);
+			}
+			dl.endList();
+			items[mode] = (int)dl.size();
+
+			KClock clock;
+			KVideo::pushRenderTarget(rt);
+			KVideo::clearColor(KColor(0, 0, 0, 1));
+			dl.draw();
+			KVideo::popRenderTarget();
+			usec[mode] = (int)(clock.getTimeNano64() / 1000);
+			drawcalls[mode] = dl.getDrawCallCount();
+			statechanges[mode] = dl.getStateChangeCount();
+			result[mode] = read_pixels(rt, W, H);
+		}
+		K__PRINT("Test_drawlist_batch: %d sprites, separate transforms: %d items, %d draw calls, %d state changes, %d usec",
+			NUM_SPRITES, items[0], drawcalls[0], statechanges[0], usec[0]);
+		K__PRINT("Test_drawlist_batch: %d sprites, pre-transformed:     %d items, %d draw calls, %d state changes, %d usec",
+			NUM_SPRITES, items[1], drawcalls[1], statechanges[1], usec[1]);
+		if (drawcalls[0] != NUM_SPRITES) num_errors++;
+		if (drawcalls[1] != 4) num_errors++;
+
+		// CPU で変形した場合も同じ画像になること。
+		// 変形の計算順序が違うので、ポリゴンの境界で丸め方が変わるピクセルはわずかに許容する
+		int num_diff = 0;
+		for (int i=0; i<W*H; i++) {
+			if (result[0][i] != result[1][i]) num_diff++;
+		}
+		if (num_diff > W * H / 1000) num_errors++;
+
+		KVideo::deleteTexture(tex[0]);
+		KVideo::deleteTexture(tex[1]);
+		KVideo::deleteTexture(rt);
+	}
+
+	// ステンシル付きで色を書き込まないアイテムの直後にユーザー定義の描画がある場合、
+	// ユーザー定義の描画にはステンシルと書き込みマスクが引き継がれないこと
+	{
+		const int W = 8;
+		const int H = 8;
+		struct CDrawCallback: public KMaterialCallback {
+			KMatrix4 proj;
+			virtual void onMaterial_Draw(const KDrawListItem *item, bool *done) override {
+				// 画面全体を赤で塗る
+				KVertex v[4];
+				v[0].pos = KVec3(-K_HALF_PIXEL,     -K_HALF_PIXEL,     0.0f);
+				v[1].pos = KVec3( W - K_HALF_PIXEL, -K_HALF_PIXEL,     0.0f);
+				v[2].pos = KVec3(-K_HALF_PIXEL,      H - K_HALF_PIXEL, 0.0f);
+				v[3].pos = KVec3( W - K_HALF_PIXEL,  H - K_HALF_PIXEL, 0.0f);
+				for (int k=0; k<4; k++) {
+					v[k].dif32 = KColor32(255, 0, 0, 255);
+				}
+				KMaterial mat;
+				mat.blend = KBlend_ONE;
+				KVideo::setProjection(proj);
+				KVideo::setTransform(KMatrix4());
+				KVideoUtils::beginMaterial(&mat);
+				KVideo::drawUserPtrV(v, 4, KPrimitive_TRIANGLE_STRIP);
+				KVideoUtils::endMaterial(&mat);
+				*done = true;
+			}
+		};
+		CDrawCallback cb;
+		cb.proj = pixel_proj(W, H);
+		KTEXID rt = KVideo::createRenderTexture(W, H);
+		KDrawList dl;
+		dl.setProjection(pixel_proj(W, H));
+		dl.setPrimitive(KPrimitive_TRIANGLES);
+		KMaterial mat;
+		mat.blend = KBlend_ONE;
+		dl.setMaterial(mat);
+		dl.setStencil(true);
+		dl.setStencilOpt(KVideo::STENCILFUNC_EQUAL, 1, KVideo::STENCILOP_KEEP); // ステンシルは 0 なので常に失敗する
+		dl.setColorWrite(false);
+		KVertex v[3];
+		v[0].pos = KVec3(0.0f, 0.0f, 0.0f);
+		v[1].pos = KVec3(4.0f, 0.0f, 0.0f);
+		v[2].pos = KVec3(0.0f, 4.0f, 0.0f);
+		dl.addVertices(v, 3);
+		dl.setStencil(false);
+		dl.setColorWrite(true);
+		mat.cb = &cb;
+		dl.setMaterial(mat);
+		dl.addVertices(v, 3);
+		dl.endList();
+		if (dl.size() != 2) num_errors++;
+
+		KVideo::pushRenderTarget(rt);
+		KVideo::clearColor(KColor(0, 0, 0, 1));
+		KVideo::clearStencil(0);
+		dl.draw();
+		KVideo::popRenderTarget();
+
+		std::vector<uint32_t> pixels = read_pixels(rt, W, H);
+		for (int i=0; i<W*H; i++) {
+			if (pixels[i] != 0xFFFF0000) num_errors++;
+		}
+		KVideo::deleteTexture(rt);
+	}
+	K__ASSERT(num_errors == 0);
+
+	if (own_init) KVideo::shutdown();
+}
+
+void Test_drawlist_stream() {
+	bool own_init = !KVideo::isInit();
+	if (own_init) KVideo::init(nullptr, nullptr, nullptr);
+
+	uint32_t seed = 27182;
+	auto rnd = [&seed](float lo, float hi) {
+		seed = seed * 1664525 + 1013904223;
+		return lo + (hi - lo) * ((seed >> 8) / (float)(1 << 24));
+	};
+	int stats[3]; // 転送バイト数、ロック回数、DISCARD 回数
+	int num_errors = 0;
+
+	// リングバッファの動作
+	{
+		std::vector<KVertex> v(K__STREAM_MIN_VERTICES * 3);
+		KVideo::getParameter(KVideo::PARAM_STREAM_STATS, stats); // リセット
+
+		// 空きがあれば直前の書き込みの後ろに続けて書き込む
+		int a = KVideo::writeStreamVertices(v.data(), 100);
+		int b = KVideo::writeStreamVertices(v.data(), 100);
+		if (a < 0) num_errors++;
+		if (b != a + 100 && b != 0) num_errors++;
+		KVideo::getParameter(KVideo::PARAM_STREAM_STATS, stats);
+		if (stats[0] != sizeof(KVertex) * 200) num_errors++;
+		if (stats[1] != 2) num_errors++;
+
+		// 一周すると先頭に戻り、DISCARD になる
+		int prev = -1;
+		int wraps = 0;
+		for (int k=0; k<8; k++) {
+			int start = KVideo::writeStreamVertices(v.data(), K__STREAM_MIN_VERTICES / 4);
+			if (start < 0) num_errors++;
+			if (start < prev) wraps++;
+			prev = start;
+		}
+		KVideo::getParameter(KVideo::PARAM_STREAM_STATS, stats);
+		if (wraps < 1) num_errors++;
+		if (stats[2] != wraps) num_errors++;
+
+		// 容量を超える書き込みではバッファを大きくして先頭から書く
+		int big = KVideo::writeStreamVertices(v.data(), (int)v.size());
+		if (big != 0) num_errors++;
+		KVideo::getParameter(KVideo::PARAM_STREAM_STATS, stats);
+		if (stats[2] != 1) num_errors++;
+	}
+
+	// 20000 個の四角形を、ストリームバッファとユーザーポインタ描画とでそれぞれ描画し、
+	// 描画結果が同じであることを確認して、転送量と時間を比べる
+	{
+		const int W = 1280;
+		const int H = 720;
+		const int NUM_QUADS = 20000;
+		const int NUM_TEX = 8;
+		const int RUN = 16; // 同じテクスチャが続く四角形の数
+		const int NUM_FRAMES = 5;
+		KTEXID rt = KVideo::createRenderTexture(W, H);
+		KTEXID tex[NUM_TEX];
+		for (int t=0; t<NUM_TEX; t++) {
+			KImage img = KImage::createFromPixels(8, 8, KColorFormat_RGBA32, nullptr);
+			KBmp bmp;
+			img.lock(&bmp);
+			for (int i=0; i<8*8*4; i++) {
+				bmp.data[i] = (uint8_t)rnd(0, 256);
+			}
+			img.unlock();
+			tex[t] = KVideo::createTextureFromImage(img);
+		}
+		std::vector<KVertex> quads(NUM_QUADS * 4);
+		for (int i=0; i<NUM_QUADS; i++) {
+			const float x = floorf(rnd(0, W - 8)) - K_HALF_PIXEL;
+			const float y = floorf(rnd(0, H - 8)) - K_HALF_PIXEL;
+			const KColor32 color(255, 255, 255, (int)rnd(64, 256));
+			KVertex *v = &quads[i * 4];
+			v[0].pos = KVec3(x,        y,        0.0f); v[0].tex = KVec2(0, 0);
+			v[1].pos = KVec3(x + 8.0f, y,        0.0f); v[1].tex = KVec2(1, 0);
+			v[2].pos = KVec3(x,        y + 8.0f, 0.0f); v[2].tex = KVec2(0, 1);
+			v[3].pos = KVec3(x + 8.0f, y + 8.0f, 0.0f); v[3].tex = KVec2(1, 1);
+			for (int k=0; k<4; k++) {
+				v[k].dif32 = color;
+			}
+		}
+		const KMatrix4 proj(
+			2.0f / W, 0, 0, 0,
+			0, -2.0f / H, 0, 0,
+			0, 0, 1, 0,
+			-1, 1, 0, 1
+		);
+		KDrawList dl;
+		dl.setProjection(proj);
+		dl.setPrimitive(KPrimitive_TRIANGLES);
+		KMaterial mat;
+		mat.blend = KBlend_ALPHA;
+		const int idx[] = {0, 1, 2, 2, 1, 3};
+		for (int i=0; i<NUM_QUADS; i++) {
+			mat.texture = tex[(i / RUN) % NUM_TEX];
+			dl.setMaterial(mat);
+			dl.addVerticesWithIndex(&quads[i * 4], 4, idx, 6);
+		}
+		dl.endList();
+
+		std::vector<uint32_t> result[2];
+		int usec[2];
+		int bytes[2];
+		int locks[2];
+		for (int mode=0; mode<2; mode++) {
+			dl.setStreamBuffer(mode == 0);
+			KVideo::getParameter(KVideo::PARAM_STREAM_STATS, stats); // リセット
+			KClock clock;
+			for (int f=0; f<NUM_FRAMES; f++) {
+				KVideo::pushRenderTarget(rt);
+				KVideo::clearColor(KColor(0, 0, 0, 1));
+				dl.draw();
+				KVideo::popRenderTarget();
+			}
+			usec[mode] = (int)(clock.getTimeNano64() / 1000 / NUM_FRAMES);
+			KVideo::getParameter(KVideo::PARAM_STREAM_STATS, stats);
+			bytes[mode] = stats[0] / NUM_FRAMES;
+			locks[mode] = stats[1] / NUM_FRAMES;
+			if (dl.getDrawCallCount() != NUM_QUADS / RUN) num_errors++;
+			const uint32_t *argb = (const uint32_t *)KVideo::findTexture(rt)->lockData();
+			result[mode].assign(argb, argb + W * H);
+			KVideo::findTexture(rt)->unlockData();
+		}
+		if (result[0] != result[1]) num_errors++;
+		if (locks[0] != 2) num_errors++; // 頂点とインデックスを１回ずつ
+		if (locks[1] != NUM_QUADS / RUN) num_errors++;
+
+		// 頂点とインデックスの書き込みだけにかかる時間
+		const int NUM_UPLOADS = 100;
+		const KMesh *mesh = dl.getMesh();
+		KClock clock;
+		for (int f=0; f<NUM_UPLOADS; f++) {
+			KVideo::writeStreamVertices(mesh->getVertices(), mesh->getVertexCount());
+			KVideo::writeStreamIndices(mesh->getIndices(), mesh->getIndexCount());
+		}
+		const int upload_nsec = (int)(clock.getTimeNano64() / NUM_UPLOADS);
+		KVideo::getParameter(KVideo::PARAM_STREAM_STATS, stats); // リセット
+
+		K__PRINT("Test_drawlist_stream: %d quads, %d draw calls: stream %d bytes/frame, %d locks/frame, %d usec/frame; user pointer %d bytes/frame, %d locks/frame, %d usec/frame",
+			NUM_QUADS, NUM_QUADS / RUN, bytes[0], locks[0], usec[0], bytes[1], locks[1], usec[1]);
+		K__PRINT("Test_drawlist_stream: upload %d vertices + %d indices: %d usec/frame (%.1f M vertices/sec)",
+			mesh->getVertexCount(), mesh->getIndexCount(), upload_nsec / 1000, mesh->getVertexCount() * 1000.0 / upload_nsec);
+
+		for (int t=0; t<NUM_TEX; t++) {
+			KVideo::deleteTexture(tex[t]);
+		}
+		KVideo::deleteTexture(rt);
+	}
+	K__ASSERT(num_errors == 0);
+
+	if (own_init) KVideo::shutdown();
+}
+
+void Test_vertex_compact() {
+	bool own_init = !KVideo::isInit();
+	if (own_init) KVideo::init(nullptr, nullptr, nullptr);
+
+	uint32_t seed = 16180;
+	auto rnd = [&seed](float lo, float hi) {
+		seed = seed * 1664525 + 1013904223;
+		return lo + (hi - lo) * ((seed >> 8) / (float)(1 << 24));
+	};
+	auto make_quad = [](KVertex *v, float x, float y, float size, const KVec2 &uv0, const KVec2 &uv1, const KColor32 &color) {
+		v[0].pos = KVec3(x,        y,        0.0f); v[0].tex = KVec2(uv0.x, uv0.y);
+		v[1].pos = KVec3(x + size, y,        0.0f); v[1].tex = KVec2(uv1.x, uv0.y);
+		v[2].pos = KVec3(x,        y + size, 0.0f); v[2].tex = KVec2(uv0.x, uv1.y);
+		v[3].pos = KVec3(x + size, y + size, 0.0f); v[3].tex = KVec2(uv1.x, uv1.y);
+		for (int k=0; k<4; k++) {
+			v[k].dif32 = color;
+		}
+	};
+	const int idx[] = {0, 1, 2, 2, 1, 3};
+	int num_errors = 0;
+
+	// 変換できる頂点とできない頂点
+	{
+		KVertex v;
+		v.pos = KVec3(1.5f, -2.0f, 3.0f);
+		v.tex = KVec2(0.375f, 1.0f);
+		v.dif32 = KColor32(10, 20, 30, 40);
+		if (!KVertexCompact::canPack(v)) num_errors++;
+		KVertexCompact c;
+		c.pack(v);
+		KVertex w = c.unpack();
+		if (w.pos != v.pos) num_errors++;
+		if (w.dif32 != v.dif32) num_errors++;
+		if (fabsf(w.tex.x - v.tex.x) > 0.5f / 65535) num_errors++;
+		if (w.tex.y != 1.0f) num_errors++;
+
+		KVertex spe = v;
+		spe.spe32 = KColor32(1, 0, 0, 0);
+		KVertex uv2 = v;
+		uv2.tex2 = KVec2(0.5f, 0.0f);
+		KVertex wrap = v;
+		wrap.tex = KVec2(2.0f, 0.0f);
+		if (KVertexCompact::canPack(spe)) num_errors++;
+		if (KVertexCompact::canPack(uv2)) num_errors++;
+		if (KVertexCompact::canPack(wrap)) num_errors++;
+	}
+
+	// メッシュの頂点レイアウトは頂点に合わせて変わる
+	{
+		KMesh mesh;
+		KVertex v[4];
+		make_quad(v, 0, 0, 8, KVec2(0, 0), KVec2(1, 1), KColor32::WHITE);
+		mesh.setVertices(0, v, 4);
+		if (mesh.getVertexLayout() != KVertexLayout_COMPACT) num_errors++;
+		mesh.setSpecular(2, KColor(0.5f, 0.0f, 0.0f, 0.0f));
+		if (mesh.getVertexLayout() != KVertexLayout_FULL) num_errors++;
+		mesh.setSpecular(2, KColor(0.0f, 0.0f, 0.0f, 0.0f));
+		if (mesh.getVertexLayout() != KVertexLayout_COMPACT) num_errors++;
+		mesh.setTexCoords2(1, KVec2(1, 1));
+		if (mesh.getVertexLayout() != KVertexLayout_FULL) num_errors++;
+	}
+
+	// 変換できない頂点を追加すると、それまでの頂点ごと KVertexLayout_FULL に広がる
+	{
+		KDrawList dl;
+		dl.setVertexLayout(KVertexLayout_COMPACT);
+		dl.setPrimitive(KPrimitive_TRIANGLES);
+		KVertex a[4];
+		KVertex b[4];
+		make_quad(a, 0, 0, 8, KVec2(0, 0), KVec2(0.5f, 0.5f), KColor32(255, 0, 0, 255));
+		make_quad(b, 8, 0, 8, KVec2(0, 0), KVec2(1, 1), KColor32(0, 255, 0, 255));
+		b[0].spe32 = KColor32(64, 64, 64, 0);
+		dl.addVerticesWithIndex(a, 4, idx, 6);
+		if (dl.getVertexLayout() != KVertexLayout_COMPACT) num_errors++;
+		dl.addVerticesWithIndex(b, 4, idx, 6);
+		if (dl.getVertexLayout() != KVertexLayout_FULL) num_errors++;
+		dl.endList();
+		const KVertex *v = dl.getMesh()->getVertices();
+		if (dl.getVertexCount() != 8) num_errors++;
+		if (fabsf(v[3].tex.x - 0.5f) > 0.5f / 65535) num_errors++; // 広げる前の頂点はテクスチャ座標が量子化されている
+		if (v[4].spe32 != b[0].spe32) num_errors++;
+
+		// シェーダー付きのマテリアルでも広がる。clear() で元のレイアウトに戻る
+		dl.clear();
+		if (dl.getVertexLayout() != KVertexLayout_COMPACT) num_errors++;
+		KMaterial mat;
+		mat.shader = (KSHADERID)&mat; // 判定に使うだけで、描画はしない
+		dl.setMaterial(mat);
+		dl.addVerticesWithIndex(a, 4, idx, 6);
+		if (dl.getVertexLayout() != KVertexLayout_FULL) num_errors++;
+		dl.clear();
+	}
+
+	// 20000 個の四角形を両方のレイアウトで記録、描画して、メモリ量と時間を比べ、描画結果が同じであることを確認する
+	{
+		const int W = 1280;
+		const int H = 720;
+		const int NUM_QUADS = 20000;
+		const int NUM_FILLS = 20;
+		KTEXID rt = KVideo::createRenderTexture(W, H);
+		KTEXID tex;
+		{
+			// 4x4 コマのアトラス
+			KImage img = KImage::createFromPixels(32, 32, KColorFormat_RGBA32, nullptr);
+			KBmp bmp;
+			img.lock(&bmp);
+			for (int i=0; i<32*32*4; i++) {
+				bmp.data[i] = (uint8_t)rnd(0, 256);
+			}
+			img.unlock();
+			tex = KVideo::createTextureFromImage(img);
+		}
+		std::vector<KVertex> quads(NUM_QUADS * 4);
+		for (int i=0; i<NUM_QUADS; i++) {
+			const int cell = (int)rnd(0, 16);
+			const KVec2 uv0((cell % 4) * 0.25f, (cell / 4) * 0.25f);
+			const KVec2 uv1 = uv0 + KVec2(0.25f, 0.25f);
+			const float x = floorf(rnd(0, W - 16)) - K_HALF_PIXEL;
+			const float y = floorf(rnd(0, H - 16)) - K_HALF_PIXEL;
+			make_quad(&quads[i * 4], x, y, 16, uv0, uv1, KColor32(255, 255, 255, (int)rnd(64, 256)));
+		}
+		const KMatrix4 proj(
+			2.0f / W, 0, 0, 0,
+			0, -2.0f / H, 0, 0,
+			0, 0, 1, 0,
+			-1, 1, 0, 1
+		);
+		std::vector<uint32_t> result[2][2]; // [フィルター][レイアウト]
+		int fill_usec[2];
+		int draw_usec[2];
+		int vertex_bytes[2];
+		int upload_bytes[2];
+		int stats[3];
+		for (int filter=0; filter<2; filter++) {
+			for (int mode=0; mode<2; mode++) {
+				KDrawList dl;
+				dl.setVertexLayout(mode == 0 ? KVertexLayout_FULL : KVertexLayout_COMPACT);
+				KMaterial mat;
+				mat.blend = KBlend_ALPHA;
+				mat.filter = filter == 0 ? KFilter_NONE : KFilter_LINEAR;
+				mat.texture = tex;
+
+				// 頂点の記録
+				KClock clock;
+				for (int f=0; f<NUM_FILLS; f++) {
+					dl.clear();
+					dl.setProjection(proj);
+					dl.setPrimitive(KPrimitive_TRIANGLES);
+					dl.setMaterial(mat);
+					for (int i=0; i<NUM_QUADS; i++) {
+						dl.addVerticesWithIndex(&quads[i * 4], 4, idx, 6);
+					}
+					dl.endList();
+				}
+				fill_usec[mode] = (int)(clock.getTimeNano64() / 1000 / NUM_FILLS);
+				if (dl.getVertexLayout() != (mode == 0 ? KVertexLayout_FULL : KVertexLayout_COMPACT)) num_errors++;
+				vertex_bytes[mode] = dl.getVertexCount() * (mode == 0 ? sizeof(KVertex) : sizeof(KVertexCompact));
+
+				// 描画
+				KVideo::getParameter(KVideo::PARAM_STREAM_STATS, stats); // リセット
+				clock.reset();
+				KVideo::pushRenderTarget(rt);
+				KVideo::clearColor(KColor(0, 0, 0, 1));
+				dl.draw();
+				KVideo::popRenderTarget();
+				draw_usec[mode] = (int)(clock.getTimeNano64() / 1000);
+				KVideo::getParameter(KVideo::PARAM_STREAM_STATS, stats);
+				upload_bytes[mode] = stats[0];
+				const uint32_t *argb = (const uint32_t *)KVideo::findTexture(rt)->lockData();
+				result[filter][mode].assign(argb, argb + W * H);
+				KVideo::findTexture(rt)->unlockData();
+			}
+		}
+		K__PRINT("Test_vertex_compact: %d quads, full:    %d vertex bytes, %d upload bytes, fill %d usec, draw %d usec",
+			NUM_QUADS, vertex_bytes[0], upload_bytes[0], fill_usec[0], draw_usec[0]);
+		K__PRINT("Test_vertex_compact: %d quads, compact: %d vertex bytes, %d upload bytes, fill %d usec, draw %d usec",
+			NUM_QUADS, vertex_bytes[1], upload_bytes[1], fill_usec[1], draw_usec[1]);
+		if (vertex_bytes[1] * 36 != vertex_bytes[0] * 20) num_errors++;
+
+		// テクスチャ座標の量子化誤差は 1/131070 以下なので、フィルターなしでは同じテクセルを参照し、描画結果は一致する。
+		// バイリニア補間では補間係数がわずかにずれて丸めが変わることがある。
+		// 半透明の四角形が重なるとその差が積み重なるので、チャンネルごとに 4 までの差を許す
+		int num_diff[2] = {0, 0};
+		int max_diff[2] = {0, 0};
+		for (int filter=0; filter<2; filter++) {
+			for (int i=0; i<W*H; i++) {
+				const uint32_t a = result[filter][0][i];
+				const uint32_t b = result[filter][1][i];
+				if (a == b) continue;
+				num_diff[filter]++;
+				for (int c=0; c<32; c+=8) {
+					max_diff[filter] = KMath::max(max_diff[filter], abs((int)((a >> c) & 0xFF) - (int)((b >> c) & 0xFF)));
+				}
+			}
+		}
+		K__PRINT("Test_vertex_compact: differing pixels: nearest %d, linear %d (max %d)", num_diff[0], num_diff[1], max_diff[1]);
+		if (num_diff[0] != 0) num_errors++;
+		if (max_diff[1] > 4) num_errors++;
+		KVideo::deleteTexture(tex);
+		KVideo::deleteTexture(rt);
+	}
+	K__ASSERT(num_errors == 0);
+
+	if (own_init) KVideo::shutdown();
+}
+} // Test
+#endif // K_USE_SOFTWARE_VIDEO
+
 } // namespace
 
@@ -120,6 +120,45 @@ struct KVertex {
 	}
 };
 
+/// 頂点レイアウト
+enum KVertexLayout {
+	KVertexLayout_FULL,    ///< KVertex (36 バイト)
+	KVertexLayout_COMPACT, ///< KVertexCompact (20 バイト)
+	KVertexLayout_ENUM_MAX
+};
+
+/// スプライト向けの小さな頂点 (20 バイト)。
+/// スペキュラ色とテクスチャ座標2を持たず、テクスチャ座標は 16 ビット正規化整数 (0..65535 が 0.0..1.0 に対応) で持つ
+struct KVertexCompact {
+	KVec3 pos;
+	uint16_t u, v;   ///< テクスチャ座標1
+	KColor32 dif32;  ///< ディフューズ色
+
+	/// テクスチャ座標の量子化を除いて、v と同じ描画結果になる KVertexCompact を作れるかどうか。
+	/// スペキュラ色とテクスチャ座標2がゼロで、テクスチャ座標1が 0.0 以上 1.0 以下であれば作れる
+	static bool canPack(const KVertex &v) {
+		return
+			(v.spe32.r | v.spe32.g | v.spe32.b | v.spe32.a) == 0 &&
+			v.tex2.x == 0 && v.tex2.y == 0 &&
+			0 <= v.tex.x && v.tex.x <= 1 &&
+			0 <= v.tex.y && v.tex.y <= 1;
+	}
+	/// v を変換して格納する
+	void pack(const KVertex &v) {
+		pos = v.pos;
+		u = (uint16_t)(v.tex.x * 65535 + 0.5f);
+		this->v = (uint16_t)(v.tex.y * 65535 + 0.5f);
+		dif32 = v.dif32;
+	}
+	KVertex unpack() const {
+		KVertex out;
+		out.pos = pos;
+		out.dif32 = dif32;
+		out.tex = KVec2(u / 65535.0f, v / 65535.0f);
+		return out;
+	}
+};
+
 class KTexture: public virtual KRef {
 public:
 	enum Format {
@@ -270,6 +309,17 @@ public:
 
 		/// ビデオアダプタ名
 		PARAM_ADAPTERNAME,
+
+		/// ソフトウェア描画 (K_USE_SOFTWARE_VIDEO) でラスタライズに使うスレッド数 {int}
+		/// 0 ならハードウェアのスレッド数、1 なら呼び出し元スレッドだけで描画する。
+		/// スレッド数を変えても描画結果は変わらない。Direct3D9 では無視する
+		PARAM_RENDER_THREADS,
+
+		/// 頂点とインデックスの転送量。この値を取得すると内部カウンタがリセットされる。
+		/// {int 転送バイト数, int ロック回数, int DISCARD 回数}
+		/// ストリームバッファへの書き込みに加えて、ユーザーポインタ描画 (drawUserPtrV など) でドライバ内部のバッファに
+		/// コピーされる分も１回のロックとして数える
+		PARAM_STREAM_STATS,
 	};
 
 	static bool init(void *hWnd, void *d3d9, void *d3ddev9);
@@ -342,6 +392,30 @@ public:
 	static void drawUserPtrV(const KVertex *vertices, int count, KPrimitive primitive);
 	static void drawIndexedUserPtrV(const KVertex *vertices, int vertex_count, const int *indices, int index_count, KPrimitive primitive);
 
+	/// ストリームバッファ（動的頂点バッファをリングバッファとして使う）に頂点を書き込み、書き込んだ先頭の頂点番号を返す。
+	/// 空きがあれば前回の書き込みの後ろに追加し (NOOVERWRITE)、足りなければバッファを破棄して先頭から書き込む (DISCARD)。
+	/// 書き込んだ頂点は、次に DISCARD が起きるまで drawStreamV, drawIndexedStreamV で参照できる。
+	/// 書き込めなかった場合は -1 を返す
+	static int writeStreamVertices(const KVertex *vertices, int count);
+
+	/// KVertexCompact の頂点をストリームバッファに書き込む。描画するときは layout に KVertexLayout_COMPACT を指定する。
+	/// KVertex とは別のリングバッファに書き込むので、互いの書き込みで破棄されることはない。
+	/// ソフトウェア描画では KVertexCompact のまま (20 バイト) 格納する。
+	/// D3D9 では固定機能パイプラインが圧縮したテクスチャ座標を読めないので、テクスチャ座標だけ float に広げて 24 バイトで格納する
+	static int writeStreamVertices(const KVertexCompact *vertices, int count);
+
+	/// ストリームバッファ（動的インデックスバッファ）にインデックスを書き込み、書き込んだ先頭の位置を返す。
+	/// 動作は writeStreamVertices と同じ。頂点とは別のリングバッファなので、互いの書き込みで破棄されることはない
+	static int writeStreamIndices(const int *indices, int count);
+
+	/// ストリームバッファの start 番目から count 個の頂点を描画する。
+	/// layout には頂点を書き込んだときの頂点レイアウトを指定する
+	static void drawStreamV(int start, int count, KPrimitive primitive, KVertexLayout layout=KVertexLayout_FULL);
+
+	/// ストリームバッファのインデックス付き描画。
+	/// インデックスは base_vertex 番目の頂点を 0 とした値で、0 以上 vertex_count 未満でなければならない
+	static void drawIndexedStreamV(int base_vertex, int vertex_count, int start_index, int index_count, KPrimitive primitive, KVertexLayout layout=KVertexLayout_FULL);
+
 	static KImage getBackbufferImage();
 
 #if 1
@@ -548,6 +622,9 @@ struct KMaterial {
 		if (m1.filter != m2.filter) {
 			return false;
 		}
+		if (m1.wrap != m2.wrap) {
+			return false;
+		}
 		return true;
 	}
 };
@@ -630,6 +707,10 @@ public:
 	/// インデックス個数を返す
 	int getIndexCount() const;
 
+	/// 全ての頂点を表現できる最も小さな頂点レイアウトを返す。
+	/// 頂点が変更されたときだけ計算し直す
+	KVertexLayout getVertexLayout() const;
+
 	void setPosition  (int index, const KVec3  &pos) { setPositions (index, &pos, 0, 1); }
 	void setColor     (int index, const KColor &dif) { setColors    (index, &dif, 0, 1); }
 	void setSpecular  (int index, const KColor &spe) { setSpeculars (index, &spe, 0, 1); }
@@ -697,6 +778,7 @@ private:
 	mutable std::vector<KColor32> m_tmpspe;
 	mutable KVec3 m_whole_aabb_min;
 	mutable KVec3 m_whole_aabb_max;
+	mutable KVertexLayout m_layout;
 
 	enum {
 		POS = 0x01,
@@ -706,6 +788,7 @@ private:
 		UV2 = 0x10,
 		IDX = 0x20,
 		AABB = 0x40,
+		LAYOUT = 0x80,
 		ALL = 0xFF,
 	};
 	mutable int m_changed;
@@ -793,6 +876,30 @@ public:
 	/// ここでの設定内容は clear() または endList() が呼ばれるまで持続する
 	void setPrimitive(KPrimitive prim);
 
+	/// true にすると、追加した頂点にその時点の変形行列を CPU で適用してから格納する（既定は false）。
+	/// 変形行列だけが異なる描画アイテム同士も結合できるようになる。
+	/// 描画アイテムの transform は単位行列になるので、マテリアルのコールバックやシェーダーで
+	/// 変形行列を参照している場合は使わないこと（コールバック付きのマテリアルには適用しない）。
+	/// 射影成分を含む変形行列の場合も適用しない
+	void setPreTransform(bool value);
+
+	/// true にすると、draw() のときに全ての頂点とインデックスをまとめてストリームバッファに書き込み、
+	/// 描画アイテムごとにその範囲を描画する（既定は true）。
+	/// false ならば描画アイテムごとにユーザーポインタ描画 (KVideo::drawUserPtrV など) を使う
+	void setStreamBuffer(bool value);
+
+	/// 頂点を格納するレイアウトを指定する（既定は KVertexLayout_FULL）。
+	/// KVertexLayout_COMPACT を指定すると頂点を KVertexCompact で格納し、
+	/// 描画するときは KVideo::writeStreamVertices(const KVertexCompact*, int) で転送する（D3D9 ではテクスチャ座標だけ float に広げられる）。
+	/// ただし、KVertexCompact で表現できない頂点 (KVertexCompact::canPack) や、
+	/// シェーダー付きのマテリアル（テクスチャ座標2やスペキュラ色を参照するかもしれない）の描画を追加すると、
+	/// その時点で KVertexLayout_FULL に広げ、clear() するまでそのまま使う。
+	/// 記録済みの頂点がある場合、KVertexLayout_COMPACT の指定は次の clear() から有効になる
+	void setVertexLayout(KVertexLayout layout);
+
+	/// 現在、頂点を格納しているレイアウト
+	KVertexLayout getVertexLayout() const;
+
 	/// 頂点配列を指定し、描画リストに新しい描画アイテムを追加する
 	void addVertices(const KVertex *v, int count);
 	
@@ -803,6 +910,13 @@ public:
 	/// submesh 描画するサブメッシュ番号
 	void addMesh(const KMesh *mesh, int submesh);
 
+	/// 別の描画リスト src に記録した内容を末尾に追加する。
+	/// src に記録したのと同じ順番で、このリストに直接 addVertices などを呼んだ場合と同じ内容になる
+	/// （src の先頭のアイテムは、条件が合えばこのリストの末尾のアイテムと結合する）。
+	/// src には endList() を呼ばずに渡すこと。
+	/// ただし、src の描画設定は初期状態から始まるので、直前の描画設定を引き継ぐことを前提にした記録は同じ結果にならない
+	void append(const KDrawList &src);
+
 	/// 描画リストの終端処理を行う
 	void endList();
 
@@ -812,22 +926,64 @@ public:
 
 	KDrawListItem & operator[](size_t index);
 
+	/// 描画アイテムが参照している頂点とインデックスをまとめたメッシュ。
+	/// 頂点レイアウトが KVertexLayout_COMPACT の場合、頂点は getCompactVertices() で得る（メッシュにはインデックスだけが入る）
+	const KMesh * getMesh() const;
+
+	/// 頂点レイアウトが KVertexLayout_COMPACT の場合の頂点配列。
+	/// 頂点数は getVertexCount() で得る
+	const KVertexCompact * getCompactVertices() const;
+
+	/// 記録した頂点の数
+	int getVertexCount() const;
+
+	/// 直前の draw() で発行した描画コマンドの数
+	int getDrawCallCount() const;
+
+	/// 直前の draw() で変更したレンダーステートの数。
+	/// 投影行列、変形行列、マテリアル、ステンシル、カラーマスクの変更をそれぞれ１回と数える
+	int getStateChangeCount() const;
+
 private:
 	/// 前回と今回の描画設定を比較する。
 	/// 同一のレンダーステートになっていて結合描画可能であれば true を返す
 	bool is_changed();
 
+	/// setPreTransform が有効なら、頂点に変形行列を適用した配列を返し、m_next.transform を単位行列にする。
+	/// そうでなければ v をそのまま返す
+	const KVertex * pre_transform(const KVertex *v, int count);
+
+	/// 頂点レイアウトが KVertexLayout_COMPACT のとき、これから追加する頂点のために KVertexLayout_FULL に広げる必要があれば広げる
+	void widen_if_needed(const KVertex *v, int count);
+
+	/// 格納している頂点を KVertexLayout_FULL に広げる
+	void widen();
+
+	/// 現在の頂点レイアウトで offset 番目から頂点を格納する
+	void put_vertices(int offset, const KVertex *v, int count);
+
 	std::vector<KDrawListItem> m_items;
 	KMesh m_unimesh;
 	KDrawListItem m_next;
 	KDrawListItem m_last;
+	KDrawListItem m_first; // 最初に頂点を追加したときの描画設定 (append で使う)
 	bool m_changed;
+	bool m_pretransform;
+	bool m_stream;
+	KVertexLayout m_layout;          // setVertexLayout で指定したレイアウト
+	bool m_compact;                  // 頂点を m_compact_vertices に格納している
+	KVertexLayout m_adding_layout;   // addMesh で追加中のメッシュの頂点レイアウト。それ以外のときは KVertexLayout_ENUM_MAX
+	std::vector<KVertexCompact> m_compact_vertices; // KVertexArray と同じく、コンストラクタを呼ばないように縮めずに使う
+	int m_num_compact_vertices;
+	int m_drawcalls;
+	int m_statechanges;
 
 	std::vector<KVec3> m_tmp_pos;
 	std::vector<KColor32> m_tmp_dif;
 	std::vector<KColor32> m_tmp_spe;
 	std::vector<KVec2> m_tmp_uv1;
 	std::vector<KVec2> m_tmp_uv2;
+	std::vector<KVertex> m_tmp_vertices;
 };
 
 extern const KColor K_GIZMO_LINE_COLOR; // KColor(0, 1, 0, 1);
@@ -1006,4 +1162,12 @@ public:
 
 };
 
+
+namespace Test {
+void Test_video_soft(); // K_USE_SOFTWARE_VIDEO でビルドした場合のみ
+void Test_drawlist_batch(); // K_USE_SOFTWARE_VIDEO でビルドした場合のみ
+void Test_drawlist_stream(); // K_USE_SOFTWARE_VIDEO でビルドした場合のみ
+void Test_vertex_compact(); // K_USE_SOFTWARE_VIDEO でビルドした場合のみ
+}
+
 } // namespace
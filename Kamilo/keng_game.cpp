@@ -4,6 +4,7 @@
 #include <map>
 #include <unordered_map>
 #include <queue>
+#include <thread> // std::this_thread::yield
 #include "KAnimation.h"
 #include "KCamera.h"
 #include "KDebug.h"
@@ -23,6 +24,7 @@
 #include "KStorage.h"
 #include "KSystem.h"
 #include "KSig.h"
+#include "KThread.h"
 #include "KXml.h"
 #include "KWindow.h"
 
@@ -234,6 +236,30 @@ std::string KEngine::passImageName(int index) {
 }
 
 
+// 次のフレーム開始時に実行するための命令。
+// メインスレッド以外からのシグナル送信やノードツリーの変更は、この形でキューに入れる
+struct SEngineCommand {
+	enum Type {
+		CMD_NONE,
+		CMD_BROADCAST,   // KEngine::broadcastSignalAsync(sig)
+		CMD_SUBSCRIBERS, // KEngine::sendSignalToSubscribers(sig)
+		CMD_SEND,        // target に sig を送る
+		CMD_SET_PARENT,  // node の親を target にする（target が nullptr ならルート）
+		CMD_REMOVE,      // target を削除する
+	};
+	Type type;
+	KSig sig;
+	EID target;
+	KNode *node; // CMD_SET_PARENT の対象。キューに入れる側が grab しておく
+
+	SEngineCommand() {
+		type = CMD_NONE;
+		target = nullptr;
+		node = nullptr;
+	}
+};
+
+
 class CEngineImpl:
 	public KNodeRemovingCallback,
 	public KWindowCallback {
@@ -243,7 +269,8 @@ public:
 private:
 	KMainLoopClock m_clock;
 	KEngine::Flags m_flags;
-	std::queue<KSig> m_broadcast_queue;
+	KMpscQueue<SEngineCommand> m_command_queue; // 次のフレーム開始時に実行する命令。どのスレッドから追加してもよい
+	std::unordered_map<KName, std::vector<KManager *>> m_mgr_signal_subscribers; // シグナルを購読しているマネージャ
 	std::recursive_mutex m_signal_mutex;
 	int m_abort_timer;
 	int m_sleep_until;
@@ -262,7 +289,7 @@ public:
 	KIniFile *m_IniFile;
 	KStorage *m_Storage;
 
-	CEngineImpl() {
+	CEngineImpl(): m_command_queue(1024) {
 		zero_clear();
 		m_thread_id = K::sysGetCurrentThreadId();
 	}
@@ -377,6 +404,7 @@ public:
 			return; // すでに終了済み or そもそも初期化されていない
 		}
 		manager_end();
+		clearCommandQueue();
 
 		KAnimation::uninstall();
 		KHitbox::uninstall();
@@ -801,6 +829,7 @@ public:
 		}
 		m_managers.clear();
 		m_mgr_call_start.clear(); // m_mgr_call_start は KManager を grab していない
+		m_mgr_signal_subscribers.clear(); // m_mgr_signal_subscribers は KManager を grab していない
 	}
 
 	/// 更新すべきかどうか判定する。
@@ -887,8 +916,9 @@ public:
 			m_mgr_call_start.clear();
 		}
 
-		// キューにたまっているシグナルを配信する
-		broadcastProcessQueue();
+		// メインスレッド以外から送られたシグナルやノード操作を実行する。
+		// 別スレッドからの要求はすべてここで処理される
+		processCommandQueue();
 
 		// on_manager_appframe
 		for (int i=0; i<(int)m_managers.size(); i++) {
@@ -1094,21 +1124,97 @@ public:
 		} else {
 			// メインスレッドでないスレッドから配信する。
 			// 安全のために次回更新時に同期配信する
-			m_signal_mutex.lock();
-			m_broadcast_queue.push(sig);
-			m_signal_mutex.unlock();
-		}
-	}
-	void broadcastProcessQueue() {
-		while (!m_broadcast_queue.empty()) {
-			KSig sig;
-			{
-				m_signal_mutex.lock();
-				sig = m_broadcast_queue.front();
-				m_broadcast_queue.pop();
-				m_signal_mutex.unlock();
+			SEngineCommand cmd;
+			cmd.type = SEngineCommand::CMD_BROADCAST;
+			cmd.sig = sig;
+			postCommand(cmd);
+		}
+	}
+	void postSignal(KNode *target, KSig &sig) {
+		if (target == nullptr) return;
+		SEngineCommand cmd;
+		cmd.type = SEngineCommand::CMD_SEND;
+		cmd.sig = sig;
+		cmd.target = target->getId();
+		postCommand(cmd);
+	}
+	void postSetParent(KNode *node, KNode *parent) {
+		if (node == nullptr) return;
+		SEngineCommand cmd;
+		cmd.type = SEngineCommand::CMD_SET_PARENT;
+		cmd.node = node;
+		cmd.node->grab(); // processCommandQueue で drop する
+		cmd.target = parent ? parent->getId() : nullptr;
+		postCommand(cmd);
+	}
+	void postRemove(KNode *node) {
+		if (node == nullptr) return;
+		SEngineCommand cmd;
+		cmd.type = SEngineCommand::CMD_REMOVE;
+		cmd.target = node->getId();
+		postCommand(cmd);
+	}
+	void postCommand(const SEngineCommand &cmd) {
+		while (!m_command_queue.push(cmd)) {
+			// キューが満杯。
+			// メインスレッドならその場で処理して空ける。そうでなければメインスレッドが処理するまで待つ
+			if (m_thread_id == K::sysGetCurrentThreadId()) {
+				processCommandQueue();
+			} else {
+				std::this_thread::yield();
 			}
-			broadcastSignalAsync(sig);
+		}
+	}
+	void processCommandQueue() {
+		// ※キューから読み出すのはメインスレッドだけ。
+		// ハンドラの中で postCommand が満杯のキューを処理するために再入することがあるので、
+		// 取り出した命令は共有のメンバーではなく、呼び出しごとのローカル変数に入れる
+		SEngineCommand cmd;
+		while (m_command_queue.pop(cmd)) {
+			switch (cmd.type) {
+			case SEngineCommand::CMD_BROADCAST:
+				broadcastSignalAsync(cmd.sig);
+				break;
+			case SEngineCommand::CMD_SUBSCRIBERS:
+				sendSignalToSubscribersAsync(cmd.sig);
+				break;
+			case SEngineCommand::CMD_SEND:
+				if (KNodeTree::isInstalled()) {
+					KNode *target = KNodeTree::findNodeById(cmd.target);
+					if (target) {
+						KNodeTree::sendSignal(target, cmd.sig);
+					}
+				}
+				break;
+			case SEngineCommand::CMD_SET_PARENT:
+				if (KNodeTree::isInstalled()) {
+					KNode *parent = cmd.target ? KNodeTree::findNodeById(cmd.target) : KNodeTree::getRoot();
+					if (parent) {
+						cmd.node->setParent(parent);
+					} else {
+						K__WARNING("postSetParent: parent node has already been removed");
+					}
+				}
+				K__DROP(cmd.node);
+				break;
+			case SEngineCommand::CMD_REMOVE:
+				if (KNodeTree::isInstalled()) {
+					KNode *target = KNodeTree::findNodeById(cmd.target);
+					if (target) {
+						target->remove();
+					}
+				}
+				break;
+			default:
+				break;
+			}
+		}
+	}
+	void clearCommandQueue() {
+		// 実行せずに破棄する
+		SEngineCommand cmd;
+		while (m_command_queue.pop(cmd)) {
+			K__DROP(cmd.node);
 		}
 	}
 	void broadcastSignalAsync(KSig &sig) {
@@ -1121,6 +1227,49 @@ public:
 			KNodeTree::broadcastSignal(sig);
 		}
 	}
+	void subscribeSignal(KManager *mgr, const KName &signame) {
+		if (mgr == nullptr || signame.empty()) return;
+		std::vector<KManager *> &mgrs = m_mgr_signal_subscribers[signame];
+		if (std::find(mgrs.begin(), mgrs.end(), mgr) == mgrs.end()) {
+			mgrs.push_back(mgr);
+		}
+	}
+	void unsubscribeSignal(KManager *mgr, const KName &signame) {
+		auto it = m_mgr_signal_subscribers.find(signame);
+		if (it != m_mgr_signal_subscribers.end()) {
+			std::vector<KManager *> &mgrs = it->second;
+			auto mit = std::find(mgrs.begin(), mgrs.end(), mgr);
+			if (mit != mgrs.end()) {
+				mgrs.erase(mit);
+			}
+		}
+	}
+	void sendSignalToSubscribers(KSig &sig) {
+		if (m_thread_id == K::sysGetCurrentThreadId()) {
+			sendSignalToSubscribersAsync(sig);
+		} else {
+			// メインスレッドでないスレッドから配信する。
+			// 安全のために次回更新時に同期配信する
+			SEngineCommand cmd;
+			cmd.type = SEngineCommand::CMD_SUBSCRIBERS;
+			cmd.sig = sig;
+			postCommand(cmd);
+		}
+	}
+	void sendSignalToSubscribersAsync(KSig &sig) {
+		// 購読しているマネージャに配信
+		auto it = m_mgr_signal_subscribers.find(sig.mName);
+		if (it != m_mgr_signal_subscribers.end()) {
+			const std::vector<KManager *> &mgrs = it->second;
+			for (size_t i=0; i<mgrs.size(); i++) {
+				mgrs[i]->on_manager_signal(sig);
+			}
+		}
+		// 購読しているノードに送信
+		if (KNodeTree::isInstalled()) {
+			KNodeTree::sendSignalToSubscribers(sig);
+		}
+	}
 
 	///////////////////
 	void addInspectorCallback(KInspectorCallback *cb, const char *label) {
@@ -1351,6 +1500,30 @@ void KEngine::broadcastSignalAsync(KSig &sig) {
 	K__ASSERT_RETURN(g_EngineInstance);
 	g_EngineInstance->broadcastSignalAsync(sig);
 }
+void KEngine::postSignal(KNode *target, KSig &sig) {
+	K__ASSERT_RETURN(g_EngineInstance);
+	g_EngineInstance->postSignal(target, sig);
+}
+void KEngine::postSetParent(KNode *node, KNode *parent) {
+	K__ASSERT_RETURN(g_EngineInstance);
+	g_EngineInstance->postSetParent(node, parent);
+}
+void KEngine::postRemove(KNode *node) {
+	K__ASSERT_RETURN(g_EngineInstance);
+	g_EngineInstance->postRemove(node);
+}
+void KEngine::subscribeSignal(KManager *mgr, const KName &signame) {
+	K__ASSERT_RETURN(g_EngineInstance);
+	g_EngineInstance->subscribeSignal(mgr, signame);
+}
+void KEngine::unsubscribeSignal(KManager *mgr, const KName &signame) {
+	K__ASSERT_RETURN(g_EngineInstance);
+	g_EngineInstance->unsubscribeSignal(mgr, signame);
+}
+void KEngine::sendSignalToSubscribers(KSig &sig) {
+	K__ASSERT_RETURN(g_EngineInstance);
+	g_EngineInstance->sendSignalToSubscribers(sig);
+}
 
 /// インスペクター項目を登録する
 /// @param cb    インスペクターに表示する項目
@@ -338,6 +338,28 @@ public:
 	static void broadcastSignal(KSig &sig);
 	static void broadcastSignalAsync(KSig &sig);
 
+	/// マネージャにシグナルを購読させる。
+	/// 購読したシグナルは sendSignalToSubscribers で配信される
+	/// @see KNode::subscribeSignal
+	static void subscribeSignal(KManager *mgr, const KName &signame);
+	static void unsubscribeSignal(KManager *mgr, const KName &signame);
+
+	/// sig を購読しているマネージャとノードにだけ送信する。
+	/// broadcastSignal はノードツリー全体を巡回するが、こちらは購読者だけを訪問する
+	static void sendSignalToSubscribers(KSig &sig);
+
+	/// 次のフレーム開始時に target へシグナルを送る。
+	/// ノードツリーの変更を伴う以下の post 系関数と同様、どのスレッドから呼んでもよい。
+	/// 要求はロックフリーのキューに積まれ、メインスレッドがフレーム開始時にまとめて実行する
+	static void postSignal(KNode *target, KSig &sig);
+
+	/// 次のフレーム開始時に node の親を parent にする（parent が nullptr ならルート）。
+	/// node はツリーに入っていなくてもよい（ワーカースレッドで作成したノードなど）
+	static void postSetParent(KNode *node, KNode *parent);
+
+	/// 次のフレーム開始時に node を削除する
+	static void postRemove(KNode *node);
+
 	static void addInspectorCallback(KInspectorCallback *cb, const char *label=""); ///< インスペクター項目を登録する
 	static void removeInspectorCallback(KInspectorCallback *cb); ///< コールバックを解除する
 